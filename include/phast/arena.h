@@ -0,0 +1,76 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file arena.h
+   Region ("arena") allocation of temporary storage.  Memory obtained
+   with ar_alloc belongs to the innermost scope opened with ar_push,
+   and is released all at once when that scope is closed with
+   ar_pop; it must not be passed to sfree or srealloc.  Allocation
+   simply advances a pointer within a large chunk, and chunks are
+   reused from one scope to the next, so that code which repeatedly
+   needs short-lived arrays (e.g., dynamic-programming matrices or
+   per-block buffers) does not call malloc and free each time.
+
+   Each thread has its own arena, so scopes may be used within tasks
+   executed by thr_parallel_for.  When the phast memory handler is in
+   use, the arena instead belongs to the current memory handler, and
+   phast_free_all releases it along with everything else (including
+   any scopes left open by an error).
+   @ingroup base
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+/** Minimum size of each chunk of memory obtained by an arena */
+#define AR_CHUNK_SIZE (1 << 16)
+
+/** Largest chunk kept for reuse after the scope that needed it has
+    been closed; larger chunks are returned to the system */
+#define AR_SPARE_MAX (1 << 24)
+
+/** Chunk of arena memory (defined in phast_arena.c) */
+typedef struct ar_chunk ArenaChunk;
+
+/** Record of an open scope (defined in phast_arena.c) */
+typedef struct ar_scope ArenaScope;
+
+/** Arena state */
+typedef struct {
+  ArenaChunk *chunk;            /**< Chunk currently being allocated from */
+  ArenaChunk *spare;            /**< Released chunk kept for reuse */
+  ArenaScope *scope;            /**< Innermost open scope */
+} Arena;
+
+/** Open a new scope in the current thread's arena.  Must be matched
+    by a call to ar_pop. */
+void ar_push();
+
+/** Close the innermost scope of the current thread's arena, releasing
+    all memory allocated since the corresponding call to ar_push. */
+void ar_pop();
+
+/** Allocate temporary memory in the innermost scope.
+    @param size Number of bytes to allocate
+    @result Pointer to memory, suitably aligned for any type, valid
+    until the scope is closed
+    @note Dies if no scope is open.
+ */
+void *ar_alloc(size_t size);
+
+/** Initialize arena state */
+void ar_init(Arena *a);
+
+/** Release all memory belonging to an arena, closing any open scopes
+    (used by phast_free_all; not needed otherwise). */
+void ar_release(Arena *a);
+
+#endif
@@ -0,0 +1,120 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file compressed_io.h
+   Transparent reading and writing of compressed files.  Input in
+   gzip format (including bgzip, which is a series of gzip members)
+   is recognized by its magic bytes and decompressed by a background
+   thread into a ring buffer, so that parsing never waits on
+   decompression unless it gets ahead of it.  Output is written in
+   bgzip (BGZF) format, which can be read by gzip, with blocks
+   compressed by background threads.  The streams returned are
+   ordinary FILE pointers, and support ftell and fseek (seeking
+   backward beyond the data retained in the ring buffer restarts
+   decompression, which requires the underlying file to be
+   seekable, and begins at the start of the file unless the positions
+   of BGZF blocks have been supplied with cio_set_block_map).  Used
+   by phast_fopen; most code need not call these
+   functions directly.
+
+   Compressed I/O requires zlib and POSIX threads; it is disabled
+   when compiling with SKIP_ZLIB, SKIP_THREADS, or RPHAST, or for
+   Windows.  In that case files are read and written as is.
+   @ingroup base
+*/
+
+#ifndef COMPRESSED_IO_H
+#define COMPRESSED_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/** Size of ring buffer for decompressed input, in bytes */
+#define CIO_RING_SIZE (1 << 23)
+
+/** Amount of already-consumed input kept in ring buffer, so that
+    short backward seeks (e.g., after peeking at a file) do not
+    require decompression to restart */
+#define CIO_RETAIN (1 << 22)
+
+/** Uncompressed size of each BGZF block written (as in samtools) */
+#define CIO_BLOCK_SIZE 0xff00
+
+/** Wrap an input stream so that it is decompressed if necessary.
+    @param src Stream open for reading, positioned at start of data
+    @param fname Name of file (used in error messages)
+    @result src itself if data is not compressed and src is seekable
+    (or compressed I/O is unavailable); otherwise a new stream from
+    which (decompressed) data can be read, beginning with any bytes
+    examined to detect compression.  In the latter case, closing the
+    new stream also closes src.
+    @note Dies if data is compressed in a format that is recognized
+    but not supported (currently zstd).
+*/
+FILE *cio_open_read(FILE *src, const char *fname);
+
+/** Wrap an output stream so that data is written to it in bgzip
+    (BGZF) format.
+    @param dest Stream open for writing
+    @result New stream to which uncompressed data should be written;
+    closing it flushes remaining data, writes an end-of-file marker,
+    and closes dest.  If compressed I/O is unavailable, dest itself
+    is returned.
+*/
+FILE *cio_open_write(FILE *dest);
+
+/** Test whether a filename indicates that output should be compressed.
+    @param fname Name of file
+    @result TRUE if fname ends with ".gz" or ".bgz"
+*/
+int cio_compressed_name(const char *fname);
+
+/** Test whether a file holds compressed data (gzip, including bgzip,
+    or zstd), by its magic bytes.  Useful where byte offsets in the
+    file itself are needed, which compressed files cannot provide.
+    @param fname Name of file
+    @result TRUE if the file can be opened and starts with a known
+    compression magic number
+*/
+int cio_compressed_file(const char *fname);
+
+/** Locate the blocks of a BGZF (bgzip) file, by reading the header
+    and trailer of each block; nothing is decompressed.  Together
+    these give BGZF "virtual offsets" (block offset << 16 | offset
+    within block) for any position in the decompressed data.
+    @param fname Name of file
+    @param[out] coffset Set to newly allocated array of the offset of
+    each block in the file
+    @param[out] upos Set to newly allocated array of the position in
+    the decompressed data of the first byte of each block
+    @result Number of blocks (including the empty block that ends the
+    file), or -1 if the file cannot be read or is not in BGZF format
+    (for example, because it was compressed with gzip rather than
+    bgzip), in which case nothing is allocated
+*/
+int cio_bgzf_blocks(const char *fname, int64_t **coffset, int64_t **upos);
+
+/** Supply the positions of BGZF blocks of the file underlying a
+    decompressing stream, so that a seek far from the data already
+    decompressed restarts decompression at the nearest preceding
+    block, rather than at the start of the file.  Any subset of the
+    blocks (for example, those listed in an index) may be given.
+    @param F Stream returned by cio_open_read (or phast_fopen)
+    @param n Number of blocks
+    @param coffset Offset of each block in the file, in increasing order
+    @param upos Position in the decompressed data of the first byte of
+    each block
+    @result TRUE if the positions will be used; FALSE if F is not a
+    decompressing stream over a seekable file (in which case seeking
+    is unaffected).  The arrays are copied.
+*/
+int cio_set_block_map(FILE *F, int n, const int64_t *coffset, 
+                      const int64_t *upos);
+
+#endif
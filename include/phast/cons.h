@@ -33,6 +33,9 @@
 /** Default RHO */
 #define DEFAULT_RHO 0.3
 
+/** Default overlap between chunks (see --chunk-overlap) */
+#define DEFAULT_CHUNK_OVERLAP 10000
+
 /** Package holding all phastCons data */
 struct phastCons_struct {
   MSA *msa;		/**< Multiple Sequence Alignment */
@@ -58,7 +61,9 @@ struct phastCons_struct {
   int nrates,		/**< Number of rates for first tree model */
     nrates2,		/**< Number of rates for second tree model */
     refidx,		/**< Index of reference sequence */
-    max_micro_indel;	/**< Maximum length of an alignment gap, any gap longer is treated as missing data*/
+    max_micro_indel,	/**< Maximum length of an alignment gap, any gap longer is treated as missing data*/
+    chunk_size,		/**< If > 0, decode the alignment in chunks of this many columns */
+    chunk_overlap;	/**< Number of columns by which chunks are extended on either side */
   double lambda,	/**< Lambda parameter value */ 
     mu,			/**< Transitions mu value */
     nu,			/**< Transitions nu value */
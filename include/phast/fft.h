@@ -0,0 +1,104 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file fft.h
+   Fast Fourier transforms and FFT-based convolution of real-valued
+   arrays.  A simple radix-2 implementation is used, so transform
+   lengths must be powers of two; the convolution functions take care
+   of zero-padding.  Used by the convolution functions of prob_vector.h
+   and prob_matrix.h when the arrays involved are large, where the
+   direct O(n*m) algorithm is prohibitively slow.
+
+   The convolution functions are intended for non-negative arrays
+   such as probability distributions.  Rounding error of an FFT is on
+   the order of DBL_EPSILON times the product of the sums of the
+   inputs, regardless of the magnitude of each element.  Therefore
+   small elements at the start of the result (the lower tail, e.g.,
+   probabilities of very few substitutions) are recomputed so that
+   they keep their relative precision, as with direct convolution: in
+   one dimension, from the corresponding leading elements of the
+   inputs, whose sums are smaller; in two dimensions, directly, for
+   the region below and to the left of the first element of each row
+   that is not small.  Elsewhere, elements smaller than the error
+   bound are set to zero, so that the result is non-negative.
+   @ingroup base
+*/
+
+#ifndef PHAST_FFT_H
+#define PHAST_FFT_H
+
+#include <phast/complex.h>
+
+/** Minimum number of multiplications (estimated) required by direct
+    convolution before the FFT is considered instead (see
+    fft_convolve_faster) */
+#define FFT_MIN_OPS 1.0e6
+
+/** Return smallest power of two greater than or equal to n. */
+int fft_len(int n);
+
+/** In-place discrete Fourier transform.
+    @param z Array of n complex numbers, replaced by its transform
+    @param n Length of array; must be a power of two
+    @param inverse If TRUE, compute the inverse transform (including
+    division by n)
+ */
+void fft_transform(Complex *z, int n, int inverse);
+
+/** In-place two-dimensional discrete Fourier transform.
+    @param z Array of nrows * ncols complex numbers in row-major
+    order, replaced by its transform
+    @param nrows Number of rows; must be a power of two
+    @param ncols Number of columns; must be a power of two
+    @param inverse If TRUE, compute the inverse transform (including
+    division by nrows * ncols)
+ */
+void fft_transform_2d(Complex *z, int nrows, int ncols, int inverse);
+
+/** Linear convolution of two real arrays, truncated to a specified
+    length, computed by FFT.
+    @param a First array
+    @param na Length of a
+    @param b Second array
+    @param nb Length of b
+    @param c Array to hold result; c[x] = sum_j a[j] * b[x-j] for 0 <=
+    x < nc.  May be the same as a or b.
+    @param nc Length of c (elements beyond na + nb - 1 are set to zero)
+ */
+void fft_convolve(double *a, int na, double *b, int nb, double *c, int nc);
+
+/** Two-dimensional linear convolution of two real arrays, truncated
+    to specified dimensions, computed by FFT.
+    @param a First array (nra x nca)
+    @param nra Number of rows in a
+    @param nca Number of columns in a
+    @param b Second array (nrb x ncb)
+    @param nrb Number of rows in b
+    @param ncb Number of columns in b
+    @param c Array to hold result (nrc x ncc); c[x][y] = sum_{j,k}
+    a[j][k] * b[x-j][y-k].  May be the same as a or b.
+    @param nrc Number of rows in c
+    @param ncc Number of columns in c
+ */
+void fft_convolve_2d(double **a, int nra, int nca, double **b, int nrb,
+                     int ncb, double **c, int nrc, int ncc);
+
+/** Decide whether FFT-based convolution is likely to be faster than
+    direct convolution.
+    @param direct_ops Estimated number of multiplications required by
+    direct convolution
+    @param nconv Number of FFT-based convolutions that would be
+    performed instead
+    @param len Number of elements in each (zero-padded) transform, as
+    returned by fft_len (or product of fft_len for each dimension)
+    @result TRUE if the FFT should be used
+ */
+int fft_convolve_faster(double direct_ops, int nconv, int len);
+
+#endif
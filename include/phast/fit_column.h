@@ -11,6 +11,13 @@
    Functions to compute likelihoods for individual alignment columns,
    estimate column-by-column scale factors by maximum likelihood,
    perform single-base LRTs, score tests, etc
+
+   The tuple-by-tuple tests (col_lrts, col_lrts_sub, col_score_tests,
+   col_score_tests_sub, and col_gerp) process column tuples in
+   parallel when more than one thread has been requested (see
+   thread_pool.h) and no log file is given.  Each thread works with
+   its own copy of the tree model and its own ColFitData, and results
+   are identical to those of a serial run.
    @ingroup phylo
 */
 
@@ -36,6 +43,21 @@ typedef enum {CON, /**< Conservation scores */
 	      CONACC /**< Summarize conservation and acceleration scores */
 	     } mode_type;
 
+/** Maximum number of sets of substitution matrices memoized by
+    col_set_subst_matrices */
+#define COL_MEMO_SIZE 8
+
+/** Number of recently requested scale factors tracked by
+    col_set_subst_matrices, to decide which to memoize */
+#define COL_MEMO_SEEN 16
+
+/** Upper limit on memory used for memoized substitution matrices */
+#define COL_MEMO_MAX_BYTES (1 << 22)
+
+/** Memo of substitution matrices by scale factor (defined in
+    phast_fit_column.c) */
+typedef struct col_memo ColMemo;
+
 /** Metadata for fitting scale factors to individual alignment columns. */
 typedef struct {
   TreeModel *mod;             /**< Pointer to Tree Model this column belongs to */
@@ -66,6 +88,9 @@ typedef struct {
   Zvector *vec_scratch1_z, *vec_scratch2_z; /**< Scratch memory for complex number vector manipulation. */
   Vector *vec_scratch1_r, *vec_scratch2_r; /**< Scratch memory for real number vector manipulation. */
   double deriv2;                /**< second derivative for 1d case. */
+  ColMemo *memo;                /**< Substitution matrices for recurring
+                                   scale factors (see
+                                   col_set_subst_matrices). */
 } ColFitData;
 
 /* data for grid of pre-computed Fisher Information Matrices */
@@ -107,6 +132,18 @@ void col_free_fit_data(ColFitData *d);
 /** \name Column Fit Data likelihood calculation functions
  \{ */
 
+/** Set the substitution matrices of d->mod for its current scale
+   factors (mod->scale and, in the subtree case, mod->scale_sub).
+   Equivalent to tm_set_subst_matrices, but matrices for scale
+   factors that are requested repeatedly (e.g., the null scale of 1
+   and the starting point of each optimization) are computed only
+   once and then copied from a memo.
+   @param d Column Fit Data whose model is to be updated
+   @note Assumes the branch lengths and rate matrix of d->mod do not
+   change while d is in use.
+*/
+void col_set_subst_matrices(ColFitData *d);
+
 /** Estimate parameters
   @param Parameter scales to use with model
   @param data Column Fit Data to estimate parameters with
@@ -36,4 +36,31 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
               opt_precision_type precision, int max_its, FILE *logf,
 	      FILE *error_file);
 
+/** Test whether the gradient of the likelihood function optimized by
+   tm_fit can be computed analytically by tm_likelihood_grad.
+   Requires, among other things, that all branch lengths are
+   estimated, the rate matrix is not rescaled during optimization,
+   background frequencies are not estimated, and the substitution
+   model is one whose parameters appear linearly in the rate matrix.
+   @param mod Tree model, set up for optimization
+   @result TRUE if the analytic gradient can be used
+*/
+int tm_likelihood_grad_ok(TreeModel *mod);
+
+/** Compute the gradient of the negative log likelihood (base 2)
+   optimized by tm_fit, using expected substitution counts from a
+   single pass of tl_compute_log_likelihood rather than finite
+   differences.  Suitable as the compute_grad argument of opt_bfgs.
+   @param grad Vector in which to store gradient
+   @param params Current parameter values
+   @param data Tree model (with mod->msa and mod->category set,
+   mod->tree_posteriors allocated to hold expected_nsubst_tot, and
+   complex eigensystems for the rate matrix)
+   @param lb Lower bounds of parameters (ignored)
+   @param ub Upper bounds of parameters (ignored)
+   @see tm_likelihood_grad_ok
+*/
+void tm_likelihood_grad(Vector *grad, Vector *params, void *data, 
+                        Vector *lb, Vector *ub);
+
 #endif
@@ -8,7 +8,11 @@
  ***************************************************************************/
 
 /** @file hashtable.h
- Fast, simple array-based hash table, optimized for 'put' and 'get' ('delete' somewhat inefficient). 
+ Fast, simple array-based hash table, optimized for 'put' and 'get'.
+ Uses open addressing with linear probing; hash values are cached
+ with each entry, and the table doubles in size as it fills, so the
+ initial capacity is only a hint.  Keys are copied into blocks of
+ memory owned by the table, and never move once stored.
   @ingroup base
 */
 
@@ -16,20 +20,35 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+#include <stdint.h>
 #include <phast/lists.h>
 #include <phast/misc.h>
 #include <phast/external_libs.h>
 
-/** Recommended by Kernighan and Pike */
-#define MULTIPLIER 31
-#define LOADING_FACTOR 5
+/** Maximum fraction of slots in use before the table is enlarged */
+#define HSH_MAX_LOAD 0.7
+
+/** Size of each block of memory used to store keys */
+#define HSH_KEY_BLOCK_SIZE 4096
+
+/** Slot in a hash table */
+typedef struct {
+  uint64_t hash;                /**< Cached hash of key (0 if slot is empty) */
+  char *key;                    /**< Copy of key */
+  void *val;                    /**< Associated value */
+} HashSlot;
 
 typedef struct hash_table Hashtable;
 /** Hash table struct  */
 struct hash_table {
-  int nbuckets;                 /**< Number of 'buckets' */
-  List **keys,                  /**< List of char* keys */
-    **vals;                     /**< Corresponding list of void* values */
+  int nslots;                   /**< Number of slots (a power of 2) */
+  int nitems;                   /**< Number of items stored */
+  HashSlot *slots;              /**< Slot array */
+  char **key_blocks;            /**< Blocks of memory holding keys */
+  int nkey_blocks,              /**< Number of key blocks in use */
+    key_blocks_alloc;           /**< Number of key blocks allocated */
+  size_t key_block_used,        /**< Bytes used in last key block */
+    key_block_size;             /**< Size of last key block */
 };
 
 /** \name HashTable allocation functions 
@@ -53,21 +72,19 @@ Hashtable* hsh_copy(Hashtable *ht);
 /** \} \name HashTable misc. functions
  \{ */
 
-/* we'll only inline the functions likely to be used heavily in inner
-   loops */  
-
-/** Hashing function mapping key to index of array holding values 
-   @param ht Hash Table to calculate mapping for 
-   @param key Key to get index in hash table for
-   @result Index in array holding values associated with key
+/** Hashing function (64-bit FNV-1a).
+   @param key Key to hash
+   @result Hash value (never 0)
 */
 static PHAST_INLINE
-unsigned int hsh_hash_func(Hashtable *ht, const char* key) {
-  unsigned int h = 0;
-  int i = 0;
-  for (i = 0; key[i] != '\0'; i++)
-    h = MULTIPLIER * h + key[i];
-  return h % ht->nbuckets;
+uint64_t hsh_hash_func(const char* key) {
+  uint64_t h = 14695981039346656037ULL;
+  int i;
+  for (i = 0; key[i] != '\0'; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h == 0 ? 1 : h;
 }
 
 /** Make a list of all the keys in the hash table.
@@ -85,21 +102,11 @@ List *hsh_keys(Hashtable *ht);
    @param ht Hash Table to add entry to
    @param key Key associated with value so we can retrieve/modify it later
    @param val Value associated with key that we wish to store
+   @note If key is already present, the new entry is hidden by the
+   existing one until that one is deleted (use hsh_reset to change
+   the value associated with a key)
 */
-static PHAST_INLINE
-void hsh_put(Hashtable *ht, const char* key, void* val) {
-  unsigned int bucket = hsh_hash_func(ht, key);
-  char *keycpy;
-  if (ht->keys[bucket] == NULL) {
-    ht->keys[bucket] = lst_new_ptr(LOADING_FACTOR);
-    ht->vals[bucket] = lst_new_ptr(LOADING_FACTOR);
-  }
-  keycpy = (char*)smalloc(sizeof(char) * (strlen(key) + 1));
-  strcpy(keycpy, key);
-
-  lst_push_ptr(ht->keys[bucket], keycpy);
-  lst_push_ptr(ht->vals[bucket], val);
-}
+void hsh_put(Hashtable *ht, const char* key, void* val);
 
 /** Add an integer to the hash table 
   @param ht Hash table to add integer to
@@ -111,8 +118,6 @@ void hsh_put_int(Hashtable *ht, const char *key, int val);
 /** \name HashTable get functions 
  \{ */
 
-/* hsh_get involves call to lst_find_compare with function pointer;
-   not sure how best to inline, if at all */ 
 /** Retrieve object associated with specified key.
   @param ht Hash Table to retrieve value from 
   @param Key key associated with the value to retrieve
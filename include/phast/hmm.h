@@ -36,6 +36,13 @@
 #define BEGIN_STATE -99
 /** Used to identify finished state */
 #define END_STATE -98
+/** Size (in bytes) above which the dynamic programming matrices of
+    hmm_viterbi and hmm_posterior_probs are replaced by checkpoints,
+    reducing memory from O(nstates * seqlen) to O(nstates *
+    sqrt(seqlen)) */
+#ifndef HMM_CHECKPOINT_BYTES
+#define HMM_CHECKPOINT_BYTES 268435456
+#endif
 
 #define BEGIN_TRANSITIONS_TAG "BEGIN_TRANSITIONS:"
 #define END_TRANSITIONS_TAG "END_TRANSITIONS:"
@@ -48,10 +55,40 @@ typedef enum {VITERBI, /**< Viterbi for speedy HMM solving */
 	      BACKWARD /**< Backward method of posterior decoding*/
 } hmm_mode;
 
-/* NOTE: eventually need to be able to support an "adjacency list"
- * rather than an "adjacency matrix" representation of an HMM, for
- * better efficiency when there are many states and they are not fully
- * connected  */
+/** Adjacency-list form of the transitions of an HMM, used by the
+    dynamic programming routines.  The predecessors of state i are
+    pred_state[pred_start[i]] ... pred_state[pred_start[i+1]-1], in
+    the same order as in the HMM's predecessors list (excluding
+    BEGIN_STATE), with log (base 2) transition scores pred_score;
+    successors are stored similarly.  Created on demand by
+    hmm_get_compiled and discarded by hmm_reset. */
+typedef struct {
+  int *pred_start,              /**< Start of each state's predecessors
+                                   (nstates+1 entries) */
+    *pred_state;                /**< Predecessor states */
+  double *pred_score;           /**< Transition scores from predecessors */
+  int *succ_start,              /**< Start of each state's successors
+                                   (nstates+1 entries) */
+    *succ_state;                /**< Successor states */
+  double *succ_score;           /**< Transition scores to successors */
+  int nbegin_succ,              /**< Number of successors of BEGIN_STATE */
+    *begin_succ;                /**< Successors of BEGIN_STATE */
+  double *begin_succ_score;     /**< Transition scores from BEGIN_STATE
+                                   to its successors */
+  int nend_pred,                /**< Number of predecessors of END_STATE */
+    *end_pred;                  /**< Predecessors of END_STATE */
+  double *end_pred_score;       /**< Transition scores from
+                                   predecessors of END_STATE */
+  double *begin_score,          /**< Transition score from BEGIN_STATE
+                                   to each state */
+    *end_score;                 /**< Transition score from each state to
+                                   END_STATE (0 if no end state) */
+  int maxdeg;                   /**< Maximum number of predecessors or
+                                   successors of any state */
+  int *int_storage;             /**< Storage for integer arrays */
+  double *dbl_storage;          /**< Storage for double arrays */
+} HMMCompiled;
+
 /** Hidden Markov Model and meta data  */
 typedef struct {
   int nstates;  /**< Number of current states in model */
@@ -67,6 +104,8 @@ typedef struct {
   **successors;			/**< List of successor states in HMM, for each state i, the list of states that state i has a transition to */
   List *begin_successors, /**< List of states for which the begin state has a transition to */
  *end_predecessors;	  /**< List of states that have a transition to the end state */
+  HMMCompiled *compiled;  /**< (Optional) adjacency lists with
+                             transition scores; see hmm_get_compiled */
 } HMM;
 
 
@@ -180,6 +219,43 @@ double hmm_backward(HMM *hmm, double **emission_scores, int seqlen,
 double hmm_posterior_probs(HMM *hmm, double **emission_scores, int seqlen,
                            double **posterior_probs);
 
+/** Fills matrix of posterior probabilities, decoding the sequence in
+   windows rather than all at once.  The sequence is divided into
+   consecutive windows of the given size, each of which is decoded
+   separately along with up to overlap columns on either side, which
+   are then discarded.  Windows are processed in parallel when
+   multiple threads are in use (see thread_pool.h).  Results approach
+   those of hmm_posterior_probs as the overlap grows relative to the
+   distance over which the HMM "forgets" its state.
+   @param hmm Model to use
+   @param emission_scores Output scores, 2D array, hmm->nstates rows & seqlen columns
+   @param seqlen Number of columns in emission_scores and posterior_probs
+   @param posterior_probs  (Optional) Must be allocated to same size as emission_scores
+   @param window Number of columns per window; if <= 0 or >= seqlen,
+   hmm_posterior_probs is used instead
+   @param overlap Number of extra columns decoded on either side of
+   each window
+   @result Approximate total log probability of sequence (sum over
+   windows, each conditional on its left overlap)
+*/
+double hmm_posterior_probs_windowed(HMM *hmm, double **emission_scores,
+                                    int seqlen, double **posterior_probs,
+                                    int window, int overlap);
+
+/** Finds a Viterbi path, decoding the sequence in overlapping windows
+   (see hmm_posterior_probs_windowed).
+  @param[in] hmm Model to use
+  @param emission_scores Output scores, 2D array, hmm->nstates rows & seqlen columns
+  @param[in] seqlen Length of path
+  @param[out] path Array of integers indicating state numbers in the HMM
+  @param[in] window Number of columns per window; if <= 0 or >=
+  seqlen, hmm_viterbi is used instead
+  @param[in] overlap Number of extra columns decoded on either side of
+  each window
+*/
+void hmm_viterbi_windowed(HMM *hmm, double **emission_scores, int seqlen,
+                          int *path, int window, int overlap);
+
 void hmm_do_dp_forward(HMM *hmm, double **emission_scores, int seqlen, 
                        hmm_mode mode, double **full_scores, int **backptr);
 void hmm_do_dp_backward(HMM *hmm, double **emission_scores, int seqlen, 
@@ -353,4 +429,15 @@ void hmm_stochastic_traceback(HMM *hmm, double **forward_scores,
 */
 void hmm_set_transition_score_matrix(HMM *hmm);
 
+/** Return adjacency lists of an HMM's transitions, with log
+    transition scores, creating them if necessary.  They remain valid
+    until the next call to hmm_reset.
+    @param hmm Model to use
+    @result Compiled transitions (owned by hmm)
+    @warning Like hmm_set_transition_score_matrix, this must be called
+    before the dynamic programming routines are used in a multithreaded
+    context.
+*/
+HMMCompiled *hmm_get_compiled(HMM *hmm);
+
 #endif
@@ -31,6 +31,17 @@
 #include "phast/msa.h"
 #include "phast/hashtable.h"
 #include "phast/gff.h"
+#include "phast/maf_reader.h"
+#include "phast/maf_index.h"
+
+/** Initial number of distinct tuples allocated when collecting
+    unordered sufficient statistics from a MAF file (storage grows as
+    needed) */
+#define MAF_SS_INIT_NTUPLES 10000
+
+/** Maximum number of blocks parsed concurrently when reading a MAF
+    file with more than one thread */
+#define MAF_BATCH_BLOCKS 256
 
 /** Hold data for a single block within a MAF file */
 typedef struct {
@@ -128,6 +139,16 @@ typedef struct {
      reference sequence make it difficult to assign sites to categories
      rationally). 
    @note The alignment won't be constructed explicitly; instead, a sufficient-statistics representation will be extracted directly from the MAF.  
+   @note If store_order == FALSE, blocks are folded into the
+     statistics one at a time (see ss_add_block), so that memory use
+     is bounded by the size of the largest block and the number of
+     distinct tuples, rather than by the length of the alignment
+     (apart from the coordinates of each block, which are retained
+     to detect redundant blocks).
+   @note If more than one thread is enabled (see thr_set_nthreads),
+     batches of up to MAF_BATCH_BLOCKS blocks are parsed, and their
+     column tuples collected, in parallel; blocks are still merged in
+     file order, so the result is identical to that of a serial read.
    @warning Any blocks falling out of order, or which are redundant with previous blocks, will be discarded.
  */
 MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
@@ -135,6 +156,30 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet
 		   char *reverse_groups, int gap_strip_mode, int keep_overlapping,
 			  List* cats_to_do, List *seqnames, int seq_keep);
 
+/** Read the part of an Alignment from a MAF file that is aligned to
+   an interval of the reference sequence.  Parameters are as for
+   maf_read_cats_subset, with the following additions.
+   @pre The MAF file must be sorted with respect to the reference
+   sequence; reading stops at the first block that starts beyond the
+   interval.
+   @param[in] idx (Optional) index of the MAF file (see
+   mafIndex_load), used to begin reading at the first block that may
+   overlap the interval, rather than at the start of the file
+   @param[in] region_start Start of interval in the reference
+   sequence (0-based, inclusive)
+   @param[in] region_end End of interval (0-based, exclusive), or -1
+   for the end of the reference sequence
+   @note Blocks that extend beyond the interval are trimmed to it.
+   @note Dies if no block overlaps the interval.
+ */
+MSA *maf_read_cats_region(FILE *F, FILE *REFSEQF, int tuple_size, 
+                          char *alphabet, GFF_Set *gff, CategoryMap *cm, 
+                          int cycle_size, int store_order, 
+                          char *reverse_groups, int gap_strip_mode, 
+                          int keep_overlapping, List *cats_to_do, 
+                          List *seqnames, int seq_keep, MafIndex *idx,
+                          int region_start, int region_end);
+
 /** Read a subset of an Alignment from a MAF file subset selected by feature names.
    @pre The MAF file must be sorted with respect to the reference sequence.  
    @param[in] F MAF file
@@ -416,7 +461,7 @@ MSA *maf_read_old(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
               char *reverse_groups, int gap_strip_mode, int keep_overlapping);
 
 /** Read a block from an MAF file.
-   @param[in] F File containing MAF data to read
+   @param[in] r Reader for MAF file (see maf_reader.h)
    @param[out] mini_msa MAF Block is stored here
    @param[out] name_hash Hash table mapping sequence names to sequence indices (prefix of name wrt '.' character)
    @param[out] start_idx stating coord of reference sequence
@@ -426,11 +471,11 @@ MSA *maf_read_old(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
    @note Reads to next "a" line or EOF
    @result 0 if successful, EOF if no more blocks available
 */
-int maf_read_block(FILE *F, MSA *mini_msa, Hashtable *name_hash,
+int maf_read_block(MafReader *r, MSA *mini_msa, Hashtable *name_hash,
                    int *start_idx, int *length, int do_toupper);
 
 /** Add sequences from a MAF file to an existing MAF block
-   @param[in] F File containing MAF data to read
+   @param[in] r Reader for MAF file (see maf_reader.h)
    @param[in,out] mini_msa MAF Block is stored here
    @param[out] name_hash Hash table mapping sequence names to sequence indices (prefix of name wrt '.' character)
    @param[out] start_idx stating coord of reference sequence
@@ -441,7 +486,7 @@ int maf_read_block(FILE *F, MSA *mini_msa, Hashtable *name_hash,
    @note Reads to next "a" line or EOF
    @result 0 if successful, EOF if no more blocks available
 */
-int maf_read_block_addseq(FILE *f, MSA *mini_msa, Hashtable *name_hash,
+int maf_read_block_addseq(MafReader *r, MSA *mini_msa, Hashtable *name_hash,
 			  int *start_idx, int *length, int do_toupper,
 			  int skip_new_species);
 
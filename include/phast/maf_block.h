@@ -24,6 +24,7 @@
 #include "stdio.h"
 #include "phast/msa.h"
 #include "phast/hashtable.h"
+#include "phast/maf_reader.h"
 
 /** Holds per-species data for a Maf Block */
 typedef struct {
@@ -67,13 +68,13 @@ void mafBlock_print(FILE *outfile, MafBlock *block, int pretty_print);
 
 /**  Read next block from Maf File.
      @pre If optional parameter specHash is not NULL make sure it is initialized
-     @param mfile MAF file to read next MAF block from
+     @param reader Reader for MAF file (see maf_reader.h)
      @param specHash  (Optional) Any new species encountered added to this hash
      @param numspec   (Optional) Number of species added to specHash
      @result MafBlock read from MAF file, OR NULL if EOF
      @warning If you use specHash, you also must use numspec.
 */
-MafBlock *mafBlock_read_next(FILE *mfile, Hashtable *specHash, int *numspec);
+MafBlock *mafBlock_read_next(MafReader *reader, Hashtable *specHash, int *numspec);
 
 /** Opens new MAF file for writing and prints minimal header for MAF.  
     @param fn File to write MAF to, NULL == stdout
@@ -0,0 +1,149 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file maf_index.h
+    Index of a MAF file by reference-sequence coordinates, allowing
+    the blocks overlapping a region to be located without scanning
+    the file.  The index is stored as a small text file alongside the
+    MAF (by default, the MAF filename with MAF_INDEX_SUFFIX
+    appended), and is created by the maf_index program.  It has a
+    header of the form
+<pre>
+##maf-index version=2
+##refseq=hg18.chr22 maf_size=27957324
+</pre>
+    followed by one line per alignment block, giving the start and
+    end of the reference sequence in the block (0-based, half-open)
+    and the byte offset of the block's "a" line, separated by tabs.
+    Only MAFs sorted with respect to the reference sequence (the first
+    sequence of each block) can be indexed.
+
+    A MAF compressed with bgzip (BGZF format) can also be indexed.
+    Offsets are then positions in the decompressed data, maf_size is
+    the size of the decompressed data, and the header gives the size
+    of the compressed file as well (e.g., "bgzf_size=5120933").  Each
+    line has a fourth field, the BGZF virtual offset of the block
+    (offset of the compressed block containing the "a" line, shifted
+    left 16 bits, plus the offset of the line within that block after
+    decompression), which allows reading to begin near the block (see
+    cio_set_block_map).  MAFs compressed with plain gzip cannot be
+    indexed.  Version 1 indexes, which lack virtual offsets, can still
+    be read.
+    @ingroup msa
+*/
+
+#ifndef MAF_INDEX_H
+#define MAF_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <phast/stringsplus.h>
+#include <phast/maf_reader.h>
+
+/** Filename suffix of MAF index files */
+#define MAF_INDEX_SUFFIX ".mai"
+
+/** Current version of index format */
+#define MAF_INDEX_VERSION 2
+
+/** Index of MAF blocks by reference-sequence coordinates */
+typedef struct {
+  String *refseq;               /**< Source name of reference sequence */
+  int64_t maf_size;             /**< Size of indexed MAF data, in bytes
+                                   (after decompression) */
+  int64_t bgzf_size;            /**< Size of compressed MAF file, in bytes,
+                                   or -1 if not compressed */
+  int nblocks;                  /**< Number of blocks */
+  int64_t *start,               /**< Start of refseq in each block (0-based) */
+    *end,                       /**< End of refseq in each block (exclusive) */
+    *offset,                    /**< File offset of each block (in
+                                   decompressed data) */
+    *voffset,                   /**< BGZF virtual offset of each block,
+                                   or NULL if not compressed */
+    *max_end;                   /**< Maximum of end over blocks 0..i */
+} MafIndex;
+
+/** \name MafIndex creation and i/o functions
+ \{ */
+
+/** Build an index by scanning a MAF file.  Dies if the reference
+    sequence is not the same in all blocks, or if the blocks are not
+    sorted with respect to it.
+    @param mfile MAF file, positioned at its beginning
+    @result New index
+*/
+MafIndex *mafIndex_build(FILE *mfile);
+
+/** Add BGZF virtual offsets to an index built from a bgzip-compressed
+    MAF file.
+    @param idx Index, as returned by mafIndex_build for the
+    (decompressed) contents of maf_fname
+    @param maf_fname Name of compressed MAF file
+    @result TRUE on success; FALSE if the file is not in BGZF format
+    (for example, if it was compressed with gzip rather than bgzip)
+*/
+int mafIndex_add_bgzf(MafIndex *idx, const char *maf_fname);
+
+/** Write an index to a file.
+    @param F File to write to
+    @param idx Index to write
+*/
+void mafIndex_write(FILE *F, MafIndex *idx);
+
+/** Read an index from a file.
+    @param F File to read from
+    @result Index
+*/
+MafIndex *mafIndex_read(FILE *F);
+
+/** Load the index of a MAF file, if one is available.  Looks for a
+    file named maf_fname with MAF_INDEX_SUFFIX appended.  If the index
+    does not match the size of the MAF file, or lacks virtual offsets
+    and the MAF file is compressed, a warning is printed and it is
+    ignored.
+    @param maf_fname Name of MAF file
+    @result Index, or NULL if none is available
+*/
+MafIndex *mafIndex_load(const char *maf_fname);
+
+/** Free an index.
+    @param idx Index to free
+*/
+void mafIndex_free(MafIndex *idx);
+
+/** \} \name MafIndex query functions
+ \{ */
+
+/** Find the first block that may contain reference positions at or
+    after a given position.
+    @param idx Index
+    @param pos Reference position (0-based)
+    @result Index of first block whose end is greater than pos, or
+    idx->nblocks if there is none
+*/
+int mafIndex_find(MafIndex *idx, int64_t pos);
+
+/** Position a MAF reader at the first block that may contain
+    reference positions at or after a given position.  Blocks read
+    from that point on are in order of reference position, so reading
+    may stop at the first block that starts beyond the region of
+    interest.
+    @param idx Index
+    @param r Reader for the indexed MAF file
+    @param pos Reference position (0-based)
+    @result TRUE if such a block exists, FALSE otherwise (in which
+    case the reader is left at the end of the file)
+    @note For a BGZF-compressed MAF, r must read from a stream opened
+    with phast_fopen (see cio_set_block_map).
+*/
+int mafIndex_seek(MafIndex *idx, MafReader *r, int64_t pos);
+
+/** \} */
+
+#endif
@@ -0,0 +1,135 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file maf_reader.h
+    Low-level line reader for MAF files.  Lines are handed out as
+    views (pointer and length) into a buffer owned by the reader, so
+    no memory is allocated per line.  When the underlying stream is a
+    regular file, the whole file is memory-mapped; otherwise (pipes,
+    standard input, or platforms without mmap) it is read in large
+    chunks.  A whitespace tokenizer that works in place on these
+    views is also provided.  Used by the block readers in maf.h and
+    maf_block.h.
+    @ingroup msa
+*/
+
+#ifndef MAF_READER_H
+#define MAF_READER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <phast/msa.h>
+
+/** Initial size of read buffer, when file is not memory-mapped */
+#define MAF_READER_BUFSIZE (1 << 22)
+
+/** Line reader for a MAF file */
+typedef struct {
+  FILE *F;                      /**< Underlying stream */
+  char *buf;                    /**< Mapped file or read buffer */
+  int64_t len;                  /**< Number of valid bytes in buf */
+  int64_t alloc;                /**< Size of read buffer (0 if mapped) */
+  int64_t pos;                  /**< Offset in buf of next unread byte */
+  int64_t base;                 /**< File offset corresponding to buf[0] */
+  int mapped;                   /**< Whether buf is a memory map */
+  int borrowed;                 /**< Whether buf belongs to the caller
+                                   (see mafReader_new_buffer) */
+  int eof;                      /**< Whether stream has been exhausted */
+  unsigned char xlate[256];     /**< Character translation table for
+                                   sequence data (see maf_read_block) */
+  MSA *xlate_msa;               /**< Alignment for which xlate was built
+                                   (NULL if not yet built) */
+  int xlate_toupper;            /**< Whether xlate converts to upper case */
+} MafReader;
+
+/** \name MafReader allocation functions
+ \{ */
+
+/** Create a reader for a MAF stream, starting at its current
+    position.
+    @param F Stream to read; must remain open until mafReader_free is
+    called, and should not be accessed directly in the meantime
+    @result New reader
+*/
+MafReader *mafReader_new(FILE *F);
+
+/** Create a reader for MAF text already in memory (e.g., a block
+    obtained with mafReader_next_block).
+    @param buf Text to read; not copied, and must remain valid until
+    mafReader_free is called
+    @param len Length of text
+    @result New reader
+*/
+MafReader *mafReader_new_buffer(const char *buf, int64_t len);
+
+/** Free a reader.  If possible, the underlying stream is positioned
+    just after the last line returned, so that it can be read further
+    by other means.  The stream is not closed.
+    @param r Reader to free
+*/
+void mafReader_free(MafReader *r);
+
+/** \} \name MafReader line and token functions
+ \{ */
+
+/** Obtain next line.
+    @param r Reader
+    @param[out] line Set to first character of line.  The line is NOT
+    NULL-terminated, and remains valid only until the next call
+    @param[out] len Set to length of line, excluding newline
+    @result 0 on success, EOF if no more lines are available
+*/
+int mafReader_next_line(MafReader *r, const char **line, int *len);
+
+/** Obtain the text of the next alignment block, without parsing it.
+    The block extends to the line preceding the next "a" line that
+    follows a sequence line, or to the end of the file, so that it
+    contains exactly the lines that maf_read_block would consume
+    (including any comments, or a header at the start of the file).
+    @param r Reader
+    @param[out] text Set to start of block.  Remains valid only until
+    the next call, unless the file is memory-mapped (r->mapped), in
+    which case it is valid until the reader is freed
+    @param[out] len Set to length of block, in bytes
+    @result 0 on success, EOF if no more text is available
+*/
+int mafReader_next_block(MafReader *r, const char **text, int64_t *len);
+
+/** Obtain file offset of next line to be returned.
+    @param r Reader
+    @result Offset in bytes from the start of the underlying file
+*/
+int64_t mafReader_tell(MafReader *r);
+
+/** Reposition reader, so that the next line returned starts at the
+    given file offset (normally one obtained from mafReader_tell or
+    from a MAF index; see maf_index.h).  Dies if the underlying stream
+    is not seekable.
+    @param r Reader
+    @param offset Offset in bytes from the start of the underlying file
+*/
+void mafReader_seek(MafReader *r, int64_t offset);
+
+/** Split a line into whitespace-delimited fields, in place.
+    Follows the conventions of str_split with a NULL delimiter (runs
+    of whitespace separate fields; leading whitespace produces an
+    empty first field).
+    @param line Line to split (need not be NULL-terminated)
+    @param len Length of line
+    @param[out] fields Set to start of each field
+    @param[out] flens Set to length of each field
+    @param maxfields Maximum number of fields to store in fields and flens
+    @result Total number of fields in line (may exceed maxfields)
+*/
+int mafReader_split(const char *line, int len, const char **fields,
+                    int *flens, int maxfields);
+
+/** \} */
+
+#endif
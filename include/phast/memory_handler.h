@@ -54,6 +54,7 @@
 #include "phast/category_map.h"
 #include "phast/trees.h"
 #include "phast/sufficient_stats.h"
+#include "phast/arena.h"
 
 /** Start new memory handler and push it on top of memory-handler stack.
  */
@@ -112,6 +113,14 @@ void *srealloc(void *ptr0, size_t size);
  */
 void sfree(void *ptr0);
 
+/** Get the arena used for temporary storage (see arena.h) while the
+    current memory handler is in effect.  Its memory is released by
+    phast_free_all().
+    @return Arena of memory handler on top of the stack, or NULL if phast
+    was compiled without memory handler support
+ */
+Arena *phast_mem_arena();
+
 /** Register a static variable.  This is necessary when memory handler is
     in use.  This re-sets the value of the variable to NULL after it is
     freed by phast_free_all().
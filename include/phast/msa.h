@@ -83,6 +83,11 @@ typedef enum {PHYLIP,           /**< PHYLIP format  */
               LAV,              /**< lav format, used by BLASTZ */
               MAF,              /**< Multiple Alignment Format (MAF)
 				    used by MULTIZ and TBA  */
+              BSS,              /**< Binary version of SS format,
+                                   which can be memory-mapped and
+                                   loaded without parsing.  Readers
+                                   of SS files accept it
+                                   automatically */
 	      UNKNOWN_FORMAT    /**< Format unknown */
 } msa_format_type; 
 
@@ -81,6 +81,12 @@ typedef struct {
   double **forward;             /**< Forward scores */
   int alloc_len;                /**< Length for which emissions and/or
                                    forward are (or are to be) allocated */
+  int window,                   /**< If > 0, Viterbi and posterior
+                                   decoding are performed in windows
+                                   of this many columns (see
+                                   hmm_posterior_probs_windowed) */
+    window_overlap;             /**< Number of columns by which windows
+                                   are extended on either side */
   int *state_pos, 		/**< Contain positive tracking data for emissions */
   *state_neg;   		/**< Contain negative tracking data for emissions */
   indel_mode_type indel_mode;   /**< Indel mode in use */
@@ -243,7 +249,7 @@ double phmm_lnl(PhyloHmm *phmm);
     @pre Emissions must have already been computed 
     @param[in] phmm PhyloHMM object
     @param[out] post_probs Calculated post probabilities
-    @result Log likelihod. 
+    @result Log likelihod (approximate if phmm->window > 0).
     @see phmm_compute_emissions
     @see phmm_new_postprobs
 */
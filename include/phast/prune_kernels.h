@@ -0,0 +1,95 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file prune_kernels.h
+    Inner loops of Felsenstein's pruning algorithm, specialized for
+    4-state (nucleotide) and 64-state (codon) models.
+
+    Partial likelihoods are stored node-major (all states of a node
+    are contiguous) and substitution matrices are packed into
+    contiguous row-major arrays aligned to PK_ALIGN bytes.  On x86
+    processors, AVX2 or AVX-512 versions of the kernels are selected at
+    run time; otherwise (or for other numbers of states) portable
+    scalar versions are used.  All versions perform the same
+    floating-point operations in the same order (without fused
+    multiply-adds), so results do not depend on which is used.
+    @ingroup phylo
+*/
+
+#ifndef PRUNE_KERNELS_H
+#define PRUNE_KERNELS_H
+
+#include <phast/markov_matrix.h>
+
+/** Alignment (in bytes) of packed matrices and partials */
+#define PK_ALIGN 64
+
+/** Instruction sets that may be used by kernels */
+typedef enum {PK_SCALAR, PK_AVX2, PK_AVX512} pk_simd_type;
+
+/** Allocate an array of doubles aligned to PK_ALIGN bytes.
+    @param n Number of doubles
+    @param base (Output) Pointer to pass to sfree when done
+    @result Aligned array */
+double *pk_new_aligned(size_t n, void **base);
+
+/** Copy a substitution matrix into a contiguous row-major array,
+    so that element (i,j) is at dest[i*size+j].
+    @param dest Array of size*size doubles
+    @param P Substitution matrix */
+void pk_pack(double *dest, MarkovMatrix *P);
+
+/** Copy the transpose of a substitution matrix into a contiguous
+    array, so that element (i,j) is at dest[j*size+i].
+    @param dest Array of size*size doubles
+    @param P Substitution matrix */
+void pk_pack_transpose(double *dest, MarkovMatrix *P);
+
+/** Compute the product of a matrix and a vector,
+    dest[i] = sum_j src[j] * M[j*n+i].  Sums are accumulated in order
+    of j.  With M a packed transpose of P, this is P times src; with M
+    a packed P, it is src times P.
+    @param dest (Output) Result, of size n; must not overlap src
+    @param M Packed matrix
+    @param src Vector of size n
+    @param n Number of states */
+void pk_matvec(double *dest, const double *M, const double *src, int n);
+
+/** Inside (pruning) recursion for one internal node:
+    dest[i] = (sum_j lsrc[j] * PTl[j*n+i]) * (sum_j rsrc[j] * PTr[j*n+i]).
+    @param dest (Output) Partials for parent node
+    @param PTl Packed transpose of substitution matrix for left branch
+    @param lsrc Partials for left child
+    @param PTr Packed transpose of substitution matrix for right branch
+    @param rsrc Partials for right child
+    @param n Number of states */
+void pk_inside(double *dest, const double *PTl, const double *lsrc,
+               const double *PTr, const double *rsrc, int n);
+
+/** First step of the outside recursion for a node with the given
+    parent and sibling:
+    dest[j] = sum_k (parent[j] * sib[k]) * PTsib[k*n+j].
+    The outside partials of the node are then given by
+    pk_matvec(outside, P, dest, n), where P is the packed substitution
+    matrix for the node's branch.
+    @param dest (Output) Intermediate values indexed by parent state
+    @param PTsib Packed transpose of substitution matrix for sibling
+    @param parent Outside partials for parent
+    @param sib Inside partials for sibling
+    @param n Number of states */
+void pk_outside(double *dest, const double *PTsib, const double *parent,
+                const double *sib, int n);
+
+/** Return the instruction set that kernels will use for a given
+    number of states.
+    @param n Number of states
+    @result Instruction set */
+pk_simd_type pk_get_simd(int n);
+
+#endif
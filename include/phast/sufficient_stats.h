@@ -18,6 +18,7 @@
 #include "phast/hashtable.h"
 #include "phast/lists.h"
 #include "phast/msa.h"
+#include "phast/tuple_hash.h"
 #include "phast/external_libs.h"
 
 /** Sufficient Statistics object for an alignment. 
@@ -26,9 +27,11 @@ struct msa_ss_struct {
   int tuple_size;               /**< Number of adjacent columns to
                                    consider as a 'column tuple' */
   int ntuples;                  /**< Number of distinct tuples */
-  char **col_tuples;            /**< The actual column tuples;
-                                   col_tuples[i] is string of length
-                                   ss->nseqs * tuple_size */
+  unsigned char **col_tuples;   /**< The actual column tuples, in
+                                   packed form; col_tuples[i]
+                                   represents a string of length
+                                   msa->nseqs * tuple_size (see
+                                   ss_get_tuple, ss_set_tuple) */
   int *tuple_idx;               /**< Defines order of column tuples in
                                    alignment; tuple_idx[i] is the
                                    index in col_tuples of the tuple
@@ -39,8 +42,25 @@ struct msa_ss_struct {
   double **cat_counts;		/** Counts per category  */
   MSA *msa;                     /** Parent alignment */
   int alloc_len, alloc_ntuples; /** for ss_realloc */
+  int tuple_bits;               /**< Bits per character in col_tuples
+                                   (4 or 8) */
+  int tuple_nsymbols;           /**< Number of 4-bit codes assigned */
+  int tuple_code[NCHARS];       /**< 4-bit code of each character
+                                   (-1 if none assigned) */
+  char tuple_decode[16];        /**< Character for each 4-bit code */
 };
 
+/** Magic number at the start of a binary sufficient statistics
+    file.  Contains a newline so that the first "line" of a binary
+    file can be peeked at like that of a text file. */
+#define SS_BINARY_MAGIC "\211PHSS\r\n\032"
+
+/** Length of SS_BINARY_MAGIC in bytes */
+#define SS_BINARY_MAGIC_LEN 8
+
+/** Current version of the binary sufficient statistics format */
+#define SS_BINARY_VERSION 2
+
 /** Alignment sufficient statistics.
     @note Completes incomplete declaration from msa.h */
 typedef struct msa_ss_struct MSA_SS; 
@@ -59,6 +79,31 @@ typedef struct {
                                    source msas to those of pooled msa */
 } PooledMSA;
 
+/** Distinct column tuples of a single alignment block, collected
+   without reference to the aggregate sufficient statistics to which
+   they will be added.  This allows the tuples of several blocks to be
+   collected concurrently (see ss_block_collect) and then merged in
+   order (see ss_block_merge), with the same result as adding the
+   blocks one at a time. */
+typedef struct {
+  int ntuples;                  /**< Number of distinct tuples */
+  int alloc_ntuples;            /**< Number of tuples allocated */
+  int keylen;                   /**< Length of each tuple string */
+  char *keys;                   /**< Tuple strings in order of first
+                                   appearance, each keylen+1
+                                   characters (NULL-terminated) */
+  double *counts;               /**< Number of occurrences of each tuple */
+  int ncats;                    /**< Number of categories (-1 if none) */
+  double **cat_counts;          /**< Counts by category (NULL if none) */
+  int ncols;                    /**< Number of columns in block */
+  int nused;                    /**< Number of columns not skipped */
+  int *col_tuple;               /**< Tuple of each column, or -1 if the
+                                   column was skipped; NULL unless
+                                   order is stored */
+  int alloc_cols;               /**< Number of columns allocated */
+  TupleHash *hash;              /**< Dictionary of tuples in block */
+} SS_Block;
+
 /** \name Calculate (populate) Sufficient Statistics functions */
 
 /**  Calculate Sufficient Statistics for an MSA.
@@ -145,9 +190,72 @@ typedef struct {
 */
 void ss_from_msas(MSA *msa, int tuple_size, int store_order, 
                   List *cats_to_do, MSA *source_msa, 
-                  Hashtable *existing_hash, int idx_offset,
+                  TupleHash *existing_hash, int idx_offset,
 		  int non_overlapping);
 
+/** Add the columns of a short alignment (typically a single MAF
+   block) to the unordered sufficient statistics of another alignment.
+   This is the streaming counterpart of ss_from_msas with a source
+   alignment and store_order == FALSE: the destination is enlarged
+   only when a new distinct tuple is encountered, so the storage
+   required is bounded by the number of distinct tuples rather than
+   by the total length of the alignments added.  Tuples are numbered
+   in order of first appearance, as with ss_from_msas.
+   @param msa Destination alignment, with unordered sufficient
+   statistics (created with ss_new) and same sequences as block
+   @param block Source alignment, with explicit sequences.  If
+   msa->ncats >= 0, block->categories must be defined
+   @param tuple_hash Dictionary of the tuples already in msa (see
+   ss_new_tuple_hash); updated as tuples are added
+   @param cats_to_do (Optional) List of category numbers to include;
+   other columns are skipped.  Ignored if msa->ncats < 0
+   @result Number of columns added.  msa->length is increased
+   accordingly
+ */
+int ss_add_block(MSA *msa, MSA *block, TupleHash *tuple_hash,
+                 List *cats_to_do);
+
+/** Create an object to hold the column tuples of a block (see
+   SS_Block).
+   @param msa Alignment to which blocks will be added; must have
+   sufficient statistics
+   @param store_order Whether order of columns will be stored
+   @result New, empty object
+ */
+SS_Block *ss_block_new(MSA *msa, int store_order);
+
+/** Collect the distinct column tuples of a block, replacing any
+   tuples previously collected.  Neither msa nor block is modified,
+   so blocks may be collected concurrently, each with its own
+   SS_Block object.
+   @param sb Object in which to store tuples
+   @param msa Alignment to which block will be added (see
+   ss_block_merge)
+   @param block Block, with explicit sequences and as many sequences
+   as msa.  If msa->ncats >= 0, block->categories must be defined
+   @param cats_to_do (Optional) List of category numbers to include;
+   other columns are skipped.  Ignored if msa->ncats < 0
+ */
+void ss_block_collect(SS_Block *sb, MSA *msa, MSA *block, List *cats_to_do);
+
+/** Add the tuples of a block to sufficient statistics.  If msa
+   stores order, the effect is that of ss_from_msas with the block as
+   source alignment and idx_offset as given; otherwise, it is that of
+   ss_add_block.
+   @param msa Alignment to which block is added
+   @param sb Tuples of block (see ss_block_collect)
+   @param tuple_hash Dictionary of the tuples already in msa
+   @param idx_offset Position in msa of first column of block if
+   storing order, ignored otherwise
+ */
+void ss_block_merge(MSA *msa, SS_Block *sb, TupleHash *tuple_hash,
+                    int idx_offset);
+
+/** Free an SS_Block object.
+   @param sb Object to free
+ */
+void ss_block_free(SS_Block *sb);
+
 /** Pool multiple MSAs into a single object of type PooledMSA.  
    @pre All msas have same names, nseqs, and alphabet (it uses those from the first MSA in the list) 
    @param source_msas List of MSA objects to pool together 
@@ -222,6 +330,40 @@ void ss_write(MSA *msa, FILE *F, int show_order);
 */
 MSA* ss_read(FILE *F, char *alphabet);
 
+/** Write MSA to file as binary sufficient statistics.  The file
+    consists of a fixed header followed by 8-byte aligned sections
+    holding the sequence names, the alphabet, the packed column
+    tuples, the counts and category counts, and (if show_order) the
+    tuple order, stored with the narrowest integer width (1, 2, or 4
+    bytes) that can represent every tuple index.  Numbers are stored
+    in native byte order.
+    @param msa MSA to save as sufficient statistics
+    @param F File descriptor to save to
+    @param show_order Keep track of tuple order
+    @see ss_read_binary
+*/
+void ss_write_binary(MSA *msa, FILE *F, int show_order);
+
+/** Read MSA from file in binary sufficient statistics format.  If F
+    refers to a regular file positioned at its start, the file is
+    memory-mapped and its sections are copied directly into the new
+    object; otherwise it is read sequentially.
+    @param F File descriptor to read from
+    @param alphabet Alphabet of MSA being read in (NULL to use the
+    alphabet stored in the file)
+    @result MSA reconstructed from sufficient statistics
+    @note Called automatically by ss_read when F begins with
+    SS_BINARY_MAGIC.
+*/
+MSA* ss_read_binary(FILE *F, char *alphabet);
+
+/** Test whether a string starts with the binary sufficient
+    statistics magic number.
+    @param str String to test (e.g., first line of a file)
+    @result 1 if str looks like the start of a binary SS file, 0 otherwise
+*/
+int ss_is_binary(const char *str);
+
 /** \} */
 
 /**  Update category count according to 'categories' attribute of MSA
@@ -310,6 +452,20 @@ MSA *ss_sub_alignment(MSA *msa, char **new_names, List *include_list,
 */
 void ss_reverse_compl(MSA *msa);
 
+/** Create an alignment representing the reverse complement of
+   another, but indexed by the columns of the original.  Column j of
+   the new alignment is the complement of column j of the original,
+   with context given by (the complements of) the columns that follow
+   it.  This is equivalent to reverse complementing a copy of the
+   alignment with msa_reverse_compl and then reversing the order of
+   its columns, but does not copy the sequences, and reverse
+   complements each distinct tuple only once.
+   @param msa Alignment with ordered sufficient statistics
+   @result New alignment with ordered sufficient statistics only
+   @note Category labels are not copied.
+*/
+MSA *ss_reverse_compl_fwd_coords(MSA *msa);
+
 /** Change sufficient statistics to reflect reordered rows of an alignment.
    @param msa MSA containing Sufficient Statistics
    @param new_to_old Array of integers mapping the new row order of the alignment to the old row order
@@ -386,13 +542,22 @@ void ss_reduce_tuple_size(MSA *msa, int new_tuple_size);
 /* Not found in implementation */
 void ss_add_seq(MSA *msa, int new_nseq);
 
+/** Create a dictionary suitable for column tuples of an alignment.
+  @param[in] msa Alignment object (defines alphabet and missing-data characters)
+  @param[in] est_capacity Estimated number of distinct tuples (dictionary grows as needed)
+  @result New, empty dictionary
+ */
+TupleHash *ss_new_tuple_hash(MSA *msa, int est_capacity);
+
 /** Retrieve tuple index from hash table using tuple as key
   @param[in] coltuple_str Key used for hash table 
   @param[in] tuple_hash Hash table of tuple indexes (integers)
   @param[in] msa Alignment object
   @result -1 if not found, otherwise Value stored in tuple_hash at key coltuple_str
+  @note Trailing missing data are ignored in the key, so that tuples
+  differing only in sequences that have no data compare equal
  */
-int ss_lookup_coltuple(char *coltuple_str, Hashtable *tuple_hash, MSA *msa);
+int ss_lookup_coltuple(char *coltuple_str, TupleHash *tuple_hash, MSA *msa);
 
 /** Add tuple index to hash table using tuple as key
   @param[in] coltuple_str Key used for hash table
@@ -400,7 +565,20 @@ int ss_lookup_coltuple(char *coltuple_str, Hashtable *tuple_hash, MSA *msa);
   @param[in] tuple_hash Hash table of tuple indices
   @param[in] msa Multiple Alignment object
  */
-void ss_add_coltuple(char *coltuple_str, void *val, Hashtable *tuple_hash, MSA *msa);
+void ss_add_coltuple(char *coltuple_str, int val, TupleHash *tuple_hash, MSA *msa);
+
+/** Retrieve tuple index from hash table, adding it with the
+  specified value if not present.  Equivalent to ss_lookup_coltuple
+  followed (if necessary) by ss_add_coltuple, but examines the tuple
+  only once.
+  @param[in] coltuple_str Key used for hash table
+  @param[in] val Value (tuple index) to add if tuple is not present
+  @param[in] tuple_hash Hash table of tuple indices
+  @param[in] msa Multiple Alignment object
+  @result Existing value if tuple was present, otherwise val
+ */
+int ss_lookup_or_add_coltuple(char *coltuple_str, int val, 
+                              TupleHash *tuple_hash, MSA *msa);
 
 /** Impose an artificial ordering on tuples if they aren't already ordered.
   @param msa Multiple Alignment to order
@@ -466,6 +644,77 @@ void set_col_char_in_string(MSA *msa, char *str, int seqidx, int tuple_size, int
   str[tuple_size*seqidx + tuple_size - 1 + col_offset] = c;
 }
 
+/* Column tuples are stored with two characters per byte (low-order
+   half first), using 4-bit codes that are assigned as characters are
+   first encountered; the gap character, the alphabet, and the
+   missing-data characters are assigned codes in advance.  If more
+   than 16 distinct characters are needed (e.g., for a protein
+   alphabet), all tuples are converted to one byte per character,
+   stored as is.  Tuples should therefore be accessed only through
+   the functions below (and ss_get_char_tuple, ss_get_char_pos, etc.),
+   never directly. */
+
+/** \name Packed column tuple functions
+\{ */
+
+/** Number of bytes occupied by a packed column tuple.
+    @param ss Sufficient statistics object
+    @param len Length of tuple in characters (normally nseqs * tuple_size)
+    @result Number of bytes
+*/
+static PHAST_INLINE
+int ss_tuple_nbytes(MSA_SS *ss, int len) {
+  return ss->tuple_bits == 4 ? (len + 1) / 2 : len;
+}
+
+/** Return a character of a packed column tuple.
+    @param ss Sufficient statistics object to which tuple belongs
+    @param tuple Packed tuple (element of ss->col_tuples)
+    @param i Index of character, as in the unpacked string (see
+    col_string_to_char)
+    @result Character at position i
+*/
+static PHAST_INLINE
+char ss_tuple_char(MSA_SS *ss, const unsigned char *tuple, int i) {
+  if (ss->tuple_bits == 8) return (char)tuple[i];
+  return ss->tuple_decode[(tuple[i >> 1] >> ((i & 1) << 2)) & 0xf];
+}
+
+/** Unpack a column tuple into a string.
+    @param[in] msa Multiple alignment with sufficient statistics
+    @param[in] tupleidx Index of tuple
+    @param[out] str String to hold tuple; must be allocated to size
+    msa->nseqs * msa->ss->tuple_size + 1.  Will be NULL-terminated.
+*/
+void ss_get_tuple(MSA *msa, int tupleidx, char *str);
+
+/** Pack a string into a column tuple, allocating or resizing
+    msa->ss->col_tuples[tupleidx] as necessary.
+    @param msa Multiple alignment with sufficient statistics
+    @param tupleidx Index of tuple to set
+    @param str String representation of tuple, as produced by
+    col_to_string (need not be NULL-terminated)
+    @param len Number of characters in str; normally msa->nseqs *
+    msa->ss->tuple_size.  A different length may be used while the
+    dimensions of the alignment are being changed (see
+    msa_add_seq_ss), but in that case str must not introduce new
+    characters.
+*/
+void ss_set_tuple(MSA *msa, int tupleidx, const char *str, int len);
+
+/** Set a single character of a column tuple.
+    @param msa Multiple alignment with sufficient statistics
+    @param tupleidx Index of tuple to modify
+    @param seqidx Index of sequence
+    @param col_offset Column offset relative to last column in
+    tuple (see col_string_to_char)
+    @param c New character
+*/
+void ss_set_char_tuple(MSA *msa, int tupleidx, int seqidx, int col_offset,
+                       char c);
+
+/** \} */
+
 /** \name Get character of tuple from alignment 
 \{ */
 
@@ -481,8 +730,9 @@ void set_col_char_in_string(MSA *msa, char *str, int seqidx, int tuple_size, int
 static PHAST_INLINE
 char ss_get_char_tuple(MSA *msa, int tupleidx, int seqidx, 
                        int col_offset) {
-  return col_string_to_char(msa, msa->ss->col_tuples[tupleidx], seqidx, 
-                            msa->ss->tuple_size, col_offset);
+  MSA_SS *ss = msa->ss;
+  return ss_tuple_char(ss, ss->col_tuples[tupleidx], ss->tuple_size*seqidx + 
+                       ss->tuple_size - 1 + col_offset);
 }
 
 /** Return character for specified sequence at specified alignment
@@ -501,9 +751,8 @@ char ss_get_char_pos(MSA *msa, int position, int seqidx,
                      int col_offset) {
   if (msa->ss->tuple_idx == NULL)
     die("ERROR ss_get_char_pos: msa->ss->tuple_idx is NULL\n");
-  return col_string_to_char(msa, 
-                            msa->ss->col_tuples[msa->ss->tuple_idx[position]], 
-                            seqidx, msa->ss->tuple_size, col_offset);
+  return ss_get_char_tuple(msa, msa->ss->tuple_idx[position], seqidx, 
+                           col_offset);
 }
 /** \} */
 /** Produce a printable representation of the specified tuple. 
@@ -518,8 +767,7 @@ void tuple_to_string_pretty(char *str, MSA *msa, int tupleidx) {
   int stridx = 0, offset, j;
   for (offset = -1 * (msa->ss->tuple_size-1); offset <= 0; offset++) {
     for (j = 0; j < msa->nseqs; j++) {
-      str[stridx++] = col_string_to_char(msa, msa->ss->col_tuples[tupleidx], 
-                                         j, msa->ss->tuple_size, offset);
+      str[stridx++] = ss_get_char_tuple(msa, tupleidx, j, offset);
     }
     if (offset < 0) str[stridx++] = ' ';
   }
@@ -543,8 +791,7 @@ void ss_get_tuple_of_chars(MSA *msa, int tupleidx, int seqidx,
   int offset;
   for (offset = -1 * (msa->ss->tuple_size-1); offset <= 0; offset++) {
     tuplestr[msa->ss->tuple_size + offset - 1] =
-      col_string_to_char(msa, msa->ss->col_tuples[tupleidx],
-                         seqidx, msa->ss->tuple_size, offset);
+      ss_get_char_tuple(msa, tupleidx, seqidx, offset);
   }
 }
 
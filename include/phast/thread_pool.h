@@ -0,0 +1,70 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file thread_pool.h
+   Simple persistent pool of worker threads for data-parallel loops.
+
+   A single process-wide pool is created on demand the first time a
+   parallel loop is requested with more than one thread.  The calling
+   thread always participates as thread 0, and thread indices are
+   less than thr_nthreads_for(ntasks), so per-thread scratch arrays
+   for a loop of ntasks tasks need only that many entries.  Tasks are
+   claimed dynamically, so uneven task costs are balanced
+   automatically.
+
+   Nested calls (e.g., from within a task) are executed serially by
+   the calling thread.  When compiled with RPHAST or SKIP_THREADS, all
+   loops are executed serially.
+   @ingroup base
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <phast/external_libs.h>
+
+/** Maximum number of threads allowed */
+#define THR_MAX_THREADS 256
+
+/** Function executed for each task of a parallel loop.
+    @param data Shared data passed to thr_parallel_for
+    @param task Index of task, in [0, ntasks)
+    @param thread Index of thread executing task, in [0, nthreads)
+ */
+typedef void (*thr_task_func)(void *data, int task, int thread);
+
+/** Set the number of threads used by parallel loops (default 1).
+    @param nthreads Number of threads, including the calling thread */
+void thr_set_nthreads(int nthreads);
+
+/** Get the number of threads used by parallel loops.
+    @result Number of threads (1 if threading is disabled) */
+int thr_get_nthreads();
+
+/** Get the number of threads a parallel loop of a given number of
+    tasks would use, i.e., the number of per-thread scratch areas it
+    requires.
+    @param ntasks Number of tasks
+    @result min(thr_get_nthreads(), ntasks), but at least 1; 1 if
+    called from within a task, as nested loops run serially */
+int thr_nthreads_for(int ntasks);
+
+/** Execute func(data, task, thread) for every task in [0, ntasks),
+    distributing tasks over the thread pool.  Returns when all tasks
+    have completed.  Tasks must not allocate memory with smalloc when
+    the phast memory handler is in use (temporary storage can instead
+    be obtained with ar_alloc; see arena.h), and must write only to
+    disjoint locations.
+    @param ntasks Number of tasks
+    @param func Function to execute for each task
+    @param data Shared data passed to each call of func
+ */
+void thr_parallel_for(int ntasks, thr_task_func func, void *data);
+
+#endif
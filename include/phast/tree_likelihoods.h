@@ -102,6 +102,11 @@ struct tp_struct {
 typedef struct tp_struct TreePosteriors;
                                 /* see incomplete type in tree_model.h */
 
+/** Working storage for tl_compute_log_likelihood, kept by a tree
+    model between calls (opaque) */
+typedef struct tl_workspace_struct TlWorkspace;
+                                /* see incomplete type in tree_model.h */
+
 #define NULL_LOG_LIKELIHOOD 1   /** Safe value for null when dealing with
                                    log likelihoods (should always be <= 0) FIXME? */
 
@@ -121,6 +126,10 @@ void tl_dump_matrices(TreeModel *mod, double **inside_vals,
    If non-NULL each of its attributes must either be NULL or
    previously allocated to the required size. 
    @result Log likelihood of entire tree model specified
+   @note Working storage is allocated on the first call and kept in
+   mod->tl_workspace for later calls, which allocate no memory unless
+   the dimensions of the model or alignment grow.  Concurrent calls
+   must not share a tree model.
 */
 double tl_compute_log_likelihood(TreeModel *mod, MSA *msa, 
                                  double *col_scores, 
@@ -128,6 +137,17 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
 				 int cat,
                                  TreePosteriors *post);
 
+/** Set up the parts of a tree model that tl_compute_log_likelihood
+   would otherwise create on demand (leaf-to-sequence mapping,
+   substitution matrices, etc.).  Some of these use static storage,
+   so this must be called for each model before calls of
+   tl_compute_log_likelihood for different models are run
+   concurrently.
+   @param mod Tree Model
+   @param msa Alignment to be used with the model
+*/
+void tl_prepare(TreeModel *mod, MSA *msa);
+
 /** Create a new TreePosteriors object.
     @param mod Tree Model of which the posterior probabilities are calculated
     @param msa Multiple Alignment
@@ -153,6 +173,12 @@ TreePosteriors *tl_new_tree_posteriors(TreeModel *mod, MSA *msa, int do_bases,
  */
 void tl_free_tree_posteriors(TreeModel *mod, MSA *msa, TreePosteriors *tp);
 
+/** Free working storage kept by a tree model for likelihood
+    computations (called by tm_free).
+   @param ws Workspace to free; may be NULL
+ */
+void tl_free_workspace(TlWorkspace *ws);
+
 /** Compute the expected (posterior) complete log likelihood of a tree
    model based on a TreePosteriors object.  
    @param[in] mod Tree Model
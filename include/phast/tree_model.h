@@ -84,6 +84,7 @@ typedef enum {
 } scale_bound_type; 
 
 struct tp_struct;
+struct tl_workspace_struct;
 
 
 /** Defines alternative substitution model for a particular branch */
@@ -110,7 +111,29 @@ typedef struct alt_subst_mod {
   /** Note: could implement sharing with other parameters, hasn't been needed yet */
 } AltSubstMod;
 
-
+/** One step of a flattened tree traversal (see TreePrunePlan).
+    Nodes are identified by id; the substitution matrix for the
+    branch above a node is mod->P[node][rcat]. */
+typedef struct {
+  int node;                     /**< Id of node */
+  int lchild;                   /**< Id of left child, or -1 for a leaf */
+  int rchild;                   /**< Id of right child, or -1 for a leaf */
+  int parent;                   /**< Id of parent, or -1 for the root */
+  int sibling;                  /**< Id of sibling, or -1 for the root */
+} TreePruneOp;
+
+/** Flattened postorder and preorder traversals of the tree of a tree
+    model, for use in pruning computations, which can follow them
+    without chasing TreeNode pointers.  Built on demand by
+    tm_get_prune_plan and discarded when the topology changes. */
+typedef struct {
+  TreeNode *tree;               /**< Root of tree for which plan was
+                                   built */
+  int nnodes;                   /**< Number of nodes (size of each
+                                   traversal) */
+  TreePruneOp *postorder;       /**< Children before parents */
+  TreePruneOp *preorder;        /**< Parents before children */
+} TreePrunePlan;
 
 /** Tree model object */
 struct tm_struct {
@@ -219,6 +242,11 @@ struct tm_struct {
 				 Normally 0, but 1 if TM_BRANCHLENS_NONE, or
 				 if TM_SCALE and alt_subst_mods!=NULL */
   int **iupac_inv_map;          /**< Inverse map for IUPAC ambiguity characters */
+  TreePrunePlan *prune_plan;    /**< (Optional) cached traversals of
+                                   tree; see tm_get_prune_plan */
+  struct tl_workspace_struct *tl_workspace;
+                                /**< (Optional) storage reused by
+                                   tl_compute_log_likelihood */
 };
 
 typedef struct tm_struct TreeModel;
@@ -657,6 +685,22 @@ double tm_extrapolate_and_prune(TreeModel *mod, TreeNode *extrapolate_tree,
 */
 void tm_reset_tree(TreeModel *mod, TreeNode *newtree);
 
+/** Obtain flattened traversals of the tree of a tree model, building
+    them if necessary.  The plan is cached with the model and reused
+    until the tree is replaced or changed by tm_prune or
+    tm_reset_tree.  Code that alters mod->tree in other ways must call
+    tm_free_prune_plan.  Not thread-safe; call once before starting
+    threads that will use the plan.
+    @param mod Tree model
+    @result Pruning plan (owned by mod)
+*/
+TreePrunePlan *tm_get_prune_plan(TreeModel *mod);
+
+/** Discard the cached pruning plan of a tree model, if any.
+    @param mod Tree model
+*/
+void tm_free_prune_plan(TreeModel *mod);
+
 /** Set branches to be ignored in likelihood calculation and parameter
    estimation.
    @param mod Tree Model containing branches to be ignored
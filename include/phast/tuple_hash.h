@@ -0,0 +1,113 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file tuple_hash.h
+    Dictionary mapping alignment column tuples to integer indices.
+    Keys are strings over a small alphabet (typically nucleotides
+    plus gap and missing-data characters); they are packed several
+    symbols per byte and stored back to back in a single growing
+    buffer.  The table uses open addressing with linear probing and
+    doubles in size as it fills, so no capacity estimate is required.
+    Used when building sufficient statistics (see sufficient_stats.h).
+    @ingroup msa
+*/
+
+#ifndef TUPLE_HASH_H
+#define TUPLE_HASH_H
+
+#include <stdint.h>
+#include <phast/external_libs.h>
+
+/** Maximum fraction of slots in use before the table is enlarged */
+#define TH_MAX_LOAD 0.5
+
+/** Entry in the slot array of a TupleHash */
+typedef struct {
+  uint64_t hash;                /**< Hash of packed key (0 if slot empty) */
+  int64_t offset;               /**< Offset of packed key in key buffer */
+  int len;                      /**< Length of key, in symbols */
+  int val;                      /**< Associated value */
+} TupleHashSlot;
+
+/** Column tuple dictionary */
+typedef struct {
+  int nslots;                   /**< Number of slots (a power of 2) */
+  int nkeys;                    /**< Number of keys stored */
+  TupleHashSlot *slots;         /**< Slot array */
+  unsigned char *keys;          /**< Packed keys, stored contiguously */
+  int64_t keys_used,            /**< Bytes in use in keys */
+    keys_alloc;                 /**< Bytes allocated for keys */
+  int bits;                     /**< Bits per symbol (4 or 8) */
+  int nsymbols;                 /**< Number of distinct symbols seen */
+  int code[256];                /**< Symbol code for each character
+                                   (-1 if not yet assigned) */
+  unsigned char decode[256];    /**< Character for each symbol code */
+  unsigned char *scratch;       /**< Buffer for packing query keys */
+  int scratch_len;              /**< Size of scratch, in bytes */
+} TupleHash;
+
+/** \name TupleHash allocation functions
+ \{ */
+
+/** Create a new tuple dictionary.
+    @param est_capacity Estimated number of keys (table grows as
+    needed, so this is only a hint)
+    @param symbols String of characters expected to appear in keys
+    (e.g., alphabet plus gap and missing-data characters); may be
+    NULL.  Other characters are accepted but may force a wider
+    encoding.
+    @result New, empty dictionary
+*/
+TupleHash *th_new(int est_capacity, const char *symbols);
+
+/** Free a tuple dictionary.
+    @param th Dictionary to free
+*/
+void th_free(TupleHash *th);
+
+/** Remove all keys from a tuple dictionary, keeping its storage and
+    symbol encoding, so that it can be reused.
+    @param th Dictionary to clear
+*/
+void th_clear(TupleHash *th);
+
+/** \} \name TupleHash lookup and insertion functions
+ \{ */
+
+/** Retrieve the value associated with a key.
+    @param th Dictionary
+    @param key Key (need not be NULL-terminated)
+    @param len Number of characters of key to use
+    @result Value associated with key, or -1 if key is not present
+*/
+int th_get(TupleHash *th, const char *key, int len);
+
+/** Associate a value with a key, replacing any existing value.
+    @param th Dictionary
+    @param key Key (need not be NULL-terminated)
+    @param len Number of characters of key to use
+    @param val Value to store (should be non-negative)
+*/
+void th_put(TupleHash *th, const char *key, int len, int val);
+
+/** Retrieve the value associated with a key, adding the key with the
+    specified value if it is not already present.  Equivalent to
+    th_get followed (if necessary) by th_put, but hashes the key only
+    once.
+    @param th Dictionary
+    @param key Key (need not be NULL-terminated)
+    @param len Number of characters of key to use
+    @param val Value to store if key is not present
+    @result Existing value if key was present, otherwise val
+*/
+int th_get_or_put(TupleHash *th, const char *key, int len, int val);
+
+/** \} */
+
+#endif
@@ -259,6 +259,7 @@ void do_p_values(BDPhyloHmm *bdphmm, GFF_Set *predictions,
       tmp = mod->tree->lchild;
       mod->tree->lchild = mod->tree->rchild;
       mod->tree->rchild = tmp;
+      tm_free_prune_plan(mod);
 
       /* now get stats */
       jp = sub_define_jump_process(mod, 1e-10, tr_total_len(mod->tree));
@@ -268,6 +269,7 @@ void do_p_values(BDPhyloHmm *bdphmm, GFF_Set *predictions,
       tr_free(mod->tree);
       sub_free_jump_process(jp);
       mod->tree = orig_tree;
+      tm_free_prune_plan(mod);
     }
 
     for (j = 0; j < lst_size(feats_this_type); j++) {
@@ -18,6 +18,7 @@
 #include <phast/sufficient_stats.h>
 #include <phast/stringsplus.h>
 #include <phast/maf.h>
+#include <phast/thread_pool.h>
 #include "exoniphy.help"
 
 /* default background feature types; used when scoring predictions and
@@ -87,6 +88,7 @@ int main(int argc, char* argv[]) {
     {"extrapolate", 1, 0, 'e'},
     {"alias", 1, 0, 'A'},
     {"quiet", 0, 0, 'q'},
+    {"threads", 1, 0, 'j'},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
   };
@@ -108,7 +110,7 @@ int main(int argc, char* argv[]) {
   char *msa_fname = NULL;
   String *fname_str = str_new(STR_LONG_LEN), *str;
 
-  while ((c = getopt_long(argc, argv, "i:D:c:H:m:M:s:p:g:B:T:L:F:IW:N:n:b:e:A:xSYUhq", 
+  while ((c = getopt_long(argc, argv, "i:D:c:H:m:M:s:p:g:B:T:L:F:IW:N:n:b:e:A:xSYUhqj:", 
                           long_opts, &opt_idx)) != -1) {
     switch(c) {
     case 'i':
@@ -187,6 +189,9 @@ int main(int argc, char* argv[]) {
     case 'q':
       quiet = TRUE;
       break;
+    case 'j':
+      thr_set_nthreads(get_arg_int_bounds(optarg, 1, THR_MAX_THREADS));
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -248,7 +253,7 @@ int main(int argc, char* argv[]) {
   if (msa_alph_has_lowercase(msa)) msa_toupper(msa); 
   msa_remove_N_from_alph(msa);
 
-  if (msa_format == SS && msa->ss->tuple_idx == NULL) 
+  if ((msa_format == SS || msa_format == BSS) && msa->ss->tuple_idx == NULL) 
     die("ERROR: Ordered representation of alignment required.\n");
   if (not_informative != NULL)
     msa_set_informative(msa, not_informative);
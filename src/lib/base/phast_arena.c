@@ -0,0 +1,164 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* arena - region allocation of temporary storage.  An arena is a
+   stack of chunks; memory is allocated by advancing the offset of the
+   newest chunk, and a new chunk is started when it is full.  Opening
+   a scope records the current chunk and offset (in a small record
+   allocated from the arena itself), and closing it restores them,
+   releasing any chunks started in the meantime.  The largest released
+   chunk is kept as a spare, so that a sequence of scopes of similar
+   size reuses the same memory.  Chunks are obtained directly from the
+   system rather than through smalloc; when the memory handler is in
+   use they are released by phast_free_all (see ar_release). */
+
+#include <phast/arena.h>
+#include <phast/misc.h>
+#ifdef USE_PHAST_MEMORY_HANDLER
+#include <phast/memory_handler.h>
+#endif
+
+#ifdef RPHAST
+#undef malloc
+#define malloc(x) (void*)Calloc((x),char)
+#undef free
+#define free(x) Free((x))
+#endif
+
+/* alignment of allocated memory */
+#define AR_ALIGN 16
+#define AR_ROUND(n) (((n) + AR_ALIGN - 1) & ~(size_t)(AR_ALIGN - 1))
+
+struct ar_chunk {
+  ArenaChunk *prev;             /* chunk started before this one */
+  size_t size;                  /* bytes available after header */
+  size_t used;                  /* bytes allocated so far */
+};
+
+/* size of chunk header, preserving alignment of data that follows */
+#define AR_HEADER AR_ROUND(sizeof(ArenaChunk))
+
+struct ar_scope {
+  ArenaScope *prev;             /* enclosing scope */
+  ArenaChunk *chunk;            /* chunk and offset when scope opened */
+  size_t used;
+};
+
+#ifdef USE_PHAST_MEMORY_HANDLER
+#define ar_current() phast_mem_arena()
+#else
+#if defined(RPHAST) || defined(SKIP_THREADS)
+#define AR_THREAD_LOCAL
+#else
+#define AR_THREAD_LOCAL __thread
+#endif
+static AR_THREAD_LOCAL Arena ar_thread_arena = {NULL, NULL, NULL};
+#define ar_current() (&ar_thread_arena)
+#endif
+
+/* start a new chunk with room for at least 'need' bytes */
+static ArenaChunk *ar_new_chunk(Arena *a, size_t need) {
+  ArenaChunk *c;
+  if (a->spare != NULL && a->spare->size >= need) {
+    c = a->spare;
+    a->spare = NULL;
+  }
+  else {
+    size_t size = max(need, AR_CHUNK_SIZE);
+    if (a->spare != NULL) {     /* too small to be worth keeping */
+      free(a->spare);
+      a->spare = NULL;
+    }
+    c = (ArenaChunk*)malloc(AR_HEADER + size);
+    if (c == NULL)
+      die("ERROR: out of memory\n");
+    c->size = size;
+  }
+  c->used = 0;
+  c->prev = a->chunk;
+  a->chunk = c;
+  return c;
+}
+
+/* dispose of a chunk no longer in use, keeping it as the spare if it
+   is the largest seen so far (within limits) */
+static void ar_retire(Arena *a, ArenaChunk *c) {
+  if (c->size <= AR_SPARE_MAX &&
+      (a->spare == NULL || c->size > a->spare->size)) {
+    if (a->spare != NULL) free(a->spare);
+    a->spare = c;
+  }
+  else free(c);
+}
+
+static void *ar_bump(Arena *a, size_t size) {
+  ArenaChunk *c = a->chunk;
+  void *retval;
+  size = AR_ROUND(size);
+  if (c == NULL || c->size - c->used < size)
+    c = ar_new_chunk(a, size);
+  retval = (char*)c + AR_HEADER + c->used;
+  c->used += size;
+  return retval;
+}
+
+void ar_push() {
+  Arena *a = ar_current();
+  ArenaChunk *c = a->chunk;
+  size_t used = (c == NULL ? 0 : c->used);
+  ArenaScope *s = (ArenaScope*)ar_bump(a, sizeof(ArenaScope));
+  s->prev = a->scope;
+  s->chunk = c;
+  s->used = used;
+  a->scope = s;
+}
+
+void ar_pop() {
+  Arena *a = ar_current();
+  ArenaScope *s = a->scope;
+  ArenaChunk *c, *keep;
+  size_t used;
+
+  if (s == NULL)
+    die("ERROR ar_pop: no scope is open\n");
+
+  /* s itself may reside in a chunk about to be released */
+  keep = s->chunk;
+  used = s->used;
+  a->scope = s->prev;
+  while (a->chunk != keep) {
+    c = a->chunk;
+    a->chunk = c->prev;
+    ar_retire(a, c);
+  }
+  if (keep != NULL) keep->used = used;
+}
+
+void *ar_alloc(size_t size) {
+  Arena *a = ar_current();
+  if (a->scope == NULL)
+    die("ERROR ar_alloc: no scope is open (see ar_push)\n");
+  return ar_bump(a, size);
+}
+
+void ar_init(Arena *a) {
+  a->chunk = a->spare = NULL;
+  a->scope = NULL;
+}
+
+void ar_release(Arena *a) {
+  ArenaChunk *c;
+  while (a->chunk != NULL) {
+    c = a->chunk;
+    a->chunk = c->prev;
+    free(c);
+  }
+  if (a->spare != NULL) free(a->spare);
+  ar_init(a);
+}
@@ -0,0 +1,812 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Transparent gzip/bgzip input and bgzip output.  See compressed_io.h.
+
+   Input: a decompression thread inflates the source file into a ring
+   buffer, which the reading side of a custom stdio stream drains.
+   Positions are absolute offsets in the decompressed data; the ring
+   holds positions [valid_from, produced), of which [consumed,
+   produced) have not yet been read.  The thread never overwrites
+   unread data, or the CIO_RETAIN bytes preceding it, so that short
+   backward seeks can be satisfied from the ring.  Uncompressed input
+   from an unseekable source goes through the same machinery (with the
+   thread simply copying), so that the bytes examined to detect
+   compression can be returned to the reader without relying on more
+   than one character of ungetc.  If the positions of some BGZF
+   blocks are known (see cio_set_block_map), a seek far from the data
+   in the ring restarts decompression at the nearest known block
+   preceding the target rather than at the start of the file.
+
+   Output: data are gathered into blocks of CIO_BLOCK_SIZE bytes, each
+   of which is compressed independently (as a BGZF block) by one of a
+   small set of worker threads.  Blocks are written in order by
+   whichever worker completes the next one due.  Streams still open at
+   exit are closed by an atexit handler, since buffered data and the
+   end-of-file block are written only on close, and many programs
+   leave their output files open. */
+
+#define _GNU_SOURCE             /* for fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <phast/misc.h>
+#include <phast/thread_pool.h>
+#include <phast/compressed_io.h>
+
+#if !defined(SKIP_ZLIB) && !defined(SKIP_THREADS) && !defined(RPHAST) && \
+  !defined(__MINGW32__) && \
+  (defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define CIO_ENABLED
+#endif
+
+int cio_compressed_name(const char *fname) {
+  int len = (int)strlen(fname);
+  return ((len > 3 && !strcmp(fname + len - 3, ".gz")) ||
+          (len > 4 && !strcmp(fname + len - 4, ".bgz")));
+}
+
+int cio_compressed_file(const char *fname) {
+  unsigned char magic[4];
+  size_t n;
+  FILE *F = fopen(fname, "rb");
+  if (F == NULL) return FALSE;
+  n = fread(magic, 1, 4, F);
+  fclose(F);
+  return ((n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) ||
+          (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+           magic[2] == 0x2f && magic[3] == 0xfd));
+}
+
+int cio_bgzf_blocks(const char *fname, int64_t **coffset, int64_t **upos) {
+  unsigned char h[12], t[4], *x = NULL;
+  int n = 0, alloc = 1024, xlen, slen, bsize, i;
+  int64_t off = 0, pos = 0;
+  size_t nread;
+  FILE *F = fopen(fname, "rb");
+
+  if (F == NULL) return -1;
+  *coffset = smalloc(alloc * sizeof(int64_t));
+  *upos = smalloc(alloc * sizeof(int64_t));
+  x = smalloc(0x10000);
+  while ((nread = fread(h, 1, 12, F)) == 12) {
+    /* gzip member with extra field, which must include the BC
+       subfield giving the size of the block */
+    if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)) break;
+    xlen = h[10] | (h[11] << 8);
+    if (fread(x, 1, xlen, F) != (size_t)xlen) break;
+    bsize = -1;
+    for (i = 0; i + 4 <= xlen; i += 4 + slen) {
+      slen = x[i+2] | (x[i+3] << 8);
+      if (x[i] == 'B' && x[i+1] == 'C' && slen == 2 && i + 6 <= xlen)
+        bsize = x[i+4] | (x[i+5] << 8);
+    }
+    if (bsize < 0 || bsize + 1 < 12 + xlen + 8) break;
+    /* uncompressed size is the last field of the trailer */
+    if (fseeko(F, off + bsize + 1 - 4, SEEK_SET) != 0 || 
+        fread(t, 1, 4, F) != 4) break;
+    if (n == alloc) {
+      alloc *= 2;
+      *coffset = srealloc(*coffset, alloc * sizeof(int64_t));
+      *upos = srealloc(*upos, alloc * sizeof(int64_t));
+    }
+    (*coffset)[n] = off;
+    (*upos)[n] = pos;
+    n++;
+    off += bsize + 1;
+    pos += (int64_t)t[0] | ((int64_t)t[1] << 8) | ((int64_t)t[2] << 16) | 
+      ((int64_t)t[3] << 24);
+  }
+  sfree(x);
+  if (nread != 0 || ferror(F)) {  /* stopped short of end of file */
+    sfree(*coffset);
+    sfree(*upos);
+    *coffset = *upos = NULL;
+    n = -1;
+  }
+  fclose(F);
+  return n;
+}
+
+#ifndef CIO_ENABLED
+
+FILE *cio_open_read(FILE *src, const char *fname) {
+  return src;
+}
+
+FILE *cio_open_write(FILE *dest) {
+  return dest;
+}
+
+int cio_set_block_map(FILE *F, int n, const int64_t *coffset, 
+                      const int64_t *upos) {
+  return FALSE;
+}
+
+#else
+
+#include <pthread.h>
+#include <zlib.h>
+
+/* size of chunks read from compressed input and inflated at once */
+#define CIO_CHUNK (1 << 16)
+
+/* largest possible BGZF block: 18-byte header, deflated data (never
+   larger than input plus a few bytes when stored), 8-byte trailer */
+#define CIO_MAX_BLOCK 0x10000
+
+/* gzip header of a BGZF block, up to the two bytes of BSIZE */
+static const unsigned char cio_bgzf_header[16] =
+  {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0};
+
+/* empty BGZF block, which marks the end of a file */
+static const unsigned char cio_bgzf_eof[28] =
+  {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0,
+   3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/***************************************************************************
+ * reading
+ ***************************************************************************/
+
+typedef struct {
+  FILE *src, *stream;           /* stream is the FILE given to callers */
+  char *fname;
+  off_t src_start;              /* offset of compressed data in src, or
+                                   -1 if src is not seekable */
+  unsigned char prefix[4];      /* bytes already taken from an
+                                   unseekable src */
+  int nprefix;
+  int raw;                      /* copy src as is rather than inflating */
+  int nmap;                     /* known BGZF blocks (see
+                                   cio_set_block_map) */
+  int64_t *map_coffset, *map_upos;
+  unsigned char *ring;
+  int64_t valid_from, consumed, produced;
+  int eof, error, stop, running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} CioReader;
+
+/* copy data into the ring at absolute position pos */
+static void cio_ring_put(CioReader *z, int64_t pos, const unsigned char *data,
+                         size_t n) {
+  size_t off = (size_t)(pos % CIO_RING_SIZE),
+    first = min(n, CIO_RING_SIZE - off);
+  memcpy(z->ring + off, data, first);
+  memcpy(z->ring, data + first, n - first);
+}
+
+/* copy data out of the ring from absolute position pos */
+static void cio_ring_get(CioReader *z, int64_t pos, char *data, size_t n) {
+  size_t off = (size_t)(pos % CIO_RING_SIZE),
+    first = min(n, CIO_RING_SIZE - off);
+  memcpy(data, z->ring + off, first);
+  memcpy(data + first, z->ring, n - first);
+}
+
+/* make decompressed data available to the reader, waiting for space
+   as necessary.  Returns FALSE if the thread has been asked to stop */
+static int cio_push(CioReader *z, const unsigned char *data, size_t n) {
+  int64_t keep_from, space, pos;
+  size_t k;
+  while (n > 0) {
+    pthread_mutex_lock(&z->lock);
+    while (1) {
+      keep_from = max(0, z->consumed - CIO_RETAIN);
+      space = keep_from + CIO_RING_SIZE - z->produced;
+      if (z->stop || space > 0) break;
+      pthread_cond_wait(&z->cond, &z->lock);
+    }
+    if (z->stop) {
+      pthread_mutex_unlock(&z->lock);
+      return FALSE;
+    }
+    k = (size_t)min((int64_t)n, space);
+    pos = z->produced;
+    /* data at positions about to be overwritten are no longer valid */
+    z->valid_from = max(z->valid_from, pos + (int64_t)k - CIO_RING_SIZE);
+    pthread_mutex_unlock(&z->lock);
+
+    cio_ring_put(z, pos, data, k);
+
+    pthread_mutex_lock(&z->lock);
+    z->produced += k;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    data += k;
+    n -= k;
+  }
+  return TRUE;
+}
+
+static void *cio_inflate_thread(void *arg) {
+  CioReader *z = arg;
+  z_stream strm;
+  unsigned char *in = smalloc(CIO_CHUNK), *out = smalloc(CIO_CHUNK);
+  int ret, error = FALSE, member_done = FALSE;
+  size_t n;
+
+  if (z->raw) {                 /* uncompressed; just pass data along */
+    n = z->nprefix;
+    memcpy(in, z->prefix, n);
+    do {
+      if (!cio_push(z, in, n)) break;
+    } while ((n = fread(in, 1, CIO_CHUNK, z->src)) > 0);
+    error = ferror(z->src);
+    sfree(in);
+    sfree(out);
+    pthread_mutex_lock(&z->lock);
+    z->eof = TRUE;
+    z->error = error;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+  }
+
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 15 + 32) != Z_OK) error = TRUE;
+  strm.next_in = in;
+  strm.avail_in = 0;
+  if (z->src_start < 0 && z->nprefix > 0) {
+    memcpy(in, z->prefix, z->nprefix);
+    strm.avail_in = z->nprefix;
+  }
+
+  while (!error) {
+    if (strm.avail_in == 0) {
+      n = fread(in, 1, CIO_CHUNK, z->src);
+      if (n == 0) {
+        /* end of input must coincide with end of a gzip member */
+        if (ferror(z->src) || !member_done) error = TRUE;
+        break;
+      }
+      strm.next_in = in;
+      strm.avail_in = (uInt)n;
+    }
+    strm.next_out = out;
+    strm.avail_out = CIO_CHUNK;
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      member_done = TRUE;
+      inflateReset(&strm);    /* bgzip files consist of many members */
+    }
+    else if (ret == Z_OK)
+      member_done = FALSE;
+    else if (ret != Z_BUF_ERROR)
+      error = TRUE;
+    if (!cio_push(z, out, CIO_CHUNK - strm.avail_out)) break;
+  }
+
+  inflateEnd(&strm);
+  sfree(in);
+  sfree(out);
+  pthread_mutex_lock(&z->lock);
+  z->eof = TRUE;
+  z->error = error;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+  return NULL;
+}
+
+/* start decompression thread, with src positioned at data beginning
+   at absolute position pos */
+static void cio_reader_start(CioReader *z, int64_t pos) {
+  z->valid_from = z->consumed = z->produced = pos;
+  z->eof = z->error = z->stop = FALSE;
+  if (pthread_create(&z->thread, NULL, cio_inflate_thread, z) != 0)
+    die("ERROR: cannot create decompression thread for %s.\n", z->fname);
+  z->running = TRUE;
+}
+
+static void cio_reader_stop(CioReader *z) {
+  if (!z->running) return;
+  pthread_mutex_lock(&z->lock);
+  z->stop = TRUE;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+  pthread_join(z->thread, NULL);
+  z->running = FALSE;
+}
+
+static ssize_t cio_read(void *cookie, char *buf, size_t size) {
+  CioReader *z = cookie;
+  int64_t pos;
+  size_t n;
+
+  pthread_mutex_lock(&z->lock);
+  while (z->consumed == z->produced && !z->eof)
+    pthread_cond_wait(&z->cond, &z->lock);
+  if (z->consumed == z->produced) {
+    pthread_mutex_unlock(&z->lock);
+    if (z->error)
+      die("ERROR: %s: compressed data are corrupt or truncated.\n",
+          z->fname);
+    return 0;
+  }
+  n = (size_t)min((int64_t)size, z->produced - z->consumed);
+  pos = z->consumed;
+  pthread_mutex_unlock(&z->lock);
+
+  cio_ring_get(z, pos, buf, n);
+
+  pthread_mutex_lock(&z->lock);
+  z->consumed += n;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+  return (ssize_t)n;
+}
+
+/* index of last known block starting at or before absolute position
+   pos, or -1 if there is none */
+static int cio_map_find(CioReader *z, int64_t pos) {
+  int lo = 0, hi = z->nmap, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (z->map_upos[mid] <= pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+/* move to absolute position target of decompressed data; returns new
+   position, or -1 if it cannot be reached */
+static int64_t cio_seek_to(CioReader *z, int64_t target) {
+  int64_t pos;
+  int k = cio_map_find(z, target);
+
+  pthread_mutex_lock(&z->lock);
+  /* restart if target is no longer in ring, or if a known block lies
+     beyond the data produced so far */
+  if (target < z->valid_from || (k >= 0 && z->map_upos[k] > z->produced)) {
+    pthread_mutex_unlock(&z->lock);
+    if (z->src_start < 0) {
+      errno = ESPIPE;
+      return -1;
+    }
+    cio_reader_stop(z);
+    if (fseeko(z->src, k >= 0 ? z->map_coffset[k] : z->src_start, 
+               SEEK_SET) != 0) 
+      return -1;
+    cio_reader_start(z, k >= 0 ? z->map_upos[k] : 0);
+    pthread_mutex_lock(&z->lock);
+  }
+  if (target < z->consumed)
+    z->consumed = target;
+  while (z->consumed < target) {
+    if (z->produced > z->consumed) {
+      z->consumed = min(target, z->produced);
+      pthread_cond_broadcast(&z->cond);
+    }
+    else if (z->eof) break;
+    else pthread_cond_wait(&z->cond, &z->lock);
+  }
+  pos = z->consumed;
+  pthread_mutex_unlock(&z->lock);
+  return pos;
+}
+
+static int64_t cio_seek(void *cookie, int64_t offset, int whence) {
+  CioReader *z = cookie;
+  int64_t target;
+  if (whence == SEEK_SET)
+    target = offset;
+  else if (whence == SEEK_CUR) {
+    pthread_mutex_lock(&z->lock);
+    target = z->consumed + offset;
+    pthread_mutex_unlock(&z->lock);
+  }
+  else target = -1;             /* length is not known in advance */
+  if (target < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return cio_seek_to(z, target);
+}
+
+/* readers not yet closed, so that cio_set_block_map can find the
+   reader behind a stream */
+static CioReader **cio_open_readers = NULL;
+static int cio_nopen_readers = 0, cio_open_readers_alloc = 0;
+static pthread_mutex_t cio_open_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cio_add_open_reader(CioReader *z) {
+  pthread_mutex_lock(&cio_open_readers_lock);
+  if (cio_nopen_readers == cio_open_readers_alloc) {
+    cio_open_readers_alloc = max(4, 2 * cio_open_readers_alloc);
+    cio_open_readers = srealloc(cio_open_readers, cio_open_readers_alloc *
+                                sizeof(CioReader*));
+  }
+  cio_open_readers[cio_nopen_readers++] = z;
+  pthread_mutex_unlock(&cio_open_readers_lock);
+}
+
+static void cio_remove_open_reader(CioReader *z) {
+  int i;
+  pthread_mutex_lock(&cio_open_readers_lock);
+  for (i = 0; i < cio_nopen_readers; i++)
+    if (cio_open_readers[i] == z) {
+      cio_open_readers[i] = cio_open_readers[--cio_nopen_readers];
+      break;
+    }
+  pthread_mutex_unlock(&cio_open_readers_lock);
+}
+
+static CioReader *cio_find_open_reader(FILE *F) {
+  CioReader *z = NULL;
+  int i;
+  pthread_mutex_lock(&cio_open_readers_lock);
+  for (i = 0; i < cio_nopen_readers; i++)
+    if (cio_open_readers[i]->stream == F) {
+      z = cio_open_readers[i];
+      break;
+    }
+  pthread_mutex_unlock(&cio_open_readers_lock);
+  return z;
+}
+
+int cio_set_block_map(FILE *F, int n, const int64_t *coffset, 
+                      const int64_t *upos) {
+  CioReader *z = cio_find_open_reader(F);
+  if (z == NULL || z->raw || z->src_start < 0) return FALSE;
+  if (z->nmap > 0) {
+    sfree(z->map_coffset);
+    sfree(z->map_upos);
+  }
+  z->nmap = n;
+  if (n > 0) {
+    z->map_coffset = smalloc(n * sizeof(int64_t));
+    z->map_upos = smalloc(n * sizeof(int64_t));
+    memcpy(z->map_coffset, coffset, n * sizeof(int64_t));
+    memcpy(z->map_upos, upos, n * sizeof(int64_t));
+  }
+  return TRUE;
+}
+
+static int cio_reader_close(void *cookie) {
+  CioReader *z = cookie;
+  int ret;
+  cio_remove_open_reader(z);
+  cio_reader_stop(z);
+  ret = fclose(z->src);
+  pthread_mutex_destroy(&z->lock);
+  pthread_cond_destroy(&z->cond);
+  if (z->nmap > 0) {
+    sfree(z->map_coffset);
+    sfree(z->map_upos);
+  }
+  sfree(z->ring);
+  sfree(z->fname);
+  sfree(z);
+  return ret;
+}
+
+/***************************************************************************
+ * writing
+ ***************************************************************************/
+
+enum {CIO_EMPTY, CIO_FILLED, CIO_BUSY, CIO_DONE};
+
+typedef struct {
+  unsigned char in[CIO_BLOCK_SIZE], out[CIO_MAX_BLOCK];
+  int in_len, out_len, state;
+} CioBlock;
+
+typedef struct {
+  FILE *dest, *stream;          /* stream is the FILE given to callers */
+  CioBlock *slots, *cur;        /* cur is the block being filled */
+  int nslots, nworkers;
+  int64_t next_fill, next_compress, next_write;  /* sequence numbers */
+  int stop, error;
+  pthread_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} CioWriter;
+
+/* compress a block as a complete BGZF member */
+static void cio_deflate_block(CioBlock *b) {
+  z_stream strm;
+  int level = Z_DEFAULT_COMPRESSION, ret, bsize;
+  uLong crc;
+
+  while (1) {
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      die("ERROR: cannot initialize compression.\n");
+    strm.next_in = b->in;
+    strm.avail_in = b->in_len;
+    strm.next_out = b->out + 18;
+    strm.avail_out = CIO_MAX_BLOCK - 18 - 8;
+    ret = deflate(&strm, Z_FINISH);
+    deflateEnd(&strm);
+    if (ret == Z_STREAM_END) break;
+    /* incompressible data; store instead */
+    if (level == 0) die("ERROR: cannot compress block.\n");
+    level = 0;
+  }
+
+  bsize = 18 + (int)strm.total_out + 8;
+  memcpy(b->out, cio_bgzf_header, 16);
+  b->out[16] = (bsize - 1) & 0xff;
+  b->out[17] = (bsize - 1) >> 8;
+  crc = crc32(crc32(0L, Z_NULL, 0), b->in, b->in_len);
+  b->out[bsize-8] = crc & 0xff;
+  b->out[bsize-7] = (crc >> 8) & 0xff;
+  b->out[bsize-6] = (crc >> 16) & 0xff;
+  b->out[bsize-5] = (crc >> 24) & 0xff;
+  b->out[bsize-4] = b->in_len & 0xff;
+  b->out[bsize-3] = (b->in_len >> 8) & 0xff;
+  b->out[bsize-2] = (b->in_len >> 16) & 0xff;
+  b->out[bsize-1] = (b->in_len >> 24) & 0xff;
+  b->out_len = bsize;
+}
+
+static void *cio_deflate_thread(void *arg) {
+  CioWriter *w = arg;
+  CioBlock *b;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->stop && w->next_compress == w->next_fill)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->next_compress == w->next_fill) break; /* stopped, nothing left */
+    b = &w->slots[w->next_compress++ % w->nslots];
+    b->state = CIO_BUSY;
+    pthread_mutex_unlock(&w->lock);
+
+    cio_deflate_block(b);
+
+    pthread_mutex_lock(&w->lock);
+    b->state = CIO_DONE;
+    /* write any completed blocks that are next in sequence */
+    while (w->next_write < w->next_compress &&
+           w->slots[w->next_write % w->nslots].state == CIO_DONE) {
+      b = &w->slots[w->next_write % w->nslots];
+      if (fwrite(b->out, 1, b->out_len, w->dest) != (size_t)b->out_len)
+        w->error = TRUE;
+      b->state = CIO_EMPTY;
+      w->next_write++;
+    }
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* hand current block to the workers */
+static void cio_submit(CioWriter *w) {
+  pthread_mutex_lock(&w->lock);
+  w->cur->state = CIO_FILLED;
+  w->next_fill++;
+  w->cur = NULL;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static ssize_t cio_write(void *cookie, const char *buf, size_t size) {
+  CioWriter *w = cookie;
+  size_t k, left = size;
+  while (left > 0) {
+    if (w->cur == NULL) {
+      CioBlock *b = &w->slots[w->next_fill % w->nslots];
+      pthread_mutex_lock(&w->lock);
+      while (b->state != CIO_EMPTY)
+        pthread_cond_wait(&w->cond, &w->lock);
+      pthread_mutex_unlock(&w->lock);
+      b->in_len = 0;
+      w->cur = b;
+    }
+    k = min(left, (size_t)(CIO_BLOCK_SIZE - w->cur->in_len));
+    memcpy(w->cur->in + w->cur->in_len, buf, k);
+    w->cur->in_len += (int)k;
+    buf += k;
+    left -= k;
+    if (w->cur->in_len == CIO_BLOCK_SIZE) cio_submit(w);
+  }
+  return (ssize_t)size;
+}
+
+/* writers not yet closed, to be closed at exit */
+static CioWriter **cio_open_writers = NULL;
+static int cio_nopen_writers = 0, cio_open_writers_alloc = 0;
+static pthread_mutex_t cio_open_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cio_close_open_writers(void) {
+  FILE *F;
+  while (1) {
+    pthread_mutex_lock(&cio_open_writers_lock);
+    F = cio_nopen_writers > 0 ? 
+      cio_open_writers[cio_nopen_writers-1]->stream : NULL;
+    pthread_mutex_unlock(&cio_open_writers_lock);
+    if (F == NULL) break;
+    fclose(F);                  /* removes it from the list */
+  }
+}
+
+static void cio_add_open_writer(CioWriter *w) {
+  pthread_mutex_lock(&cio_open_writers_lock);
+  if (cio_open_writers == NULL) atexit(cio_close_open_writers);
+  if (cio_nopen_writers == cio_open_writers_alloc) {
+    cio_open_writers_alloc = max(4, 2 * cio_open_writers_alloc);
+    /* plain realloc, as this outlives any memory handler cleanup */
+    cio_open_writers = realloc(cio_open_writers, cio_open_writers_alloc *
+                               sizeof(CioWriter*));
+    if (cio_open_writers == NULL) die("ERROR: out of memory\n");
+  }
+  cio_open_writers[cio_nopen_writers++] = w;
+  pthread_mutex_unlock(&cio_open_writers_lock);
+}
+
+static void cio_remove_open_writer(CioWriter *w) {
+  int i;
+  pthread_mutex_lock(&cio_open_writers_lock);
+  for (i = 0; i < cio_nopen_writers; i++)
+    if (cio_open_writers[i] == w) {
+      cio_open_writers[i] = cio_open_writers[--cio_nopen_writers];
+      break;
+    }
+  pthread_mutex_unlock(&cio_open_writers_lock);
+}
+
+static int cio_writer_close(void *cookie) {
+  CioWriter *w = cookie;
+  int i, ret;
+
+  cio_remove_open_writer(w);
+
+  if (w->cur != NULL && w->cur->in_len > 0) cio_submit(w);
+  pthread_mutex_lock(&w->lock);
+  w->stop = TRUE;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->nworkers; i++)
+    pthread_join(w->workers[i], NULL);
+
+  if (fwrite(cio_bgzf_eof, 1, sizeof(cio_bgzf_eof), w->dest) !=
+      sizeof(cio_bgzf_eof))
+    w->error = TRUE;
+  ret = fclose(w->dest);
+  if (w->error) ret = EOF;
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  sfree(w->workers);
+  sfree(w->slots);
+  sfree(w);
+  return ret;
+}
+
+/***************************************************************************
+ * stream creation
+ ***************************************************************************/
+
+#if defined(__GLIBC__)
+
+static ssize_t cio_gnu_read(void *cookie, char *buf, size_t size) {
+  return cio_read(cookie, buf, size);
+}
+
+static int cio_gnu_seek(void *cookie, off64_t *offset, int whence) {
+  int64_t pos = cio_seek(cookie, *offset, whence);
+  if (pos < 0) return -1;
+  *offset = pos;
+  return 0;
+}
+
+static ssize_t cio_gnu_write(void *cookie, const char *buf, size_t size) {
+  return cio_write(cookie, buf, size);
+}
+
+static FILE *cio_stream_read(CioReader *z) {
+  cookie_io_functions_t fns = {cio_gnu_read, NULL, cio_gnu_seek,
+                               cio_reader_close};
+  return fopencookie(z, "r", fns);
+}
+
+static FILE *cio_stream_write(CioWriter *w) {
+  cookie_io_functions_t fns = {NULL, cio_gnu_write, NULL, cio_writer_close};
+  return fopencookie(w, "w", fns);
+}
+
+#else  /* BSD, Mac OS */
+
+static int cio_bsd_read(void *cookie, char *buf, int size) {
+  return (int)cio_read(cookie, buf, size);
+}
+
+static fpos_t cio_bsd_seek(void *cookie, fpos_t offset, int whence) {
+  return (fpos_t)cio_seek(cookie, offset, whence);
+}
+
+static int cio_bsd_write(void *cookie, const char *buf, int size) {
+  return (int)cio_write(cookie, buf, size);
+}
+
+static FILE *cio_stream_read(CioReader *z) {
+  return funopen(z, cio_bsd_read, NULL, cio_bsd_seek, cio_reader_close);
+}
+
+static FILE *cio_stream_write(CioWriter *w) {
+  return funopen(w, NULL, cio_bsd_write, NULL, cio_writer_close);
+}
+
+#endif
+
+FILE *cio_open_read(FILE *src, const char *fname) {
+  unsigned char magic[4];
+  int n = 0, c, gzip, zstd;
+  off_t start = ftello(src);
+  CioReader *z;
+  FILE *F;
+
+  while (n < 4 && (c = getc(src)) != EOF)
+    magic[n++] = (unsigned char)c;
+  gzip = (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b);
+  zstd = (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+          magic[2] == 0x2f && magic[3] == 0xfd);
+  if (zstd)
+    die("ERROR: %s is zstd-compressed, which is not supported; decompress it first.\n", fname);
+
+  /* put back what was read, if possible by seeking */
+  if (start >= 0 && fseeko(src, start, SEEK_SET) == 0) n = 0;
+  else start = -1;
+  if (!gzip && n == 0) return src;
+
+  /* if bytes could not be put back by seeking, they are supplied by
+     the reader thread, even if the data are not compressed */
+  z = smalloc(sizeof(CioReader));
+  z->src = src;
+  z->fname = copy_charstr(fname);
+  z->src_start = start;
+  memcpy(z->prefix, magic, n);
+  z->nprefix = n;
+  z->raw = !gzip;
+  z->nmap = 0;
+  z->ring = smalloc(CIO_RING_SIZE);
+  z->running = FALSE;
+  pthread_mutex_init(&z->lock, NULL);
+  pthread_cond_init(&z->cond, NULL);
+  cio_reader_start(z, 0);
+  if ((F = cio_stream_read(z)) == NULL)
+    die("ERROR: cannot open decompression stream for %s.\n", fname);
+  z->stream = F;
+  cio_add_open_reader(z);
+  return F;
+}
+
+FILE *cio_open_write(FILE *dest) {
+  CioWriter *w = smalloc(sizeof(CioWriter));
+  FILE *F;
+  int i;
+
+  w->dest = dest;
+  w->nworkers = max(1, thr_get_nthreads());
+  w->nslots = 2 * w->nworkers + 2;
+  w->slots = smalloc(w->nslots * sizeof(CioBlock));
+  for (i = 0; i < w->nslots; i++) w->slots[i].state = CIO_EMPTY;
+  w->cur = NULL;
+  w->next_fill = w->next_compress = w->next_write = 0;
+  w->stop = w->error = FALSE;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->workers = smalloc(w->nworkers * sizeof(pthread_t));
+  for (i = 0; i < w->nworkers; i++)
+    if (pthread_create(&w->workers[i], NULL, cio_deflate_thread, w) != 0)
+      die("ERROR: cannot create compression thread.\n");
+  if ((F = cio_stream_write(w)) == NULL)
+    die("ERROR: cannot open compression stream.\n");
+  w->stream = F;
+  cio_add_open_writer(w);
+  return F;
+}
+
+#endif
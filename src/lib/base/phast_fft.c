@@ -0,0 +1,356 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* fft - iterative radix-2 fast Fourier transform, and convolution of
+   real arrays using it.  Two real arrays are convolved with a single
+   complex transform in each direction: a is placed in the real part
+   and b in the imaginary part, and the transforms of a and b are
+   separated using the symmetry of transforms of real sequences.
+   Scratch space is allocated in an arena scope (see arena.h). */
+
+#include <float.h>
+#include <phast/fft.h>
+#include <phast/arena.h>
+#include <phast/misc.h>
+
+/* approximate cost of one FFT-based convolution, relative to one
+   multiplication in a direct convolution, per element per level of
+   the transform (used by fft_convolve_faster) */
+#define FFT_OPS_FACTOR 4.0
+
+/* elements of the lower tail of a convolution smaller than this
+   multiple of the bound on rounding error are recomputed directly */
+#define FFT_EXACT_RATIO 1.0e6
+
+int fft_len(int n) {
+  int len = 1;
+  while (len < n) len <<= 1;
+  return len;
+}
+
+/* twiddle factors w[k] = exp(-2 pi i k / n), 0 <= k < n/2 */
+static Complex *fft_twiddles(int n) {
+  Complex *w = ar_alloc(max(n/2, 1) * sizeof(Complex));
+  int k;
+  for (k = 0; k < n/2; k++)
+    w[k] = z_set(cos(2 * M_PI * k / n), -sin(2 * M_PI * k / n));
+  return w;
+}
+
+/* unnormalized transform using precomputed twiddle factors */
+static void fft_core(Complex *z, int n, Complex *w, int inverse) {
+  int i, j, k, bit, len, half, step;
+  Complex t, u, wk;
+
+  /* bit-reversal permutation */
+  for (i = 1, j = 0; i < n; i++) {
+    for (bit = n >> 1; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      t = z[i];
+      z[i] = z[j];
+      z[j] = t;
+    }
+  }
+
+  /* butterflies */
+  for (len = 2; len <= n; len <<= 1) {
+    half = len >> 1;
+    step = n / len;
+    for (i = 0; i < n; i += len) {
+      for (k = 0; k < half; k++) {
+        wk = w[k * step];
+        if (inverse) wk.y = -wk.y;
+        t = z_mul(z[i + k + half], wk);
+        u = z[i + k];
+        z[i + k] = z_add(u, t);
+        z[i + k + half] = z_sub(u, t);
+      }
+    }
+  }
+}
+
+/* 2-d transform (row-major) by transforming rows, then columns */
+static void fft_core_2d(Complex *z, int nrows, int ncols, Complex *wr,
+                        Complex *wc, int inverse) {
+  Complex *col = ar_alloc(nrows * sizeof(Complex));
+  int x, y;
+  for (x = 0; x < nrows; x++)
+    fft_core(&z[x * ncols], ncols, wc, inverse);
+  for (y = 0; y < ncols; y++) {
+    for (x = 0; x < nrows; x++)
+      col[x] = z[x * ncols + y];
+    fft_core(col, nrows, wr, inverse);
+    for (x = 0; x < nrows; x++)
+      z[x * ncols + y] = col[x];
+  }
+}
+
+static void fft_check_len(int n) {
+  if (n < 1 || (n & (n - 1)) != 0)
+    die("ERROR fft: length %i is not a power of two\n", n);
+}
+
+void fft_transform(Complex *z, int n, int inverse) {
+  int i;
+  fft_check_len(n);
+  ar_push();
+  fft_core(z, n, fft_twiddles(n), inverse);
+  ar_pop();
+  if (inverse)
+    for (i = 0; i < n; i++)
+      z[i] = z_mul_real(z[i], 1.0 / n);
+}
+
+void fft_transform_2d(Complex *z, int nrows, int ncols, int inverse) {
+  int i;
+  fft_check_len(nrows);
+  fft_check_len(ncols);
+  ar_push();
+  fft_core_2d(z, nrows, ncols, fft_twiddles(nrows), fft_twiddles(ncols),
+              inverse);
+  ar_pop();
+  if (inverse)
+    for (i = 0; i < nrows * ncols; i++)
+      z[i] = z_mul_real(z[i], 1.0 / (nrows * ncols));
+}
+
+/* Given the transform z of a + ib (length n, in place), replace it
+   with the transform of the convolution of a and b.  With A and B the
+   transforms of the real sequences a and b, z[k] = A[k] + iB[k] and
+   conj(z[-k]) = A[k] - iB[k].  Since the product is also the
+   transform of a real sequence, only half of it needs computing. */
+static void fft_spectral_product(Complex *z, int n, int k, int kneg) {
+  Complex zk = z[k], zc = z_set(z[kneg].x, -z[kneg].y), a, b, c;
+  a = z_mul_real(z_add(zk, zc), 0.5);
+  b = z_sub(zk, zc);
+  b = z_set(0.5 * b.y, -0.5 * b.x); /* divide by 2i */
+  c = z_mul(a, b);
+  z[k] = c;
+  z[kneg] = z_set(c.x, -c.y);
+}
+
+/* bound on rounding error of FFT-based convolution of arrays whose
+   elements sum (in absolute value) to suma and sumb */
+static double fft_noise(int len, double suma, double sumb) {
+  return 4 * (log2_int(len) + 1) * DBL_EPSILON * suma * sumb;
+}
+
+/* (used by fft_convolve) linear convolution truncated at nc elements,
+   where c is distinct from a and b.  See fft_convolve for lower tail */
+static void fft_convolve_trunc(double *a, int na, double *b, int nb,
+                               double *c, int nc) {
+  int n, x, j, ncfull, off, ntail;
+  double suma = 0, sumb = 0, taila = 0, tailb = 0, noise, cutoff;
+  Complex *z, *w;
+
+  /* leading zeroes (e.g., probabilities too small to represent) just
+     shift the result; strip them, so that they neither lengthen the
+     transform nor need to be recomputed in the lower tail */
+  for (off = 0; na > 0 && *a == 0; off++, a++, na--);
+  for (; nb > 0 && *b == 0; off++, b++, nb--);
+  for (x = 0; x < min(off, nc); x++) c[x] = 0;
+  c += off;
+  nc -= off;
+
+  /* elements beyond nc cannot contribute */
+  na = min(na, nc);
+  nb = min(nb, nc);
+  if (na <= 0 || nb <= 0) {
+    for (x = 0; x < nc; x++) c[x] = 0;
+    return;
+  }
+  ncfull = min(nc, na + nb - 1);
+  for (x = ncfull; x < nc; x++) c[x] = 0;
+
+  /* no wrap-around of circular convolution may reach [0, nc) */
+  n = fft_len(na + nb - 1);
+
+  if (!fft_convolve_faster((double)na * nb, 1, n)) {
+    for (x = 0; x < ncfull; x++) {
+      c[x] = 0;
+      for (j = max(0, x - nb + 1); j <= min(x, na - 1); j++)
+        c[x] += a[j] * b[x - j];
+    }
+    return;
+  }
+
+  ar_push();
+  z = ar_alloc(n * sizeof(Complex));
+  for (x = 0; x < n; x++)
+    z[x] = z_set(x < na ? a[x] : 0, x < nb ? b[x] : 0);
+  for (x = 0; x < na; x++) suma += fabs(a[x]);
+  for (x = 0; x < nb; x++) sumb += fabs(b[x]);
+
+  w = fft_twiddles(n);
+  fft_core(z, n, w, FALSE);
+  for (x = 0; x <= n/2; x++)
+    fft_spectral_product(z, n, x, (n - x) & (n - 1));
+  fft_core(z, n, w, TRUE);
+
+  /* Rounding error is roughly uniform in absolute terms, so small
+     elements lose relative precision.  Elements after the lower tail
+     that cannot be distinguished from noise are discarded */
+  noise = fft_noise(n, suma, sumb);
+  cutoff = FFT_EXACT_RATIO * noise;
+  for (ntail = 0; ntail < ncfull && z[ntail].x / n < cutoff; ntail++);
+  for (x = ntail; x < ncfull; x++) {
+    c[x] = z[x].x / n;
+    if (c[x] < noise) c[x] = 0;
+  }
+  ar_pop();
+
+  if (ntail == 0) return;
+
+  /* In the lower tail, where tiny probabilities matter (e.g., for
+     p-values of conserved elements), elements must keep their
+     relative precision.  They depend only on the first ntail
+     elements of a and b, whose sums are typically far smaller, so
+     convolving those again gives a much smaller bound on error;
+     repeat until the tail is short, or compute directly if there is
+     no progress */
+  for (x = 0; x < min(na, ntail); x++) taila += fabs(a[x]);
+  for (x = 0; x < min(nb, ntail); x++) tailb += fabs(b[x]);
+  if (taila * tailb <= 0.5 * suma * sumb)
+    fft_convolve_trunc(a, min(na, ntail), b, min(nb, ntail), c, ntail);
+  else {
+    for (x = 0; x < ntail; x++) {
+      c[x] = 0;
+      for (j = max(0, x - nb + 1); j <= min(x, na - 1); j++)
+        c[x] += a[j] * b[x - j];
+    }
+  }
+}
+
+void fft_convolve(double *a, int na, double *b, int nb, double *c, int nc) {
+  double *tmp;
+  int x;
+  if (c != a && c != b) {
+    fft_convolve_trunc(a, na, b, nb, c, nc);
+    return;
+  }
+  ar_push();
+  tmp = ar_alloc(nc * sizeof(double));
+  fft_convolve_trunc(a, na, b, nb, tmp, nc);
+  for (x = 0; x < nc; x++) c[x] = tmp[x];
+  ar_pop();
+}
+
+/* (used by fft_convolve_2d) find first nonzero row and column of a
+   two-dimensional array */
+static void fft_leading_zeroes(double **a, int nrows, int ncols,
+                               int *row, int *col) {
+  int x, y;
+  *row = nrows;
+  *col = ncols;
+  for (x = 0; x < nrows; x++)
+    for (y = 0; y < *col; y++)
+      if (a[x][y] != 0) {
+        if (*row == nrows) *row = x;
+        *col = y;
+        break;
+      }
+}
+
+void fft_convolve_2d(double **a, int nra, int nca, double **b, int nrb,
+                     int ncb, double **c, int nrc, int ncc) {
+  int nr, nc, x, y, j, k, lim, ar, ac, br, bc, roff, coff;
+  int nrfull, ncfull;
+  double suma = 0, sumb = 0, noise, cutoff, sum;
+  Complex *z;
+
+  /* as in fft_convolve, strip leading zero rows and columns; elements
+     of a are then a[ar + x][ac + y], and similarly for b */
+  fft_leading_zeroes(a, nra, nca, &ar, &ac);
+  fft_leading_zeroes(b, nrb, ncb, &br, &bc);
+  roff = ar + br;
+  coff = ac + bc;
+  nra = min(nra - ar, nrc - roff);
+  nca = min(nca - ac, ncc - coff);
+  nrb = min(nrb - br, nrc - roff);
+  ncb = min(ncb - bc, ncc - coff);
+  if (nra <= 0 || nca <= 0 || nrb <= 0 || ncb <= 0) {
+    for (x = 0; x < nrc; x++)
+      for (y = 0; y < ncc; y++)
+        c[x][y] = 0;
+    return;
+  }
+
+  nrfull = min(nrc - roff, nra + nrb - 1);
+  ncfull = min(ncc - coff, nca + ncb - 1);
+  nr = fft_len(nra + nrb - 1);
+  nc = fft_len(nca + ncb - 1);
+
+  ar_push();
+  z = ar_alloc(nr * nc * sizeof(Complex));
+  for (x = 0; x < nr; x++)
+    for (y = 0; y < nc; y++)
+      z[x * nc + y] = z_set(x < nra && y < nca ? a[ar + x][ac + y] : 0,
+                            x < nrb && y < ncb ? b[br + x][bc + y] : 0);
+  for (x = 0; x < nra; x++)
+    for (y = 0; y < nca; y++)
+      suma += fabs(a[ar + x][ac + y]);
+  for (x = 0; x < nrb; x++)
+    for (y = 0; y < ncb; y++)
+      sumb += fabs(b[br + x][bc + y]);
+
+  {
+    Complex *wr = fft_twiddles(nr), *wc = fft_twiddles(nc);
+    fft_core_2d(z, nr, nc, wr, wc, FALSE);
+    /* pair each (x, y) with (-x, -y); visiting every element and
+       skipping those already done keeps this simple */
+    for (x = 0; x < nr; x++) {
+      int xneg = (nr - x) & (nr - 1);
+      for (y = 0; y < nc; y++) {
+        int yneg = (nc - y) & (nc - 1);
+        if (xneg * nc + yneg < x * nc + y) continue;
+        fft_spectral_product(z, nr * nc, x * nc + y, xneg * nc + yneg);
+      }
+    }
+    fft_core_2d(z, nr, nc, wr, wc, TRUE);
+  }
+
+  /* as in fft_convolve, but the lower tail is the region below and to
+     the left of the first element of each row that exceeds the
+     cutoff (running minimum over rows) */
+  noise = fft_noise(nr * nc, suma, sumb);
+  cutoff = FFT_EXACT_RATIO * noise;
+  lim = ncfull;
+  for (x = 0; x < nrfull; x++) {
+    for (y = 0; y < ncfull; y++) {
+      z[x * nc + y].x /= (nr * nc);
+      if (y >= lim) {
+        if (z[x * nc + y].x < noise) z[x * nc + y].x = 0;
+        continue;
+      }
+      if (z[x * nc + y].x >= cutoff) {
+        lim = y;
+        continue;
+      }
+      sum = 0;
+      for (j = max(0, x - nrb + 1); j <= min(x, nra - 1); j++)
+        for (k = max(0, y - ncb + 1); k <= min(y, nca - 1); k++)
+          sum += a[ar + j][ac + k] * b[br + x - j][bc + y - k];
+      z[x * nc + y].x = sum;
+    }
+  }
+
+  for (x = 0; x < nrc; x++)
+    for (y = 0; y < ncc; y++)
+      c[x][y] = (x >= roff && x - roff < nrfull && y >= coff &&
+                 y - coff < ncfull ? z[(x - roff) * nc + y - coff].x : 0);
+  ar_pop();
+}
+
+int fft_convolve_faster(double direct_ops, int nconv, int len) {
+  return (direct_ops >= FFT_MIN_OPS &&
+          direct_ops > FFT_OPS_FACTOR * nconv * (double)len *
+          (log2_int(len) + 1));
+}
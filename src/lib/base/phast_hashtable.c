@@ -8,9 +8,15 @@
  ***************************************************************************/
 
 /* hashtable - Fast, simple array-based hash table, optimized for
-   'put' and 'get' ('delete' somewhat inefficient).  Stores copies of
-   keys but not of data objects, which are managed as void*s (memory
-   management expected to be done externally) */
+   'put' and 'get'.  Stores copies of keys but not of data objects,
+   which are managed as void*s (memory management expected to be done
+   externally).  Open addressing with linear probing; deletion shifts
+   later entries of a cluster back rather than leaving markers, so
+   probe sequences stay short.  Entries with the same key (which
+   arise if hsh_put is called twice for the same key) remain in
+   insertion order along the probe sequence, so that hsh_get always
+   returns the first one, as in the original bucket-list
+   implementation. */
 
 #include <stdlib.h>
 #include <phast/lists.h>
@@ -18,19 +24,93 @@
 #include <math.h>
 #include <phast/misc.h>
 
+/* home slot for a hash value */
+static PHAST_INLINE int hsh_home(Hashtable *ht, uint64_t h) {
+  return (int)((h ^ (h >> 29)) & (uint64_t)(ht->nslots - 1));
+}
+
+/* index of slot holding first entry with given key, or -1 */
+static PHAST_INLINE int hsh_find(Hashtable *ht, const char *key, uint64_t h) {
+  int mask = ht->nslots - 1, i = hsh_home(ht, h);
+  HashSlot *s;
+  while ((s = &ht->slots[i])->hash != 0) {
+    if (s->hash == h && strcmp(s->key, key) == 0) return i;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+/* place an entry in the first free slot along its probe sequence */
+static PHAST_INLINE void hsh_place(Hashtable *ht, HashSlot *entry) {
+  int mask = ht->nslots - 1, i = hsh_home(ht, entry->hash);
+  while (ht->slots[i].hash != 0) i = (i + 1) & mask;
+  ht->slots[i] = *entry;
+}
+
+static void hsh_alloc_slots(Hashtable *ht, int nslots) {
+  int i;
+  ht->nslots = nslots;
+  ht->slots = (HashSlot*)smalloc(nslots * sizeof(HashSlot));
+  for (i = 0; i < nslots; i++) ht->slots[i].hash = 0;
+}
+
+/* double the number of slots.  Old slots are visited starting just
+   after an empty one, so that no cluster is split across the
+   wrap-around and entries with equal keys keep their order */
+static void hsh_grow(Hashtable *ht) {
+  HashSlot *old = ht->slots;
+  int i, start, oldn = ht->nslots;
+  for (start = 0; old[start].hash != 0; start++);
+  hsh_alloc_slots(ht, 2 * oldn);
+  for (i = 1; i <= oldn; i++) {
+    HashSlot *s = &old[(start + i) % oldn];
+    if (s->hash != 0) hsh_place(ht, s);
+  }
+  sfree(old);
+}
+
+/* make a copy of key in the table's key storage */
+static char *hsh_store_key(Hashtable *ht, const char *key) {
+  size_t len = strlen(key) + 1;
+  char *retval;
+  if (ht->nkey_blocks == 0 || ht->key_block_used + len > ht->key_block_size) {
+    if (ht->nkey_blocks == ht->key_blocks_alloc) {
+      ht->key_blocks_alloc *= 2;
+      ht->key_blocks = (char**)srealloc(ht->key_blocks, ht->key_blocks_alloc * 
+                                        sizeof(char*));
+    }
+    ht->key_block_size = max(HSH_KEY_BLOCK_SIZE, len);
+    ht->key_blocks[ht->nkey_blocks++] = (char*)smalloc(ht->key_block_size);
+    ht->key_block_used = 0;
+  }
+  retval = ht->key_blocks[ht->nkey_blocks-1] + ht->key_block_used;
+  memcpy(retval, key, len);
+  ht->key_block_used += len;
+  return retval;
+}
+
+static void hsh_free_keys(Hashtable *ht) {
+  int i;
+  for (i = 0; i < ht->nkey_blocks; i++) sfree(ht->key_blocks[i]);
+  ht->nkey_blocks = 0;
+  ht->key_block_used = ht->key_block_size = 0;
+}
+
 /* Create new hashtable with initial capacity as specified (in number
    of items).  
    Returns new hashtable with initial capacity as specified. */
 Hashtable* hsh_new(int est_capacity) {
   Hashtable* ht;
-  int i;
+  int nslots = 16;
   ht = (Hashtable*)smalloc(sizeof(Hashtable));
-  ht->nbuckets = (int)ceil(est_capacity*1.0/LOADING_FACTOR);
-  if (ht->nbuckets < 10) ht->nbuckets = 10;
-  ht->keys = (List**)smalloc(ht->nbuckets*sizeof(List*));
-  ht->vals = (List**)smalloc(ht->nbuckets*sizeof(List*));
-  for (i = 0; i < ht->nbuckets; i++) 
-    ht->keys[i] = ht->vals[i] = NULL;    
+  while (nslots < est_capacity / HSH_MAX_LOAD && nslots < (1 << 30)) 
+    nslots *= 2;
+  hsh_alloc_slots(ht, nslots);
+  ht->nitems = 0;
+  ht->key_blocks_alloc = 4;
+  ht->key_blocks = (char**)smalloc(ht->key_blocks_alloc * sizeof(char*));
+  ht->nkey_blocks = 0;
+  ht->key_block_used = ht->key_block_size = 0;
   return ht;
 }
 
@@ -38,41 +118,35 @@ Hashtable* hsh_new(int est_capacity) {
    only copies pointers.  Does copy keys. */
 Hashtable *hsh_copy(Hashtable *src) {
   Hashtable *ht;
-  int i, j, len;
-  char *key, *keycpy;
+  int i;
   ht = (Hashtable*)smalloc(sizeof(Hashtable));
-  ht->nbuckets = src->nbuckets;
-  ht->keys = (List**)smalloc(ht->nbuckets*sizeof(List*));
-  ht->vals = (List**)smalloc(ht->nbuckets*sizeof(List*));
-  for (i=0; i<ht->nbuckets; i++) {
-    if (src->keys[i] == NULL) {
-      ht->keys[i] = NULL;
-      ht->vals[i] = NULL;
-    }
-    else {
-      len = lst_size(src->keys[i]);
-      ht->keys[i] = lst_new_ptr(len);
-      ht->vals[i] = lst_new_ptr(len);
-      for (j=0; j<len; j++) {
-	key = (char*)lst_get_ptr(src->keys[i], j);
-	keycpy = smalloc(sizeof(char)*(strlen(key)+1));
-	strcpy(keycpy, key);
-	lst_push_ptr(ht->keys[i], keycpy);
-	lst_push_ptr(ht->vals[i], lst_get_ptr(src->vals[i], j));
-      }
-    }
+  ht->nslots = src->nslots;
+  ht->nitems = src->nitems;
+  ht->slots = (HashSlot*)smalloc(ht->nslots * sizeof(HashSlot));
+  ht->key_blocks_alloc = 4;
+  ht->key_blocks = (char**)smalloc(ht->key_blocks_alloc * sizeof(char*));
+  ht->nkey_blocks = 0;
+  ht->key_block_used = ht->key_block_size = 0;
+  for (i = 0; i < ht->nslots; i++) {
+    ht->slots[i] = src->slots[i];
+    if (src->slots[i].hash != 0)
+      ht->slots[i].key = hsh_store_key(ht, src->slots[i].key);
   }
   return ht;
 }
 
-void hsh_put_int(Hashtable *ht, const char *key, int val) {
-  hsh_put(ht, key, int_to_ptr(val));
+void hsh_put(Hashtable *ht, const char* key, void* val) {
+  HashSlot entry;
+  if (ht->nitems + 1 > ht->nslots * HSH_MAX_LOAD) hsh_grow(ht);
+  entry.hash = hsh_hash_func(key);
+  entry.key = hsh_store_key(ht, key);
+  entry.val = val;
+  hsh_place(ht, &entry);
+  ht->nitems++;
 }
 
-/* Equality function to pass to list_find_equivalent; simply tests for
-   exact string match */
-int equal(void *key1ptr, void *key2) {
-  return !strcmp(*((char**)key1ptr), (char*)key2);
+void hsh_put_int(Hashtable *ht, const char *key, int val) {
+  hsh_put(ht, key, int_to_ptr(val));
 }
 
 /* Retrieve object associated with specified key.
@@ -81,13 +155,8 @@ int equal(void *key1ptr, void *key2) {
    Warning: Convention of returning -1 when object is not found is
    inappropriate when objects are integers (needs to be fixed).*/
 void* hsh_get(Hashtable* ht, const char *key) {
-  unsigned int bucket;
-  int idx;
-  bucket = hsh_hash_func(ht, key);
-  if (ht->keys[bucket] == NULL || 
-      (idx = lst_find_compare(ht->keys[bucket], (void*)key, equal)) == -1) 
-    return (void*)-1;
-  return lst_get_ptr(ht->vals[bucket], idx);
+  int i = hsh_find(ht, key, hsh_hash_func(key));
+  return i == -1 ? (void*)-1 : ht->slots[i].val;
 }
 
 int hsh_get_int(Hashtable *ht, const char *key) {
@@ -98,27 +167,29 @@ int hsh_get_int(Hashtable *ht, const char *key) {
 /* Delete entry with specified key.  
    Returns 1 if item found and deleted, 0 if item not found */
 int hsh_delete(Hashtable* ht, const char *key) {
-  unsigned int bucket;
-  int idx;
-  bucket = hsh_hash_func(ht, key);
-  if (ht->keys[bucket] == NULL || 
-      (idx = lst_find_compare(ht->keys[bucket], (void*)key, equal)) == -1) 
+  int mask = ht->nslots - 1, i, j, home;
+  if ((i = hsh_find(ht, key, hsh_hash_func(key))) == -1) 
     return 0;
-  lst_delete_idx(ht->keys[bucket], idx);
-  lst_delete_idx(ht->vals[bucket], idx);
+  /* shift back any later entries of the cluster that could occupy
+     the vacated slot */
+  for (j = (i + 1) & mask; ht->slots[j].hash != 0; j = (j + 1) & mask) {
+    home = hsh_home(ht, ht->slots[j].hash);
+    if ((j > i && (home <= i || home > j)) || 
+        (j < i && (home <= i && home > j))) {
+      ht->slots[i] = ht->slots[j];
+      i = j;
+    }
+  }
+  ht->slots[i].hash = 0;
+  ht->nitems--;
   return 1;
 }
 
 /* reset value for given key; returns 0 on success, 1 if item isn't found */
 int hsh_reset(Hashtable *ht, const char* key, void* val) {
-  unsigned int bucket;
-  int idx;
-  bucket = hsh_hash_func(ht, key);
-  if (ht->keys[bucket] == NULL || 
-      (idx = lst_find_compare(ht->keys[bucket], (void*)key, equal)) == -1) 
-    return 1;
-  
-  lst_set_ptr(ht->vals[bucket], idx, val);
+  int i = hsh_find(ht, key, hsh_hash_func(key));
+  if (i == -1) return 1;
+  ht->slots[i].val = val;
   return 0;
 }
 
@@ -129,78 +200,44 @@ int hsh_reset_int(Hashtable *ht, const char *key, int val) {
 
 /* Free all resources; does *not* free memory associated with values */
 void hsh_free(Hashtable *ht) {
-  int i, j;
-  for (i = 0; i < ht->nbuckets; i++) {
-    if (ht->keys[i] != NULL) {
-      for (j = 0; j < lst_size(ht->keys[i]); j++)
-        sfree(lst_get_ptr(ht->keys[i], j));
-      lst_free(ht->keys[i]);
-      lst_free(ht->vals[i]);      
-    }
-  }
-  sfree(ht->keys);
-  sfree(ht->vals);
+  hsh_free_keys(ht);
+  sfree(ht->key_blocks);
+  sfree(ht->slots);
   sfree(ht);
 }
 
 /* Free all resources; *does* free memory associated with values */
 void hsh_free_with_vals(Hashtable *ht) {
-  int i, j;
-  for (i = 0; i < ht->nbuckets; i++) {
-    if (ht->keys[i] != NULL) {
-      for (j = 0; j < lst_size(ht->keys[i]); j++)
-        sfree(lst_get_ptr(ht->keys[i], j));
-      for (j = 0; j < lst_size(ht->vals[i]); j++)
-        sfree(lst_get_ptr(ht->vals[i], j));
-      lst_free(ht->keys[i]);
-      lst_free(ht->vals[i]);      
-    }
-  }
-  sfree(ht->keys);
-  sfree(ht->vals);
-  sfree(ht);
+  int i;
+  for (i = 0; i < ht->nslots; i++) 
+    if (ht->slots[i].hash != 0) sfree(ht->slots[i].val);
+  hsh_free(ht);
 }
 
 List *hsh_keys(Hashtable *ht) {
-  int i, j;
-  List *retval = lst_new_ptr(ht->nbuckets); /* often under-loaded */
-  for (i = 0; i < ht->nbuckets; i++) {
-    if (ht->keys[i] == NULL) continue;
-    for (j = 0; j < lst_size(ht->keys[i]); j++)
-      lst_push_ptr(retval, lst_get_ptr(ht->keys[i], j));
-  }
+  int i;
+  List *retval = lst_new_ptr(max(ht->nitems, 1));
+  for (i = 0; i < ht->nslots; i++) 
+    if (ht->slots[i].hash != 0)
+      lst_push_ptr(retval, ht->slots[i].key);
   return retval;
 }
 
 /* Clear keys and values in a hashtable without freeing the hashtable. The end
    result is equivaslent to a newly-allocated hashtable. */
 void hsh_clear_with_vals(Hashtable *ht) {
-  int i, j;
-  for (i = 0; i < ht->nbuckets; i++) {
-    if (ht->keys[i] != NULL) {
-      for (j = 0; j < lst_size(ht->keys[i]); j++)
-        sfree(lst_get_ptr(ht->keys[i], j));
-      for (j = 0; j < lst_size(ht->vals[i]); j++)
-        sfree(lst_get_ptr(ht->vals[i], j));
-      lst_free(ht->keys[i]);
-      lst_free(ht->vals[i]);      
-      ht->keys[i] = ht->vals[i] = NULL;
-    }
-  }
+  int i;
+  for (i = 0; i < ht->nslots; i++) 
+    if (ht->slots[i].hash != 0) sfree(ht->slots[i].val);
+  hsh_clear(ht);
 }
 
 /* Clear keys in a hashtable without freeing the hashtable or values. The end
    result is equivaslent to a newly-allocated hashtable, but objects pointed
    to by the hash are left intact. */
 void hsh_clear(Hashtable *ht) {
-  int i, j;
-  for (i = 0; i < ht->nbuckets; i++) {
-    if (ht->keys[i] != NULL) {
-      for (j = 0; j < lst_size(ht->keys[i]); j++)
-	sfree(lst_get_ptr(ht->keys[i], j));
-      lst_free(ht->keys[i]);
-      lst_free(ht->vals[i]);
-      ht->keys[i] = ht->vals[i] = NULL;
-    }
-  }
+  int i;
+  for (i = 0; i < ht->nslots; i++) ht->slots[i].hash = 0;
+  ht->nitems = 0;
+  hsh_free_keys(ht);
 }
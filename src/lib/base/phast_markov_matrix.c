@@ -21,6 +21,7 @@
 #include <phast/eigen.h>
 #include <phast/prob_vector.h>
 #include <phast/external_libs.h>
+#include <phast/arena.h>
 
 #define SUM_EPSILON 0.0001
 #define ELEMENT_EPSILON 0.00001
@@ -464,9 +465,10 @@ void mm_exp_higham(MarkovMatrix *P, MarkovMatrix *Q, double t, int do_mu) {
 /* general version allowing for complex eigenvalues/eigenvectors */
 void mm_exp_complex(MarkovMatrix *P, MarkovMatrix *Q, double t) {
 
-  static Zmatrix *Eexp = NULL; /* reuse these if possible */
-  static Zmatrix *tmp = NULL;
-  static int last_size = 0;
+  Zmatrix tmp;                  /* scratch storage is temporary
+                                   rather than static, so that
+                                   threads may call this function
+                                   concurrently */
   int n = Q->size;
   int i, j;
 
@@ -479,19 +481,6 @@ void mm_exp_complex(MarkovMatrix *P, MarkovMatrix *Q, double t) {
     return;
   }
 
-  if (last_size != Q->size && Eexp != NULL) {
-    zmat_free(Eexp);
-    zmat_free(tmp);
-    Eexp = NULL;
-  }
-
-  if (Eexp == NULL) {
-    Eexp = zmat_new(Q->size, Q->size);
-    set_static_var((void**)&Eexp);
-    tmp = zmat_new(Q->size, Q->size);
-    last_size = Q->size;
-  }
-
   /* Diagonalize (if necessary) */
   if (Q->diagonalize_error != 1 &&
       (Q->evec_matrix_z == NULL || Q->evals_z == NULL ||
@@ -505,23 +494,28 @@ void mm_exp_complex(MarkovMatrix *P, MarkovMatrix *Q, double t) {
     return;
   }
 
+  ar_push();
+  tmp.nrows = tmp.ncols = n;
+  tmp.data = ar_alloc(n * sizeof(Complex*));
+  for (i = 0; i < n; i++)
+    tmp.data[i] = ar_alloc(n * sizeof(Complex));
+
   /* Compute P(t) = S exp(Dt) S^-1.  Start by computing exp(Dt) S^-1 */
   for (i = 0; i < n; i++) {
     Complex exp_dt_i =
       z_exp(z_mul_real(zvec_get(Q->evals_z, i), t));
     for (j = 0; j < n; j++)
-      zmat_set(tmp, i, j, z_mul(exp_dt_i, zmat_get(Q->evec_matrix_inv_z, i, j)));
+      zmat_set(&tmp, i, j, z_mul(exp_dt_i, zmat_get(Q->evec_matrix_inv_z, i, j)));
   }
 
   /* Now multiply by S (on the left) */
-  zmat_mult_real(P->matrix, Q->evec_matrix_z, tmp);
-
+  zmat_mult_real(P->matrix, Q->evec_matrix_z, &tmp);
+  ar_pop();
 }
 
 /* version that assumes real eigenvalues/eigenvectors */
 void mm_exp_real(MarkovMatrix *P, MarkovMatrix *Q, double t) {
-  static Vector *exp_evals = NULL; /* reuse if possible */
-  static int last_size = -1;
+  Vector exp_evals;             /* temporary, as above */
   int n = Q->size;
   int i;
 
@@ -534,15 +528,6 @@ void mm_exp_real(MarkovMatrix *P, MarkovMatrix *Q, double t) {
     return;
   }
 
-  if (exp_evals == NULL || last_size != Q->size) {
-    if (exp_evals != NULL)
-      vec_free(exp_evals);
-
-    exp_evals = vec_new(Q->size);
-    set_static_var((void**)&exp_evals);
-    last_size = Q->size;
-  }
-
   /* Diagonalize (if necessary) */
   if (Q->diagonalize_error != 1 &&
       (Q->evec_matrix_r == NULL || Q->evals_r == NULL ||
@@ -556,10 +541,14 @@ void mm_exp_real(MarkovMatrix *P, MarkovMatrix *Q, double t) {
   }
 
   /* Compute P(t) = S exp(Dt) S^-1 */
+  ar_push();
+  exp_evals.size = n;
+  exp_evals.data = ar_alloc(n * sizeof(double));
   for (i = 0; i < n; i++)
-    exp_evals->data[i] = exp(Q->evals_r->data[i] * t);
+    exp_evals.data[i] = exp(Q->evals_r->data[i] * t);
 
-  mat_mult_diag(P->matrix, Q->evec_matrix_r, exp_evals, Q->evec_matrix_inv_r);
+  mat_mult_diag(P->matrix, Q->evec_matrix_r, &exp_evals, Q->evec_matrix_inv_r);
+  ar_pop();
 }
 
 /* computes discrete matrix P by the formula P = exp(Qt),
@@ -32,6 +32,7 @@ struct mem_list_type {
   FILE **open_files;
   int num_open_files;
   int open_files_alloc_len;
+  Arena arena;                  /* temporary storage (see arena.h) */
 };
 
 static MemList *memlist=NULL;
@@ -140,6 +141,7 @@ void phast_init_memlist() {
   memlist->open_files = NULL;
   memlist->num_open_files = 0;
   memlist->open_files_alloc_len = 0;
+  ar_init(&memlist->arena);
 }
 
 void phast_new_mem_handler() {
@@ -306,6 +308,7 @@ void phast_free_all() {
     memlist->num_open_files = 0;
     memlist->open_files_alloc_len = 0;
   }
+  ar_release(&memlist->arena);
   num_memlist--;
   if (num_memlist > 0)
     memlist = &big_memlist[num_memlist-1];
@@ -318,6 +321,17 @@ void phast_free_all() {
 }
 
 
+Arena *phast_mem_arena() {
+#ifdef USE_PHAST_MEMORY_HANDLER
+  if (memlist == NULL)
+    die("ERROR phast_mem_arena: no memory handler (see phast_new_mem_handler)\n");
+  return &memlist->arena;
+#else
+  return NULL;
+#endif
+}
+
+
 void set_static_var(void **ptr) {
 #ifdef USE_PHAST_MEMORY_HANDLER
   if (memlist->static_mem_list_len == memlist->static_mem_list_alloc_len) {
@@ -752,6 +766,11 @@ void hmm_protect(HMM *hmm) {
   phast_mem_protect(hmm->successors);
   lst_protect(hmm->begin_successors);
   lst_protect(hmm->end_predecessors);
+  if (hmm->compiled != NULL) {
+    phast_mem_protect(hmm->compiled->int_storage);
+    phast_mem_protect(hmm->compiled->dbl_storage);
+    phast_mem_protect(hmm->compiled);
+  }
 }
 
 
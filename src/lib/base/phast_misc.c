@@ -16,6 +16,7 @@
 #include <phast/stringsplus.h>
 #include <stdarg.h>
 #include <phast/hashtable.h>
+#include <phast/compressed_io.h>
 #include <unistd.h>
 #include <assert.h>
 
@@ -278,13 +279,24 @@ FILE* phast_fopen_no_exit(const char *fname, const char *mode) {
   FILE *F = NULL;
   if (!strcmp(fname, "-")) {
     if (mode[0]=='r') 
-      return stdin;
+      return cio_open_read(stdin, "stdin");
     else if (mode[0]=='w')
       return stdout;
     else die("ERROR: bad args to phast_fopen.\n");
   }
   F = fopen(fname, mode);
-  if (F != NULL) register_open_file(F);
+  if (F != NULL) {
+    /* decompress input and compress output transparently; output
+       is compressed according to the suffix of fname, whatever the
+       mode ("w", "w+", "a", ...) */
+    if (mode[0] == 'r') {
+      if (strchr(mode, '+') == NULL)
+        F = cio_open_read(F, fname);
+    }
+    else if (cio_compressed_name(fname))
+      F = cio_open_write(F);
+    register_open_file(F);
+  }
   return F;
 }
 
@@ -297,8 +309,8 @@ FILE* phast_fopen(const char *fname, const char *mode) {
 
 void phast_fclose(FILE *f) {
   if (f != stdout && f!=stderr) {
-    fclose(f);
     unregister_open_file(f);
+    fclose(f);
   }
 }
 
@@ -19,6 +19,7 @@
 #include <phast/prob_matrix.h>
 #include <phast/prob_vector.h>
 #include <phast/misc.h>
+#include <phast/fft.h>
 
 void pm_mean(Matrix *p, double *mean_x, double *mean_y) {
   int x, y;
@@ -112,6 +113,54 @@ void pm_normalize(Matrix *p) {
   mat_scale(p, 1/sum);
 }
 
+/* (used by convolution functions below) replace r by its convolution
+   with s, truncated at the dimensions of r.  Only the first *nrows x
+   *ncols elements of r and snrows x sncols elements of s are in use
+   (the rest of r must be zero); *nrows and *ncols are updated */
+static void pm_convolve_fft_step(Matrix *r, int *nrows, int *ncols,
+                                 Matrix *s, int snrows, int sncols) {
+  int newnrows = min(r->nrows, *nrows + snrows - 1),
+    newncols = min(r->ncols, *ncols + sncols - 1);
+  fft_convolve_2d(r->data, *nrows, *ncols, s->data, snrows, sncols,
+                  r->data, newnrows, newncols);
+  *nrows = newnrows;
+  *ncols = newncols;
+}
+
+/* (used by convolution functions below) convolve distribution n
+   times by FFT using repeated squaring, truncating at max_nrows x
+   max_ncols (see pv_convolve_fft).  Returns a max_nrows x max_ncols
+   matrix, of which the first *nrows x *ncols elements may be nonzero */
+static Matrix *pm_convolve_fft(Matrix *p, int n, int max_nrows,
+                               int max_ncols, int *nrows, int *ncols) {
+  Matrix *retval = NULL, *pow_p = mat_new(max_nrows, max_ncols);
+  int x, y, pow_nrows = min(p->nrows, max_nrows),
+    pow_ncols = min(p->ncols, max_ncols);
+
+  mat_zero(pow_p);
+  for (x = 0; x < pow_nrows; x++)
+    for (y = 0; y < pow_ncols; y++)
+      pow_p->data[x][y] = p->data[x][y];
+
+  while (TRUE) {
+    if (n & 1) {
+      if (retval == NULL) {
+        retval = mat_create_copy(pow_p);
+        *nrows = pow_nrows;
+        *ncols = pow_ncols;
+      }
+      else pm_convolve_fft_step(retval, nrows, ncols, pow_p, pow_nrows,
+                                pow_ncols);
+    }
+    n >>= 1;
+    if (n == 0) break;
+    pm_convolve_fft_step(pow_p, &pow_nrows, &pow_ncols, pow_p, pow_nrows,
+                         pow_ncols);
+  }
+  mat_free(pow_p);
+  return retval;
+}
+
 /* convolve distribution n times */
 Matrix *pm_convolve(Matrix *p, int n, double epsilon) {
   int i, j, k, x, y;
@@ -139,27 +188,35 @@ Matrix *pm_convolve(Matrix *p, int n, double epsilon) {
     vec_free(marg_y);
   }
 
-  q_i = mat_new(max_nrows, max_ncols);
-  q_i_1 = mat_new(max_nrows, max_ncols);
+  if (fft_convolve_faster((double)(n - 1) * max_nrows * max_ncols *
+                          p->nrows * p->ncols, 2 * log2_int(n),
+                          fft_len(2 * max_nrows) * fft_len(2 * max_ncols))) {
+    int nrows, ncols;           /* trimmed below */
+    q_i = pm_convolve_fft(p, n, max_nrows, max_ncols, &nrows, &ncols);
+  }
+  else {
+    q_i = mat_new(max_nrows, max_ncols);
+    q_i_1 = mat_new(max_nrows, max_ncols);
 
-  /* compute convolution recursively */
-  mat_zero(q_i_1);
-  for (x = 0; x < p->nrows; x++)
-    for (y = 0; y < p->ncols; y++)
-      q_i_1->data[x][y] = p->data[x][y];
+    /* compute convolution recursively */
+    mat_zero(q_i_1);
+    for (x = 0; x < p->nrows; x++)
+      for (y = 0; y < p->ncols; y++)
+        q_i_1->data[x][y] = p->data[x][y];
 
-  for (i = 1; i < n; i++) {
-    mat_zero(q_i);
-    for (x = 0; x < q_i->nrows; x++) {
-      for (y = 0; y < q_i->ncols; y++) 
-        for (j = max(0, x - p->nrows + 1); j <= x; j++) 
-          for (k = max(0, y - p->ncols + 1); k <= y; k++) 
-            q_i->data[x][y] += q_i_1->data[j][k] * p->data[x - j][y - k];
+    for (i = 1; i < n; i++) {
+      mat_zero(q_i);
+      for (x = 0; x < q_i->nrows; x++) {
+        for (y = 0; y < q_i->ncols; y++) 
+          for (j = max(0, x - p->nrows + 1); j <= x; j++) 
+            for (k = max(0, y - p->ncols + 1); k <= y; k++) 
+              q_i->data[x][y] += q_i_1->data[j][k] * p->data[x - j][y - k];
+      }
+      mat_copy(q_i_1, q_i);
     }
-    mat_copy(q_i_1, q_i);
-  }
 
-  mat_free(q_i_1);
+    mat_free(q_i_1);
+  }
 
   /* trim dimension before returning */
   max_nrows = max_ncols = -1;
@@ -249,9 +306,9 @@ Matrix **pm_convolve_save(Matrix *p, int n, double epsilon) {
    NULL, then each distrib is assumed to have multiplicity 1 */
 Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
   int i, j, k, l, x, y, max_nrows, max_ncols, count, tot_count = 0,
-    this_max_nrows, this_max_ncols;
+    this_max_nrows, this_max_ncols, nconv;
   Matrix *q_i, *q_i_1;
-  double max_nsd;
+  double max_nsd, direct_ops;
 
   max_nrows = max_ncols = 0; 
   for (i = 0; i < n; i++) {
@@ -288,37 +345,77 @@ Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
     max_ncols = (int)ceil(tot_mean_y + max_nsd * sqrt(tot_var_y)) + 1;
   }
 
-  q_i = mat_new(max_nrows, max_ncols);
-  q_i_1 = mat_new(max_nrows, max_ncols);
-
-  /* compute convolution recursively */
-  mat_zero(q_i_1);
+  /* estimate cost of direct convolution (see below) */
+  direct_ops = 0;
+  nconv = 0;
   this_max_nrows = min(p[0]->nrows, max_nrows);
   this_max_ncols = min(p[0]->ncols, max_ncols);
-  for (x = 0; x < this_max_nrows; x++)
-    for (y = 0; y < this_max_ncols; y++)
-      q_i_1->data[x][y] = p[0]->data[x][y];
- 
-  this_max_nrows = p[0]->nrows;
-  this_max_ncols = p[0]->ncols;
   for (i = 0; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
-    if (i == 0) count--; /* initialization takes care of first one */
-    this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows);
-    this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols);
-    for (l = 0; l < count; l++) {
-      mat_zero(q_i);
-      for (x = 0; x < this_max_nrows; x++) {
-        for (y = 0; y < this_max_ncols; y++) 
-          for (j = max(0, x - p[i]->nrows + 1); j <= x; j++) 
-            for (k = max(0, y - p[i]->ncols + 1); k <= y; k++) 
-              q_i->data[x][y] += q_i_1->data[j][k] * p[i]->data[x - j][y - k];
+    if (i == 0) count--;
+    if (count <= 0) continue;
+    this_max_nrows = min(max_nrows, this_max_nrows + count * p[i]->nrows);
+    this_max_ncols = min(max_ncols, this_max_ncols + count * p[i]->ncols);
+    direct_ops += (double)count * this_max_nrows * this_max_ncols *
+      p[i]->nrows * p[i]->ncols;
+    nconv += 2 * log2_int(count) + 1;
+  }
+
+  if (fft_convolve_faster(direct_ops, nconv, fft_len(2 * max_nrows) *
+                          fft_len(2 * max_ncols))) {
+    /* raise each distribution to the power of its count, then combine */
+    int pow_nrows, pow_ncols;
+    q_i = NULL;
+    for (i = 0; i < n; i++) {
+      count = (counts == NULL ? 1 : counts[i]);
+      if (i == 0 && count < 1) count = 1; /* as below */
+      if (count <= 0) continue;
+      if (q_i == NULL)
+        q_i = pm_convolve_fft(p[i], count, max_nrows, max_ncols,
+                              &this_max_nrows, &this_max_ncols);
+      else {
+        q_i_1 = pm_convolve_fft(p[i], count, max_nrows, max_ncols,
+                                &pow_nrows, &pow_ncols);
+        pm_convolve_fft_step(q_i, &this_max_nrows, &this_max_ncols,
+                             q_i_1, pow_nrows, pow_ncols);
+        mat_free(q_i_1);
       }
-      mat_copy(q_i_1, q_i);
     }
   }
+  else {
+    q_i = mat_new(max_nrows, max_ncols);
+    q_i_1 = mat_new(max_nrows, max_ncols);
+
+    /* compute convolution recursively */
+    mat_zero(q_i_1);
+    this_max_nrows = min(p[0]->nrows, max_nrows);
+    this_max_ncols = min(p[0]->ncols, max_ncols);
+    for (x = 0; x < this_max_nrows; x++)
+      for (y = 0; y < this_max_ncols; y++)
+        q_i_1->data[x][y] = p[0]->data[x][y];
+ 
+    this_max_nrows = p[0]->nrows;
+    this_max_ncols = p[0]->ncols;
+    for (i = 0; i < n; i++) {
+      count = (counts == NULL ? 1 : counts[i]);
+      if (i == 0) count--; /* initialization takes care of first one */
+      for (l = 0; l < count; l++) {
+        /* support grows with each convolution */
+        this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows);
+        this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols);
+        mat_zero(q_i);
+        for (x = 0; x < this_max_nrows; x++) {
+          for (y = 0; y < this_max_ncols; y++) 
+            for (j = max(0, x - p[i]->nrows + 1); j <= x; j++) 
+              for (k = max(0, y - p[i]->ncols + 1); k <= y; k++) 
+                q_i->data[x][y] += q_i_1->data[j][k] * p[i]->data[x - j][y - k];
+        }
+        mat_copy(q_i_1, q_i);
+      }
+    }
 
-  mat_free(q_i_1);
+    mat_free(q_i_1);
+  }
 
   /* trim dimension before returning */
   max_nrows = max_ncols = -1;
@@ -345,11 +442,39 @@ Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
 Matrix *pm_convolve_many_fast(Matrix **p, int n, int max_nrows, int max_ncols) {
   int i, j, k, x, y, this_max_nrows, this_max_ncols;
   Matrix *q_i, *q_i_1;
+  double direct_ops;
 
   if (n == 1)
     /* no convolution necessary */
     return mat_create_copy(p[0]);
 
+  /* estimate cost of direct convolution (see below) */
+  direct_ops = 0;
+  this_max_nrows = p[0]->nrows;
+  this_max_ncols = p[0]->ncols;
+  for (i = 1; i < n; i++) {
+    this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows);
+    this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols);
+    direct_ops += (double)this_max_nrows * this_max_ncols * p[i]->nrows *
+      p[i]->ncols;
+  }
+
+  if (fft_convolve_faster(direct_ops, n - 1, fft_len(2 * max_nrows) *
+                          fft_len(2 * max_ncols))) {
+    q_i = mat_new(max_nrows, max_ncols);
+    mat_zero(q_i);
+    this_max_nrows = min(p[0]->nrows, max_nrows);
+    this_max_ncols = min(p[0]->ncols, max_ncols);
+    for (x = 0; x < this_max_nrows; x++)
+      for (y = 0; y < this_max_ncols; y++)
+        q_i->data[x][y] = p[0]->data[x][y];
+    for (i = 1; i < n; i++)
+      pm_convolve_fft_step(q_i, &this_max_nrows, &this_max_ncols, p[i],
+                           min(p[i]->nrows, max_nrows),
+                           min(p[i]->ncols, max_ncols));
+    return q_i;
+  }
+
   q_i = mat_new(max_nrows, max_ncols);
   q_i_1 = mat_new(max_nrows, max_ncols);
 
@@ -17,6 +17,7 @@
 
 #include <phast/prob_vector.h>
 #include <phast/misc.h>
+#include <phast/fft.h>
 
 /* compute mean and variance */
 void pv_stats(Vector *p, double *mean, double *var) {  
@@ -25,7 +26,7 @@ void pv_stats(Vector *p, double *mean, double *var) {
   *var = 0;
   for (x = 0; x < p->size; x++) {
     *mean += x * p->data[x];
-    *var += x * x * p->data[x];
+    *var += (double)x * x * p->data[x];
   }
   *var -= (*mean * *mean);
 }
@@ -141,6 +142,46 @@ void pv_normalize(Vector *p) {
   vec_scale(p, 1/sum);
 }
 
+/* (used by convolution functions below) replace r by its convolution
+   with s, truncated at max_x elements.  Both vectors must have room
+   for max_x elements; their sizes give the lengths currently in use */
+static void pv_convolve_fft_step(Vector *r, Vector *s, int max_x) {
+  int newsize = min(max_x, r->size + s->size - 1);
+  fft_convolve(r->data, r->size, s->data, s->size, r->data, newsize);
+  r->size = newsize;
+}
+
+/* (used by convolution functions below) convolve distribution n
+   times by FFT, truncating at max_x elements.  Uses repeated squaring,
+   so only O(log n) convolutions are needed.  Truncation after each
+   step does not affect the result, because the elements retained
+   depend only on elements at smaller indices */
+static Vector *pv_convolve_fft(Vector *p, int n, int max_x) {
+  Vector *retval = NULL, *pow_p = vec_new(max_x);
+  int x;
+
+  pow_p->size = min(p->size, max_x);
+  for (x = 0; x < pow_p->size; x++)
+    pow_p->data[x] = p->data[x];
+
+  while (TRUE) {
+    if (n & 1) {
+      if (retval == NULL) {
+        retval = vec_new(max_x);
+        retval->size = pow_p->size;
+        for (x = 0; x < pow_p->size; x++)
+          retval->data[x] = pow_p->data[x];
+      }
+      else pv_convolve_fft_step(retval, pow_p, max_x);
+    }
+    n >>= 1;
+    if (n == 0) break;
+    pv_convolve_fft_step(pow_p, pow_p, max_x);
+  }
+  vec_free(pow_p);
+  return retval;
+}
+
 /* convolve distribution n times */
 Vector *pv_convolve(Vector *p, int n, double epsilon) {
   int i, j, x;
@@ -162,24 +203,32 @@ Vector *pv_convolve(Vector *p, int n, double epsilon) {
     max_x = max((int)ceil(n * mean + max_nsd * sqrt(n * var)), p->size);
   }
 
-  q_i = vec_new(max_x);
-  q_i_1 = vec_new(max_x);
+  if (fft_convolve_faster((double)(n - 1) * max_x * p->size,
+                          2 * log2_int(n), fft_len(2 * max_x))) {
+    q_i = pv_convolve_fft(p, n, max_x);
+    for (x = q_i->size; x < max_x; x++) q_i->data[x] = 0;
+    q_i->size = max_x;
+  }
+  else {
+    q_i = vec_new(max_x);
+    q_i_1 = vec_new(max_x);
 
-  /* compute convolution recursively */
-  vec_zero(q_i_1);
-  for (x = 0; x < p->size; x++)
-    q_i_1->data[x] = p->data[x];
+    /* compute convolution recursively */
+    vec_zero(q_i_1);
+    for (x = 0; x < p->size; x++)
+      q_i_1->data[x] = p->data[x];
 
-  for (i = 1; i < n; i++) {
-    vec_zero(q_i);
-    for (x = 0; x < q_i->size; x++) {
-      for (j = max(0, x - p->size + 1); j <= x; j++) 
-        q_i->data[x] += q_i_1->data[j] * p->data[x - j];
+    for (i = 1; i < n; i++) {
+      vec_zero(q_i);
+      for (x = 0; x < q_i->size; x++) {
+        for (j = max(0, x - p->size + 1); j <= x; j++) 
+          q_i->data[x] += q_i_1->data[j] * p->data[x - j];
+      }
+      if (i < n - 1) vec_copy(q_i_1, q_i);
     }
-    if (i < n - 1) vec_copy(q_i_1, q_i);
-  }
 
-  vec_free(q_i_1);
+    vec_free(q_i_1);
+  }
 
   /* trim very small values off tail before returning */
   for (x = q_i->size - 1; x >= 0; x--) {
@@ -252,9 +301,9 @@ Vector **pv_convolve_save(Vector *p, int n, double epsilon) {
 /* take convolution of a set of probability vectors.  If counts is
    NULL, then each distrib is assumed to have multiplicity 1 */
 Vector *pv_convolve_many(Vector **p, int *counts, int n, double epsilon) {
-  int i, j, k, x, max_x = 0, tot_count = 0, count, thismax;
+  int i, j, k, x, max_x = 0, tot_count = 0, count, thismax, nconv;
   Vector *q_i, *q_i_1;
-  double mean, var, max_nsd;
+  double mean, var, max_nsd, direct_ops;
 
   for (i = 0; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
@@ -284,30 +333,64 @@ Vector *pv_convolve_many(Vector **p, int *counts, int n, double epsilon) {
     max_x = (int)ceil(tot_mean + max_nsd * sqrt(tot_var));
   }
 
-  q_i = vec_new(max_x);
-  q_i_1 = vec_new(max_x);
-
-  /* compute convolution recursively */
-  vec_zero(q_i_1);
+  /* estimate cost of direct convolution (see below) */
+  direct_ops = 0;
+  nconv = 0;
   thismax = min(p[0]->size, max_x);
-  for (x = 0; x < thismax; x++)
-    q_i_1->data[x] = p[0]->data[x];
-
   for (i = 0; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
-    if (i == 0) count--; /* initialization takes care of first one */
-    thismax = min(max_x, thismax + p[i]->size);
-    for (k = 0; k < count; k++) {
-      vec_zero(q_i);
-      for (x = 0; x < thismax; x++) {
-        for (j = max(0, x - p[i]->size + 1); j <= x; j++) 
-          q_i->data[x] += q_i_1->data[j] * p[i]->data[x - j];
+    if (i == 0) count--;
+    if (count <= 0) continue;
+    direct_ops += (double)count * min(max_x, thismax + count * p[i]->size) *
+      p[i]->size;
+    thismax = min(max_x, thismax + count * p[i]->size);
+    nconv += 2 * log2_int(count) + 1;
+  }
+
+  if (fft_convolve_faster(direct_ops, nconv, fft_len(2 * max_x))) {
+    /* raise each distribution to the power of its count, then combine */
+    q_i = NULL;
+    for (i = 0; i < n; i++) {
+      count = (counts == NULL ? 1 : counts[i]);
+      if (i == 0 && count < 1) count = 1; /* as below */
+      if (count <= 0) continue;
+      q_i_1 = pv_convolve_fft(p[i], count, max_x);
+      if (q_i == NULL) q_i = q_i_1;
+      else {
+        pv_convolve_fft_step(q_i, q_i_1, max_x);
+        vec_free(q_i_1);
       }
-      vec_copy(q_i_1, q_i);
     }
+    for (x = q_i->size; x < max_x; x++) q_i->data[x] = 0;
+    q_i->size = max_x;
   }
+  else {
+    q_i = vec_new(max_x);
+    q_i_1 = vec_new(max_x);
+
+    /* compute convolution recursively */
+    vec_zero(q_i_1);
+    thismax = min(p[0]->size, max_x);
+    for (x = 0; x < thismax; x++)
+      q_i_1->data[x] = p[0]->data[x];
 
-  vec_free(q_i_1);
+    for (i = 0; i < n; i++) {
+      count = (counts == NULL ? 1 : counts[i]);
+      if (i == 0) count--; /* initialization takes care of first one */
+      for (k = 0; k < count; k++) {
+        /* support grows with each convolution */
+        thismax = min(max_x, thismax + p[i]->size);
+        vec_zero(q_i);
+        for (x = 0; x < thismax; x++) {
+          for (j = max(0, x - p[i]->size + 1); j <= x; j++) 
+            q_i->data[x] += q_i_1->data[j] * p[i]->data[x - j];
+        }
+        vec_copy(q_i_1, q_i);
+      }
+    }
+
+    vec_free(q_i_1);
+  }
 
   /* trim very small values off tail before returning */
   for (x = q_i->size - 1; x >= 0; x--) {
@@ -0,0 +1,162 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* thread_pool - persistent pool of worker threads used for
+   data-parallel loops.  Workers sleep on a condition variable between
+   loops; each loop is published as a new "generation" and tasks are
+   claimed one at a time under a single mutex.  Tasks are expected to
+   be coarse-grained (e.g., blocks of alignment columns), so
+   contention on the mutex is negligible. */
+
+#include <phast/thread_pool.h>
+#include <phast/misc.h>
+
+static int thr_nthreads = 1;
+
+#if !defined(RPHAST) && !defined(SKIP_THREADS)
+#include <pthread.h>
+
+static pthread_mutex_t thr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thr_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t thr_done_cond = PTHREAD_COND_INITIALIZER;
+static int thr_nworkers = 0;    /* number of worker threads started */
+static unsigned long thr_generation = 0,
+  thr_start_generation = 0;    /* generation when workers last started */
+static int thr_busy = FALSE;    /* TRUE while a loop is in progress */
+
+/* description of loop currently in progress */
+static thr_task_func thr_func = NULL;
+static void *thr_data = NULL;
+static int thr_ntasks = 0, thr_next_task = 0, thr_job_nthreads = 0,
+  thr_nactive = 0;
+
+/* claim and execute tasks until none remain.  Called with thr_lock
+   held; returns with it held */
+static void thr_run_tasks(int thread) {
+  while (thr_next_task < thr_ntasks) {
+    int task = thr_next_task++;
+    pthread_mutex_unlock(&thr_lock);
+    thr_func(thr_data, task, thread);
+    pthread_mutex_lock(&thr_lock);
+  }
+}
+
+static void *thr_worker(void *arg) {
+  int thread = ptr_to_int(arg);
+  unsigned long seen;
+
+  pthread_mutex_lock(&thr_lock);
+  seen = thr_start_generation;  /* not thr_generation, which may already
+                                   have advanced for the loop this
+                                   worker was started for */
+  while (1) {
+    while (thr_generation == seen)
+      pthread_cond_wait(&thr_work_cond, &thr_lock);
+    seen = thr_generation;
+    if (thread >= thr_job_nthreads) continue; /* not needed for this loop */
+    thr_run_tasks(thread);
+    if (--thr_nactive == 0)
+      pthread_cond_signal(&thr_done_cond);
+  }
+  pthread_mutex_unlock(&thr_lock);
+  return NULL;
+}
+
+/* start workers so that at least nthreads-1 are available.  Called
+   with thr_lock held */
+static void thr_start_workers(int nthreads) {
+  thr_start_generation = thr_generation;
+  while (thr_nworkers < nthreads - 1) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, thr_worker,
+                       int_to_ptr(thr_nworkers + 1)) != 0)
+      die("ERROR thr_start_workers: unable to create thread.\n");
+    pthread_attr_destroy(&attr);
+    thr_nworkers++;
+  }
+}
+
+void thr_set_nthreads(int nthreads) {
+  if (nthreads < 1 || nthreads > THR_MAX_THREADS)
+    die("ERROR thr_set_nthreads: number of threads must be between 1 and %i.\n",
+        THR_MAX_THREADS);
+  thr_nthreads = nthreads;
+}
+
+void thr_parallel_for(int ntasks, thr_task_func func, void *data) {
+  int task, nthreads;
+
+  pthread_mutex_lock(&thr_lock);
+  nthreads = min(thr_nthreads, ntasks);
+  if (thr_busy || nthreads <= 1) {
+    /* nothing to gain or nested call; run in calling thread */
+    pthread_mutex_unlock(&thr_lock);
+    for (task = 0; task < ntasks; task++)
+      func(data, task, 0);
+    return;
+  }
+  thr_busy = TRUE;
+  thr_start_workers(nthreads);
+  thr_func = func;
+  thr_data = data;
+  thr_ntasks = ntasks;
+  thr_next_task = 0;
+  thr_job_nthreads = nthreads;
+  thr_nactive = nthreads - 1;
+  thr_generation++;
+  pthread_cond_broadcast(&thr_work_cond);
+
+  thr_run_tasks(0);             /* calling thread acts as thread 0 */
+  while (thr_nactive > 0)
+    pthread_cond_wait(&thr_done_cond, &thr_lock);
+
+  thr_func = NULL;
+  thr_data = NULL;
+  thr_busy = FALSE;
+  pthread_mutex_unlock(&thr_lock);
+}
+
+int thr_nthreads_for(int ntasks) {
+  int nthreads;
+  pthread_mutex_lock(&thr_lock);
+  /* a loop started from within a task runs serially */
+  nthreads = (thr_busy ? 1 : max(1, min(thr_nthreads, ntasks)));
+  pthread_mutex_unlock(&thr_lock);
+  return nthreads;
+}
+
+#else  /* threads not available; everything runs serially */
+
+void thr_set_nthreads(int nthreads) {
+  if (nthreads < 1 || nthreads > THR_MAX_THREADS)
+    die("ERROR thr_set_nthreads: number of threads must be between 1 and %i.\n",
+        THR_MAX_THREADS);
+  if (nthreads > 1)
+    phast_warning("WARNING: compiled without thread support; using a single thread.\n");
+}
+
+void thr_parallel_for(int ntasks, thr_task_func func, void *data) {
+  int task;
+  for (task = 0; task < ntasks; task++)
+    func(data, task, 0);
+}
+
+int thr_nthreads_for(int ntasks) {
+  return 1;
+}
+
+#endif
+
+int thr_get_nthreads() {
+  return thr_nthreads;
+}
+
@@ -16,8 +16,12 @@
 #include "phast/stacks.h"
 #include <phast/vector.h>
 #include <phast/prob_vector.h>
+#include <phast/thread_pool.h>
+#include <phast/arena.h>
 #include <time.h>
 
+static void hmm_free_compiled(HMM *hmm);
+
 /* Library of functions for manipulation of hidden Markov models.
    Includes simple reading and writing routines, as well as
    implementations of the Viterbi algorithm, the forward algorithm,
@@ -53,6 +57,7 @@ HMM* hmm_new(MarkovMatrix *mm, Vector *eq_freqs,
   hmm->begin_transition_scores = hmm->end_transition_scores = NULL;
   hmm->predecessors = hmm->successors = NULL;
   hmm->begin_successors = hmm->end_predecessors = NULL;
+  hmm->compiled = NULL;
 
   /* if begin_transitions are NULL, make them uniform */
   if (begin_transitions == NULL) {
@@ -139,6 +144,7 @@ void hmm_free(HMM *hmm) {
   lst_free(hmm->end_predecessors);
   sfree(hmm->predecessors);
   sfree(hmm->successors);
+  hmm_free_compiled(hmm);
   sfree(hmm);
 }
 
@@ -266,26 +272,238 @@ double hmm_get_transition_score(HMM *hmm, int from_state, int to_state) {
   return (mat_get(hmm->transition_score_matrix, from_state, to_state));
 }
 
+/* Checkpointing.  For long sequences, the full dynamic programming
+   matrices of hmm_viterbi and hmm_posterior_probs are not stored.
+   Instead, the sequence is divided into about sqrt(seqlen) blocks of
+   about sqrt(seqlen) columns; a forward pass saves only the last
+   column of each block, and each block's columns are recomputed from
+   the preceding checkpoint when they are needed (for posterior
+   probabilities, as the backward pass reaches the block; for Viterbi,
+   during the traceback).  Memory is O(nstates * sqrt(seqlen)), at the
+   cost of a second forward pass.  The same operations are performed
+   in the same order as with full matrices, so results are
+   identical. */
+
+/* Matrices used by the dynamic-programming routines are temporary
+   and are allocated in the caller's arena scope (see arena.h), which
+   releases them all at once */
+static double **hmm_new_dp_matrix(int nstates, int ncols) {
+  int i;
+  double **m = (double**)ar_alloc(nstates * sizeof(double*));
+  for (i = 0; i < nstates; i++)
+    m[i] = (double*)ar_alloc(ncols * sizeof(double));
+  return m;
+}
+
+static int **hmm_new_backptr_matrix(int nstates, int ncols) {
+  int i;
+  int **m = (int**)ar_alloc(nstates * sizeof(int*));
+  for (i = 0; i < nstates; i++)
+    m[i] = (int*)ar_alloc(ncols * sizeof(int));
+  return m;
+}
+
+/* Log (base 2) of the sum of 2^x[i] over the n values in x, computed
+   exactly as log_sum (see misc.h) would compute it for a list of the
+   same values.  Overwrites x */
+static PHAST_INLINE
+double hmm_log_sum_array(double *x, int n) {
+  double maxval, expsum = 1;
+  int i, k, m = 0, imax = 0;
+
+  if (n == 0) return NEGINFTY;
+  for (i = 1; i < n; i++)
+    if (x[i] > x[imax]) imax = i;
+  maxval = x[imax];
+
+  /* keep the values other than the maximum that log_sum would add,
+     sorted in decreasing order (insertion sort; lists are short) */
+  for (i = 0; i < n; i++) {
+    double v = x[i];
+    if (i == imax || !(v - maxval > SUM_LOG_THRESHOLD)) continue;
+    for (k = m++; k > 0 && x[k-1] < v; k--)
+      x[k] = x[k-1];
+    x[k] = v;
+  }
+  for (k = 0; k < m; k++)
+    expsum += exp2(x[k] - maxval);
+
+  return maxval + log2(expsum);
+}
+
+/* Forward (or Viterbi) recursion for columns start to end-1.  Column
+   j is stored at index j-offset of full_scores (and backptr), and
+   when start > 0, column start-1 must already be present */
+static void hmm_dp_forward_range(HMM *hmm, double **emission_scores,
+                                 int start, int end, int offset,
+                                 hmm_mode mode, double **full_scores,
+                                 int **backptr) {
+  HMMCompiled *c = hmm_get_compiled(hmm);
+  int i, j, k;
+  double prev[hmm->nstates], cand[c->maxdeg + 1];
+
+  for (j = start; j < end; j++) {
+    if (j == 0) {               /* initialization */
+      for (i = 0; i < hmm->nstates; i++) {
+        full_scores[i][-offset] = emission_scores[i][0] + c->begin_score[i];
+        if (mode == VITERBI) backptr[i][-offset] = -1;
+      }
+      continue;
+    }
+
+    for (i = 0; i < hmm->nstates; i++)
+      prev[i] = full_scores[i][j-1-offset];
+
+    for (i = 0; i < hmm->nstates; i++) {
+      double retval = NEGINFTY;
+      if (mode == VITERBI) {
+        int initialized = 0;
+        for (k = c->pred_start[i]; k < c->pred_start[i+1]; k++) {
+          double candidate = prev[c->pred_state[k]] + c->pred_score[k];
+          if (candidate > retval || initialized == 0) {
+            retval = candidate;
+            backptr[i][j-offset] = c->pred_state[k];
+            initialized = 1;
+          }
+        }
+      }
+      else {
+        int n = 0;
+        for (k = c->pred_start[i]; k < c->pred_start[i+1]; k++)
+          cand[n++] = prev[c->pred_state[k]] + c->pred_score[k];
+        retval = hmm_log_sum_array(cand, n);
+      }
+      full_scores[i][j-offset] = emission_scores[i][j] + retval;
+    }
+  }
+}
+
+/* Backward recursion for columns end-1 down to start.  Column j is
+   stored at index j-offset of full_scores, where 0 <= offset <=
+   start, and when end < seqlen, column end must already be present */
+static void hmm_dp_backward_range(HMM *hmm, double **emission_scores,
+                                  int seqlen, int start, int end,
+                                  int offset, double **full_scores) {
+  HMMCompiled *c = hmm_get_compiled(hmm);
+  int i, j, k;
+  double next[hmm->nstates], cand[c->maxdeg + 1];
+
+  for (j = end - 1; j >= start; j--) {
+    if (j == seqlen - 1) {      /* initialization */
+      for (i = 0; i < hmm->nstates; i++)
+        full_scores[i][j-offset] = c->end_score[i];
+                                /*  will be 0 when no end state */
+      continue;
+    }
+    checkInterruptN(j, 1000);
+
+    for (i = 0; i < hmm->nstates; i++)
+      next[i] = emission_scores[i][j+1] + full_scores[i][j+1-offset];
+
+    for (i = 0; i < hmm->nstates; i++) {
+      int n = 0;
+      for (k = c->succ_start[i]; k < c->succ_start[i+1]; k++)
+        cand[n++] = next[c->succ_state[k]] + c->succ_score[k];
+      full_scores[i][j-offset] = hmm_log_sum_array(cand, n);
+    }
+  }
+}
+
+/* Number of columns per block for checkpointed dynamic programming,
+   or 0 if the full matrices (of the given number of bytes per column
+   per state) fit within HMM_CHECKPOINT_BYTES */
+static int hmm_checkpoint_block_size(HMM *hmm, int seqlen, size_t bytes) {
+  int blocksize;
+  if ((double)hmm->nstates * seqlen * bytes <= HMM_CHECKPOINT_BYTES)
+    return 0;
+  blocksize = (int)ceil(sqrt((double)seqlen));
+  return max(blocksize, 1);
+}
+
+/* Viterbi algorithm with checkpointing (see above) */
+static void hmm_viterbi_checkpointed(HMM *hmm, double **emission_scores,
+                                     int seqlen, int *path, int blocksize) {
+  int nblocks = (seqlen + blocksize - 1) / blocksize;
+  int i, j, b, start, end, bestidx, state;
+  double besttran, **ckpt, **block_scores;
+  int **backptr;
+
+  ar_push();
+  ckpt = hmm_new_dp_matrix(hmm->nstates, nblocks);
+  block_scores = hmm_new_dp_matrix(hmm->nstates, blocksize + 1);
+  backptr = hmm_new_backptr_matrix(hmm->nstates, blocksize + 1);
+
+  /* forward pass, saving the last column of each block; column j of
+     a block starting at 'start' is at index j - start + 1 */
+  for (b = 0; b < nblocks; b++) {
+    start = b * blocksize;
+    end = min(start + blocksize, seqlen);
+    if (b > 0)
+      for (i = 0; i < hmm->nstates; i++)
+        block_scores[i][0] = ckpt[i][b-1];
+    hmm_dp_forward_range(hmm, emission_scores, start, end, start - 1,
+                         VITERBI, block_scores, backptr);
+    for (i = 0; i < hmm->nstates; i++)
+      ckpt[i][b] = block_scores[i][end - start];
+  }
+
+  /* find starting place for traceback (see hmm_viterbi) */
+  bestidx = 0;
+  besttran = hmm_get_transition_score(hmm, 0, END_STATE);
+  for (i = 1; i < hmm->nstates; i++) {
+    double thistran = hmm_get_transition_score(hmm, i, END_STATE);
+    if (ckpt[i][nblocks-1] + thistran > ckpt[bestidx][nblocks-1] + besttran)
+      bestidx = i;
+  }
+
+  /* trace back block by block, recomputing the backpointers of each
+     block from the preceding checkpoint (those of the last block are
+     still available) */
+  state = bestidx;
+  for (b = nblocks - 1; b >= 0 && state != -1; b--) {
+    start = b * blocksize;
+    end = min(start + blocksize, seqlen);
+    if (b < nblocks - 1) {
+      if (b > 0)
+        for (i = 0; i < hmm->nstates; i++)
+          block_scores[i][0] = ckpt[i][b-1];
+      hmm_dp_forward_range(hmm, emission_scores, start, end, start - 1,
+                           VITERBI, block_scores, backptr);
+    }
+    for (j = end - 1; j >= start && state != -1; j--) {
+      path[j] = state;
+      state = backptr[state][j - start + 1];
+    }
+  }
+
+  ar_pop();
+}
+
 /* Finds most probable path, according to the Viterbi algorithm.
    Emission scores must be passed in as a two dimensional matrix, with
    hmm->nstates rows and seqlen columns.  The array "path" must be
    allocated externally and be of length seqlen.  This array will be
-   filled with integers indicating state numbers in the HMM. */
+   filled with integers indicating state numbers in the HMM.  For
+   long sequences, checkpointing is used to save memory (see above). */
 void hmm_viterbi(HMM *hmm, double **emission_scores, int seqlen, int *path) {
 
   double **full_scores;
   int **backptr;
   int i, j, len, bestidx;
   double besttran;
+  int blocksize = hmm_checkpoint_block_size(hmm, seqlen,
+                                            sizeof(double) + sizeof(int));
+
+  if (blocksize > 0) {
+    hmm_viterbi_checkpointed(hmm, emission_scores, seqlen, path, blocksize);
+    return;
+  }
 
   /* set up necessary arrays */
-  full_scores = (double**)smalloc(hmm->nstates * sizeof(double*));
-  backptr = (int**)smalloc(hmm->nstates * sizeof(int*));
   len = seqlen;
-  for (i = 0; i < hmm->nstates; i++) {
-    full_scores[i] = (double*)smalloc(len * sizeof(double));
-    backptr[i] = (int*)smalloc(len * sizeof(int));
-  }
+  ar_push();
+  full_scores = hmm_new_dp_matrix(hmm->nstates, len);
+  backptr = hmm_new_backptr_matrix(hmm->nstates, len);
 
   /* fill array using DP */
   hmm_do_dp_forward(hmm, emission_scores, seqlen, VITERBI, full_scores, 
@@ -316,12 +534,7 @@ void hmm_viterbi(HMM *hmm, double **emission_scores, int seqlen, int *path) {
     j--;
   }
 
-  for (i = 0; i < hmm->nstates; i++) {
-    sfree(full_scores[i]);
-    sfree(backptr[i]);
-  }
-  sfree(full_scores);
-  sfree(backptr);
+  ar_pop();
 }
 
 /* Fills matrix of "forward" scores and returns total log probability
@@ -358,6 +571,98 @@ double hmm_backward(HMM *hmm, double **emission_scores, int seqlen,
                         BEGIN_STATE, -1, BACKWARD);
 }
 
+/* Compute the posterior probabilities of column j, given its forward
+   and backward scores at indices jf of forward_scores and jb of
+   backward_scores */
+static void hmm_posterior_column(HMM *hmm, double **forward_scores, int jf,
+                                 double **backward_scores, int jb,
+                                 double **posterior_probs, int j,
+                                 List *val_list) {
+  int i;
+  double this_logp;
+
+  /* to avoid rounding errors, estimate total log prob
+     separately for each column */
+  lst_clear(val_list);
+  for (i = 0; i < hmm->nstates; i++)
+    lst_push_dbl(val_list, (forward_scores[i][jf] + backward_scores[i][jb]));
+  this_logp = log_sum(val_list);
+
+  for (i = 0; i < hmm->nstates; i++)
+    if (posterior_probs[i] != NULL) /* indicates probs for this
+                                       state are not desired */
+      posterior_probs[i][j] = exp2(forward_scores[i][jf] +
+                                   backward_scores[i][jb] - this_logp);
+}
+
+/* Posterior probabilities with checkpointing (see above) */
+static double hmm_posterior_probs_checkpointed(HMM *hmm,
+                                               double **emission_scores,
+                                               int seqlen,
+                                               double **posterior_probs,
+                                               int blocksize) {
+  int nblocks = (seqlen + blocksize - 1) / blocksize;
+  int i, j, b, start = 0, end;
+  double logp_fw, logp_bw, **ckpt, **fw, **bw;
+  List *val_list = lst_new_dbl(hmm->nstates);
+
+  ar_push();
+  ckpt = hmm_new_dp_matrix(hmm->nstates, nblocks);
+  fw = hmm_new_dp_matrix(hmm->nstates, blocksize + 1);
+  bw = hmm_new_dp_matrix(hmm->nstates, blocksize + 1);
+
+  /* forward pass, saving the last column of each block; column j of
+     a block starting at 'start' is at index j - start + 1 of fw */
+  for (b = 0; b < nblocks; b++) {
+    start = b * blocksize;
+    end = min(start + blocksize, seqlen);
+    if (b > 0)
+      for (i = 0; i < hmm->nstates; i++)
+        fw[i][0] = ckpt[i][b-1];
+    hmm_dp_forward_range(hmm, emission_scores, start, end, start - 1,
+                         FORWARD, fw, NULL);
+    for (i = 0; i < hmm->nstates; i++)
+      ckpt[i][b] = fw[i][end - start];
+  }
+  logp_fw = hmm_max_or_sum(hmm, fw, NULL, NULL, END_STATE,
+                           seqlen - start + 1, FORWARD);
+
+  /* backward pass, block by block; column j of a block is at index
+     j - start of bw, and the first column of the following block is
+     carried over at index blocksize.  Forward scores are recomputed
+     for each block (those of the last block are still available) */
+  for (b = nblocks - 1; b >= 0; b--) {
+    start = b * blocksize;
+    end = min(start + blocksize, seqlen);
+    if (end < seqlen)
+      for (i = 0; i < hmm->nstates; i++)
+        bw[i][end - start] = bw[i][0];
+    hmm_dp_backward_range(hmm, emission_scores, seqlen, start, end, start,
+                          bw);
+    if (b < nblocks - 1) {
+      if (b > 0)
+        for (i = 0; i < hmm->nstates; i++)
+          fw[i][0] = ckpt[i][b-1];
+      hmm_dp_forward_range(hmm, emission_scores, start, end, start - 1,
+                           FORWARD, fw, NULL);
+    }
+    for (j = start; j < end; j++) {
+      checkInterruptN(j, 1000);
+      hmm_posterior_column(hmm, fw, j - start + 1, bw, j - start,
+                           posterior_probs, j, val_list);
+    }
+  }
+  logp_bw = hmm_max_or_sum(hmm, bw, emission_scores, NULL, BEGIN_STATE, -1,
+                           BACKWARD);
+
+  if (fabs(logp_fw - logp_bw) > 1.0)
+    fprintf(stderr, "WARNING: forward and backward algorithms returned different total log\nprobabilities (%f and %f, respectively).\n", logp_fw, logp_bw);
+
+  ar_pop();
+  lst_free(val_list);
+  return logp_fw;
+}
+
 /* Fills matrix of posterior probabilities.  As above, emission scores
    must be passed in as a two dimensional matrix with hmm->nstates
    rows and seqlen columns.  Here the array posterior_probs_scores
@@ -366,23 +671,26 @@ double hmm_backward(HMM *hmm, double **emission_scores, int seqlen,
    hmm_backward, but it transparently handles the management of the
    arrays used by those routines.  NOTE: if the posterior probs for
    any state i are not desired, set posterior_probs[i] = NULL.  The
-   return value is the log likelihood.  */
+   return value is the log likelihood.  For long sequences,
+   checkpointing is used to save memory (see above). */
 double hmm_posterior_probs(HMM *hmm, double **emission_scores, int seqlen,
                          double **posterior_probs) {
-  int i, j, len;
+  int j, len;
   double logp_fw, logp_bw;
   double **forward_scores, **backward_scores;
   List *val_list;
+  int blocksize = hmm_checkpoint_block_size(hmm, seqlen, 2 * sizeof(double));
+
+  if (blocksize > 0)
+    return hmm_posterior_probs_checkpointed(hmm, emission_scores, seqlen,
+                                            posterior_probs, blocksize);
 
   len = seqlen;
 
   /* allocate arrays for forward and backward algs */
-  forward_scores = (double**)smalloc(hmm->nstates * sizeof(double*));
-  backward_scores = (double**)smalloc(hmm->nstates * sizeof(double*));
-  for (i = 0; i < hmm->nstates; i++) {
-    forward_scores[i] = (double*)smalloc(len * sizeof(double));
-    backward_scores[i] = (double*)smalloc(len * sizeof(double));
-  }
+  ar_push();
+  forward_scores = hmm_new_dp_matrix(hmm->nstates, len);
+  backward_scores = hmm_new_dp_matrix(hmm->nstates, len);
 
   /* run forward and backward algs */
   logp_fw = hmm_forward(hmm, emission_scores, seqlen, forward_scores); 
@@ -394,61 +702,175 @@ double hmm_posterior_probs(HMM *hmm, double **emission_scores, int seqlen,
   /* compute posterior probs */
   val_list = lst_new_dbl(hmm->nstates);
   for (j = 0; j < len; j++) {
-    double this_logp;
-    checkInterruptN(i, 1000);
-
-    /* to avoid rounding errors, estimate total log prob
-       separately for each column */
-    lst_clear(val_list);
-    for (i = 0; i < hmm->nstates; i++) 
-      lst_push_dbl(val_list, (forward_scores[i][j] + backward_scores[i][j]));
-    this_logp = log_sum(val_list);
-
-    for (i = 0; i < hmm->nstates; i++) 
-      if (posterior_probs[i] != NULL) /* indicates probs for this
-                                         state are not desired */
-        posterior_probs[i][j] = exp2(forward_scores[i][j] + 
-                                     backward_scores[i][j] - this_logp);
+    checkInterruptN(j, 1000);
+    hmm_posterior_column(hmm, forward_scores, j, backward_scores, j,
+                         posterior_probs, j, val_list);
   }
 
-  for (i = 0; i < hmm->nstates; i++) {
-    sfree(forward_scores[i]);
-    sfree(backward_scores[i]);
-  }
-  sfree(forward_scores);
-  sfree(backward_scores);
+  ar_pop();
   lst_free(val_list);
 
   return logp_fw;
 }
 
+/* Shared data for windowed decoding (see below).  Window w covers
+   columns w*window to min((w+1)*window, seqlen) - 1 (its "core"),
+   extended by up to 'overlap' columns on either side */
+typedef struct {
+  HMM *hmm;
+  double **emission_scores;
+  int seqlen, window, overlap;
+  double **posterior_probs;     /* posterior mode */
+  double *lnl;                  /* posterior mode, one per window */
+  int *path;                    /* Viterbi mode */
+} HmmWindowData;
+
+/* Extent of a window, including overlaps, and of its core */
+static void hmm_window_bounds(HmmWindowData *d, int w, int *wstart, int *wend,
+                              int *cstart, int *cend) {
+  *cstart = w * d->window;
+  *cend = min(*cstart + d->window, d->seqlen);
+  *wstart = max(*cstart - d->overlap, 0);
+  *wend = min(*cend + d->overlap, d->seqlen);
+}
+
+/* Log of the sum over states of column j of forward_scores */
+static double hmm_forward_column_total(HMM *hmm, double **forward_scores,
+                                       int j, List *val_list) {
+  int i;
+  lst_clear(val_list);
+  for (i = 0; i < hmm->nstates; i++)
+    lst_push_dbl(val_list, forward_scores[i][j]);
+  return log_sum(val_list);
+}
+
+/* Posterior probabilities for the core of one window */
+static void hmm_posterior_window(void *data, int w, int thread) {
+  HmmWindowData *d = data;
+  HMM *hmm = d->hmm;
+  int i, j, wstart, wend, cstart, cend, wlen;
+  double *E[hmm->nstates], **fw, **bw, lnl_fw;
+  List *val_list = lst_new_dbl(hmm->nstates);
+
+  hmm_window_bounds(d, w, &wstart, &wend, &cstart, &cend);
+  wlen = wend - wstart;
+  for (i = 0; i < hmm->nstates; i++)
+    E[i] = d->emission_scores[i] + wstart;
+  ar_push();
+  fw = hmm_new_dp_matrix(hmm->nstates, wlen);
+  bw = hmm_new_dp_matrix(hmm->nstates, wlen);
+
+  lnl_fw = hmm_forward(hmm, E, wlen, fw);
+  hmm_backward(hmm, E, wlen, bw);
+  for (j = cstart; j < cend; j++)
+    hmm_posterior_column(hmm, fw, j - wstart, bw, j - wstart,
+                         d->posterior_probs, j, val_list);
+
+  /* contribution of the core to the log likelihood, conditional on
+     the columns that precede it in the window */
+  d->lnl[w] = (cend == d->seqlen ? lnl_fw :
+               hmm_forward_column_total(hmm, fw, cend - 1 - wstart,
+                                          val_list));
+  if (cstart > wstart)
+    d->lnl[w] -= hmm_forward_column_total(hmm, fw, cstart - 1 - wstart,
+                                          val_list);
+
+  ar_pop();
+  lst_free(val_list);
+}
+
+/* Viterbi path for the core of one window */
+static void hmm_viterbi_window(void *data, int w, int thread) {
+  HmmWindowData *d = data;
+  HMM *hmm = d->hmm;
+  int i, wstart, wend, cstart, cend, *wpath;
+  double *E[hmm->nstates];
+
+  hmm_window_bounds(d, w, &wstart, &wend, &cstart, &cend);
+  for (i = 0; i < hmm->nstates; i++)
+    E[i] = d->emission_scores[i] + wstart;
+  ar_push();
+  wpath = ar_alloc((wend - wstart) * sizeof(int));
+  hmm_viterbi(hmm, E, wend - wstart, wpath);
+  memcpy(&d->path[cstart], &wpath[cstart - wstart],
+         (cend - cstart) * sizeof(int));
+  ar_pop();
+}
+
+/* Windowed version of hmm_posterior_probs.  The sequence is divided
+   into windows of 'window' columns, each of which is decoded
+   separately (in parallel if threads are available) together with
+   'overlap' columns on either side; the overlaps are then discarded.
+   Returns an approximation of the log likelihood, obtained by summing
+   the contribution of each window conditional on its left overlap */
+double hmm_posterior_probs_windowed(HMM *hmm, double **emission_scores,
+                                    int seqlen, double **posterior_probs,
+                                    int window, int overlap) {
+  HmmWindowData d;
+  int w, nwindows;
+  double lnl = 0;
+
+  if (window <= 0 || seqlen <= window)
+    return hmm_posterior_probs(hmm, emission_scores, seqlen,
+                               posterior_probs);
+  if (overlap < 0)
+    die("ERROR hmm_posterior_probs_windowed: overlap must be nonnegative\n");
+
+  nwindows = (seqlen + window - 1) / window;
+  d.hmm = hmm;
+  d.emission_scores = emission_scores;
+  d.seqlen = seqlen;
+  d.window = window;
+  d.overlap = overlap;
+  d.posterior_probs = posterior_probs;
+  d.lnl = smalloc(nwindows * sizeof(double));
+  d.path = NULL;
+
+  hmm_get_compiled(hmm);        /* shared by all threads */
+  thr_parallel_for(nwindows, hmm_posterior_window, &d);
+
+  for (w = 0; w < nwindows; w++) lnl += d.lnl[w];
+  sfree(d.lnl);
+  return lnl;
+}
+
+/* Windowed version of hmm_viterbi (see hmm_posterior_probs_windowed) */
+void hmm_viterbi_windowed(HMM *hmm, double **emission_scores, int seqlen,
+                          int *path, int window, int overlap) {
+  HmmWindowData d;
+
+  if (window <= 0 || seqlen <= window) {
+    hmm_viterbi(hmm, emission_scores, seqlen, path);
+    return;
+  }
+  if (overlap < 0)
+    die("ERROR hmm_viterbi_windowed: overlap must be nonnegative\n");
+
+  d.hmm = hmm;
+  d.emission_scores = emission_scores;
+  d.seqlen = seqlen;
+  d.window = window;
+  d.overlap = overlap;
+  d.posterior_probs = NULL;
+  d.lnl = NULL;
+  d.path = path;
+
+  hmm_get_compiled(hmm);
+  thr_parallel_for((seqlen + window - 1) / window, hmm_viterbi_window, &d);
+}
+
 /* This is the core dynamic programming routine used by hmm_viterbi
    and hmm_forward.  It is not intended to be called directly. */
 void hmm_do_dp_forward(HMM *hmm, double **emission_scores, int seqlen, 
                        hmm_mode mode, double **full_scores, int **backptr) {  
 
-  int i, j;
-
   if (!(seqlen > 0 && hmm != NULL && hmm->nstates > 0 && 
 	(mode == VITERBI || mode == FORWARD) && 
 	full_scores != NULL && (mode != VITERBI || backptr != NULL)))
     die("ERROR hmm_do_dp_forward: bad params\n");
 
-  /* initialization */
-  for (i = 0; i < hmm->nstates; i++) {
-    full_scores[i][0] = emission_scores[i][0] +
-      hmm_get_transition_score(hmm, BEGIN_STATE, i);
-    if (mode == VITERBI) backptr[i][0] = -1;
-  }
-
-  /* recursion */
-  for (j = 1; j < seqlen; j++) {
-    for (i = 0; i < hmm->nstates; i++) {
-      full_scores[i][j] = emission_scores[i][j] + 
-        hmm_max_or_sum(hmm, full_scores, emission_scores, backptr, 
-                       i, j, mode);
-    }
-  }
+  hmm_dp_forward_range(hmm, emission_scores, 0, seqlen, 0, mode,
+                       full_scores, backptr);
 
 #ifdef DEBUG
   hmm_dump_matrices(hmm, emission_scores, seqlen, full_scores, backptr);
@@ -460,26 +882,12 @@ void hmm_do_dp_forward(HMM *hmm, double **emission_scores, int seqlen,
 void hmm_do_dp_backward(HMM *hmm, double **emission_scores,  int seqlen, 
                         double **full_scores) {  
 
-  int i, j;
-
   if (!(seqlen > 0 && hmm != NULL && hmm->nstates > 0 && 
 	full_scores != NULL))
     die("ERROR hmm_do_dp_backward: bad params\n");
 
-  /* initialization */
-  for (i = 0; i < hmm->nstates; i++)
-    full_scores[i][seqlen-1] = hmm_get_transition_score(hmm, i, END_STATE);
-                                /*  will be 0 when no end state */
-
-  /* recursion */
-  for (j = seqlen - 2; j >= 0; j--) {
-    checkInterruptN(j, 1000);
-    for (i = 0; i < hmm->nstates; i++) {
-      full_scores[i][j] = 
-        hmm_max_or_sum(hmm, full_scores, emission_scores, NULL, 
-                       i, j, BACKWARD);
-    }
-  }
+  hmm_dp_backward_range(hmm, emission_scores, seqlen, 0, seqlen, 0,
+                        full_scores);
 }
 
 /* Finds max or sum of score/transition combination over all previous
@@ -490,66 +898,47 @@ void hmm_do_dp_backward(HMM *hmm, double **emission_scores,  int seqlen,
    BACKWARD).  */  
 double hmm_max_or_sum(HMM *hmm, double **full_scores, double **emission_scores,
                       int **backptr, int i, int j, hmm_mode mode) { 
-  int k;
-  double retval = NEGINFTY;
-  
-  static List *l = NULL;
-
-  if (l == NULL) {
-    l = lst_new_dbl(hmm->nstates);
-    set_static_var((void**)&l);
-  }
+  HMMCompiled *c = hmm_get_compiled(hmm);
+  int k, n = 0;
+  double retval = NEGINFTY, cand[c->maxdeg + 1];
 
   if (mode == VITERBI) {
     int initialized = 0;
-    for (k = 0; k < lst_size(hmm->predecessors[i]); k++) {
-      int pred;
-      double candidate;
-      pred = lst_get_int(hmm->predecessors[i], k);
-      if (pred == BEGIN_STATE) continue;
-      candidate = full_scores[pred][j-1] + 
-        hmm_get_transition_score(hmm, pred, i);
-
+    for (k = c->pred_start[i]; k < c->pred_start[i+1]; k++) {
+      int pred = c->pred_state[k];
+      double candidate = full_scores[pred][j-1] + c->pred_score[k];
       if (candidate > retval || initialized == 0) {
         retval = candidate;
         backptr[i][j] = pred;
         initialized=1;
       }
     }
+    return retval;
   }
   else if (mode == FORWARD) {
-    List *pred_lst = (i == END_STATE ? hmm->end_predecessors :
-      hmm->predecessors[i]);
-    lst_clear(l);
-    for (k = 0; k < lst_size(pred_lst); k++) {
-      int pred;
-      double candidate;
-      pred = lst_get_int(pred_lst, k);
-      if (pred == BEGIN_STATE) continue;
-      candidate = full_scores[pred][j-1] +  
-        hmm_get_transition_score(hmm, pred, i);
-      lst_push_dbl(l, candidate);
-    }
+    if (i == END_STATE)
+      for (k = 0; k < c->nend_pred; k++)
+        cand[n++] = full_scores[c->end_pred[k]][j-1] + c->end_pred_score[k];
+    else
+      for (k = c->pred_start[i]; k < c->pred_start[i+1]; k++)
+        cand[n++] = full_scores[c->pred_state[k]][j-1] + c->pred_score[k];
   }
   else {                        /* mode == BACKWARD */
-    List *succ_lst = (i == BEGIN_STATE ? hmm->begin_successors :
-      hmm->successors[i]);
-    lst_clear(l);
-    for (k = 0; k < lst_size(succ_lst); k++) {
-      int succ;
-      double candidate;
-      succ = lst_get_int(succ_lst, k);
-      if (succ == END_STATE) continue;
-      candidate = emission_scores[succ][j+1] + full_scores[succ][j+1]
-        + hmm_get_transition_score(hmm, i, succ);
-      lst_push_dbl(l, candidate);
-    }
+    if (i == BEGIN_STATE)
+      for (k = 0; k < c->nbegin_succ; k++) {
+        int succ = c->begin_succ[k];
+        cand[n++] = emission_scores[succ][j+1] + full_scores[succ][j+1]
+          + c->begin_succ_score[k];
+      }
+    else
+      for (k = c->succ_start[i]; k < c->succ_start[i+1]; k++) {
+        int succ = c->succ_state[k];
+        cand[n++] = emission_scores[succ][j+1] + full_scores[succ][j+1]
+          + c->succ_score[k];
+      }
   }    
 
-  if (mode == FORWARD || mode == BACKWARD)
-    retval = log_sum(l);
-
-  return retval;
+  return hmm_log_sum_array(cand, n);
 }
 
 /* reset arcs of HMM according to a matrix of counts and, optionally,
@@ -1002,6 +1391,7 @@ void hmm_reset(HMM *hmm) {
     vec_free(hmm->end_transition_scores);
     hmm->end_transition_scores = NULL;
   }
+  hmm_free_compiled(hmm);
 }
 
 /* Given an HMM, some of whose states represent strand-specific
@@ -1214,6 +1604,8 @@ void hmm_set_transition_score_matrix(HMM *hmm) {
   double prob;
   Matrix *m = mat_new(hmm->nstates, hmm->nstates);
 
+  hmm_free_compiled(hmm);
+
   /* "normal" transitions */
   for (i = 0; i < hmm->nstates; i++) {
     for (j = 0; j < hmm->nstates; j++) {
@@ -1251,3 +1643,99 @@ void hmm_set_transition_score_matrix(HMM *hmm) {
   }
 }
 
+/* count the entries of a list of states, excluding BEGIN_STATE and
+   END_STATE */
+static int hmm_count_states(List *l) {
+  int k, n = 0;
+  for (k = 0; k < lst_size(l); k++)
+    if (lst_get_int(l, k) >= 0) n++;
+  return n;
+}
+
+HMMCompiled *hmm_get_compiled(HMM *hmm) {
+  HMMCompiled *c;
+  int i, k, npred = 0, nsucc = 0, *ip;
+  double *dp;
+
+  if (hmm->compiled != NULL) return hmm->compiled;
+
+  c = (HMMCompiled*)smalloc(sizeof(HMMCompiled));
+  c->maxdeg = 0;
+  for (i = 0; i < hmm->nstates; i++) {
+    int np = hmm_count_states(hmm->predecessors[i]),
+      ns = hmm_count_states(hmm->successors[i]);
+    npred += np;
+    nsucc += ns;
+    c->maxdeg = max(c->maxdeg, max(np, ns));
+  }
+  c->nbegin_succ = hmm_count_states(hmm->begin_successors);
+  c->nend_pred = hmm_count_states(hmm->end_predecessors);
+  c->maxdeg = max(c->maxdeg, max(c->nbegin_succ, c->nend_pred));
+
+  /* carve all arrays out of two blocks */
+  ip = c->int_storage = (int*)smalloc((2 * (hmm->nstates + 1) + npred + nsucc +
+                                       c->nbegin_succ + c->nend_pred + 1) *
+                                      sizeof(int));
+  dp = c->dbl_storage = (double*)smalloc((npred + nsucc + c->nbegin_succ +
+                                          c->nend_pred + 2 * hmm->nstates + 1) *
+                                         sizeof(double));
+  c->pred_start = ip; ip += hmm->nstates + 1;
+  c->succ_start = ip; ip += hmm->nstates + 1;
+  c->pred_state = ip; ip += npred;
+  c->succ_state = ip; ip += nsucc;
+  c->begin_succ = ip; ip += c->nbegin_succ;
+  c->end_pred = ip;
+  c->pred_score = dp; dp += npred;
+  c->succ_score = dp; dp += nsucc;
+  c->begin_succ_score = dp; dp += c->nbegin_succ;
+  c->end_pred_score = dp; dp += c->nend_pred;
+  c->begin_score = dp; dp += hmm->nstates;
+  c->end_score = dp;
+
+  /* keep the order of the predecessor and successor lists, so that
+     sums are accumulated as before */
+  npred = nsucc = 0;
+  for (i = 0; i < hmm->nstates; i++) {
+    c->pred_start[i] = npred;
+    for (k = 0; k < lst_size(hmm->predecessors[i]); k++) {
+      int pred = lst_get_int(hmm->predecessors[i], k);
+      if (pred < 0) continue;
+      c->pred_state[npred] = pred;
+      c->pred_score[npred++] = hmm_get_transition_score(hmm, pred, i);
+    }
+    c->succ_start[i] = nsucc;
+    for (k = 0; k < lst_size(hmm->successors[i]); k++) {
+      int succ = lst_get_int(hmm->successors[i], k);
+      if (succ < 0) continue;
+      c->succ_state[nsucc] = succ;
+      c->succ_score[nsucc++] = hmm_get_transition_score(hmm, i, succ);
+    }
+    c->begin_score[i] = hmm_get_transition_score(hmm, BEGIN_STATE, i);
+    c->end_score[i] = hmm_get_transition_score(hmm, i, END_STATE);
+  }
+  c->pred_start[hmm->nstates] = npred;
+  c->succ_start[hmm->nstates] = nsucc;
+  for (k = 0, i = 0; k < lst_size(hmm->begin_successors); k++) {
+    int succ = lst_get_int(hmm->begin_successors, k);
+    if (succ < 0) continue;
+    c->begin_succ[i] = succ;
+    c->begin_succ_score[i++] = hmm_get_transition_score(hmm, BEGIN_STATE, succ);
+  }
+  for (k = 0, i = 0; k < lst_size(hmm->end_predecessors); k++) {
+    int pred = lst_get_int(hmm->end_predecessors, k);
+    if (pred < 0) continue;
+    c->end_pred[i] = pred;
+    c->end_pred_score[i++] = hmm_get_transition_score(hmm, pred, END_STATE);
+  }
+
+  hmm->compiled = c;
+  return c;
+}
+
+static void hmm_free_compiled(HMM *hmm) {
+  if (hmm->compiled == NULL) return;
+  sfree(hmm->compiled->int_storage);
+  sfree(hmm->compiled->dbl_storage);
+  sfree(hmm->compiled);
+  hmm->compiled = NULL;
+}
@@ -12,7 +12,64 @@
 #include <phast/maf.h>
 #include <ctype.h>
 #include <phast/maf_block.h>
+#include <phast/maf_reader.h>
 #include <phast/misc.h>
+#include <phast/thread_pool.h>
+#include <phast/arena.h>
+#include <string.h>
+
+/* value of add_seqs argument to maf_read_block_generic for
+   concurrent parsing, and corresponding return value */
+#define MAF_DEFER_NEW_SEQS 2
+#define MAF_NEW_SEQ -2
+
+static int maf_read_block_generic(MafReader *r, MSA *mini_msa, 
+                                  Hashtable *name_hash, int *start_idx, 
+                                  int *length, int do_toupper, int add_seqs,
+                                  int skip_new_species);
+
+/* Blocks read and parsed in parallel (see maf_batch_next).  Block
+   texts are located serially and parsed concurrently, each into its
+   own alignment ("slot"), which the caller then processes in order.
+   Rather than being added to the sufficient statistics directly, the
+   slots are queued (maf_batch_fold); their column tuples are
+   collected concurrently and merged in order once the whole batch
+   has been processed (maf_batch_flush), so that tuples are numbered
+   exactly as if the blocks had been added one at a time. */
+typedef struct {
+  MafReader *reader;            /* source of block texts */
+  MSA *mini_msa;                /* owns sequence names; also used for
+                                   blocks that introduce new sequences */
+  Hashtable *name_hash;         /* sequence names to indices */
+  int do_toupper, skip_new_species;
+  int nblocks;                  /* number of blocks in batch */
+  int next;                     /* next block to hand out */
+  int nparsed;                  /* blocks before this one are parsed */
+  const char *text[MAF_BATCH_BLOCKS]; /* text of each block */
+  int64_t textlen[MAF_BATCH_BLOCKS];
+  char *copy;                   /* copies of texts, if not mapped */
+  int64_t copy_off[MAF_BATCH_BLOCKS], copy_used, copy_alloc;
+  MSA *slot[MAF_BATCH_BLOCKS];  /* parsed blocks */
+  int status[MAF_BATCH_BLOCKS], start_idx[MAF_BATCH_BLOCKS], 
+    length[MAF_BATCH_BLOCKS];
+  MSA *msa;                     /* destination of statistics */
+  TupleHash *tuple_hash;        /* dictionary of tuples in msa */
+  List *cats_to_do;
+  int nfolds;                   /* number of blocks queued */
+  MSA *fold_msa[MAF_BATCH_BLOCKS];
+  int fold_offset[MAF_BATCH_BLOCKS];
+  SS_Block *sblock[MAF_BATCH_BLOCKS]; /* tuples of queued blocks */
+} MafBatch;
+
+static MafBatch *maf_batch_new(MafReader *reader, MSA *mini_msa, 
+                               Hashtable *name_hash, int do_toupper,
+                               int skip_new_species, MSA *msa, 
+                               TupleHash *tuple_hash, List *cats_to_do);
+static MSA *maf_batch_next(MafBatch *b, int *start_idx, int *length);
+static void maf_batch_fold(MafBatch *b, MSA *block, int idx_offset);
+static void maf_batch_free(MafBatch *b);
+static void maf_block_trim_region(MSA *block, int *start_idx, int *length,
+                                  int region_start, int region_end);
 
 
 /** Read An Alignment from a MAF file.  The alignment won't be
@@ -25,10 +82,26 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
    char *alphabet, GFF_Set *gff, CategoryMap *cm, int cycle_size, 
    int store_order, char *reverse_groups, int gap_strip_mode, 
    int keep_overlapping, List *cats_to_do, List *seqnames, int seq_keep ) {
+  return maf_read_cats_region(F, REFSEQF, tuple_size, alphabet, gff, cm, 
+                              cycle_size, store_order, reverse_groups, 
+                              gap_strip_mode, keep_overlapping, cats_to_do, 
+                              seqnames, seq_keep, NULL, 0, -1);
+}
+
+/* As above, but only for reference positions in [region_start,
+   region_end); with an index, reading begins at the first block that
+   may overlap the region */
+MSA *maf_read_cats_region(FILE *F, FILE *REFSEQF, int tuple_size, 
+   char *alphabet, GFF_Set *gff, CategoryMap *cm, int cycle_size, 
+   int store_order, char *reverse_groups, int gap_strip_mode, 
+   int keep_overlapping, List *cats_to_do, List *seqnames, int seq_keep,
+   MafIndex *idx, int region_start, int region_end) {
 
   int i, start_idx, length, max_tuples, block_no,  
     refseqlen = -1, do_toupper, last_refseqpos = -1;
-  Hashtable *tuple_hash;
+  TupleHash *tuple_hash;
+  MafReader *reader;
+  MafBatch *batch = NULL;
   Hashtable *name_hash = hsh_new(25);
   MSA *msa, *mini_msa;
   GFF_Set *mini_gff = NULL;
@@ -147,9 +220,15 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
   if (max_tuples > 10000000 || max_tuples < 0) max_tuples = 10000000;
   if (max_tuples < 1000000) max_tuples = 1000000;
 
-  tuple_hash = hsh_new(max_tuples); 
-  ss_new(msa, tuple_size, max_tuples, gff != NULL || cycle_size > 0 ? 1 : 0, 
-         store_order); 
+  tuple_hash = ss_new_tuple_hash(msa, min(max_tuples, 100000));
+                                /* grows as needed */
+  ss_new(msa, tuple_size, store_order ? max_tuples : 
+         min(max_tuples, MAF_SS_INIT_NTUPLES), 
+         gff != NULL || cycle_size > 0 ? 1 : 0, store_order); 
+                                /* if not storing order, statistics
+                                   are accumulated block by block and
+                                   grow with the number of distinct
+                                   tuples (see ss_add_block) */
 
   if (store_order) {
     for (i = 0; i < msa->length; i++) 
@@ -158,8 +237,17 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
 
   /* process MAF one block at a time */
   block_no = 0;
-  while (maf_read_block_addseq(F, mini_msa, name_hash, &start_idx,
-			       &length, do_toupper, seqnames != NULL && seq_keep) != EOF) {
+  reader = mafReader_new(F);
+  if (idx != NULL) mafIndex_seek(idx, reader, region_start);
+  if (thr_get_nthreads() > 1)   /* parse and fold blocks in parallel */
+    batch = maf_batch_new(reader, mini_msa, name_hash, do_toupper,
+                          seqnames != NULL && seq_keep, msa, tuple_hash,
+                          cats_to_do);
+  while (batch != NULL ? 
+         (mini_msa = maf_batch_next(batch, &start_idx, &length)) != NULL :
+         maf_read_block_addseq(reader, mini_msa, name_hash, &start_idx,
+                               &length, do_toupper, 
+                               seqnames != NULL && seq_keep) != EOF) {
     checkInterruptN(block_no++, 1000);
 
     //sequence may have been added in maf_read_block so reset numseqs
@@ -168,6 +256,16 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
       msa_add_seq_ss(msa, mini_msa->nseqs);
       msa->nseqs = mini_msa->nseqs;
     }
+
+    /* restrict to region; blocks are sorted, so none after one that
+       starts beyond the region can overlap it */
+    if (region_end >= 0 && start_idx >= region_end) break;
+    if (start_idx + length <= region_start) continue;
+    if (start_idx < region_start || 
+        (region_end >= 0 && start_idx + length > region_end))
+      maf_block_trim_region(mini_msa, &start_idx, &length, region_start,
+                            region_end);
+
     end_idx = start_idx + length - 1;
 
     /* if creating a map, require MAF to be sorted wrt reference sequence, otherwise skip block */
@@ -309,8 +407,13 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
 
     /* extract the suff stats from the mini alignment and fold them
        into the new msa */
-    ss_from_msas(msa, tuple_size, store_order, cats_to_do, mini_msa, 
-                 tuple_hash, idx_offset, 0);
+    if (batch != NULL)
+      maf_batch_fold(batch, mini_msa, idx_offset);
+    else if (store_order)
+      ss_from_msas(msa, tuple_size, store_order, cats_to_do, mini_msa, 
+                   tuple_hash, idx_offset, 0);
+    else
+      ss_add_block(msa, mini_msa, tuple_hash, cats_to_do);
 
     if (gff != NULL) {          /* free features and clear list */
       for (i = 0; i < lst_size(mini_gff->features); i++)
@@ -318,6 +421,14 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
       lst_clear(mini_gff->features);
     }
   }
+  if (batch != NULL) {
+    mini_msa = batch->mini_msa;
+    maf_batch_free(batch);
+  }
+  mafReader_free(reader);
+  if (first_idx == -1 && (region_start > 0 || region_end >= 0))
+    die("ERROR: no alignment blocks overlap reference positions %d-%d.\n",
+        region_start + 1, region_end);
   if (map != NULL)
     map->msa_len = map->seq_len + gap_sum;
 
@@ -414,12 +525,13 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
 	    tuple_str[tuple_size-1 + offset] =
               i+offset >= 0 ? refseq->chars[i+offset] : msa->missing[1];
 
-	  if ((tuple_idx = ss_lookup_coltuple(tuple_str, tuple_hash, msa)) == -1) {
-                                /* tuple isn't in hash yet; have to add */
-            tuple_idx = msa->ss->ntuples++;
-	    ss_add_coltuple(tuple_str, int_to_ptr(tuple_idx), tuple_hash, msa);
-            msa->ss->col_tuples[tuple_idx] = smalloc(tuple_size * msa->nseqs * sizeof(char));
-            strncpy(msa->ss->col_tuples[tuple_idx], tuple_str, msa->nseqs * tuple_size);
+	  if ((tuple_idx = ss_lookup_or_add_coltuple(tuple_str, 
+                                                     msa->ss->ntuples, 
+                                                     tuple_hash, msa)) == 
+              msa->ss->ntuples) {
+                                /* tuple wasn't in hash yet; was added */
+            msa->ss->ntuples++;
+            ss_set_tuple(msa, tuple_idx, tuple_str, msa->nseqs * tuple_size);
             if (fasthash_idx != -1) fasthash[fasthash_idx] = tuple_idx;
           }
         }
@@ -466,6 +578,8 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
     str_free(refseq);
     sfree(fasthash);
   }
+  else if (msa->ss->ntuples > 0) 
+    ss_compact(msa->ss);        /* release unused tuple storage */
 
   msa->names = mini_msa->names;
   mini_msa->names = NULL;       /* will prohibit names from being
@@ -473,7 +587,7 @@ MSA *maf_read_cats_subset(FILE *F, FILE *REFSEQF, int tuple_size,
   msa_free(mini_msa);
   if (mini_gff != NULL) gff_free_set(mini_gff);
 
-  hsh_free(tuple_hash);
+  th_free(tuple_hash);
   hsh_free(name_hash);
   lst_free(block_starts);
   lst_free(block_ends);
@@ -524,7 +638,8 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
 
   int i, start_idx, length, max_tuples, block_no, rbl_idx, 
     refseqlen = -1, do_toupper;
-  Hashtable *tuple_hash;
+  TupleHash *tuple_hash;
+  MafReader *reader;
   Hashtable *name_hash = hsh_new(25);
   MSA *msa, *mini_msa;
   GFF_Set *mini_gff = NULL;
@@ -604,9 +719,15 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
     if (max_tuples < 0) max_tuples = 50000;
   }
 
-  tuple_hash = hsh_new(max_tuples); 
-  ss_new(msa, tuple_size, max_tuples, gff != NULL || cycle_size > 0 ? 1 : 0, 
-         store_order); 
+  tuple_hash = ss_new_tuple_hash(msa, min(max_tuples, 100000));
+                                /* grows as needed */
+  ss_new(msa, tuple_size, store_order ? max_tuples : 
+         min(max_tuples, MAF_SS_INIT_NTUPLES), 
+         gff != NULL || cycle_size > 0 ? 1 : 0, store_order); 
+                                /* if not storing order, statistics
+                                   are accumulated block by block and
+                                   grow with the number of distinct
+                                   tuples (see ss_add_block) */
 
   if (store_order)
     for (i = 0; i < msa->length; i++) msa->ss->tuple_idx[i] = -1;
@@ -614,7 +735,8 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
   /* process MAF one block at a time */
   block_no = 0;
   rbl_idx = 0;
-  while (maf_read_block(F, mini_msa, name_hash, &start_idx, 
+  reader = mafReader_new(F);
+  while (maf_read_block(reader, mini_msa, name_hash, &start_idx, 
                         &length, do_toupper) != EOF) {
     int idx_offset;
     checkInterruptN(block_no, 1000);
@@ -678,8 +800,11 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
 
     /* extract the suff stats from the mini alignment and fold them
        into the new msa */
-    ss_from_msas(msa, tuple_size, store_order, cats_to_do, mini_msa, 
-                 tuple_hash, idx_offset, 0);
+    if (store_order)
+      ss_from_msas(msa, tuple_size, store_order, cats_to_do, mini_msa, 
+                   tuple_hash, idx_offset, 0);
+    else
+      ss_add_block(msa, mini_msa, tuple_hash, cats_to_do);
 
     if (gff != NULL) {          /* free features and clear list */
       for (i = 0; i < lst_size(mini_gff->features); i++)
@@ -687,6 +812,7 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
       lst_clear(mini_gff->features);
     }
   }
+  mafReader_free(reader);
 
   /* if necessary, read reference sequence, make sure consistent with
      alignments, fill in remaining tuples */
@@ -769,12 +895,13 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
           for (offset = -1 * (tuple_size-1); offset <= 0; offset++) 
 	    tuple_str[tuple_size - 1 + offset] = 
               i+offset >= 0 ? refseq->chars[i+offset] : msa->missing[1];
-	  if ((tuple_idx = ss_lookup_coltuple(tuple_str, tuple_hash, msa)) == -1) {
-                                /* tuple isn't in hash yet; have to add */
-            tuple_idx = msa->ss->ntuples++;
-	    ss_add_coltuple(tuple_str, int_to_ptr(tuple_idx), tuple_hash, msa);
-            msa->ss->col_tuples[tuple_idx] = smalloc(tuple_size * msa->nseqs * sizeof(char));
-            strncpy(msa->ss->col_tuples[tuple_idx], tuple_str, msa->nseqs * tuple_size);
+	  if ((tuple_idx = ss_lookup_or_add_coltuple(tuple_str, 
+                                                     msa->ss->ntuples, 
+                                                     tuple_hash, msa)) == 
+              msa->ss->ntuples) {
+                                /* tuple wasn't in hash yet; was added */
+            msa->ss->ntuples++;
+            ss_set_tuple(msa, tuple_idx, tuple_str, msa->nseqs * tuple_size);
             if (fasthash_idx != -1) fasthash[fasthash_idx] = tuple_idx;
           }
         }
@@ -819,13 +946,15 @@ MSA *maf_read_unsorted(FILE *F, FILE *REFSEQF, int tuple_size, char *alphabet,
     str_free(refseq);
     sfree(fasthash);
   }
+  else if (msa->ss->ntuples > 0) 
+    ss_compact(msa->ss);        /* release unused tuple storage */
 
   mini_msa->names = NULL;       /* will prohibit names from being
                                    freed (they are shared) */
   msa_free(mini_msa);
   if (mini_gff != NULL) gff_free_set(mini_gff);
 
-  hsh_free(tuple_hash);
+  th_free(tuple_hash);
   hsh_free(name_hash);
   lst_free(redundant_blocks);
   if (map != NULL) msa_map_free(map);
@@ -842,83 +971,140 @@ MSA *maf_read_old(FILE *f, FILE *REFSEQF, int tuple_size, char *alphabet,
 }
 
 
-/* Read a block from an MAF file and store it as a "mini-msa" using
-   the provided object.  Allocates memory for sequences if they are
-   NULL (as with first block).  Reads to next "a" line or EOF.
-   Returns EOF when no more alignments are available.  Sets start
-   coord and length of reference sequence if non-NULL
-   pointers are provided.  Uses provided hash to map sequence names to
-   sequence indices (prefix of name wrt '.' character); sequences not
-   present in a block will be represented by missing-data characters. */
-int maf_read_block_addseq(FILE *F, MSA *mini_msa, Hashtable *name_hash, 
-			  int *start_idx, int *length, int do_toupper,
-			  int skip_new_species) {
+/* Fill the translation table of a MafReader for use with mini_msa.
+   Each character of a sequence line maps to the character to be
+   stored: characters are converted to upper case if requested, '.'
+   becomes the missing-data character (unless it is part of the
+   alphabet), and unrecognized letters become 'N'.  Characters that
+   are not allowed map to 0.  The table is rebuilt only when the
+   alignment or case conversion changes. */
+static void maf_build_xlate(MafReader *r, MSA *mini_msa, int do_toupper) {
+  int c, d;
+  if (r->xlate_msa == mini_msa && r->xlate_toupper == do_toupper) return;
+  for (c = 0; c < NCHARS; c++) {
+    d = do_toupper ? toupper(c) : c;
+    if (d == '.' && mini_msa->inv_alphabet[(int)'.'] == -1) 
+      d = (unsigned char)mini_msa->missing[0];
+    if (d != GAP_CHAR && !mini_msa->is_missing[d] &&
+        mini_msa->inv_alphabet[d] == -1 && get_iupac_map()[d] == NULL)
+      d = isalpha(d) ? 'N' : 0;
+    r->xlate[c] = (unsigned char)d;
+  }
+  r->xlate_msa = mini_msa;
+  r->xlate_toupper = do_toupper;
+}
 
-  int seqidx, more_blocks = 0, i, j;
-  String *this_seq, *linebuffer = str_new(STR_VERY_LONG_LEN);
-  List *l = lst_new_ptr(7);
-  String *this_name = str_new(STR_SHORT_LEN);
+/* NULL-terminated copy of a line, for use in error messages */
+static char *maf_line_str(const char *line, int len) {
+  char *s = smalloc((len+1) * sizeof(char));
+  memcpy(s, line, len);
+  s[len] = '\0';
+  return s;
+}
+
+/* Equivalent of str_as_int for a field of a line */
+static int maf_field_as_int(const char *field, int len, int *i) {
+  char tmp[STR_SHORT_LEN], *endptr;
+  int val;
+  if (len >= STR_SHORT_LEN) return 2;
+  memcpy(tmp, field, len);
+  tmp[len] = '\0';
+  val = (int)strtol(tmp, &endptr, 0);
+  if (endptr == tmp) return 1;
+  *i = val;
+  return (endptr - tmp == len ? 0 : 2);
+}
+
+/* Shared implementation of maf_read_block and maf_read_block_addseq.
+   Lines are parsed in place in the reader's buffer and sequence
+   characters are translated through a lookup table, so no memory is
+   allocated per line.  If add_seqs is TRUE, sequences not in
+   name_hash are added to mini_msa (or skipped, if skip_new_species
+   is also TRUE); otherwise they are an error.  If add_seqs is
+   MAF_DEFER_NEW_SEQS, neither name_hash nor the set of sequences is
+   modified; instead, MAF_NEW_SEQ is returned if a sequence would
+   have been added (used when parsing blocks concurrently). */
+static int maf_read_block_generic(MafReader *r, MSA *mini_msa, 
+                                  Hashtable *name_hash, int *start_idx, 
+                                  int *length, int do_toupper, int add_seqs,
+                                  int skip_new_species) {
+  int seqidx, more_blocks = 0, i, j, len, flens[7];
+  const char *line, *fields[7], *seq;
+  char *dest, *this_name;
   int *mark;
 
+  /* temporary storage for names and marks is released on return */
+  ar_push();
+  maf_build_xlate(r, mini_msa, do_toupper);
   mini_msa->length = -1;
-  mark = smalloc(mini_msa->nseqs*sizeof(int));
+  mark = ar_alloc(mini_msa->nseqs*sizeof(int));
   for (i = 0; i < mini_msa->nseqs; i++) mark[i] = 0;
-  while (str_readline(linebuffer, F) != EOF) {
-    if (str_starts_with_charstr(linebuffer, "#") ||
-        str_starts_with_charstr(linebuffer, "i ") ||
-        str_starts_with_charstr(linebuffer, "e ") ||
-        str_starts_with_charstr(linebuffer, "q ")) 
+  while (mafReader_next_line(r, &line, &len) != EOF) {
+    if (len > 0 && 
+        (line[0] == '#' || 
+         (len > 1 && line[1] == ' ' && 
+          (line[0] == 'i' || line[0] == 'e' || line[0] == 'q'))))
       continue;                 /* ignore i, e, and q lines for now */
-    else if (str_starts_with_charstr(linebuffer, "a")) {
+    else if (len > 0 && line[0] == 'a') {
       if (mini_msa->length == -1) continue;   /* assume first block (?) */
       more_blocks = 1;          /* want to distinguish a new block
                                    from an EOF */
       break;
     }
-    str_trim(linebuffer);
-    if (linebuffer->length == 0) continue;
-
-    /* if we get here, linebuffer should contain a sequence line */
-    str_split(linebuffer, NULL, l);    
-    if (lst_size(l) != 7 || !str_equals_charstr(lst_get_ptr(l, 0), "s")) 
-      die("ERROR: bad sequence line in MAF file --\n\t\"%s\"\n", linebuffer->chars);
-    str_cpy(this_name, lst_get_ptr(l, 1));
-    str_shortest_root(this_name, '.');
-    this_seq = lst_get_ptr(l, 6);
+    while (len > 0 && isspace((unsigned char)line[len-1])) len--;
+    if (len == 0) continue;
+
+    /* if we get here, line should contain a sequence line */
+    if (mafReader_split(line, len, fields, flens, 7) != 7 || 
+        flens[0] != 1 || fields[0][0] != 's') 
+      die("ERROR: bad sequence line in MAF file --\n\t\"%s\"\n", 
+          maf_line_str(line, len));
+    for (i = 0; i < flens[1] && fields[1][i] != '.'; i++);
+    this_name = ar_alloc(i + 1);
+    memcpy(this_name, fields[1], i);
+    this_name[i] = '\0';
+    seq = fields[6];
 
     /* if this is the reference sequence, also grab start_idx and
        length and check strand */
     if (mini_msa->length == -1 && 
-        ((start_idx != NULL && str_as_int(lst_get_ptr(l, 2), start_idx) != 0) ||
-        (length != NULL && str_as_int(lst_get_ptr(l, 3), length) != 0) ||
-        ((String*)lst_get_ptr(l, 4))->chars[0] != '+')) {
-      die("ERROR: bad integers or strand in MAF (strand must be + for reference sequence) --\n\t\"%s\"\n", linebuffer->chars);
-    }
+        ((start_idx != NULL && maf_field_as_int(fields[2], flens[2], start_idx) != 0) ||
+         (length != NULL && maf_field_as_int(fields[3], flens[3], length) != 0) ||
+         fields[4][0] != '+'))
+      die("ERROR: bad integers or strand in MAF (strand must be + for reference sequence) --\n\t\"%s\"\n", maf_line_str(line, len));
 
     /* ensure lengths of all seqs are consistent */
-    if (mini_msa->length == -1) 
-      mini_msa->length = this_seq->length;
-    else if (this_seq->length != mini_msa->length) {
-      die("ERROR: sequence lengths do not match in MAF block -- \n\tsee line \"%s\"\n", linebuffer->chars);
-    }
+    if (mini_msa->length == -1) mini_msa->length = flens[6];
+    else if (flens[6] != mini_msa->length) 
+      die("ERROR: sequence lengths do not match in MAF block -- \n\tsee line \"%s\"\n", maf_line_str(line, len));
 
     /* obtain index of seq */
-    seqidx = hsh_get_int(name_hash, this_name->chars);
-    if (seqidx == -2 || (seqidx == -1 && !skip_new_species)) {
-      seqidx = msa_add_seq(mini_msa, this_name->chars);
-      hsh_put_int(name_hash, this_name->chars, seqidx);
-      mark = srealloc(mark, mini_msa->nseqs*sizeof(int));
-    } else if (seqidx == -1) {
-      goto msa_read_block_addseq_free_loop;
+    seqidx = hsh_get_int(name_hash, this_name);
+    if (add_seqs && (seqidx == -2 || (seqidx == -1 && !skip_new_species))) {
+      int *old_mark = mark;
+      if (add_seqs == MAF_DEFER_NEW_SEQS) {
+        ar_pop();
+        return MAF_NEW_SEQ;
+      }
+      seqidx = msa_add_seq(mini_msa, this_name);
+      hsh_put_int(name_hash, this_name, seqidx);
+      mark = ar_alloc(mini_msa->nseqs*sizeof(int));
+      memcpy(mark, old_mark, seqidx*sizeof(int));
+      mark[seqidx] = 0;
+    } 
+    else if (seqidx == -1) {
+      if (add_seqs) continue;
+      die("ERROR: unexpected sequence name '%s' --\n\tsee line \"%s\"\n", 
+          this_name, maf_line_str(line, len));
     }
-    if (!(str_equals_charstr(this_name, mini_msa->names[seqidx])))
-      die("ERROR: maf_read_block_addseq: %s != %s\n",
-	  this_name->chars, mini_msa->names[seqidx]);
-
+    if (strcmp(this_name, mini_msa->names[seqidx]) != 0)
+      die("ERROR: %s: %s != %s\n", 
+          add_seqs ? "maf_read_block_addseq" : "maf_read_block",
+          this_name, mini_msa->names[seqidx]);
 
     /* enlarge allocated sequence lengths as necessary */
-    if (this_seq->length > mini_msa->alloc_len) {
-      mini_msa->alloc_len = this_seq->length;
+    if (flens[6] > mini_msa->alloc_len) {
+      mini_msa->alloc_len = flens[6];
       for (i = 0; i < mini_msa->nseqs; i++)
         mini_msa->seqs[i] = 
           srealloc(mini_msa->seqs[i], (mini_msa->alloc_len+1) * sizeof(char));
@@ -927,38 +1113,22 @@ int maf_read_block_addseq(FILE *F, MSA *mini_msa, Hashtable *name_hash,
           srealloc(mini_msa->categories, mini_msa->alloc_len * sizeof(int)); 
     }
 
-    for (i = 0; i < this_seq->length; i++) {
-      mini_msa->seqs[seqidx][i] = do_toupper ? (char)toupper(this_seq->chars[i]) : 
-        this_seq->chars[i];
-      if (mini_msa->seqs[seqidx][i] == '.' && mini_msa->inv_alphabet[(int)'.'] == -1) 
-        mini_msa->seqs[seqidx][i] = mini_msa->missing[0];
-      if (mini_msa->seqs[seqidx][i] != GAP_CHAR && 
-          !mini_msa->is_missing[(int)mini_msa->seqs[seqidx][i]] &&
-          mini_msa->inv_alphabet[(int)mini_msa->seqs[seqidx][i]] == -1 &&
-	  get_iupac_map()[(int)mini_msa->seqs[seqidx][i]] == NULL) {
-        if (isalpha(mini_msa->seqs[seqidx][i]))
-          mini_msa->seqs[seqidx][i] = 'N';
-        else 
-          die("ERROR: unrecognized character in sequence in MAF block ('%c')\n",
-              mini_msa->seqs[seqidx][i]);
-      }
-    }
-    fflush(stdout);
-    mini_msa->seqs[seqidx][this_seq->length] = '\0';
+    dest = mini_msa->seqs[seqidx];
+    for (i = 0; i < flens[6]; i++) 
+      if ((dest[i] = (char)r->xlate[(unsigned char)seq[i]]) == '\0')
+        die("ERROR: unrecognized character in sequence in MAF block ('%c')\n",
+            do_toupper ? toupper(seq[i]) : seq[i]);
+    dest[flens[6]] = '\0';
     mark[seqidx] = 1;
-  msa_read_block_addseq_free_loop:
-    for (i = 0; i < lst_size(l); i++) str_free(lst_get_ptr(l, i));
   }
 
-  lst_free(l);
-  str_free(linebuffer);
-  str_free(this_name);
-
   if (mini_msa->length == -1 && !more_blocks) {
-    sfree(mark);
-    return EOF;}                 /* in this case, an EOF must have been
+    ar_pop();
+    return EOF;                 /* in this case, an EOF must have been
                                    encountered before any alignment
                                    blocks were found */
+  }
+
   /* pad unmarked seqs with missing-data characters */
   for (i = 0; i < mini_msa->nseqs; i++) {
     if (!mark[i]) {
@@ -967,13 +1137,10 @@ int maf_read_block_addseq(FILE *F, MSA *mini_msa, Hashtable *name_hash,
       mini_msa->seqs[i][mini_msa->length] = '\0';
     }
   }
-  sfree(mark);
+  ar_pop();
   return 0;
 }
 
-
-
-
 /* Read a block from an MAF file and store it as a "mini-msa" using
    the provided object.  Allocates memory for sequences if they are
    NULL (as with first block).  Reads to next "a" line or EOF.
@@ -981,114 +1148,226 @@ int maf_read_block_addseq(FILE *F, MSA *mini_msa, Hashtable *name_hash,
    coord and length of reference sequence if non-NULL
    pointers are provided.  Uses provided hash to map sequence names to
    sequence indices (prefix of name wrt '.' character); sequences not
-   present in a block will be represented by missing-data characters. */
-int maf_read_block(FILE *F, MSA *mini_msa, Hashtable *name_hash,
+   present in a block will be represented by missing-data
+   characters.  Sequences not already in the hash are added to
+   mini_msa unless skip_new_species is TRUE. */
+int maf_read_block_addseq(MafReader *r, MSA *mini_msa, Hashtable *name_hash, 
+			  int *start_idx, int *length, int do_toupper,
+			  int skip_new_species) {
+  return maf_read_block_generic(r, mini_msa, name_hash, start_idx, length,
+                                do_toupper, TRUE, skip_new_species);
+}
+
+/* As above, but sequences not already in the hash are an error */
+int maf_read_block(MafReader *r, MSA *mini_msa, Hashtable *name_hash,
                    int *start_idx, int *length, int do_toupper) {
+  return maf_read_block_generic(r, mini_msa, name_hash, start_idx, length,
+                                do_toupper, FALSE, FALSE);
+}
 
-  int seqidx, more_blocks = 0, i, j;
-  String *this_seq, *linebuffer = str_new(STR_VERY_LONG_LEN);
-  List *l = lst_new_ptr(7);
-  String *this_name = str_new(STR_SHORT_LEN);
-  int mark[mini_msa->nseqs];
+/* Functions for reading blocks in parallel (see MafBatch above) */
+
+static MafBatch *maf_batch_new(MafReader *reader, MSA *mini_msa, 
+                               Hashtable *name_hash, int do_toupper,
+                               int skip_new_species, MSA *msa, 
+                               TupleHash *tuple_hash, List *cats_to_do) {
+  MafBatch *b = smalloc(sizeof(MafBatch));
+  int i;
+  b->reader = reader;
+  b->mini_msa = mini_msa;
+  b->name_hash = name_hash;
+  b->do_toupper = do_toupper;
+  b->skip_new_species = skip_new_species;
+  b->nblocks = b->next = b->nparsed = b->nfolds = 0;
+  b->copy = NULL;
+  b->copy_used = b->copy_alloc = 0;
+  b->msa = msa;
+  b->tuple_hash = tuple_hash;
+  b->cats_to_do = cats_to_do;
+  for (i = 0; i < MAF_BATCH_BLOCKS; i++) {
+    b->slot[i] = NULL;
+    b->sblock[i] = NULL;
+  }
+  return b;
+}
 
-  mini_msa->length = -1;
-  for (i = 0; i < mini_msa->nseqs; i++) mark[i] = 0;
-  while (str_readline(linebuffer, F) != EOF) {
-    if (str_starts_with_charstr(linebuffer, "#") ||
-        str_starts_with_charstr(linebuffer, "i ") ||
-        str_starts_with_charstr(linebuffer, "e ") ||
-        str_starts_with_charstr(linebuffer, "q ")) 
-      continue;                 /* ignore i, e, and q lines for now */
-    else if (str_starts_with_charstr(linebuffer, "a")) {
-      if (mini_msa->length == -1) continue;   /* assume first block (?) */
-      more_blocks = 1;          /* want to distinguish a new block
-                                   from an EOF */
-      break;
+/* locate next batch of blocks */
+static void maf_batch_fill(MafBatch *b) {
+  const char *text;
+  int64_t len;
+  b->nblocks = b->next = b->nparsed = 0;
+  b->copy_used = 0;
+  while (b->nblocks < MAF_BATCH_BLOCKS && 
+         mafReader_next_block(b->reader, &text, &len) != EOF) {
+    if (!b->reader->mapped) {   /* text is overwritten by next read */
+      if (b->copy_used + len > b->copy_alloc) {
+        b->copy_alloc = max(2 * b->copy_alloc, b->copy_used + len);
+        b->copy = srealloc(b->copy, b->copy_alloc);
+      }
+      memcpy(b->copy + b->copy_used, text, len);
+      b->copy_off[b->nblocks] = b->copy_used;
+      b->copy_used += len;
     }
-    str_trim(linebuffer);
-    if (linebuffer->length == 0) continue;
+    b->text[b->nblocks] = text;
+    b->textlen[b->nblocks] = len;
+    b->nblocks++;
+  }
+  if (!b->reader->mapped) {     /* copy buffer is now stable */
+    int i;
+    for (i = 0; i < b->nblocks; i++) 
+      b->text[i] = b->copy + b->copy_off[i];
+  }
+}
 
-    /* if we get here, linebuffer should contain a sequence line */
-    str_split(linebuffer, NULL, l);    
-    if (lst_size(l) != 7 || !str_equals_charstr(lst_get_ptr(l, 0), "s")) {
-      die("ERROR: bad sequence line in MAF file --\n\t\"%s\"\n", linebuffer->chars);
+static void maf_batch_parse_task(void *data, int task, int thread) {
+  MafBatch *b = data;
+  int i = b->nparsed + task;
+  MafReader *r = mafReader_new_buffer(b->text[i], b->textlen[i]);
+  b->status[i] = maf_read_block_generic(r, b->slot[i], b->name_hash,
+                                        &b->start_idx[i], &b->length[i],
+                                        b->do_toupper, MAF_DEFER_NEW_SEQS, 
+                                        b->skip_new_species);
+  mafReader_free(r);
+}
+
+/* parse remaining blocks of batch concurrently, each into its own
+   slot, sharing the sequence names of mini_msa */
+static void maf_batch_parse(MafBatch *b) {
+  MSA *mini = b->mini_msa;
+  int i;
+  for (i = b->nparsed; i < b->nblocks; i++) {
+    if (b->slot[i] != NULL && b->slot[i]->nseqs != mini->nseqs) {
+      b->slot[i]->names = NULL;
+      msa_free(b->slot[i]);
+      b->slot[i] = NULL;
+    }
+    if (b->slot[i] == NULL) {
+      int j;
+      b->slot[i] = msa_new(NULL, mini->names, mini->nseqs, -1, 
+                           mini->alphabet);
+      b->slot[i]->ncats = mini->ncats;
+      b->slot[i]->seqs = smalloc(mini->nseqs * sizeof(char*));
+      for (j = 0; j < mini->nseqs; j++) b->slot[i]->seqs[j] = NULL;
     }
-    str_cpy(this_name, lst_get_ptr(l, 1));
-    str_shortest_root(this_name, '.');
-    this_seq = lst_get_ptr(l, 6);
+    b->slot[i]->names = mini->names; /* may have been reallocated */
+  }
+  thr_parallel_for(b->nblocks - b->nparsed, maf_batch_parse_task, b);
+  b->nparsed = b->nblocks;
+}
 
-    /* if this is the reference sequence, also grab start_idx and
-       length and check strand */
-    if (mini_msa->length == -1 && 
-        ((start_idx != NULL && str_as_int(lst_get_ptr(l, 2), start_idx) != 0) ||
-        (length != NULL && str_as_int(lst_get_ptr(l, 3), length) != 0) ||
-        ((String*)lst_get_ptr(l, 4))->chars[0] != '+'))
-      die("ERROR: bad integers or strand in MAF (strand must be + for reference sequence) --\n\t\"%s\"\n", linebuffer->chars);
+static void maf_batch_collect_task(void *data, int task, int thread) {
+  MafBatch *b = data;
+  ss_block_collect(b->sblock[task], b->msa, b->fold_msa[task], 
+                   b->cats_to_do);
+}
 
-    /* ensure lengths of all seqs are consistent */
-    if (mini_msa->length == -1) mini_msa->length = this_seq->length;
-    else if (this_seq->length != mini_msa->length) 
-      die("ERROR: sequence lengths do not match in MAF block -- \n\tsee line \"%s\"\n", linebuffer->chars);
+/* collect tuples of queued blocks concurrently, then merge them into
+   the destination alignment in order */
+static void maf_batch_flush(MafBatch *b) {
+  int i;
+  if (b->nfolds == 0) return;
+  for (i = 0; i < b->nfolds; i++)
+    if (b->sblock[i] == NULL)
+      b->sblock[i] = ss_block_new(b->msa, b->msa->ss->tuple_idx != NULL);
+  thr_parallel_for(b->nfolds, maf_batch_collect_task, b);
+  for (i = 0; i < b->nfolds; i++)
+    ss_block_merge(b->msa, b->sblock[i], b->tuple_hash, b->fold_offset[i]);
+  b->nfolds = 0;
+}
 
-    /* enlarge allocated sequence lengths as necessary */
-    if (this_seq->length > mini_msa->alloc_len) {
-      mini_msa->alloc_len = this_seq->length;
-      for (i = 0; i < mini_msa->nseqs; i++)
-        mini_msa->seqs[i] = 
-          srealloc(mini_msa->seqs[i], (mini_msa->alloc_len+1) * sizeof(char));
-      if (mini_msa->ncats >= 0) 
-        mini_msa->categories = 
-          srealloc(mini_msa->categories, mini_msa->alloc_len * sizeof(int)); 
+/* Return next block of MAF as an alignment, or NULL if none remain.
+   Blocks are parsed a batch at a time.  A block that introduces a
+   new sequence is instead parsed serially into mini_msa (which is
+   returned in that case), after which the remaining blocks of the
+   batch are parsed again with the enlarged set of sequences.  The
+   alignment returned remains valid until the next call. */
+static MSA *maf_batch_next(MafBatch *b, int *start_idx, int *length) {
+  int i;
+  while (1) {
+    if (b->next == b->nblocks) {
+      maf_batch_flush(b);       /* slots are about to be reused */
+      maf_batch_fill(b);
+      if (b->nblocks == 0) return NULL;
     }
-
-    /* obtain index of seq */
-    seqidx = hsh_get_int(name_hash, this_name->chars);
-    if (seqidx == -1) 
-      die("ERROR: unexpected sequence name '%s' --\n\tsee line \"%s\"\n", this_name->chars, linebuffer->chars);
-    if (!(str_equals_charstr(this_name, mini_msa->names[seqidx])))
-      die("ERROR: maf_read_block: %s != %s\n", this_name->chars, mini_msa->names[seqidx]);
-
-    for (i = 0; i < this_seq->length; i++) {
-      mini_msa->seqs[seqidx][i] = do_toupper ? (char)toupper(this_seq->chars[i]) : 
-        this_seq->chars[i];
-      if (mini_msa->seqs[seqidx][i] == '.' && mini_msa->inv_alphabet[(int)'.'] == -1) 
-        mini_msa->seqs[seqidx][i] = mini_msa->missing[0];
-      if (mini_msa->seqs[seqidx][i] != GAP_CHAR && 
-          !mini_msa->is_missing[(int)mini_msa->seqs[seqidx][i]] &&
-          mini_msa->inv_alphabet[(int)mini_msa->seqs[seqidx][i]] == -1 &&
-	  get_iupac_map()[(int)mini_msa->seqs[seqidx][i]] == NULL) {
-        if (isalpha(mini_msa->seqs[seqidx][i]))
-          mini_msa->seqs[seqidx][i] = 'N';
-        else 
-          die("ERROR: unrecognized character in sequence in MAF block ('%c')\n",
-              mini_msa->seqs[seqidx][i]);
-      }
+    if (b->next == b->nparsed) maf_batch_parse(b);
+    i = b->next++;
+    if (b->status[i] == EOF) continue;
+    if (b->status[i] == MAF_NEW_SEQ) {
+      MafReader *r = mafReader_new_buffer(b->text[i], b->textlen[i]);
+      maf_batch_flush(b);       /* queued blocks have old sequences */
+      if (maf_read_block_addseq(r, b->mini_msa, b->name_hash, start_idx, 
+                                length, b->do_toupper, 
+                                b->skip_new_species) == EOF)
+        die("ERROR: maf_batch_next: block unexpectedly empty.\n");
+      mafReader_free(r);
+      b->nparsed = b->next;
+      return b->mini_msa;
     }
-    mini_msa->seqs[seqidx][this_seq->length] = '\0';
-    mark[seqidx] = 1;
-
-    for (i = 0; i < lst_size(l); i++) str_free(lst_get_ptr(l, i));
+    *start_idx = b->start_idx[i];
+    *length = b->length[i];
+    return b->slot[i];
   }
+}
 
-  lst_free(l);
-  str_free(linebuffer);
-
-  if (mini_msa->length == -1 && !more_blocks) 
-    return EOF;                 /* in this case, an EOF must have been
-                                   encountered before any alignment
-                                   blocks were found */
-
+/* queue block (as returned by maf_batch_next) to be added to the
+   sufficient statistics of the destination alignment */
+static void maf_batch_fold(MafBatch *b, MSA *block, int idx_offset) {
+  if (block == b->mini_msa) {   /* not in a slot; will be overwritten */
+    if (b->msa->ss->tuple_idx != NULL)
+      ss_from_msas(b->msa, b->msa->ss->tuple_size, TRUE, b->cats_to_do, 
+                   block, b->tuple_hash, idx_offset, 0);
+    else
+      ss_add_block(b->msa, block, b->tuple_hash, b->cats_to_do);
+    return;
+  }
+  b->fold_msa[b->nfolds] = block;
+  b->fold_offset[b->nfolds] = idx_offset;
+  b->nfolds++;
+}
 
-  /* pad unmarked seqs with missing-data characters */
-  for (i = 0; i < mini_msa->nseqs; i++) {
-    if (!mark[i]) {
-      for (j = 0; j < mini_msa->length; j++) 
-        mini_msa->seqs[i][j] = mini_msa->missing[0];
-      mini_msa->seqs[i][mini_msa->length] = '\0';
+static void maf_batch_free(MafBatch *b) {
+  int i;
+  maf_batch_flush(b);
+  for (i = 0; i < MAF_BATCH_BLOCKS; i++) {
+    if (b->slot[i] != NULL) {
+      b->slot[i]->names = NULL;
+      msa_free(b->slot[i]);
     }
+    if (b->sblock[i] != NULL) ss_block_free(b->sblock[i]);
   }
+  if (b->copy != NULL) sfree(b->copy);
+  sfree(b);
+}
 
-  return 0;
+/* Trim a block, as read by maf_read_block, to the columns aligned to
+   reference positions in [region_start, region_end) (region_end < 0
+   for no limit), and adjust start_idx and length accordingly.  Gap
+   columns in the reference are kept between retained positions, and
+   at either end of the block if that end is not trimmed.  The block
+   must overlap the region. */
+static void maf_block_trim_region(MSA *block, int *start_idx, int *length,
+                                  int region_start, int region_end) {
+  int i, j, pos = *start_idx, first = -1, last = -1, end = *start_idx + *length;
+  for (i = 0; i < block->length; i++) {
+    if (block->seqs[0][i] == GAP_CHAR) continue;
+    if (pos >= region_start && (region_end < 0 || pos < region_end)) {
+      if (first == -1) first = i;
+      last = i + 1;
+    }
+    pos++;
+  }
+  if (first == -1) 
+    die("ERROR: maf_block_trim_region: block does not overlap region.\n");
+  if (*start_idx >= region_start) first = 0;
+  if (region_end < 0 || end <= region_end) last = block->length;
+  for (j = 0; j < block->nseqs; j++) {
+    memmove(block->seqs[j], block->seqs[j] + first, last - first);
+    block->seqs[j][last - first] = '\0';
+  }
+  block->length = last - first;
+  if (*start_idx < region_start) *start_idx = region_start;
+  if (region_end >= 0 && end > region_end) end = region_end;
+  *length = end - *start_idx;
 }
 
 /* these are used in the function below */
@@ -11,9 +11,11 @@
 #include <phast/sufficient_stats.h>
 #include <phast/msa.h>
 #include <phast/maf_block.h>
+#include <phast/maf_reader.h>
 #include <phast/hashtable.h>
 #include <ctype.h>
 #include <assert.h>
+#include <string.h>
 
 MafBlock *mafBlock_new() {
   MafBlock *block = smalloc(sizeof(MafBlock));
@@ -87,63 +89,80 @@ MafBlock* mafBlock_copy(MafBlock *src) {
   return block;
 }
 
+/* New String holding a field of a MAF line */
+static String *mafBlock_field_str(const char *field, int len) {
+  String *s = str_new(len);
+  str_nappend_charstr(s, field, len);
+  return s;
+}
+
+/* NULL-terminated copy of a field of a MAF line, for error messages */
+static char *mafBlock_field_charstr(const char *field, int len) {
+  char *s = smalloc((len+1) * sizeof(char));
+  memcpy(s, field, len);
+  s[len] = '\0';
+  return s;
+}
+
+/* Numeric value of a field of a MAF line (as with atol) */
+static long mafBlock_field_long(const char *field, int len) {
+  char tmp[STR_SHORT_LEN];
+  if (len >= STR_SHORT_LEN) len = STR_SHORT_LEN - 1;
+  memcpy(tmp, field, len);
+  tmp[len] = '\0';
+  return atol(tmp);
+}
+
 //parses a line from maf block starting with 'e' or 's' and returns a new MafSubBlock 
-//object. 
-MafSubBlock *mafBlock_get_subBlock(String *line) {
-  int i;
-  List *l = lst_new_ptr(7);
-  String *str;
+//object.  The line need not be NULL-terminated.
+MafSubBlock *mafBlock_get_subBlock(const char *line, int len) {
+  const char *f[7];
+  int flen[7];
   MafSubBlock *sub;
 
-  if (7 != str_split(line, NULL, l)) 
+  if (7 != mafReader_split(line, len, f, flen, 7)) 
     die("Error: mafBlock_get_subBlock expected seven fields in MAF line starting "
-	"with %s\n",
-	((String*)lst_get_ptr(l, 0))->chars);
+	"with %s\n", mafBlock_field_charstr(f[0], flen[0]));
   
   sub = mafBlock_new_subBlock();
   
   //field 0: should be 's' or 'e'
-  str = (String*)lst_get_ptr(l, 0);
-  if (str_compare_charstr(str, "s")==0)
+  if (flen[0] == 1 && f[0][0] == 's')
     sub->lineType[0]='s';
-  else if (str_compare_charstr(str, "e")==0)
+  else if (flen[0] == 1 && f[0][0] == 'e')
     sub->lineType[0]='e';
   else die("ERROR: mafBlock_get_subBlock expected first field 's' or 'e' (got %s)\n",
-	   str->chars);
+	   mafBlock_field_charstr(f[0], flen[0]));
 
   //field 1: should be src.  Also set specName
-  sub->src = (String*)lst_get_ptr(l, 1);
+  sub->src = mafBlock_field_str(f[1], flen[1]);
   sub->specName = str_new_charstr(sub->src->chars);
   str_shortest_root(sub->specName, '.');
 
   //field 2: should be start
-  sub->start = atol(((String*)lst_get_ptr(l, 2))->chars);
+  sub->start = mafBlock_field_long(f[2], flen[2]);
   
   //field 3: should be length
-  sub->size = atoi(((String*)lst_get_ptr(l, 3))->chars);
+  sub->size = (int)mafBlock_field_long(f[3], flen[3]);
 
   //field 4: should be strand
-  str = (String*)lst_get_ptr(l, 4);
-  if (str_compare_charstr(str, "+")==0)
+  if (flen[4] == 1 && f[4][0] == '+')
     sub->strand = '+';
-  else if (str_compare_charstr(str, "-")==0)
+  else if (flen[4] == 1 && f[4][0] == '-')
     sub->strand = '-';
-  else die("ERROR: got strand %s\n", str->chars);
+  else die("ERROR: got strand %s\n", mafBlock_field_charstr(f[4], flen[4]));
   
   //field 5: should be srcSize
-  sub->srcSize = atol(((String*)lst_get_ptr(l, 5))->chars);
+  sub->srcSize = mafBlock_field_long(f[5], flen[5]);
 
   //field 6: sequence if sLine, eStatus if eLine.
-  str = (String*)lst_get_ptr(l, 6);
   if (sub->lineType[0]=='s')
-    sub->seq = str;
+    sub->seq = mafBlock_field_str(f[6], flen[6]);
   else {
-    if (sub->lineType[0] != 'e')
-      die("ERROR mafBlock_get_subBlock: bad lineType (expected 'e', got %c)\n",
-	  sub->lineType[0]);
-    if (str->length != 1)
-      die("ERROR: e-Line with status %s in MAF block\n", str->chars);
-    sub->eStatus = str->chars[0];
+    if (flen[6] != 1)
+      die("ERROR: e-Line with status %s in MAF block\n", 
+          mafBlock_field_charstr(f[6], flen[6]));
+    sub->eStatus = f[6][0];
     //note: don't know what status 'T' means (it's not in MAF documentation), but
     //it is in the 44-way MAFs
     if (sub->eStatus != 'C' && sub->eStatus != 'I' && sub->eStatus != 'M' &&
@@ -151,43 +170,38 @@ MafSubBlock *mafBlock_get_subBlock(String *line) {
       die("ERROR: e-Line has illegal status %c\n", sub->eStatus);
   }
   sub->numLine = 1;
-  //free all strings except field 1 and field 6 when lineType=='s'
-  for (i=0; i<7; i++)
-    if (i!=1 && (i!=6 || sub->lineType[0]!='s')) 
-      str_free((String*)lst_get_ptr(l, i));
-  lst_free(l);
   return sub;
 }
 
-void mafBlock_add_iLine(String *line, MafSubBlock *sub) {
-  List *l = lst_new_ptr(6);
-  String *str;
-  int i;
+void mafBlock_add_iLine(const char *line, int len, MafSubBlock *sub) {
+  const char *f[6];
+  int flen[6], i, n;
 
   if (sub->numLine<1 || sub->lineType[0]!='s') 
     die("ERROR: got i-Line without preceding s-Line in MAF block\n");
   
-  if (6 != str_split(line, NULL, l))
+  if (6 != (n = mafReader_split(line, len, f, flen, 6)))
     die("ERROR: expected six fields in MAF line starting with 'i' (got %i)\n",
-	lst_size(l));
+	n);
 
   //field[0] should be 'i'
-  if (!(str_compare_charstr((String*)lst_get_ptr(l, 0), "i")==0))
+  if (flen[0] != 1 || f[0][0] != 'i')
     die("ERROR: mafBlock_add_iLine: field[0] should be 'i', got %s\n",
-	((String*)lst_get_ptr(l, 0))->chars);
+	mafBlock_field_charstr(f[0], flen[0]));
 
   //field[1] should be src, and should match src already set in sub
-  if (str_compare((String*)lst_get_ptr(l, 1), sub->src) != 0)
+  if (flen[1] != sub->src->length || 
+      memcmp(f[1], sub->src->chars, flen[1]) != 0)
     die("iLine sourceName does not match preceding s-Line (%s, %s)\n", 
-	((String*)lst_get_ptr(l, 1))->chars, sub->src->chars);
+	mafBlock_field_charstr(f[1], flen[1]), sub->src->chars);
 
   for (i=0; i<2; i++) {
 
     //field[2,4] should be leftStatus, rightStauts
-    str = (String*)lst_get_ptr(l, i*2+2);
-    if (str->length != 1) die("ERROR: i-Line got illegal %sStatus = %s\n",
-			      i==0 ? "left": "right", str->chars);
-    sub->iStatus[i] = str->chars[0];
+    if (flen[i*2+2] != 1) die("ERROR: i-Line got illegal %sStatus = %s\n",
+			      i==0 ? "left": "right", 
+                              mafBlock_field_charstr(f[i*2+2], flen[i*2+2]));
+    sub->iStatus[i] = f[i*2+2][0];
     if (sub->iStatus[i] != 'C' && sub->iStatus[i] != 'I' &&
 	sub->iStatus[i] != 'N' && sub->iStatus[i] != 'n' &&
 	sub->iStatus[i] != 'M' && sub->iStatus[i] != 'T')
@@ -195,12 +209,9 @@ void mafBlock_add_iLine(String *line, MafSubBlock *sub) {
 	  i==0 ? "left" : "right", sub->iStatus[i]);
 
     //field 3,5 should be leftCount, rightCount
-    str = (String*)lst_get_ptr(l, i*2+3);
-    sub->iCount[i] = atoi(str->chars);
+    sub->iCount[i] = (int)mafBlock_field_long(f[i*2+3], flen[i*2+3]);
   }
   
-  for (i=0; i<6; i++) str_free((String*)lst_get_ptr(l, i));
-  lst_free(l);
   if (sub->numLine >= 4) die("Error: bad MAF file");
   sub->lineType[sub->numLine++] = 'i';
 
@@ -208,34 +219,33 @@ void mafBlock_add_iLine(String *line, MafSubBlock *sub) {
 }
 
 
-void mafBlock_add_qLine(String *line, MafSubBlock *sub) {
-  List *l = lst_new_ptr(3);
-  String *str;
-  int i;
+void mafBlock_add_qLine(const char *line, int len, MafSubBlock *sub) {
+  const char *f[3];
+  int flen[3], i, n;
 
   if (sub->numLine<1 || sub->lineType[0]!='s') 
     die("ERROR: got q-Line without preceding s-Line in MAF block\n");
 
-  if (3 != str_split(line, NULL, l))
-    die("ERROR: expected three fields in q-Line of maf file, got %i\n", lst_size(l));
+  if (3 != (n = mafReader_split(line, len, f, flen, 3)))
+    die("ERROR: expected three fields in q-Line of maf file, got %i\n", n);
   
   //field[0] should be 'q'
-  if (!(str_compare_charstr((String*)lst_get_ptr(l, 0), "q")==0))
+  if (flen[0] != 1 || f[0][0] != 'q')
     die("ERROR mafBlock_add_qLine expected 'q' got %s\n",
-	((String*)lst_get_ptr(l, 0))->chars);
+	mafBlock_field_charstr(f[0], flen[0]));
   
   //field[1] should be src, and should match src already set in sub
-  if (str_compare((String*)lst_get_ptr(l, 1), sub->src) != 0)
+  if (flen[1] != sub->src->length || 
+      memcmp(f[1], sub->src->chars, flen[1]) != 0)
     die("iLine sourceName does not match preceding s-Line (%s, %s)\n", 
-	((String*)lst_get_ptr(l, 1))->chars, sub->src->chars);
+	mafBlock_field_charstr(f[1], flen[1]), sub->src->chars);
 
   //field[2] should be quality
   if (sub->seq == NULL)
     die("ERROR mafBlock_add_qLine: sub->seq is NULL\n");
-  str = (String*)lst_get_ptr(l, 2);
-  if (sub->seq->length != str->length) 
+  if (sub->seq->length != flen[2]) 
     die("ERROR: length of q-line does not match sequence length\n");
-  sub->quality = str;
+  sub->quality = mafBlock_field_str(f[2], flen[2]);
   for (i=0; i<sub->quality->length; i++) {
     if (sub->seq->chars[i] == '-') {
       if (sub->quality->chars[i] != '-') 
@@ -248,23 +258,21 @@ void mafBlock_add_qLine(String *line, MafSubBlock *sub) {
     }
   }
    
-  for (i=0; i<2; i++) str_free((String*)lst_get_ptr(l, i));
-  lst_free(l);
   if (sub->numLine >= 4) die("Error: bad MAF file");
   sub->lineType[sub->numLine++] = 'q';
 
 }
 
 
-//read next block in mfile and return MafBlock object or NULL if EOF.
+//read next block from reader and return MafBlock object or NULL if EOF.
 //specHash and numSpec are not used, but if specHash is not NULL,
 //it should be initialized, and any new species encountered will be added
 //to the hash, with numSpec increased accordingly.  If specHash is NULL,
 //numSpec will not be used or modified.
-MafBlock *mafBlock_read_next(FILE *mfile, Hashtable *specHash, int *numSpec) {
-  int i;
+MafBlock *mafBlock_read_next(MafReader *reader, Hashtable *specHash, int *numSpec) {
+  int i, len;
   char firstchar;
-  String *currLine = str_new(1000);
+  const char *line;
   MafBlock *block=NULL;
   MafSubBlock *sub=NULL;
 
@@ -272,23 +280,23 @@ MafBlock *mafBlock_read_next(FILE *mfile, Hashtable *specHash, int *numSpec) {
     die("ERROR: mafBlock_read_next: numSpec cannot be NULL "
 	"if specHash is not NULL\n");
 
-  while (EOF != str_readline(currLine, mfile)) {
-    str_trim(currLine);
-    if (currLine->length==0) {  //if blank line, it is either first or last line
+  while (EOF != mafReader_next_line(reader, &line, &len)) {
+    while (len > 0 && isspace((unsigned char)line[len-1])) len--;
+    if (len==0) {  //if blank line, it is either first or last line
       if (block == NULL) continue;
       else break;
     }
-    firstchar = currLine->chars[0];
+    firstchar = line[0];
     if (firstchar == '#') continue;  //ignore comments
     if (block == NULL) {
       if (firstchar != 'a') 
 	die("ERROR: first line of MAF block should start with 'a'\n");
       block = mafBlock_new();
-      block->aLine = str_new_charstr(currLine->chars);
+      block->aLine = mafBlock_field_str(line, len);
     }
     //if 's' or 'e', then this is first line of data for this species
     else if (firstchar == 's' || firstchar == 'e') {
-      sub = mafBlock_get_subBlock(currLine);
+      sub = mafBlock_get_subBlock(line, len);
       if (hsh_get_int(block->specMap, sub->src->chars) != -1) 
 	die("ERROR: mafBlock has two alignments with same srcName (%s)\n", 
 	    sub->src->chars);
@@ -304,13 +312,12 @@ MafBlock *mafBlock_read_next(FILE *mfile, Hashtable *specHash, int *numSpec) {
     }
     else {
       if (firstchar == 'i')
-	mafBlock_add_iLine(currLine, sub);
+	mafBlock_add_iLine(line, len, sub);
       else if (firstchar == 'q')
-	mafBlock_add_qLine(currLine, sub);
+	mafBlock_add_qLine(line, len, sub);
       else die("ERROR: found line in MAF block starting with '%c'\n", firstchar);
     }
   }
-  str_free(currLine);
   if (block == NULL) return NULL;
 
   //set seqlen and make sure all seq arrays agree
@@ -0,0 +1,285 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Index of MAF blocks by reference-sequence coordinates.  See
+   maf_index.h */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <phast/misc.h>
+#include <phast/maf_index.h>
+#include <phast/compressed_io.h>
+
+static MafIndex *mafIndex_new(int alloc) {
+  MafIndex *idx = smalloc(sizeof(MafIndex));
+  idx->refseq = NULL;
+  idx->maf_size = 0;
+  idx->bgzf_size = -1;
+  idx->nblocks = 0;
+  idx->start = smalloc(alloc * sizeof(int64_t));
+  idx->end = smalloc(alloc * sizeof(int64_t));
+  idx->offset = smalloc(alloc * sizeof(int64_t));
+  idx->voffset = NULL;
+  idx->max_end = NULL;
+  return idx;
+}
+
+/* add a block, enlarging arrays as necessary */
+static void mafIndex_add(MafIndex *idx, int *alloc, int64_t start,
+                         int64_t end, int64_t offset, int64_t voffset) {
+  if (idx->nblocks == *alloc) {
+    *alloc *= 2;
+    idx->start = srealloc(idx->start, *alloc * sizeof(int64_t));
+    idx->end = srealloc(idx->end, *alloc * sizeof(int64_t));
+    idx->offset = srealloc(idx->offset, *alloc * sizeof(int64_t));
+    if (idx->voffset != NULL)
+      idx->voffset = srealloc(idx->voffset, *alloc * sizeof(int64_t));
+  }
+  if (idx->nblocks > 0 && start < idx->start[idx->nblocks-1])
+    die("ERROR: MAF must be sorted with respect to reference sequence to be indexed (block at offset %lld)\n", (long long)offset);
+  idx->start[idx->nblocks] = start;
+  idx->end[idx->nblocks] = end;
+  idx->offset[idx->nblocks] = offset;
+  if (idx->voffset != NULL) idx->voffset[idx->nblocks] = voffset;
+  idx->nblocks++;
+}
+
+/* fill in max_end once all blocks have been added */
+static void mafIndex_finish(MafIndex *idx) {
+  int i;
+  idx->max_end = smalloc(max(idx->nblocks, 1) * sizeof(int64_t));
+  for (i = 0; i < idx->nblocks; i++)
+    idx->max_end[i] = (i == 0 || idx->end[i] > idx->max_end[i-1] ?
+                       idx->end[i] : idx->max_end[i-1]);
+}
+
+/* numeric value of a field of a MAF line */
+static int64_t mafIndex_field_int64(const char *field, int len) {
+  char tmp[STR_SHORT_LEN];
+  if (len >= STR_SHORT_LEN) len = STR_SHORT_LEN - 1;
+  memcpy(tmp, field, len);
+  tmp[len] = '\0';
+  return strtoll(tmp, NULL, 10);
+}
+
+MafIndex *mafIndex_build(FILE *mfile) {
+  MafReader *r = mafReader_new(mfile);
+  int alloc = 10000, len, need_ref = FALSE, flen[7];
+  int64_t line_offset, block_offset = 0, start;
+  const char *line, *f[7];
+  MafIndex *idx = mafIndex_new(alloc);
+
+  while (1) {
+    line_offset = mafReader_tell(r);
+    if (mafReader_next_line(r, &line, &len) == EOF) break;
+    if (len > 0 && line[0] == 'a') {
+      block_offset = line_offset;
+      need_ref = TRUE;
+      continue;
+    }
+    /* reference sequence is first sequence of each block */
+    if (!need_ref || len == 0 || line[0] != 's') continue;
+    need_ref = FALSE;
+    if (mafReader_split(line, len, f, flen, 7) != 7)
+      die("ERROR: bad sequence line in MAF file (block at offset %lld)\n",
+          (long long)block_offset);
+    if (idx->refseq == NULL) {
+      idx->refseq = str_new(flen[1]);
+      str_nappend_charstr(idx->refseq, f[1], flen[1]);
+    }
+    else if (flen[1] != idx->refseq->length ||
+             memcmp(f[1], idx->refseq->chars, flen[1]) != 0)
+      die("ERROR: reference sequence not consistent in MAF (expected %s in block at offset %lld); cannot index\n",
+          idx->refseq->chars, (long long)block_offset);
+    start = mafIndex_field_int64(f[2], flen[2]);
+    mafIndex_add(idx, &alloc, start, start + mafIndex_field_int64(f[3], flen[3]),
+                 block_offset, -1);
+  }
+  idx->maf_size = mafReader_tell(r);
+  mafReader_free(r);
+  if (idx->refseq == NULL) idx->refseq = str_new_charstr("");
+  mafIndex_finish(idx);
+  return idx;
+}
+
+int mafIndex_add_bgzf(MafIndex *idx, const char *maf_fname) {
+  int64_t *coffset, *upos;
+  int n = cio_bgzf_blocks(maf_fname, &coffset, &upos), i, k = 0, ok = TRUE;
+  struct stat st;
+
+  if (n < 0) return FALSE;
+  if (stat(maf_fname, &st) != 0) ok = FALSE;
+  idx->voffset = smalloc(max(idx->nblocks, 1) * sizeof(int64_t));
+  for (i = 0; ok && i < idx->nblocks; i++) {
+    /* blocks are in file order, so one pass suffices */
+    while (k + 1 < n && upos[k+1] <= idx->offset[i]) k++;
+    if (k >= n || idx->offset[i] - upos[k] > 0xffff) ok = FALSE;
+    else idx->voffset[i] = (coffset[k] << 16) | (idx->offset[i] - upos[k]);
+  }
+  if (n > 0) {
+    sfree(coffset);
+    sfree(upos);
+  }
+  if (!ok) {
+    sfree(idx->voffset);
+    idx->voffset = NULL;
+    return FALSE;
+  }
+  idx->bgzf_size = st.st_size;
+  return TRUE;
+}
+
+void mafIndex_write(FILE *F, MafIndex *idx) {
+  int i;
+  fprintf(F, "##maf-index version=%d\n", MAF_INDEX_VERSION);
+  fprintf(F, "##refseq=%s maf_size=%lld", idx->refseq->chars,
+          (long long)idx->maf_size);
+  if (idx->voffset != NULL)
+    fprintf(F, " bgzf_size=%lld", (long long)idx->bgzf_size);
+  fprintf(F, "\n");
+  for (i = 0; i < idx->nblocks; i++) {
+    fprintf(F, "%lld\t%lld\t%lld", (long long)idx->start[i],
+            (long long)idx->end[i], (long long)idx->offset[i]);
+    if (idx->voffset != NULL)
+      fprintf(F, "\t%lld", (long long)idx->voffset[i]);
+    fprintf(F, "\n");
+  }
+}
+
+MafIndex *mafIndex_read(FILE *F) {
+  String *line = str_new(STR_MED_LEN);
+  int alloc = 10000, version = -1, nf;
+  long long start, end, offset, voffset = -1, size = -1, bgzf_size = -1;
+  char *refseq = NULL;
+  MafIndex *idx = mafIndex_new(alloc);
+
+  while (str_readline(line, F) != EOF) {
+    str_trim(line);
+    if (line->length == 0) continue;
+    if (str_starts_with_charstr(line, "##maf-index")) {
+      if (sscanf(line->chars, "##maf-index version=%d", &version) != 1)
+        die("ERROR: bad header in MAF index (\"%s\")\n", line->chars);
+      if (version < 1 || version > MAF_INDEX_VERSION)
+        die("ERROR: unsupported MAF index version %d\n", version);
+    }
+    else if (str_starts_with_charstr(line, "##refseq=")) {
+      char *sp = strstr(line->chars, " maf_size=");
+      if (sp == NULL || sscanf(sp, " maf_size=%lld bgzf_size=%lld", &size, 
+                               &bgzf_size) < 1)
+        die("ERROR: bad header in MAF index (\"%s\")\n", line->chars);
+      *sp = '\0';
+      refseq = line->chars + strlen("##refseq=");
+      idx->refseq = str_new_charstr(refseq);
+      /* virtual offsets are given for BGZF-compressed MAFs */
+      if (bgzf_size >= 0)
+        idx->voffset = smalloc(alloc * sizeof(int64_t));
+    }
+    else if (line->chars[0] == '#') continue;
+    else {
+      nf = sscanf(line->chars, "%lld %lld %lld %lld", &start, &end, &offset,
+                  &voffset);
+      if (nf != (idx->voffset != NULL ? 4 : 3) || 
+          (idx->voffset != NULL && voffset < 0))
+        die("ERROR: bad line in MAF index (\"%s\")\n", line->chars);
+      mafIndex_add(idx, &alloc, start, end, offset, voffset);
+    }
+  }
+  if (version == -1 || idx->refseq == NULL)
+    die("ERROR: MAF index lacks header\n");
+  idx->maf_size = size;
+  idx->bgzf_size = bgzf_size;
+  str_free(line);
+  mafIndex_finish(idx);
+  return idx;
+}
+
+MafIndex *mafIndex_load(const char *maf_fname) {
+  String *fname = str_new_charstr(maf_fname);
+  FILE *F;
+  MafIndex *idx;
+  struct stat st;
+
+  str_append_charstr(fname, MAF_INDEX_SUFFIX);
+  if ((F = phast_fopen_no_exit(fname->chars, "r")) == NULL) {
+    str_free(fname);
+    return NULL;
+  }
+  idx = mafIndex_read(F);
+  phast_fclose(F);
+  if (idx->voffset == NULL && cio_compressed_file(maf_fname)) {
+    fprintf(stderr, "WARNING: ignoring %s, which was built from uncompressed data (re-run maf_index on %s).\n",
+            fname->chars, maf_fname);
+    mafIndex_free(idx);
+    idx = NULL;
+  }
+  else if (stat(maf_fname, &st) != 0 || 
+           st.st_size != (idx->voffset != NULL ? idx->bgzf_size : 
+                          idx->maf_size)) {
+    fprintf(stderr, "WARNING: ignoring %s, which does not match %s (re-run maf_index).\n",
+            fname->chars, maf_fname);
+    mafIndex_free(idx);
+    idx = NULL;
+  }
+  str_free(fname);
+  return idx;
+}
+
+void mafIndex_free(MafIndex *idx) {
+  if (idx->refseq != NULL) str_free(idx->refseq);
+  sfree(idx->start);
+  sfree(idx->end);
+  sfree(idx->offset);
+  if (idx->voffset != NULL) sfree(idx->voffset);
+  if (idx->max_end != NULL) sfree(idx->max_end);
+  sfree(idx);
+}
+
+int mafIndex_find(MafIndex *idx, int64_t pos) {
+  int lo = 0, hi = idx->nblocks, mid;
+  /* max_end is nondecreasing, so binary search for first entry
+     exceeding pos */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (idx->max_end[mid] > pos) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+/* give a decompressing stream the BGZF blocks in which indexed MAF
+   blocks start, so that it can seek without decompressing everything
+   before the target */
+static void mafIndex_set_block_map(MafIndex *idx, FILE *F) {
+  int64_t *coffset = smalloc(max(idx->nblocks, 1) * sizeof(int64_t)),
+    *upos = smalloc(max(idx->nblocks, 1) * sizeof(int64_t));
+  int i, n = 0;
+  for (i = 0; i < idx->nblocks; i++) {
+    if (n > 0 && coffset[n-1] == idx->voffset[i] >> 16) continue;
+    coffset[n] = idx->voffset[i] >> 16;
+    upos[n] = idx->offset[i] - (idx->voffset[i] & 0xffff);
+    n++;
+  }
+  cio_set_block_map(F, n, coffset, upos);
+  sfree(coffset);
+  sfree(upos);
+}
+
+int mafIndex_seek(MafIndex *idx, MafReader *r, int64_t pos) {
+  int i = mafIndex_find(idx, pos);
+  if (idx->voffset != NULL && r->F != NULL && !r->mapped)
+    mafIndex_set_block_map(idx, r->F);
+  if (i == idx->nblocks) {
+    mafReader_seek(r, idx->maf_size);
+    return FALSE;
+  }
+  mafReader_seek(r, idx->offset[i]);
+  return TRUE;
+}
@@ -0,0 +1,222 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Zero-copy line reader for MAF files.  See maf_reader.h */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+#include <phast/misc.h>
+#include <phast/maf_reader.h>
+
+/* whitespace, as understood by str_split */
+#define MAF_IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || \
+                         (c) == '\r' || (c) == '\f' || (c) == '\v')
+
+MafReader *mafReader_new(FILE *F) {
+  MafReader *r = smalloc(sizeof(MafReader));
+  r->F = F;
+  r->buf = NULL;
+  r->len = r->alloc = r->pos = r->base = 0;
+  r->mapped = FALSE;
+  r->borrowed = FALSE;
+  r->eof = FALSE;
+  r->xlate_msa = NULL;
+  r->xlate_toupper = FALSE;
+
+#if !defined(__MINGW32__)
+  {
+    /* map entire file if it is a regular one; ftello accounts for
+       anything already consumed through stdio */
+    struct stat st;
+    int fd = fileno(F);
+    off_t start = ftello(F);
+    if (fd >= 0 && start >= 0 && fstat(fd, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0 && start <= st.st_size) {
+      void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+        madvise(base, st.st_size, MADV_SEQUENTIAL);
+#endif
+        r->buf = base;
+        r->len = st.st_size;
+        r->pos = start;
+        r->mapped = TRUE;
+        r->eof = TRUE;
+        return r;
+      }
+    }
+  }
+#endif
+
+  r->alloc = MAF_READER_BUFSIZE;
+  r->buf = smalloc(r->alloc);
+  r->base = ftello(F);
+  if (r->base < 0) r->base = 0; /* not seekable; offsets are relative */
+  return r;
+}
+
+MafReader *mafReader_new_buffer(const char *buf, int64_t len) {
+  MafReader *r = smalloc(sizeof(MafReader));
+  r->F = NULL;
+  r->buf = (char*)buf;
+  r->len = len;
+  r->alloc = r->pos = r->base = 0;
+  r->mapped = FALSE;
+  r->borrowed = TRUE;
+  r->eof = TRUE;
+  r->xlate_msa = NULL;
+  r->xlate_toupper = FALSE;
+  return r;
+}
+
+void mafReader_free(MafReader *r) {
+  if (r->borrowed) {
+    sfree(r);
+    return;
+  }
+#if !defined(__MINGW32__)
+  if (r->mapped) {
+    munmap(r->buf, r->len);
+    fseeko(r->F, r->pos, SEEK_SET);
+    sfree(r);
+    return;
+  }
+#endif
+  /* hand back unconsumed data if stream is seekable */
+  if (r->len > r->pos)
+    fseeko(r->F, -(off_t)(r->len - r->pos), SEEK_CUR);
+  sfree(r->buf);
+  sfree(r);
+}
+
+/* discard consumed data and read more, enlarging the buffer if it is
+   full */
+static void mafReader_fill(MafReader *r) {
+  size_t n;
+  if (r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->base += r->pos;
+    r->pos = 0;
+  }
+  if (r->len == r->alloc) {
+    r->alloc *= 2;
+    r->buf = srealloc(r->buf, r->alloc);
+  }
+  n = fread(r->buf + r->len, 1, r->alloc - r->len, r->F);
+  if (n == 0) r->eof = TRUE;
+  r->len += n;
+}
+
+int mafReader_next_line(MafReader *r, const char **line, int *len) {
+  char *nl = NULL;
+  int64_t scanned = 0;          /* bytes past pos known to lack a newline */
+
+  while (1) {
+    nl = memchr(r->buf + r->pos + scanned, '\n', r->len - r->pos - scanned);
+    if (nl != NULL || r->eof) break;
+    scanned = r->len - r->pos;
+    mafReader_fill(r);
+  }
+  if (r->pos >= r->len) return EOF;
+
+  *line = r->buf + r->pos;
+  if (nl == NULL) {             /* final line lacks newline */
+    *len = (int)(r->len - r->pos);
+    r->pos = r->len;
+  }
+  else {
+    *len = (int)(nl - *line);
+    r->pos += *len + 1;
+  }
+  return 0;
+}
+
+int mafReader_next_block(MafReader *r, const char **text, int64_t *len) {
+  int64_t cur = 0;              /* offset of current line from pos */
+  int64_t scanned = 0;          /* bytes past cur known to lack a newline */
+  int seen_seq = FALSE, n;
+  const char *line;
+  char *nl;
+
+  /* scan ahead line by line without consuming anything, so that the
+     whole block stays in the buffer */
+  while (1) {
+    while ((nl = memchr(r->buf + r->pos + cur + scanned, '\n',
+                        r->len - r->pos - cur - scanned)) == NULL &&
+           !r->eof) {
+      scanned = r->len - r->pos - cur;
+      mafReader_fill(r);
+    }
+    scanned = 0;
+    if (r->pos + cur >= r->len) break;
+    line = r->buf + r->pos + cur;
+    n = (int)(nl == NULL ? r->len - r->pos - cur : nl - line);
+
+    /* classify line as maf_read_block does */
+    if (n > 0 && line[0] == 'a' && seen_seq) break;
+    if (n > 0 && line[0] != '#' && line[0] != 'a' &&
+        !(n > 1 && line[1] == ' ' &&
+          (line[0] == 'i' || line[0] == 'e' || line[0] == 'q'))) {
+      int m = n;
+      while (m > 0 && MAF_IS_SPACE(line[m-1])) m--;
+      if (m > 0) seen_seq = TRUE;
+    }
+    cur += n + (nl == NULL ? 0 : 1);
+  }
+  if (cur == 0) return EOF;
+  *text = r->buf + r->pos;
+  *len = cur;
+  r->pos += cur;
+  return 0;
+}
+
+int64_t mafReader_tell(MafReader *r) {
+  return r->base + r->pos;
+}
+
+void mafReader_seek(MafReader *r, int64_t offset) {
+  if (r->mapped) {
+    if (offset < 0 || offset > r->len)
+      die("ERROR: mafReader_seek: offset %lld out of range\n", 
+          (long long)offset);
+    r->pos = offset;
+    return;
+  }
+  if (offset >= r->base && offset <= r->base + r->len) {
+    r->pos = offset - r->base;  /* already buffered */
+    return;
+  }
+  if (fseeko(r->F, offset, SEEK_SET) != 0)
+    die("ERROR: mafReader_seek: cannot seek in MAF stream\n");
+  r->base = offset;
+  r->len = r->pos = 0;
+  r->eof = FALSE;
+}
+
+int mafReader_split(const char *line, int len, const char **fields,
+                    int *flens, int maxfields) {
+  int i = 0, j, n = 0;
+
+  while (i < len) {
+    for (j = i; j < len && !MAF_IS_SPACE(line[j]); j++);
+    if (n < maxfields) {
+      fields[n] = line + i;
+      flens[n] = j - i;
+    }
+    n++;
+    for (j++; j < len && MAF_IS_SPACE(line[j]); j++);
+    i = j;
+  }
+  return n;
+}
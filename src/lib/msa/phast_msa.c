@@ -114,7 +114,7 @@ MSA *msa_new_from_file_define_format(FILE *F, msa_format_type format, char *alph
     return (msa_read_fasta(F, alphabet));
   else if (format == LAV)
     return la_to_msa(la_read_lav(F, 1), 0);
-  else if (format == SS) 
+  else if (format == SS || format == BSS) 
     return ss_read(F, alphabet);
 
   //format must be PHYLIP or MPM
@@ -356,6 +356,11 @@ void msa_print(FILE *F, MSA *msa, msa_format_type format, int pretty_print) {
     ss_write(msa, F, 1);
     return;
   }
+  if (format == BSS) {
+    if (msa->ss == NULL) ss_from_msas(msa, 1, 1, NULL, NULL, NULL, -1, 0);
+    ss_write_binary(msa, F, 1);
+    return;
+  }
 
   /* otherwise, require explicit representation of alignment */
   if (msa->seqs == NULL && msa->ss != NULL) ss_to_msa(msa);
@@ -446,7 +451,7 @@ void reduce_to_4d(MSA *msa, CategoryMap *cm) {
   int i, j, k, is_4d, tuple_size = 3, idx;
   char **seq, codon[3], key[msa->nseqs * 3 + 1];
   MSA *temp_msa, *new_msa;
-  Hashtable *tuple_hash = hsh_new(msa->length);
+  TupleHash *tuple_hash;
 
   if (msa->categories == NULL)
     die("ERROR reduce_to_4d got msa->categories==NULL\n");
@@ -464,6 +469,7 @@ void reduce_to_4d(MSA *msa, CategoryMap *cm) {
   temp_msa = msa_new(seq, msa->names, msa->nseqs, 3, msa->alphabet);
   new_msa = msa_new(NULL, msa->names, msa->nseqs, 0, msa->alphabet);
   ss_new(new_msa, tuple_size, msa->length, 0, 0);
+  tuple_hash = ss_new_tuple_hash(new_msa, 10000);
 
   for (i=0; i<msa->length; i++) {
     checkInterruptN(i, 10000);
@@ -515,11 +521,11 @@ void reduce_to_4d(MSA *msa, CategoryMap *cm) {
 
     //now we have to add this to the SS!
     col_to_string(key, temp_msa, 2, 3);
-    if ((idx = ss_lookup_coltuple(key, tuple_hash, new_msa)) == -1) {
-      idx = new_msa->ss->ntuples++;
-      ss_add_coltuple(key, int_to_ptr(idx), tuple_hash, new_msa);
-      new_msa->ss->col_tuples[idx] = (char*)smalloc((tuple_size * msa->nseqs + 1)*sizeof(char));
-      strncpy(new_msa->ss->col_tuples[idx], key, (msa->nseqs*tuple_size+1));
+    if ((idx = ss_lookup_or_add_coltuple(key, new_msa->ss->ntuples, 
+                                         tuple_hash, new_msa)) == 
+        new_msa->ss->ntuples) {
+      new_msa->ss->ntuples++;
+      ss_set_tuple(new_msa, idx, key, msa->nseqs * tuple_size);
     } 
     new_msa->ss->counts[idx]++;
     new_msa->length++;
@@ -542,7 +548,7 @@ void reduce_to_4d(MSA *msa, CategoryMap *cm) {
   temp_msa->names = NULL;
   msa_free(new_msa);
   msa_free(temp_msa);
-  hsh_free(tuple_hash);
+  th_free(tuple_hash);
 }
 
 
@@ -1163,24 +1169,26 @@ int msa_map_seq_to_seq(msa_coord_map *from_map, msa_coord_map *to_map,
 */
 void msa_add_seq_ss(MSA *msa, int new_nseqs) {
   int i, j, k, newlen;
-  char newchar;
+  char newchar, *tuple;
   if (new_nseqs <= msa->nseqs) 
     die("ERROR: new numseq must be >= than old in ss_add_seq\n");
-  newlen = new_nseqs*msa->ss->tuple_size + 1;
+  newlen = new_nseqs*msa->ss->tuple_size;
+  tuple = smalloc((newlen + 1) * sizeof(char));
   for (i=0; i<msa->ss->ntuples; i++) {
     checkInterruptN(i, 1000);
-    msa->ss->col_tuples[i] = srealloc(msa->ss->col_tuples[i], newlen*sizeof(char));
+    ss_get_tuple(msa, i, tuple);
     for (k = -msa->ss->tuple_size + 1; k<=0; k++) {
       for (j=0; j < msa->nseqs; j++)
-	if (col_string_to_char(msa, msa->ss->col_tuples[i], j, msa->ss->tuple_size, k) 
+	if (col_string_to_char(msa, tuple, j, msa->ss->tuple_size, k) 
 	    != GAP_CHAR) break;
       if (j == msa->nseqs) newchar = GAP_CHAR;
       else newchar = msa->missing[0];
       for (j=msa->nseqs; j<new_nseqs; j++)
-	set_col_char_in_string(msa, msa->ss->col_tuples[i], j, msa->ss->tuple_size, k, newchar);
+	set_col_char_in_string(msa, tuple, j, msa->ss->tuple_size, k, newchar);
     }
-    msa->ss->col_tuples[i][newlen - 1] = '\0';
+    ss_set_tuple(msa, i, tuple, newlen);
   }
+  sfree(tuple);
 }
 
 
@@ -1690,7 +1698,7 @@ void msa_get_backgd_3x4(Vector *backgd, MSA *msa) {
     for (i=0; i < msa->ss->ntuples; i++) {
       for (spec=0; spec < msa->nseqs; spec++) {
 	for (j=0; j < 3; j++) {
-	  cod[j] = col_string_to_char(msa, msa->ss->col_tuples[i], spec, msa->ss->tuple_size, j-2);
+	  cod[j] = ss_get_char_tuple(msa, i, spec, j-2);
 	  if (msa->is_missing[(int)cod[j]] || cod[j]==GAP_CHAR) break;
 	}
 	if (j == 3 && 
@@ -2541,6 +2549,7 @@ msa_format_type msa_str_to_format(const char *str) {
   if (!strcmp(str, "MPM")) return MPM;
   else if (!strcmp(str, "FASTA")) return FASTA;
   else if (!strcmp(str, "SS")) return SS;
+  else if (!strcmp(str, "BSS")) return BSS;
   else if (!strcmp(str, "LAV")) return LAV;
   else if (!strcmp(str, "PHYLIP")) return PHYLIP;
   else if (!strcmp(str, "MAF")) return MAF;
@@ -2554,6 +2563,7 @@ char *msa_format_to_str(msa_format_type format) {
   if (format == PHYLIP) return "PHYLIP";
   if (format == MPM) return "MPM";
   if (format == SS) return "SS";
+  if (format == BSS) return "BSS";
   if (format == MAF) return "MAF";
   return "UNKNOWN";
 }
@@ -2567,6 +2577,7 @@ msa_format_type msa_format_for_suffix(const char *fname) {
   if (str_equals_charstr(s, "mpm")) retval = MPM;
   else if (str_equals_charstr(s, "fa")) retval = FASTA;
   else if (str_equals_charstr(s, "ss")) retval = SS;
+  else if (str_equals_charstr(s, "bss")) retval = BSS;
   else if (str_equals_charstr(s, "lav")) retval = LAV;
   else if (str_equals_charstr(s, "ph") ||
 	   str_equals_charstr(s, "phy")) retval = PHYLIP;
@@ -2593,8 +2604,8 @@ msa_format_type msa_format_for_content(FILE *F, int die_if_unknown) {
   lav_re = str_re_new("^#:lav.*");
   maf_re = str_re_new("^##maf");
 
-  //Check if file has a Sufficent Statistics header
-  if(str_re_match(line, ss_re, matches, 1) >= 0) {
+  //Check if file has a Sufficent Statistics header (text or binary)
+  if(str_re_match(line, ss_re, matches, 1) >= 0 || ss_is_binary(line->chars)) {
     retval = SS;
   }
   //Check if file has a PHYLIP/MPM header
@@ -2657,6 +2668,8 @@ char *msa_suffix_for_format(msa_format_type t) {
     return "mpm";
   case SS:
     return "ss";
+  case BSS:
+    return "bss";
   case MAF:
     return "maf";
   default:
@@ -2835,13 +2848,10 @@ void msa_missing_to_gaps(MSA *msa, int refseq) {
           if (msa->is_missing[(int)c]) {
             if (j == refseq - 1 && c == 'N') {
               int char_idx = (int)(4.0 * unif_rand());
-              set_col_char_in_string(msa, msa->ss->col_tuples[i], j, 
-                                     msa->ss->tuple_size, -k, 
-                                     msa->alphabet[char_idx]);
+              ss_set_char_tuple(msa, i, j, -k, msa->alphabet[char_idx]);
             }
             else
-              set_col_char_in_string(msa, msa->ss->col_tuples[i], j, 
-                                     msa->ss->tuple_size, -k, GAP_CHAR);
+              ss_set_char_tuple(msa, i, j, -k, GAP_CHAR);
           }
         }
       }
@@ -2904,9 +2914,8 @@ void msa_toupper(MSA *msa) {
       checkInterruptN(i, 10000);
       for (j = 0; j < msa->nseqs; j++) 
         for (k = 0; k < msa->ss->tuple_size; k++) 
-          set_col_char_in_string(msa, msa->ss->col_tuples[i], j, 
-                                 msa->ss->tuple_size, -k, 
-                                 (char)toupper(ss_get_char_tuple(msa, i, j, -k)));
+          ss_set_char_tuple(msa, i, j, -k, 
+                            (char)toupper(ss_get_char_tuple(msa, i, j, -k)));
     }
   }
   if (msa->seqs != NULL) {
@@ -7,6 +7,14 @@
  * file LICENSE.txt for details.
  ***************************************************************************/
 
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 #include "phast/misc.h"
 #include "phast/sufficient_stats.h"
 #include "phast/maf.h"
@@ -69,12 +77,12 @@
 
 void ss_from_msas(MSA *msa, int tuple_size, int store_order, 
                   List *cats_to_do, MSA *source_msa, 
-                  Hashtable *existing_hash,
+                  TupleHash *existing_hash,
                   int idx_offset, int non_overlapping) {
   int i, j, do_cats, idx, upper_bound;
   int max_tuples;
   MSA_SS *main_ss, *source_ss = NULL;
-  Hashtable *tuple_hash = NULL;
+  TupleHash *tuple_hash = NULL;
   int *do_cat_number = NULL;
   char key[msa->nseqs * tuple_size + 1];
   MSA *smsa;
@@ -148,7 +156,8 @@ void ss_from_msas(MSA *msa, int tuple_size, int store_order,
 
 
   main_ss = msa->ss;
-  tuple_hash = existing_hash != NULL ? existing_hash : hsh_new((int)((double)max_tuples/3));
+  tuple_hash = existing_hash != NULL ? existing_hash : 
+    ss_new_tuple_hash(msa, min(max_tuples, MAX_NTUPLE_ALLOC));
 
   if (source_msa != NULL && source_msa->ss != NULL)
     source_ss = source_msa->ss;
@@ -158,16 +167,11 @@ void ss_from_msas(MSA *msa, int tuple_size, int store_order,
                                               existing suff stats */
     for (i = 0; i < source_ss->ntuples; i++) {
       checkInterruptN(i, 1000);
-/*       fprintf(stderr, "col_tuple %d: %s\n", i, source_ss->col_tuples[i]); */
-
-      if ((idx = ss_lookup_coltuple(source_ss->col_tuples[i], tuple_hash, msa)) == -1) {
- 	idx = main_ss->ntuples++;
-	ss_add_coltuple(source_ss->col_tuples[i], int_to_ptr(idx), tuple_hash, msa);
-        main_ss->col_tuples[idx] = (char*)smalloc((tuple_size * msa->nseqs +1) 
-						  * sizeof(char));
-	main_ss->col_tuples[idx][msa->nseqs * tuple_size] = '\0';
-        strncpy(main_ss->col_tuples[idx], source_ss->col_tuples[i],
-		(msa->nseqs * tuple_size + 1));
+      ss_get_tuple(source_msa, i, key);
+      if ((idx = ss_lookup_or_add_coltuple(key, main_ss->ntuples, tuple_hash, 
+                                           msa)) == main_ss->ntuples) {
+ 	main_ss->ntuples++;
+        ss_set_tuple(msa, idx, key, msa->nseqs * tuple_size);
                                 /* NOTE: here main_ss must have
                                    sufficient size; we don't need to
                                    worry about reallocating */
@@ -199,24 +203,21 @@ void ss_from_msas(MSA *msa, int tuple_size, int store_order,
       if (smsa->seqs != NULL)
         col_to_string(key, smsa, i, tuple_size);
       else                      /* NOTE: must have ordered suff stats */
-        strncpy(key, smsa->ss->col_tuples[smsa->ss->tuple_idx[i]], 
-		(msa->nseqs * tuple_size + 1));
+        ss_get_tuple(smsa, smsa->ss->tuple_idx[i], key);
 
-      if ((idx = ss_lookup_coltuple(key, tuple_hash, msa)) == -1) {
+      if ((idx = ss_lookup_or_add_coltuple(key, main_ss->ntuples, 
+                                           tuple_hash, msa)) == 
+          main_ss->ntuples) {
                                 /* column tuple has not been seen
                                    before */
-        idx = main_ss->ntuples++;
-	ss_add_coltuple(key, int_to_ptr(idx), tuple_hash, msa);
+        main_ss->ntuples++;
 
         if (main_ss->ntuples > main_ss->alloc_ntuples) 
                                 /* possible if allocated only for
                                    MAX_NTUPLE_ALLOC */
           ss_realloc(msa, tuple_size, main_ss->ntuples, do_cats, store_order);
 
-        main_ss->col_tuples[idx] = (char*)smalloc((tuple_size * msa->nseqs + 1)
-						  * sizeof(char));
-	main_ss->col_tuples[idx][tuple_size * msa->nseqs] = '\0';
-        strncpy(main_ss->col_tuples[idx], key, msa->nseqs * tuple_size);
+        ss_set_tuple(msa, idx, key, msa->nseqs * tuple_size);
       }
 
       main_ss->counts[idx]++;
@@ -235,12 +236,244 @@ void ss_from_msas(MSA *msa, int tuple_size, int store_order,
     ss_compact(main_ss);        /* only compact if it looks like this
                                    function is not being called
                                    repeatedly */
-    hsh_free(tuple_hash);
+    th_free(tuple_hash);
   }
 
   if (do_cats) sfree(do_cat_number);
 }
 
+int ss_add_block(MSA *msa, MSA *block, TupleHash *tuple_hash,
+                 List *cats_to_do) {
+  MSA_SS *ss = msa->ss;
+  int i, idx, ncols = 0, tuple_size = ss->tuple_size;
+  int do_cats = (msa->ncats >= 0 && block->categories != NULL),
+    cat_counts = (do_cats && ss->cat_counts != NULL);
+  int do_cat_number[msa->ncats >= 0 ? msa->ncats + 1 : 1];
+  char key[msa->nseqs * tuple_size + 1];
+
+  if (msa->nseqs != block->nseqs)
+    die("ERROR ss_add_block: numbers of sequences must be equal in source and destination alignments.\n");
+  if (block->seqs == NULL)
+    die("ERROR ss_add_block: source alignment must have explicit sequences.\n");
+  if (ss->tuple_idx != NULL)
+    die("ERROR ss_add_block: destination must have unordered sufficient statistics.\n");
+
+  if (do_cats) {
+    for (i = 0; i <= msa->ncats; i++) do_cat_number[i] = (cats_to_do == NULL);
+    if (cats_to_do != NULL)
+      for (i = 0; i < lst_size(cats_to_do); i++)
+        do_cat_number[lst_get_int(cats_to_do, i)] = 1;
+  }
+
+  for (i = 0; i < block->length; i++) {
+    if (do_cats) {
+      if (!(block->categories[i] >= 0 && block->categories[i] <= msa->ncats))
+	die("ERROR ss_add_block: block->categories[i]=%i should be in [0,%i]\n",
+	    block->categories[i], msa->ncats);
+      if (!do_cat_number[block->categories[i]]) continue;
+    }
+
+    col_to_string(key, block, i, tuple_size);
+    if ((idx = ss_lookup_or_add_coltuple(key, ss->ntuples, tuple_hash, msa))
+        == ss->ntuples) {       /* new tuple; grow geometrically */
+      if (ss->ntuples == ss->alloc_ntuples)
+        ss_realloc(msa, tuple_size, ss->ntuples + 1, cat_counts, FALSE);
+      ss->ntuples++;
+      ss_set_tuple(msa, idx, key, msa->nseqs * tuple_size);
+    }
+    ss->counts[idx]++;
+    if (cat_counts) ss->cat_counts[block->categories[i]][idx]++;
+    ncols++;
+  }
+  msa->length += ncols;
+  return ncols;
+}
+
+SS_Block *ss_block_new(MSA *msa, int store_order) {
+  SS_Block *sb = smalloc(sizeof(SS_Block));
+  int j;
+  sb->ntuples = sb->ncols = sb->nused = 0;
+  sb->alloc_ntuples = 64;        /* grows as needed */
+  sb->keylen = msa->nseqs * msa->ss->tuple_size;
+  sb->keys = smalloc(sb->alloc_ntuples * (sb->keylen + 1) * sizeof(char));
+  sb->counts = smalloc(sb->alloc_ntuples * sizeof(double));
+  sb->ncats = msa->ncats;
+  sb->cat_counts = NULL;
+  if (sb->ncats >= 0) {
+    sb->cat_counts = smalloc((sb->ncats + 1) * sizeof(double*));
+    for (j = 0; j <= sb->ncats; j++)
+      sb->cat_counts[j] = smalloc(sb->alloc_ntuples * sizeof(double));
+  }
+  sb->alloc_cols = 0;
+  sb->col_tuple = NULL;
+  if (store_order) {
+    sb->alloc_cols = 1000;
+    sb->col_tuple = smalloc(sb->alloc_cols * sizeof(int));
+  }
+  sb->hash = ss_new_tuple_hash(msa, sb->alloc_ntuples);
+  return sb;
+}
+
+void ss_block_collect(SS_Block *sb, MSA *msa, MSA *block, List *cats_to_do) {
+  int i, j, idx, cat = 0, tuple_size = msa->ss->tuple_size;
+  int do_cats = (msa->ncats >= 0 && block->categories != NULL);
+  int do_cat_number[msa->ncats >= 0 ? msa->ncats + 1 : 1];
+  char *key;
+
+  if (msa->nseqs != block->nseqs)
+    die("ERROR ss_block_collect: numbers of sequences must be equal in block and destination alignment.\n");
+  if (block->seqs == NULL)
+    die("ERROR ss_block_collect: block must have explicit sequences.\n");
+
+  if (sb->keylen != msa->nseqs * tuple_size) {
+    sb->keylen = msa->nseqs * tuple_size;
+    sb->keys = srealloc(sb->keys, sb->alloc_ntuples * (sb->keylen + 1) * 
+                        sizeof(char));
+  }
+  if (sb->col_tuple != NULL && block->length > sb->alloc_cols) {
+    sb->alloc_cols = max(block->length, 2 * sb->alloc_cols);
+    sb->col_tuple = srealloc(sb->col_tuple, sb->alloc_cols * sizeof(int));
+  }
+  th_clear(sb->hash);
+  sb->ntuples = 0;
+  sb->ncols = block->length;
+  sb->nused = 0;
+
+  if (do_cats) {
+    for (i = 0; i <= msa->ncats; i++) do_cat_number[i] = (cats_to_do == NULL);
+    if (cats_to_do != NULL)
+      for (i = 0; i < lst_size(cats_to_do); i++)
+        do_cat_number[lst_get_int(cats_to_do, i)] = 1;
+  }
+
+  for (i = 0; i < block->length; i++) {
+    if (do_cats) {
+      cat = block->categories[i];
+      if (!(cat >= 0 && cat <= msa->ncats))
+	die("ERROR ss_block_collect: block->categories[i]=%i should be in [0,%i]\n",
+	    cat, msa->ncats);
+      if (!do_cat_number[cat]) {
+        if (sb->col_tuple != NULL) sb->col_tuple[i] = -1;
+        continue;
+      }
+    }
+
+    if (sb->ntuples == sb->alloc_ntuples) {
+      sb->alloc_ntuples *= 2;
+      sb->keys = srealloc(sb->keys, sb->alloc_ntuples * (sb->keylen + 1) *
+                          sizeof(char));
+      sb->counts = srealloc(sb->counts, sb->alloc_ntuples * sizeof(double));
+      for (j = 0; sb->cat_counts != NULL && j <= sb->ncats; j++)
+        sb->cat_counts[j] = srealloc(sb->cat_counts[j], sb->alloc_ntuples *
+                                     sizeof(double));
+    }
+
+    /* build tuple in place of next new one; kept only if it is new */
+    key = sb->keys + (size_t)sb->ntuples * (sb->keylen + 1);
+    col_to_string(key, block, i, tuple_size);
+    if ((idx = ss_lookup_or_add_coltuple(key, sb->ntuples, sb->hash, msa)) ==
+        sb->ntuples) {
+      sb->counts[idx] = 0;
+      for (j = 0; sb->cat_counts != NULL && j <= sb->ncats; j++)
+        sb->cat_counts[j][idx] = 0;
+      sb->ntuples++;
+    }
+    sb->counts[idx]++;
+    if (do_cats && sb->cat_counts != NULL) sb->cat_counts[cat][idx]++;
+    if (sb->col_tuple != NULL) sb->col_tuple[i] = idx;
+    sb->nused++;
+  }
+}
+
+void ss_block_merge(MSA *msa, SS_Block *sb, TupleHash *tuple_hash,
+                    int idx_offset) {
+  MSA_SS *ss = msa->ss;
+  int i, j, idx, store_order = (ss->tuple_idx != NULL);
+  int *global_idx = smalloc(max(sb->ntuples, 1) * sizeof(int));
+  char *key;
+
+  if (msa->nseqs * ss->tuple_size != sb->keylen)
+    die("ERROR ss_block_merge: numbers of sequences must be equal in block and destination alignment.\n");
+  if (store_order && sb->col_tuple == NULL)
+    die("ERROR ss_block_merge: order of block was not collected.\n");
+
+  if (store_order) {            /* as in ss_from_msas */
+    int newlen = max(idx_offset, 0) + sb->ncols;
+    msa_realloc(msa, newlen, newlen + 100000, msa->ncats >= 0, TRUE);
+    ss_realloc(msa, ss->tuple_size, ss->alloc_ntuples, msa->ncats >= 0, TRUE);
+  }
+
+  for (i = 0; i < sb->ntuples; i++) {
+    key = sb->keys + (size_t)i * (sb->keylen + 1);
+    if ((idx = ss_lookup_or_add_coltuple(key, ss->ntuples, tuple_hash, msa))
+        == ss->ntuples) {
+      if (ss->ntuples == ss->alloc_ntuples)
+        ss_realloc(msa, ss->tuple_size, ss->ntuples + 1, 
+                   ss->cat_counts != NULL, store_order);
+      ss->ntuples++;
+      ss_set_tuple(msa, idx, key, sb->keylen);
+    }
+    ss->counts[idx] += sb->counts[i];
+    for (j = 0; sb->cat_counts != NULL && ss->cat_counts != NULL && 
+           j <= sb->ncats; j++)
+      ss->cat_counts[j][idx] += sb->cat_counts[j][i];
+    global_idx[i] = idx;
+  }
+
+  if (store_order) 
+    for (i = 0; i < sb->ncols; i++)
+      ss->tuple_idx[i + max(idx_offset, 0)] = 
+        (sb->col_tuple[i] == -1 ? -1 : global_idx[sb->col_tuple[i]]);
+  else msa->length += sb->nused;
+  sfree(global_idx);
+}
+
+void ss_block_free(SS_Block *sb) {
+  int j;
+  sfree(sb->keys);
+  sfree(sb->counts);
+  if (sb->cat_counts != NULL) {
+    for (j = 0; j <= sb->ncats; j++) sfree(sb->cat_counts[j]);
+    sfree(sb->cat_counts);
+  }
+  if (sb->col_tuple != NULL) sfree(sb->col_tuple);
+  th_free(sb->hash);
+  sfree(sb);
+}
+
+/* convert packed tuples from 4 to 8 bits per character */
+static void ss_widen_tuples(MSA *msa) {
+  MSA_SS *ss = msa->ss;
+  int i, j, len = msa->nseqs * ss->tuple_size;
+  for (i = 0; i < ss->alloc_ntuples; i++) {
+    unsigned char *old = ss->col_tuples[i], *new;
+    if (old == NULL) continue;
+    new = smalloc(max(len, 1) * sizeof(unsigned char));
+    for (j = 0; j < len; j++) new[j] = (unsigned char)ss_tuple_char(ss, old, j);
+    sfree(old);
+    ss->col_tuples[i] = new;
+  }
+  ss->tuple_bits = 8;
+}
+
+/* make sure character c can be represented in packed tuples,
+   assigning it a 4-bit code or switching to 8 bits per character.
+   The latter requires all tuples to have the standard length; 'len'
+   is the length of the tuple being stored, or 0 if none. */
+static void ss_add_tuple_symbol(MSA *msa, char c, int len) {
+  MSA_SS *ss = msa->ss;
+  unsigned char uc = (unsigned char)c;
+  if (ss->tuple_bits == 8 || ss->tuple_code[uc] >= 0) return;
+  if (ss->tuple_nsymbols < 16) {
+    ss->tuple_decode[ss->tuple_nsymbols] = c;
+    ss->tuple_code[uc] = ss->tuple_nsymbols++;
+    return;
+  }
+  if (len != 0 && len != msa->nseqs * ss->tuple_size)
+    die("ERROR ss_set_tuple: cannot add character '%c' to tuple of nonstandard length.\n", c);
+  ss_widen_tuples(msa);
+}
+
 /* creates a new sufficient statistics object and links it to the
    specified alignment.  Allocates sufficient space for max_ntuples
    distinct column tuples (see ss_compact, below).  The optional
@@ -266,7 +499,8 @@ void ss_new(MSA *msa, int tuple_size, int max_ntuples, int do_cats,
     for (i=0; i < ss->alloc_len; i++)
       ss->tuple_idx[i] = -1;
   }
-  ss->col_tuples = (char**)smalloc(max_ntuples * sizeof(char*));
+  ss->col_tuples = (unsigned char**)smalloc(max_ntuples * 
+                                            sizeof(unsigned char*));
   for (i = 0; i < max_ntuples; i++) ss->col_tuples[i] = NULL;
   ss->counts = (double*)smalloc(max_ntuples * sizeof(double));
   for (i = 0; i < max_ntuples; i++) ss->counts[i] = 0; 
@@ -281,6 +515,77 @@ void ss_new(MSA *msa, int tuple_size, int max_ntuples, int do_cats,
     }
   }
   ss->alloc_ntuples = max_ntuples;
+
+  /* assign codes for packed tuples to the characters expected */
+  ss->tuple_bits = 4;
+  ss->tuple_nsymbols = 0;
+  for (i = 0; i < NCHARS; i++) ss->tuple_code[i] = -1;
+  ss_add_tuple_symbol(msa, GAP_CHAR, 0);
+  for (i = 0; msa->alphabet[i] != '\0'; i++)
+    ss_add_tuple_symbol(msa, msa->alphabet[i], 0);
+  for (i = 0; msa->missing[i] != '\0'; i++)
+    ss_add_tuple_symbol(msa, msa->missing[i], 0);
+}
+
+void ss_get_tuple(MSA *msa, int tupleidx, char *str) {
+  MSA_SS *ss = msa->ss;
+  const unsigned char *t = ss->col_tuples[tupleidx];
+  int i, len = msa->nseqs * ss->tuple_size;
+  if (ss->tuple_bits == 8) 
+    memcpy(str, t, len);
+  else {
+    for (i = 0; i + 1 < len; i += 2) {
+      str[i] = ss->tuple_decode[t[i >> 1] & 0xf];
+      str[i+1] = ss->tuple_decode[t[i >> 1] >> 4];
+    }
+    if (i < len) str[i] = ss->tuple_decode[t[i >> 1] & 0xf];
+  }
+  str[len] = '\0';
+}
+
+void ss_set_tuple(MSA *msa, int tupleidx, const char *str, int len) {
+  MSA_SS *ss = msa->ss;
+  const unsigned char *s = (const unsigned char*)str;
+  unsigned char *t;
+  int i, nbytes;
+
+  if (ss->tuple_bits == 4) 
+    for (i = 0; i < len; i++)
+      if (ss->tuple_code[s[i]] < 0) ss_add_tuple_symbol(msa, str[i], len);
+
+  nbytes = max(ss_tuple_nbytes(ss, len), 1);
+  if (ss->col_tuples[tupleidx] == NULL)
+    ss->col_tuples[tupleidx] = smalloc(nbytes * sizeof(unsigned char));
+  else 
+    ss->col_tuples[tupleidx] = srealloc(ss->col_tuples[tupleidx], 
+                                        nbytes * sizeof(unsigned char));
+  t = ss->col_tuples[tupleidx];
+
+  if (ss->tuple_bits == 8)
+    memcpy(t, s, len);
+  else {
+    for (i = 0; i + 1 < len; i += 2)
+      t[i >> 1] = (unsigned char)(ss->tuple_code[s[i]] | 
+                                  (ss->tuple_code[s[i+1]] << 4));
+    if (i < len) t[i >> 1] = (unsigned char)ss->tuple_code[s[i]];
+  }
+}
+
+void ss_set_char_tuple(MSA *msa, int tupleidx, int seqidx, int col_offset,
+                       char c) {
+  MSA_SS *ss = msa->ss;
+  int i = ss->tuple_size*seqidx + ss->tuple_size - 1 + col_offset, shift;
+  unsigned char *t;
+  if (ss->tuple_bits == 4 && ss->tuple_code[(unsigned char)c] < 0)
+    ss_add_tuple_symbol(msa, c, msa->nseqs * ss->tuple_size);
+  t = ss->col_tuples[tupleidx];
+  if (ss->tuple_bits == 8) 
+    t[i] = (unsigned char)c;
+  else {
+    shift = (i & 1) << 2;
+    t[i >> 1] = (unsigned char)((t[i >> 1] & ~(0xf << shift)) | 
+                                (ss->tuple_code[(unsigned char)c] << shift));
+  }
 }
 
 /* ensures a suff stats object has enough memory allocated to
@@ -311,8 +616,9 @@ void ss_realloc(MSA *msa, int tuple_size, int max_ntuples, int do_cats,
   if (max_ntuples > ss->alloc_ntuples) {
     int new_alloc_ntuples = max(max_ntuples, ss->alloc_ntuples*2);
 /*     fprintf(stderr, "Realloc: max_ntuples = %d, alloc_ntuples = %d; realloc to %d\n", max_ntuples, ss->alloc_ntuples, new_alloc_ntuples); */
-    ss->col_tuples = (char**)srealloc(ss->col_tuples, new_alloc_ntuples * 
-                                     sizeof(char*));
+    ss->col_tuples = (unsigned char**)srealloc(ss->col_tuples, 
+                                               new_alloc_ntuples * 
+                                               sizeof(unsigned char*));
     for (i = ss->alloc_ntuples; i < new_alloc_ntuples; i++) 
       ss->col_tuples[i] = NULL;
 
@@ -342,8 +648,7 @@ PooledMSA *ss_pooled_from_msas(List *source_msas, int tuple_size, int ncats,
   int i, j;
   MSA *rep_msa;
   PooledMSA *pmsa = (PooledMSA*)smalloc(sizeof(PooledMSA));
-  Hashtable *tuple_hash = hsh_new(100000); /* wild guess on size.  Big
-                                              enough?  Preview files? */
+  TupleHash *tuple_hash;
   char *key;
 
   if (lst_size(source_msas) <= 0)
@@ -357,6 +662,8 @@ PooledMSA *ss_pooled_from_msas(List *source_msas, int tuple_size, int ncats,
   for (i = 0; i < rep_msa->nseqs; i++) 
     pmsa->pooled_msa->names[i] = copy_charstr(rep_msa->names[i]);
   if (ncats >= 0) pmsa->pooled_msa->ncats = ncats;
+  tuple_hash = ss_new_tuple_hash(pmsa->pooled_msa, 100000);
+                                /* grows as needed */
   pmsa->lens = smalloc(lst_size(source_msas) * sizeof(int));
 
   pmsa->tuple_idx_map = smalloc(lst_size(source_msas) * sizeof(int*));
@@ -380,7 +687,7 @@ PooledMSA *ss_pooled_from_msas(List *source_msas, int tuple_size, int ncats,
        indexing scheme to be used */
     pmsa->tuple_idx_map[i] = smalloc(smsa->ss->ntuples * sizeof(int));
     for (j = 0; j < smsa->ss->ntuples; j++) {
-      strncpy(key, smsa->ss->col_tuples[j], (smsa->nseqs * tuple_size + 1));
+      ss_get_tuple(smsa, j, key);
 /*       fprintf(stderr, "i %d, j %d, key %s, tuple_idx[i][j] %d\n", */
 /* 	      i, j, key, (int)hsh_get(tuple_hash, key)); */
       pmsa->tuple_idx_map[i][j] = ss_lookup_coltuple(key, tuple_hash, smsa);
@@ -389,7 +696,7 @@ PooledMSA *ss_pooled_from_msas(List *source_msas, int tuple_size, int ncats,
 	    i, j, pmsa->tuple_idx_map[i][j]);
     }
   }
-  hsh_free(tuple_hash);
+  th_free(tuple_hash);
   sfree(key);
   return pmsa;
 }
@@ -423,7 +730,7 @@ MSA *ss_aggregate_from_files(List *fnames,
                              int cycle_size) {
 
   MSA *retval;
-  Hashtable *tuple_hash = hsh_new(100000);
+  TupleHash *tuple_hash;
   int nseqs = lst_size(seqnames);
   MSA *source_msa = NULL;
   int i, j;
@@ -439,6 +746,7 @@ MSA *ss_aggregate_from_files(List *fnames,
 
   retval = msa_new(NULL, names, nseqs, 0, NULL);
   retval->ncats = cycle_size > 0 ? cycle_size : -1;
+  tuple_hash = ss_new_tuple_hash(retval, 100000);
 
   for (i = 0; i < lst_size(fnames); i++) {
     String *fname = lst_get_ptr(fnames, i);
@@ -482,7 +790,7 @@ MSA *ss_aggregate_from_files(List *fnames,
     msa_free(source_msa);
   }
 
-  hsh_free(tuple_hash);
+  th_free(tuple_hash);
   return retval;
 }
 
@@ -497,8 +805,7 @@ char *ss_get_one_seq(MSA *msa, int spec) {
     col = 0;
     for (i=0; i<msa->ss->ntuples; i++) {
       checkInterruptN(i, 1000);
-      c = col_string_to_char(msa, msa->ss->col_tuples[i], spec,
-			     msa->ss->tuple_size, 0);
+      c = ss_get_char_tuple(msa, i, spec, 0);
       while (col + msa->ss->counts[i] > msa->length) {  
 	//this shouldn't happen, but the length isn't necessarily initialized
 	//when SS is created
@@ -513,9 +820,7 @@ char *ss_get_one_seq(MSA *msa, int spec) {
       seq = srealloc(seq, (col+1)*sizeof(char));
   } else { /* ordered sufficient stats */
     for (col = 0; col < msa->length; col++) {
-      seq[col] = col_string_to_char(msa, 
-				    msa->ss->col_tuples[msa->ss->tuple_idx[col]], 
-				    spec, msa->ss->tuple_size, 0);
+      seq[col] = ss_get_char_pos(msa, col, spec, 0);
     }
   }
   return seq;
@@ -656,7 +961,14 @@ MSA* ss_read(FILE *F, char *alphabet) {
     idx_offset = 0, idx, offset, line_no=0;
   MSA *msa = NULL;
   List *matches;
-  char **names = NULL;
+  char **names = NULL, *tuplestr = NULL;
+  int c;
+
+  /* binary files are recognized by their first byte, which can't
+     begin a text SS file */
+  if ((c = getc(F)) != EOF) ungetc(c, F);
+  if (c == (unsigned char)SS_BINARY_MAGIC[0])
+    return ss_read_binary(F, alphabet);
 
   nseqs_re = str_re_new("NSEQS[[:space:]]*=[[:space:]]*([0-9]+)");
   length_re = str_re_new("LENGTH[[:space:]]*=[[:space:]]*([0-9]+)");
@@ -727,15 +1039,7 @@ MSA* ss_read(FILE *F, char *alphabet) {
         msa->idx_offset = idx_offset;
         ss_new(msa, tuple_size, ntuples, (ncats > 0 ? 1 : 0), 0);
         msa->ss->ntuples = ntuples;
-        /* in this case, we can preallocate the col_tuples, because we
-           know exactly how many there will be */
-/* 	fprintf(stderr, "ntuples %d, nseqs %d, tuple_size %d, alloc_size %d\n", */
-/* 		ntuples, nseqs, tuple_size, (nseqs * tuple_size + 1)); */
-        for (i = 0; i < ntuples; i++) {
-          msa->ss->col_tuples[i] = (char*)smalloc((nseqs * tuple_size + 1) *
-						   sizeof(char));
-	  msa->ss->col_tuples[i][nseqs * tuple_size] = '\0';
-	}
+        tuplestr = smalloc((nseqs * tuple_size + 1) * sizeof(char));
 
         str_free(alph);
         header_done = 1;
@@ -757,12 +1061,11 @@ MSA* ss_read(FILE *F, char *alphabet) {
 
 /* 	fprintf(stderr, "tuple %d from input msa: %s\n", idx, tmpstr->chars); */
         for (i = 0; i < msa->nseqs; i++) {
-          set_col_char_in_string(msa, msa->ss->col_tuples[idx], i,
-                                 msa->ss->tuple_size, offset,
-                                 tmpstr->chars[i]);
+          set_col_char_in_string(msa, tuplestr, i, msa->ss->tuple_size, 
+                                 offset, tmpstr->chars[i]);
         }
-/* 	fprintf(stderr, "tuple from msa in memory: %s\n", msa->ss->col_tuples[idx]); */
       }
+      ss_set_tuple(msa, idx, tuplestr, msa->nseqs * msa->ss->tuple_size);
 
       for (i = -1; i <= ncats; i++) { 
                                 /* i == -1 -> global count; other
@@ -805,13 +1108,310 @@ MSA* ss_read(FILE *F, char *alphabet) {
   str_re_free(tuple_re);
   str_re_free(order_re);
   str_free(line);
-  
-/*   for (idx = 0; idx < ntuples; idx++) */
-/*     fprintf(stderr, "Tuple %d in msa: %s\n", idx, msa->ss->col_tuples[idx]); */
-  
+  sfree(tuplestr);
   return msa;
 }
 
+/* Header of a binary SS file.  Every field after the magic number is
+   64 bits wide, so the layout has no padding.  Section offsets are
+   relative to the start of the file and are multiples of 8. */
+typedef struct {
+  char magic[SS_BINARY_MAGIC_LEN];
+  int64_t version;
+  int64_t byte_order;           /* SS_BINARY_BYTE_ORDER, as written */
+  int64_t nseqs, length, tuple_size, ntuples, ncats, idx_offset;
+  int64_t idx_width;            /* bytes per tuple_idx entry; 0 if
+                                   order not stored */
+  int64_t names_offset, names_bytes, alph_offset, alph_bytes;
+  int64_t tuples_offset, counts_offset, cat_counts_offset, 
+    idx_order_offset, total_bytes;
+  /* fields below were added in version 2; version 1 files store one
+     byte per character */
+  int64_t tuple_bits;           /* bits per character in tuples (4 or 8) */
+  int64_t tuple_nsymbols;       /* number of 4-bit codes in use */
+  char tuple_decode[16];        /* character for each 4-bit code */
+} SSBinaryHeader;
+
+#define SS_BINARY_HEADER_V1_BYTES ((int64_t)offsetof(SSBinaryHeader, tuple_bits))
+
+#define SS_BINARY_BYTE_ORDER ((int64_t)0x0102030405060708LL)
+#define SS_BINARY_ALIGN(x) (((x) + 7) & ~((int64_t)7))
+
+/* write zero bytes up to the next 8-byte boundary */
+static void ss_binary_pad(FILE *F, int64_t pos) {
+  static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  if (SS_BINARY_ALIGN(pos) > pos)
+    fwrite(zeros, 1, SS_BINARY_ALIGN(pos) - pos, F);
+}
+
+void ss_write_binary(MSA *msa, FILE *F, int show_order) {
+  MSA_SS *ss = msa->ss;
+  SSBinaryHeader hdr;
+  int64_t tuplen = (int64_t)msa->nseqs * ss->tuple_size, pos,
+    tuple_bytes = ss_tuple_nbytes(ss, tuplen);
+  int i, j, min_idx = 0, max_idx = 0, 
+    do_cats = (msa->ncats > 0 && ss->cat_counts != NULL),
+    do_order = (show_order && ss->tuple_idx != NULL);
+  unsigned char buf[4096];
+
+  memset(&hdr, 0, sizeof(SSBinaryHeader));
+  memcpy(hdr.magic, SS_BINARY_MAGIC, SS_BINARY_MAGIC_LEN);
+  hdr.version = SS_BINARY_VERSION;
+  hdr.byte_order = SS_BINARY_BYTE_ORDER;
+  hdr.nseqs = msa->nseqs;
+  hdr.length = msa->length;
+  hdr.tuple_size = ss->tuple_size;
+  hdr.ntuples = ss->ntuples;
+  hdr.ncats = msa->ncats;
+  hdr.idx_offset = msa->idx_offset;
+  hdr.tuple_bits = ss->tuple_bits;
+  if (ss->tuple_bits == 4) {
+    hdr.tuple_nsymbols = ss->tuple_nsymbols;
+    memcpy(hdr.tuple_decode, ss->tuple_decode, ss->tuple_nsymbols);
+  }
+
+  if (do_order) {
+    /* use the narrowest width that holds every index */
+    for (i = 0; i < msa->length; i++) {
+      if (ss->tuple_idx[i] < min_idx) min_idx = ss->tuple_idx[i];
+      if (ss->tuple_idx[i] > max_idx) max_idx = ss->tuple_idx[i];
+    }
+    if (min_idx < 0 || max_idx > 65535) hdr.idx_width = 4;
+    else if (max_idx > 255) hdr.idx_width = 2;
+    else hdr.idx_width = 1;
+  }
+
+  for (i = 0; i < msa->nseqs; i++) 
+    hdr.names_bytes += strlen(msa->names[i]) + 1;
+  hdr.alph_bytes = strlen(msa->alphabet) + 1;
+
+  pos = SS_BINARY_ALIGN((int64_t)sizeof(SSBinaryHeader));
+  hdr.names_offset = pos;
+  pos = SS_BINARY_ALIGN(pos + hdr.names_bytes);
+  hdr.alph_offset = pos;
+  pos = SS_BINARY_ALIGN(pos + hdr.alph_bytes);
+  hdr.tuples_offset = pos;
+  pos = SS_BINARY_ALIGN(pos + hdr.ntuples * tuple_bytes);
+  hdr.counts_offset = pos;
+  pos += hdr.ntuples * sizeof(double);
+  if (do_cats) {
+    hdr.cat_counts_offset = pos;
+    pos += (hdr.ncats + 1) * hdr.ntuples * sizeof(double);
+  }
+  if (do_order) {
+    hdr.idx_order_offset = pos;
+    pos = SS_BINARY_ALIGN(pos + hdr.length * hdr.idx_width);
+  }
+  hdr.total_bytes = pos;
+
+  fwrite(&hdr, sizeof(SSBinaryHeader), 1, F);
+  ss_binary_pad(F, sizeof(SSBinaryHeader));
+  for (i = 0; i < msa->nseqs; i++) 
+    fwrite(msa->names[i], 1, strlen(msa->names[i]) + 1, F);
+  ss_binary_pad(F, hdr.names_offset + hdr.names_bytes);
+  fwrite(msa->alphabet, 1, hdr.alph_bytes, F);
+  ss_binary_pad(F, hdr.alph_offset + hdr.alph_bytes);
+  for (i = 0; i < ss->ntuples; i++) {   /* already packed */
+    checkInterruptN(i, 10000);
+    fwrite(ss->col_tuples[i], 1, tuple_bytes, F);
+  }
+  ss_binary_pad(F, hdr.tuples_offset + hdr.ntuples * tuple_bytes);
+  fwrite(ss->counts, sizeof(double), ss->ntuples, F);
+  if (do_cats)
+    for (j = 0; j <= msa->ncats; j++)
+      fwrite(ss->cat_counts[j], sizeof(double), ss->ntuples, F);
+  if (do_order) {
+    int n = sizeof(buf) / hdr.idx_width, k;
+    for (i = 0; i < msa->length; i += n) {
+      checkInterrupt();
+      for (k = 0; k < n && i + k < msa->length; k++) {
+        if (hdr.idx_width == 1)
+          buf[k] = (uint8_t)ss->tuple_idx[i+k];
+        else if (hdr.idx_width == 2)
+          ((uint16_t*)buf)[k] = (uint16_t)ss->tuple_idx[i+k];
+        else
+          ((int32_t*)buf)[k] = (int32_t)ss->tuple_idx[i+k];
+      }
+      fwrite(buf, hdr.idx_width, k, F);
+    }
+    ss_binary_pad(F, hdr.idx_order_offset + hdr.length * hdr.idx_width);
+  }
+}
+
+MSA* ss_read_binary(FILE *F, char *alphabet) {
+  SSBinaryHeader hdr;
+  char *base = NULL, **names, *p;
+  const char *alph;
+  int64_t tuplen, tuple_bytes, hdr_bytes, counts_end, i, j;
+  int mapped = FALSE;
+  MSA *msa;
+  MSA_SS *ss;
+
+  memset(&hdr, 0, sizeof(SSBinaryHeader));
+  if (fread(&hdr, SS_BINARY_HEADER_V1_BYTES, 1, F) != 1 ||
+      memcmp(hdr.magic, SS_BINARY_MAGIC, SS_BINARY_MAGIC_LEN) != 0)
+    die("ERROR: bad header in binary SS file.\n");
+  if (hdr.byte_order != SS_BINARY_BYTE_ORDER)
+    die("ERROR: binary SS file was written with a different byte order.\n");
+  if (hdr.version <= 0 || hdr.version > SS_BINARY_VERSION)
+    die("ERROR: binary SS file has version %lld; only versions 1 to %i are supported.\n",
+        (long long)hdr.version, SS_BINARY_VERSION);
+  if (hdr.version >= 2) {
+    if (fread((char*)&hdr + SS_BINARY_HEADER_V1_BYTES, 
+              sizeof(SSBinaryHeader) - SS_BINARY_HEADER_V1_BYTES, 1, F) != 1)
+      die("ERROR: bad header in binary SS file.\n");
+    hdr_bytes = sizeof(SSBinaryHeader);
+  }
+  else {
+    hdr.tuple_bits = 8;
+    hdr_bytes = SS_BINARY_HEADER_V1_BYTES;
+  }
+
+  /* dimensions are stored as int64_t but held as int in memory */
+  if (hdr.nseqs <= 0 || hdr.nseqs > INT_MAX)
+    die("ERROR: binary SS file has %lld sequences.\n", (long long)hdr.nseqs);
+  if (hdr.tuple_size <= 0 || hdr.tuple_size > INT_MAX)
+    die("ERROR: binary SS file has tuple size %lld.\n", 
+        (long long)hdr.tuple_size);
+  if (hdr.ntuples <= 0 || hdr.ntuples > INT_MAX)
+    die("ERROR: binary SS file has %lld tuples.\n", (long long)hdr.ntuples);
+  if (hdr.length < 0 || hdr.length > INT_MAX)
+    die("ERROR: binary SS file has length %lld.\n", (long long)hdr.length);
+  if (hdr.ncats < -1 || hdr.ncats > INT_MAX)
+    die("ERROR: binary SS file has %lld categories.\n", (long long)hdr.ncats);
+
+  tuplen = hdr.nseqs * hdr.tuple_size;
+  tuple_bytes = hdr.tuple_bits == 4 ? (tuplen + 1) / 2 : tuplen;
+  counts_end = hdr.counts_offset + hdr.ntuples * (int64_t)sizeof(double);
+  if (hdr.total_bytes < hdr_bytes ||
+      (hdr.tuple_bits != 4 && hdr.tuple_bits != 8) ||
+      (hdr.tuple_bits == 4 && 
+       (hdr.tuple_nsymbols <= 0 || hdr.tuple_nsymbols > 16)) ||
+      (hdr.idx_width != 0 && hdr.idx_width != 1 && hdr.idx_width != 2 && 
+       hdr.idx_width != 4) ||
+      hdr.names_offset < hdr_bytes || hdr.alph_offset < hdr_bytes ||
+      hdr.tuples_offset < hdr_bytes || hdr.counts_offset < hdr_bytes ||
+      hdr.names_bytes <= 0 || hdr.alph_bytes <= 0 ||
+      hdr.names_offset + hdr.names_bytes > hdr.total_bytes ||
+      hdr.alph_offset + hdr.alph_bytes > hdr.total_bytes ||
+      tuple_bytes > (hdr.total_bytes - hdr.tuples_offset) / hdr.ntuples ||
+      counts_end > hdr.total_bytes ||
+      (hdr.cat_counts_offset != 0 && 
+       (hdr.ncats <= 0 || hdr.cat_counts_offset < hdr_bytes ||
+        hdr.ncats + 1 > (hdr.total_bytes - hdr.cat_counts_offset) / 
+        (counts_end - hdr.counts_offset))) ||
+      (hdr.idx_width != 0 && 
+       (hdr.idx_order_offset < hdr_bytes ||
+        hdr.idx_order_offset + hdr.length * hdr.idx_width > hdr.total_bytes)))
+    die("ERROR: inconsistent header in binary SS file.\n");
+
+#if !defined(__MINGW32__)
+  /* map the file directly if possible */
+  {
+    struct stat st;
+    int fd = fileno(F);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= hdr.total_bytes &&
+        ftello(F) == (off_t)hdr_bytes) {
+      base = mmap(NULL, hdr.total_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED) base = NULL;
+      else {
+        mapped = TRUE;
+        fseeko(F, hdr.total_bytes, SEEK_SET);
+      }
+    }
+  }
+#endif
+  if (base == NULL) {
+    base = smalloc(hdr.total_bytes);
+    memcpy(base, &hdr, hdr_bytes);
+    if (fread(base + hdr_bytes, 1, hdr.total_bytes - hdr_bytes, F) != 
+        hdr.total_bytes - hdr_bytes)
+      die("ERROR: premature end of binary SS file.\n");
+  }
+
+  names = (char**)smalloc(hdr.nseqs * sizeof(char*));
+  p = base + hdr.names_offset;
+  for (i = 0; i < hdr.nseqs; i++) {
+    char *end = memchr(p, '\0', base + hdr.names_offset + hdr.names_bytes - p);
+    if (end == NULL) die("ERROR: too few names in binary SS file.\n");
+    names[i] = copy_charstr(p);
+    p = end + 1;
+  }
+  alph = base + hdr.alph_offset;
+  if (alph[hdr.alph_bytes-1] != '\0')
+    die("ERROR: bad alphabet in binary SS file.\n");
+
+  msa = msa_new(NULL, names, hdr.nseqs, hdr.length, 
+                alphabet != NULL ? alphabet : (char*)alph);
+                                /* allow alphabet from file to be overridden */
+  if (hdr.ncats > 0) msa->ncats = hdr.ncats;
+  msa->idx_offset = hdr.idx_offset;
+  ss_new(msa, hdr.tuple_size, hdr.ntuples, hdr.cat_counts_offset != 0, 0);
+  ss = msa->ss;
+  ss->ntuples = hdr.ntuples;
+
+  p = base + hdr.tuples_offset;
+  if (hdr.tuple_bits == 8) 
+    for (i = 0; i < hdr.ntuples; i++, p += tuplen)
+      ss_set_tuple(msa, i, p, tuplen);
+  else {                        /* copy packed tuples as they are,
+                                   adopting the file's codes */
+    ss->tuple_bits = 4;
+    ss->tuple_nsymbols = hdr.tuple_nsymbols;
+    for (i = 0; i < NCHARS; i++) ss->tuple_code[i] = -1;
+    for (i = 0; i < hdr.tuple_nsymbols; i++) {
+      ss->tuple_decode[i] = hdr.tuple_decode[i];
+      ss->tuple_code[(unsigned char)hdr.tuple_decode[i]] = i;
+    }
+    for (i = 0; i < hdr.ntuples; i++, p += tuple_bytes) {
+      for (j = 0; j < tuple_bytes; j++)
+        if ((((unsigned char)p[j]) & 0xf) >= hdr.tuple_nsymbols || 
+            (((unsigned char)p[j]) >> 4) >= hdr.tuple_nsymbols)
+          die("ERROR: bad tuple %lld in binary SS file.\n", (long long)i);
+      ss->col_tuples[i] = smalloc(tuple_bytes * sizeof(unsigned char));
+      memcpy(ss->col_tuples[i], p, tuple_bytes);
+    }
+  }
+  memcpy(ss->counts, base + hdr.counts_offset, hdr.ntuples * sizeof(double));
+  if (hdr.cat_counts_offset != 0)
+    for (j = 0; j <= hdr.ncats; j++)
+      memcpy(ss->cat_counts[j], base + hdr.cat_counts_offset + 
+             j * hdr.ntuples * sizeof(double), hdr.ntuples * sizeof(double));
+
+  if (hdr.idx_width != 0) {
+    const void *idx = base + hdr.idx_order_offset;
+    ss->tuple_idx = smalloc(ss->alloc_len * sizeof(int));
+    if (hdr.idx_width == 1) 
+      for (i = 0; i < hdr.length; i++) 
+        ss->tuple_idx[i] = ((const uint8_t*)idx)[i];
+    else if (hdr.idx_width == 2) 
+      for (i = 0; i < hdr.length; i++) 
+        ss->tuple_idx[i] = ((const uint16_t*)idx)[i];
+    else 
+      memcpy(ss->tuple_idx, idx, hdr.length * sizeof(int32_t));
+    for (i = 0; i < hdr.length; i++)
+      if (ss->tuple_idx[i] < 0 || ss->tuple_idx[i] >= hdr.ntuples)
+        die("ERROR: binary SS file has tuple index %i at position %lld; should be in [0, %lld).\n",
+            ss->tuple_idx[i], (long long)i, (long long)hdr.ntuples);
+  }
+
+#if !defined(__MINGW32__)
+  if (mapped) munmap(base, hdr.total_bytes);
+  else 
+#endif
+    sfree(base);
+
+  return msa;
+}
+
+int ss_is_binary(const char *str) {
+  /* compare only through the newline embedded in the magic number, so
+     that this also works on a line peeked from a file */
+  return (strncmp(str, SS_BINARY_MAGIC, 
+                  strchr(SS_BINARY_MAGIC, '\n') - SS_BINARY_MAGIC + 1) == 0);
+}
+
 void ss_free_categories(MSA_SS *ss) {
   int j;
   if (ss->cat_counts != NULL) {
@@ -864,8 +1464,8 @@ void ss_update_categories(MSA *msa) {
 /* Shrinks arrays to size ss->ntuples. */
 void ss_compact(MSA_SS *ss) {
   int j;
-  ss->col_tuples = (char**)srealloc(ss->col_tuples, 
-                                    ss->ntuples*sizeof(char*));
+  ss->col_tuples = (unsigned char**)srealloc(ss->col_tuples, 
+                                             ss->ntuples*sizeof(unsigned char*));
   ss->counts = (double*)srealloc(ss->counts, 
                                 ss->ntuples*sizeof(double));
   for (j = 0; ss->cat_counts != NULL && j <= ss->msa->ncats; j++)
@@ -924,6 +1524,7 @@ MSA *ss_sub_alignment(MSA *msa, char **new_names, List *include_list,
                                 /* special case: taking subset of seqs only
                                    with unordered sufficient stats */
   MSA_SS *ss;
+  char *tuplestr;
 
   if (msa->ss == NULL)
     die("ERROR: sufficient stats required in ss_sub_alignment.\n");
@@ -974,21 +1575,22 @@ MSA *ss_sub_alignment(MSA *msa, char **new_names, List *include_list,
   ss->ntuples = sub_ntuples;
 
   /* copy column tuples for specified seqs */
+  tuplestr = smalloc((retval->nseqs * ss->tuple_size + 1) * sizeof(char));
   for (tupidx = sub_tupidx = 0; tupidx < msa->ss->ntuples; tupidx++) {
     checkInterruptN(tupidx, 1000);
     if (full_to_sub[tupidx] == -1) continue;
 
-    ss->col_tuples[sub_tupidx] = smalloc((retval->nseqs * ss->tuple_size + 1) * 
-                                         sizeof(char));
     for (offset = -(ss->tuple_size-1); offset <= 0; offset++) {
       for (i = 0; i < lst_size(include_list); i++) {
         seqidx = lst_get_int(include_list, i);
-	ss->col_tuples[sub_tupidx][ss->tuple_size*i + ss->tuple_size-1 + offset] =
-	  msa->ss->col_tuples[tupidx][msa->ss->tuple_size*seqidx + msa->ss->tuple_size-1 + offset];
+        set_col_char_in_string(retval, tuplestr, i, ss->tuple_size, offset,
+                               ss_get_char_tuple(msa, tupidx, seqidx, offset));
       }
     }
+    ss_set_tuple(retval, sub_tupidx, tuplestr, retval->nseqs * ss->tuple_size);
     full_to_sub[tupidx] = sub_tupidx++;
   }
+  sfree(tuplestr);
   
   if (sub_tupidx != sub_ntuples)
     die("ERROR ss_sub_alignment: sub_tupidx (%i) != sub_ntuples (%i)\n",
@@ -1037,7 +1639,7 @@ void ss_reverse_compl(MSA *msa) {
   int i, j, k, offset1, offset2, midpt, do_cats, idx1, idx2;
   char c1, c2;
   MSA_SS *ss;
-  char *first_tuple;
+  char first_tuple[msa->ss->tuple_size * msa->nseqs + 1];
   char new_tuple[msa->ss->tuple_size * msa->nseqs + 1];
   Queue *overwrites = que_new_int(msa->ss->tuple_size);
 
@@ -1072,18 +1674,14 @@ void ss_reverse_compl(MSA *msa) {
         offset1 = -(ss->tuple_size-1) + k;
         offset2 = -k;
 
-        c1 = msa_compl_char(col_string_to_char(msa, ss->col_tuples[i],
-                                               j, ss->tuple_size, offset1));
+        c1 = msa_compl_char(ss_get_char_tuple(msa, i, j, offset1));
 
-        c2 = msa_compl_char(col_string_to_char(msa, ss->col_tuples[i],
-                                               j, ss->tuple_size, offset2));
+        c2 = msa_compl_char(ss_get_char_tuple(msa, i, j, offset2));
 
-        set_col_char_in_string(msa, ss->col_tuples[i], j, ss->tuple_size, 
-                               offset1, c2);
+        ss_set_char_tuple(msa, i, j, offset1, c2);
 
         if (offset1 != offset2) /* true iff at midpoint */
-          set_col_char_in_string(msa, ss->col_tuples[i], j, ss->tuple_size, 
-                                 offset2, c1);          
+          ss_set_char_tuple(msa, i, j, offset2, c1);
       }
     }
   }
@@ -1109,7 +1707,7 @@ void ss_reverse_compl(MSA *msa) {
   }
 
   /* now add representation of initial columns of reverse compl */
-  first_tuple = ss->col_tuples[ss->tuple_idx[ss->tuple_size-1]];
+  ss_get_tuple(msa, ss->tuple_idx[ss->tuple_size-1], first_tuple);
   new_tuple[ss->tuple_size * msa->nseqs] = '\0';
   for (i = 0; i < ss->tuple_size-1; i++) {
     int new_tuple_idx;
@@ -1130,13 +1728,10 @@ void ss_reverse_compl(MSA *msa) {
     if (!que_empty(overwrites)) new_tuple_idx = que_pop_int(overwrites);
     else {
       ss_realloc(msa, ss->tuple_size, ss->ntuples + 1, do_cats, 1);
-      ss->col_tuples[ss->ntuples] = smalloc((ss->tuple_size * msa->nseqs+1)*
-                                           sizeof(char));
       new_tuple_idx = ss->ntuples++;
     }
 
-    strncpy(ss->col_tuples[new_tuple_idx], new_tuple, 
-            (msa->nseqs * ss->tuple_size + 1));
+    ss_set_tuple(msa, new_tuple_idx, new_tuple, msa->nseqs * ss->tuple_size);
     ss->counts[new_tuple_idx]++;
     if (do_cats) ss->cat_counts[msa->categories[i]][new_tuple_idx]++;
 
@@ -1145,28 +1740,135 @@ void ss_reverse_compl(MSA *msa) {
   que_free(overwrites);
 }
 
+/* Character of sequence 'seq' in column 'col' of an alignment with
+   ordered sufficient statistics, taken from the sequences if they are
+   present and otherwise from the right-most column of the tuple (as
+   in ss_to_msa) */
+static PHAST_INLINE
+char ss_column_char(MSA *msa, int seq, int col) {
+  if (msa->seqs != NULL) return msa->seqs[seq][col];
+  return ss_get_char_pos(msa, col, seq, 0);
+}
+
+/* Reverse complement of the alignment, indexed in forward-strand
+   coordinates.  The tuple at column j consists of the complements of
+   columns j, j+1, ..., j+tuple_size-1 (i.e., its context lies to the
+   *right* of j).  Wherever the context of the tuple at column
+   j+tuple_size-1 agrees with the preceding columns, the new tuple is
+   simply that tuple reverse complemented, so each distinct tuple is
+   reverse complemented only once; elsewhere (e.g., at the boundaries
+   of MAF blocks and at the end of the alignment) the tuple is
+   rebuilt from the columns themselves, as msa_reverse_compl would
+   do. */
+MSA *ss_reverse_compl_fwd_coords(MSA *msa) {
+  MSA_SS *ss = msa->ss, *new_ss;
+  MSA *retval;
+  int T, len = msa->length, nseqs = msa->nseqs, tuplen;
+  int i, j, s, o, x, *new_idx, *fwd_map;
+  char **names;
+  List *tuples;
+  Hashtable *extra;
+
+  if (ss == NULL || ss->tuple_idx == NULL)
+    die("ERROR ss_reverse_compl_fwd_coords: Need ordered sufficient statistics\n");
+
+  T = ss->tuple_size;
+  tuplen = T * nseqs;
+  new_idx = smalloc(len * sizeof(int));
+  fwd_map = smalloc(ss->ntuples * sizeof(int));
+  for (i = 0; i < ss->ntuples; i++) fwd_map[i] = -1;
+  tuples = lst_new_ptr(ss->ntuples);
+  extra = hsh_new(1000);
+
+  for (j = 0; j < len; j++) {
+    int consistent;
+    char *tuple;
+    checkInterruptN(j, 10000);
+
+    /* can the tuple ending at column x be used? */
+    x = j + T - 1;
+    consistent = (x < len);
+    for (s = 0; consistent && s < nseqs; s++)
+      for (o = -(T-1); consistent && o <= (msa->seqs != NULL && T > 1 ? 0 : -1); o++)
+        if (ss_get_char_tuple(msa, ss->tuple_idx[x], s, o)
+            != ss_column_char(msa, s, x + o))
+          consistent = FALSE;
+
+    if (consistent) {
+      int t = ss->tuple_idx[x];
+      if (fwd_map[t] == -1) {
+        tuple = smalloc((tuplen + 1) * sizeof(char));
+        for (s = 0; s < nseqs; s++)
+          for (o = 0; o < T; o++)
+            tuple[T*s + o] = msa_compl_char(ss_get_char_tuple(msa, t, s, -o));
+        tuple[tuplen] = '\0';
+        fwd_map[t] = lst_size(tuples);
+        lst_push_ptr(tuples, tuple);
+      }
+      new_idx[j] = fwd_map[t];
+    }
+    else {
+      char key[tuplen + 1];
+      int k;
+      for (s = 0; s < nseqs; s++)
+        for (o = -(T-1); o <= 0; o++)
+          key[T*s + T-1 + o] = (j - o < len ?
+                                msa_compl_char(ss_column_char(msa, s, j - o)) :
+                                GAP_CHAR);
+      key[tuplen] = '\0';
+      if ((k = hsh_get_int(extra, key)) == -1) {
+        k = lst_size(tuples);
+        hsh_put_int(extra, key, k);
+        lst_push_ptr(tuples, copy_charstr(key));
+      }
+      new_idx[j] = k;
+    }
+  }
+
+  names = smalloc(nseqs * sizeof(char*));
+  for (s = 0; s < nseqs; s++) names[s] = copy_charstr(msa->names[s]);
+  retval = msa_new(NULL, names, nseqs, len, msa->alphabet);
+  retval->idx_offset = msa->idx_offset;
+
+  ss_new(retval, T, lst_size(tuples), FALSE, TRUE);
+  new_ss = retval->ss;
+  new_ss->ntuples = lst_size(tuples);
+  for (i = 0; i < new_ss->ntuples; i++) {
+    ss_set_tuple(retval, i, lst_get_ptr(tuples, i), tuplen);
+    sfree(lst_get_ptr(tuples, i));
+  }
+  for (j = 0; j < len; j++) {
+    new_ss->tuple_idx[j] = new_idx[j];
+    new_ss->counts[new_idx[j]]++;
+  }
+
+  sfree(new_idx);
+  sfree(fwd_map);
+  lst_free(tuples);
+  hsh_free(extra);
+  return retval;
+}
+
 
 /* change sufficient stats to reflect reordered rows of an alignment --
    see msa_reorder_rows.  */
 void ss_reorder_rows(MSA *msa, int *new_to_old, int new_nseqs) {
   int ts = msa->ss->tuple_size;
-  char tmp[msa->nseqs * ts];
+  char tmp[msa->nseqs * ts + 1], new_tuple[new_nseqs * ts];
   int col_offset, j, tup;
   for (tup = 0; tup < msa->ss->ntuples; tup++) {
     checkInterruptN(tup, 10000);
-    strncpy(tmp, msa->ss->col_tuples[tup], msa->nseqs * ts);
-    if (new_nseqs > msa->nseqs) 
-      msa->ss->col_tuples[tup] = srealloc(msa->ss->col_tuples[tup], 
-                                          new_nseqs * ts);
+    ss_get_tuple(msa, tup, tmp);
     for (col_offset = -ts+1; col_offset <= 0; col_offset++) {
       for (j = 0; j < new_nseqs; j++) {
         if (new_to_old[j] >= 0)
-	  msa->ss->col_tuples[tup][ts*j + ts - 1 + col_offset] = 
+	  new_tuple[ts*j + ts - 1 + col_offset] = 
 	    tmp[ts*new_to_old[j] + ts - 1 + col_offset];
         else
-	  msa->ss->col_tuples[tup][ts*j + ts-1 + col_offset] = msa->missing[0];
+	  new_tuple[ts*j + ts-1 + col_offset] = msa->missing[0];
       }
     }
+    ss_set_tuple(msa, tup, new_tuple, new_nseqs * ts);
   }
 }
 
@@ -1216,7 +1918,7 @@ void ss_unique(MSA *msa) {
 
   for (i = 0; i < msa->ss->ntuples; i++) {
     checkInterruptN(i, 10000);
-    strncpy(key, msa->ss->col_tuples[i], (msa->nseqs * msa->ss->tuple_size + 1));
+    ss_get_tuple(msa, i, key);
     if ((idx = hsh_get_int(hash, key)) == -1) { /* tuple not seen before */
       hsh_put_int(hash, key, i);
       old_to_new[i] = i;
@@ -1244,22 +1946,26 @@ void ss_unique(MSA *msa) {
     character (msa->missing[0]).  Optionally also convert gap
     characters.  Can be useful in reducing number of tuples */
 void ss_collapse_missing(MSA *msa, int do_gaps) {
-  int i, j, len = msa->nseqs * msa->ss->tuple_size;
+  int i, j, len = msa->nseqs * msa->ss->tuple_size, changed;
   int changed_missing = FALSE, changed_gaps = FALSE, exists_missing = FALSE;
+  char tuple[len + 1];
   for (i = 0; i < msa->ss->ntuples; i++) {
     checkInterruptN(i, 10000);
+    ss_get_tuple(msa, i, tuple);
+    changed = FALSE;
     for (j = 0; j < len; j++) {
-      char c = msa->ss->col_tuples[i][j];
+      char c = tuple[j];
       if (!exists_missing && c == msa->missing[0]) exists_missing = TRUE;
       else if (c != msa->missing[0] && msa->is_missing[(int)c]) {
-        msa->ss->col_tuples[i][j] = msa->missing[0];
-        if (!changed_missing) changed_missing = TRUE;
+        tuple[j] = msa->missing[0];
+        changed = changed_missing = TRUE;
       }
       else if (do_gaps && c == GAP_CHAR) {
-        msa->ss->col_tuples[i][j] = msa->missing[0];
-	if (!changed_gaps) changed_gaps = TRUE;
+        tuple[j] = msa->missing[0];
+	changed = changed_gaps = TRUE;
       }
     }
+    if (changed) ss_set_tuple(msa, i, tuple, len);
   }
 
   if (changed_missing || (exists_missing && changed_gaps))
@@ -1414,81 +2120,80 @@ int ss_is_4d(MSA *msa, int tuple) {
 }
 
 /* reduce to smaller tuple size representation */
-/* NOTE: this only works because we know that ss are represented in
-   strings in such a way that the old tuples won't be over-written by 
-   the new ones. */
 void ss_reduce_tuple_size(MSA *msa, int new_tuple_size) {
   int i, j, k, newlen;
+  char tuple[msa->nseqs * msa->ss->tuple_size + 1];
   if (new_tuple_size >= msa->ss->tuple_size)
     die("ERROR: new tuple size must be smaller than old in ss_reduce_tuple_size.\n");
   newlen = msa->nseqs * new_tuple_size;
   for (i = 0; i < msa->ss->ntuples; i++)  {
     checkInterruptN(i, 10000);
+    ss_get_tuple(msa, i, tuple);
+    /* new tuple fits in the beginning of the old one without
+       overwriting characters still to be copied */
     for (j = 0; j < msa->nseqs; j++) 
       for (k= -new_tuple_size+1; k<=0; k++) {
-	set_col_char_in_string(msa, msa->ss->col_tuples[i], j, new_tuple_size, k,
-			       col_string_to_char(msa, msa->ss->col_tuples[i], j, msa->ss->tuple_size, k));
+	set_col_char_in_string(msa, tuple, j, new_tuple_size, k,
+			       col_string_to_char(msa, tuple, j, msa->ss->tuple_size, k));
       }
-    msa->ss->col_tuples[i][newlen] = '\0';
-    msa->ss->col_tuples[i] = srealloc(msa->ss->col_tuples[i], (newlen+1)*sizeof(char));
+    ss_set_tuple(msa, i, tuple, newlen);
   }
   msa->ss->tuple_size = new_tuple_size;
   ss_unique(msa);
 }
 
-int ss_lookup_coltuple(char *coltuple_str, Hashtable *tuple_hash, MSA *msa) {
-  int allgap[msa->ss->tuple_size], i, j, rv, tuple_size, len;
-  char tempchar;
-  tuple_size = msa->ss->tuple_size;
-  len = tuple_size * msa->nseqs;
-  for (i=0; i < tuple_size; i++) {
-    for (j=0; j<msa->nseqs; j++)
-      if (coltuple_str[j*tuple_size + i]!=GAP_CHAR &&
-	  coltuple_str[j*tuple_size + i]!=msa->missing[0]) break;
-    allgap[i] = (j == msa->nseqs);
-  }
-  for (i=len-1; i>=0; i--) {
-/*     fprintf(stderr, "i %d, coltuple_str %s, coltuple_str[i] %c, msa->missing[0] %c, allgap[i tuple_size] %d\n", */
-/* 	    i, coltuple_str, coltuple_str[i], msa->missing[0], */
-/* 	    allgap[i%tuple_size]); */
-    if (coltuple_str[i] != msa->missing[0] && allgap[i%tuple_size]==0)
-      break;
+/* Length of the portion of a column tuple used as its hash key.
+   Trailing characters are ignored if they are missing data
+   (msa->missing[0]) or fall in a column of the tuple consisting
+   entirely of gaps and missing data; the key is then extended to
+   cover whole sequences.  This way, a tuple is identified with the
+   same key whether or not sequences consisting only of missing data
+   have been added to the alignment yet.  Columns are tested for
+   being all-gap lazily, since usually only the last one is needed */
+static PHAST_INLINE 
+int ss_coltuple_key_len(const char *coltuple_str, MSA *msa) {
+  int tuple_size = msa->ss->tuple_size, nseqs = msa->nseqs;
+  int allgap[tuple_size], i, j, col;
+  char missing = msa->missing[0];
+
+  for (i = 0; i < tuple_size; i++) allgap[i] = -1;
+  for (i = nseqs * tuple_size - 1; i >= 0; i--) {
+    if (coltuple_str[i] == missing) continue;
+    col = i % tuple_size;
+    if (allgap[col] == -1) {
+      for (j = 0; j < nseqs; j++)
+        if (coltuple_str[j*tuple_size + col] != GAP_CHAR &&
+            coltuple_str[j*tuple_size + col] != missing) break;
+      allgap[col] = (j == nseqs);
+    }
+    if (!allgap[col]) break;
   }
   i++;
-  while (i%msa->ss->tuple_size != 0) i++;
-  tempchar = coltuple_str[i];
-  coltuple_str[i] = '\0';
-  rv = hsh_get_int(tuple_hash, coltuple_str);
-  coltuple_str[i] = tempchar;
-  return rv;
+  while (i % tuple_size != 0) i++;
+  return i;
 }
 
-void ss_add_coltuple(char *coltuple_str, void *val, Hashtable *tuple_hash, 
-		     MSA *msa) {
-  int allgap[msa->ss->tuple_size], i, j, tuple_size, len;
-  char tempchar;
-  tuple_size = msa->ss->tuple_size;
-  len = tuple_size * msa->nseqs;
+TupleHash *ss_new_tuple_hash(MSA *msa, int est_capacity) {
+  char symbols[strlen(msa->alphabet) + strlen(msa->missing) + 2];
+  sprintf(symbols, "%s%c%s", msa->alphabet, GAP_CHAR, msa->missing);
+  return th_new(est_capacity, symbols);
+}
 
-  for (i=0; i < tuple_size; i++) {
-    for (j=0; j<msa->nseqs; j++)
-      if (coltuple_str[j*tuple_size + i]!=GAP_CHAR &&
-	  coltuple_str[j*tuple_size + i]!=msa->missing[0]) break;
-    allgap[i] = (j==msa->nseqs);
-  }
+int ss_lookup_coltuple(char *coltuple_str, TupleHash *tuple_hash, MSA *msa) {
+  return th_get(tuple_hash, coltuple_str, 
+                ss_coltuple_key_len(coltuple_str, msa));
+}
 
-  for (i=len-1; i>=0; i--)
-    if (coltuple_str[i] != msa->missing[0] && allgap[i%tuple_size]==0)
-      break;
-  i++;
+void ss_add_coltuple(char *coltuple_str, int val, TupleHash *tuple_hash, 
+		     MSA *msa) {
+  th_put(tuple_hash, coltuple_str, ss_coltuple_key_len(coltuple_str, msa),
+         val);
+}
 
-  while (i%msa->ss->tuple_size != 0) i++;
-  /* Until 1-27-2009, tempchar was not being stored! This bug took three months
-     to find and wreaked havoc with dmsample! --agd27 */
-  tempchar = coltuple_str[i];
-  coltuple_str[i] = '\0';
-  hsh_put(tuple_hash, coltuple_str, val);
-  coltuple_str[i] = tempchar;
+int ss_lookup_or_add_coltuple(char *coltuple_str, int val, 
+                              TupleHash *tuple_hash, MSA *msa) {
+  return th_get_or_put(tuple_hash, coltuple_str, 
+                       ss_coltuple_key_len(coltuple_str, msa), val);
 }
 
 
@@ -0,0 +1,244 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Dictionary of column tuples, keyed by packed strings.  See
+   tuple_hash.h */
+
+#include <string.h>
+#include "phast/misc.h"
+#include "phast/tuple_hash.h"
+
+/* final mixing step of the SplitMix64 generator */
+static PHAST_INLINE uint64_t th_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/* hash of a packed key of len symbols occupying nbytes bytes; never
+   returns 0, which marks an empty slot */
+static PHAST_INLINE uint64_t th_hash(const unsigned char *p, int64_t nbytes,
+                                     int len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len, w;
+  for (; nbytes >= 8; nbytes -= 8, p += 8) {
+    memcpy(&w, p, 8);
+    h = th_mix(h ^ w);
+  }
+  if (nbytes > 0) {
+    w = 0;
+    memcpy(&w, p, nbytes);
+    h = th_mix(h ^ w);
+  }
+  return h == 0 ? 1 : h;
+}
+
+static PHAST_INLINE int64_t th_nbytes(TupleHash *th, int len) {
+  return th->bits == 4 ? (len + 1) / 2 : len;
+}
+
+TupleHash *th_new(int est_capacity, const char *symbols) {
+  TupleHash *th = smalloc(sizeof(TupleHash));
+  int i;
+
+  th->nslots = 16;
+  while (th->nslots < est_capacity / TH_MAX_LOAD && th->nslots < (1 << 30))
+    th->nslots *= 2;
+  th->nkeys = 0;
+  th->slots = smalloc(th->nslots * sizeof(TupleHashSlot));
+  for (i = 0; i < th->nslots; i++) th->slots[i].hash = 0;
+  th->keys_alloc = 1024;
+  th->keys = smalloc(th->keys_alloc);
+  th->keys_used = 0;
+  th->scratch_len = 0;
+  th->scratch = NULL;
+
+  th->nsymbols = 0;
+  for (i = 0; i < 256; i++) th->code[i] = -1;
+  if (symbols != NULL)
+    for (i = 0; symbols[i] != '\0'; i++) {
+      unsigned char c = (unsigned char)symbols[i];
+      if (th->code[c] == -1) {
+        th->decode[th->nsymbols] = c;
+        th->code[c] = th->nsymbols++;
+      }
+    }
+  th->bits = (th->nsymbols <= 16 ? 4 : 8);
+  return th;
+}
+
+void th_free(TupleHash *th) {
+  sfree(th->slots);
+  sfree(th->keys);
+  if (th->scratch != NULL) sfree(th->scratch);
+  sfree(th);
+}
+
+void th_clear(TupleHash *th) {
+  int i;
+  if (th->nkeys == 0) return;
+  for (i = 0; i < th->nslots; i++) th->slots[i].hash = 0;
+  th->nkeys = 0;
+  th->keys_used = 0;
+}
+
+/* find slot for packed key in th->scratch; returns index of matching
+   slot or of the empty slot where it belongs */
+static PHAST_INLINE int th_find_slot(TupleHash *th, uint64_t h, int len,
+                                     int64_t nbytes) {
+  int mask = th->nslots - 1, i = (int)(h & mask);
+  TupleHashSlot *s;
+  while ((s = &th->slots[i])->hash != 0) {
+    if (s->hash == h && s->len == len &&
+        memcmp(th->keys + s->offset, th->scratch, nbytes) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* double the number of slots, reinserting existing entries (hashes
+   are stored, so keys need not be rehashed) */
+static void th_grow(TupleHash *th) {
+  TupleHashSlot *old = th->slots;
+  int i, j, oldn = th->nslots, mask;
+  th->nslots *= 2;
+  mask = th->nslots - 1;
+  th->slots = smalloc(th->nslots * sizeof(TupleHashSlot));
+  for (i = 0; i < th->nslots; i++) th->slots[i].hash = 0;
+  for (i = 0; i < oldn; i++) {
+    if (old[i].hash == 0) continue;
+    for (j = (int)(old[i].hash & mask); th->slots[j].hash != 0;
+         j = (j + 1) & mask);
+    th->slots[j] = old[i];
+  }
+  sfree(old);
+}
+
+/* switch from 4 to 8 bits per symbol, repacking and rehashing all
+   stored keys */
+static void th_widen(TupleHash *th) {
+  unsigned char *old = th->keys;
+  int i, j, mask = th->nslots - 1;
+  int64_t used = 0;
+  TupleHashSlot *slots = th->slots;
+
+  for (i = 0; i < th->nslots; i++)
+    if (slots[i].hash != 0) used += slots[i].len;
+  th->keys_alloc = max(used, 1024);
+  th->keys = smalloc(th->keys_alloc);
+  th->keys_used = 0;
+  th->bits = 8;
+
+  th->slots = smalloc(th->nslots * sizeof(TupleHashSlot));
+  for (i = 0; i < th->nslots; i++) th->slots[i].hash = 0;
+  for (i = 0; i < th->nslots; i++) {
+    TupleHashSlot s = slots[i];
+    unsigned char *dest = th->keys + th->keys_used;
+    if (s.hash == 0) continue;
+    for (j = 0; j < s.len; j++)
+      dest[j] = (old[s.offset + j/2] >> (4 * (j % 2))) & 0xf;
+    s.offset = th->keys_used;
+    s.hash = th_hash(dest, s.len, s.len);
+    th->keys_used += s.len;
+    for (j = (int)(s.hash & mask); th->slots[j].hash != 0;
+         j = (j + 1) & mask);
+    th->slots[j] = s;
+  }
+  sfree(slots);
+  sfree(old);
+}
+
+/* pack the first len characters of key into th->scratch and return
+   the number of bytes used.  Characters without a code are assigned
+   one if 'assign' is TRUE (widening the encoding if necessary);
+   otherwise -1 is returned, since such a key cannot be present */
+static int64_t th_pack(TupleHash *th, const char *key, int len, int assign) {
+  int64_t nbytes;
+  int i, c;
+  const unsigned char *k = (const unsigned char*)key;
+
+  for (i = 0; i < len; i++) {
+    if (th->code[k[i]] != -1) continue;
+    if (!assign) return -1;
+    if (th->bits == 4 && th->nsymbols == 16) th_widen(th);
+    th->decode[th->nsymbols] = k[i];
+    th->code[k[i]] = th->nsymbols++;
+  }
+
+  nbytes = th_nbytes(th, len);
+  if (nbytes > th->scratch_len) {
+    th->scratch_len = max(2 * th->scratch_len, nbytes);
+    if (th->scratch != NULL) sfree(th->scratch);
+    th->scratch = smalloc(th->scratch_len);
+  }
+  if (th->bits == 8)
+    for (i = 0; i < len; i++) th->scratch[i] = (unsigned char)th->code[k[i]];
+  else {
+    for (i = 0; i + 1 < len; i += 2)
+      th->scratch[i/2] =
+        (unsigned char)(th->code[k[i]] | (th->code[k[i+1]] << 4));
+    if (i < len) {
+      c = th->code[k[i]];
+      th->scratch[i/2] = (unsigned char)c;
+    }
+  }
+  return nbytes;
+}
+
+/* store the packed key in th->scratch at slot i */
+static void th_insert(TupleHash *th, int i, uint64_t h, int len,
+                      int64_t nbytes, int val) {
+  TupleHashSlot *s;
+  if (th->nkeys + 1 > th->nslots * TH_MAX_LOAD) {
+    th_grow(th);
+    i = th_find_slot(th, h, len, nbytes);
+  }
+  if (th->keys_used + nbytes > th->keys_alloc) {
+    th->keys_alloc = max(2 * th->keys_alloc, th->keys_used + nbytes);
+    th->keys = srealloc(th->keys, th->keys_alloc);
+  }
+  memcpy(th->keys + th->keys_used, th->scratch, nbytes);
+  s = &th->slots[i];
+  s->hash = h;
+  s->offset = th->keys_used;
+  s->len = len;
+  s->val = val;
+  th->keys_used += nbytes;
+  th->nkeys++;
+}
+
+int th_get(TupleHash *th, const char *key, int len) {
+  int64_t nbytes = th_pack(th, key, len, FALSE);
+  uint64_t h;
+  int i;
+  if (nbytes < 0) return -1;
+  h = th_hash(th->scratch, nbytes, len);
+  i = th_find_slot(th, h, len, nbytes);
+  return th->slots[i].hash == 0 ? -1 : th->slots[i].val;
+}
+
+void th_put(TupleHash *th, const char *key, int len, int val) {
+  int64_t nbytes = th_pack(th, key, len, TRUE);
+  uint64_t h = th_hash(th->scratch, nbytes, len);
+  int i = th_find_slot(th, h, len, nbytes);
+  if (th->slots[i].hash != 0) th->slots[i].val = val;
+  else th_insert(th, i, h, len, nbytes, val);
+}
+
+int th_get_or_put(TupleHash *th, const char *key, int len, int val) {
+  int64_t nbytes = th_pack(th, key, len, TRUE);
+  uint64_t h = th_hash(th->scratch, nbytes, len);
+  int i = th_find_slot(th, h, len, nbytes);
+  if (th->slots[i].hash != 0) return th->slots[i].val;
+  th_insert(th, i, h, len, nbytes, val);
+  return val;
+}
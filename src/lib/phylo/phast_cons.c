@@ -41,6 +41,8 @@ struct phastCons_struct *phastCons_struct_new(int rphast) {
   p->nrates2 = -1;
   p->refidx = 1;
   p->max_micro_indel = 20;
+  p->chunk_size = 0;
+  p->chunk_overlap = DEFAULT_CHUNK_OVERLAP;
   p->lambda = 0.9;
   p->mu = 0.01;
   p->nu = 0.01;
@@ -355,6 +357,8 @@ int phastCons(struct phastCons_struct *p) {
   else indel_mode = NONPARAMETERIC;
 
   phmm = phmm_new(hmm, mod, cm, pivot_states, indel_mode);
+  phmm->window = p->chunk_size;
+  phmm->window_overlap = p->chunk_overlap;
 
   if (FC) {
     if (!quiet)
@@ -598,7 +602,10 @@ int phastCons(struct phastCons_struct *p) {
     } else {
       double *postprobs, *postprobsNoMissing=NULL;
       int idx=0, j, k;
-      postprobs = phmm_postprobs_cats(phmm, states, &lnl);
+      /* the log likelihood is only approximate when decoding in
+         chunks; leave it to be computed below */
+      postprobs = phmm_postprobs_cats(phmm, states,
+                                      phmm->window > 0 ? NULL : &lnl);
       if (results != NULL) {
 	postprobsNoMissing = smalloc(msa->length*sizeof(double));
 	coord = smalloc(msa->length*sizeof(int));
@@ -14,10 +14,12 @@
    perform single-base LRTs, score tests, phyloP, etc. */
 
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <phast/fit_column.h>
 #include <phast/sufficient_stats.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/thread_pool.h>
 #include <time.h>
 
 #define DERIV_EPSILON 1e-6
@@ -30,6 +32,21 @@
 /* number of significant figures to which to estimate column scale
    parameters (currently affects 1d parameter estimation only) */
 
+#define COL_CHUNKS_PER_THREAD 64
+/* tasks per thread in tuple-by-tuple tests; many small tasks balance
+   the widely varying cost of optimizing scale factors for different
+   tuples */
+
+struct col_memo {
+  int maxentries;               /* capacity (depends on model size) */
+  int nentries;
+  double scale[COL_MEMO_SIZE], scale_sub[COL_MEMO_SIZE];
+  Matrix ***P[COL_MEMO_SIZE];   /* matrices by node and rate category
+                                   (NULL for root) */
+  double seen_scale[COL_MEMO_SEEN], seen_scale_sub[COL_MEMO_SEEN];
+  int nseen, next_seen;         /* ring of recent scales not in memo */
+};
+
 /* Compute and return the log likelihood of a tree model with respect
    to a single column tuple in an alignment.  This is a pared-down
    version of tl_compute_log_likelihood for use in estimation of
@@ -43,9 +60,9 @@ double col_compute_scaled_log_likelihood(TreeModel *mod, MSA *msa, int tupleidx,
 
   int i, j, k, nodeidx, rcat;
   int nstates = mod->rate_matrix->size;
-  TreeNode *n;
   double total_prob = 0;
-  List *traversal = tr_postorder(mod->tree);
+  TreePrunePlan *plan = tm_get_prune_plan(mod);
+  TreePruneOp *op;
   double **pL = NULL;
   double log_scale = 0;
   double scaling_threshold = DBL_MIN;
@@ -69,40 +86,40 @@ double col_compute_scaled_log_likelihood(TreeModel *mod, MSA *msa, int tupleidx,
   }
 
   for (rcat = 0; rcat < mod->nratecats; rcat++) {
-    for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
-      n = lst_get_ptr(traversal, nodeidx);
-      if (n->lchild == NULL) {
+    for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+      op = &plan->postorder[nodeidx];
+      if (op->lchild < 0) {
         /* leaf: base case of recursion */
         int state = mod->rate_matrix->
           inv_states[(int)ss_get_char_tuple(msa, tupleidx,
-                                            mod->msa_seq_idx[n->id], 0)];
+                                            mod->msa_seq_idx[op->node], 0)];
         for (i = 0; i < nstates; i++) {
           if (state < 0 || i == state)
-            pL[i][n->id] = 1;
+            pL[i][op->node] = 1;
           else
-            pL[i][n->id] = 0;
+            pL[i][op->node] = 0;
         }
       }
       else {
         /* general recursive case */
-        MarkovMatrix *lsubst_mat = mod->P[n->lchild->id][rcat];
-        MarkovMatrix *rsubst_mat = mod->P[n->rchild->id][rcat];
+        MarkovMatrix *lsubst_mat = mod->P[op->lchild][rcat];
+        MarkovMatrix *rsubst_mat = mod->P[op->rchild][rcat];
         for (i = 0; i < nstates; i++) {
           double totl = 0, totr = 0;
           for (j = 0; j < nstates; j++)
-            totl += pL[j][n->lchild->id] *
+            totl += pL[j][op->lchild] *
               mm_get(lsubst_mat, i, j);
 
           for (k = 0; k < nstates; k++)
-            totr += pL[k][n->rchild->id] *
+            totr += pL[k][op->rchild] *
               mm_get(rsubst_mat, i, k);
           
           if (totl * totr < scaling_threshold) {
-            pL[i][n->id] = (totl / scaling_threshold) * totr;
+            pL[i][op->node] = (totl / scaling_threshold) * totr;
             log_scale -= log(scaling_threshold);
           }
           else {
-            pL[i][n->id] = totl * totr;
+            pL[i][op->node] = totl * totr;
           }
         }
       }
@@ -306,9 +323,9 @@ double col_scale_derivs(ColFitData *d, double *first_deriv,
 
   int i, j, k, nodeidx, rcat;
   int nstates = d->mod->rate_matrix->size;
-  TreeNode *n;
   double total_prob = 0;
-  List *traversal = tr_postorder(d->mod->tree);
+  TreePrunePlan *plan = tm_get_prune_plan(d->mod);
+  TreePruneOp *op;
   double **L=NULL;                   /* partial likelihoods */
   double **LL=NULL;                  /* 1st deriv of partial likelihoods wrt
                                    scale param */
@@ -348,59 +365,59 @@ double col_scale_derivs(ColFitData *d, double *first_deriv,
   col_scale_derivs_subst(d);
 
   for (rcat = 0; rcat < d->mod->nratecats; rcat++) {
-    for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
-      n = lst_get_ptr(traversal, nodeidx);
-      if (n->lchild == NULL) {
+    for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+      op = &plan->postorder[nodeidx];
+      if (op->lchild < 0) {
         /* leaf: base case of recursion */
         int state = d->mod->rate_matrix->
           inv_states[(int)ss_get_char_tuple(d->msa, d->tupleidx,
-                                            d->mod->msa_seq_idx[n->id], 0)];
+                                            d->mod->msa_seq_idx[op->node], 0)];
         for (i = 0; i < nstates; i++) {
           if (state < 0 || i == state)
-            L[i][n->id] = 1;
+            L[i][op->node] = 1;
           else
-            L[i][n->id] = 0;
+            L[i][op->node] = 0;
 
-          LL[i][n->id] = 0;
-          if (second_deriv != NULL) LLL[i][n->id] = 0;
+          LL[i][op->node] = 0;
+          if (second_deriv != NULL) LLL[i][op->node] = 0;
         }
       }
       else {
         /* general recursive case */
-        MarkovMatrix *lsubst_mat = d->mod->P[n->lchild->id][rcat];
-        MarkovMatrix *rsubst_mat = d->mod->P[n->rchild->id][rcat];
+        MarkovMatrix *lsubst_mat = d->mod->P[op->lchild][rcat];
+        MarkovMatrix *rsubst_mat = d->mod->P[op->rchild][rcat];
         for (i = 0; i < nstates; i++) {
           double totl = 0, totr = 0, A = 0, B = 0, E = 0, F = 0;
           for (j = 0; j < nstates; j++) {
-            totl += L[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
+            totl += L[j][op->lchild] * mm_get(lsubst_mat, i, j);
 
-            A += (L[j][n->lchild->id] * d->PP[n->lchild->id][rcat]->data[i][j]) +
-              (LL[j][n->lchild->id] * mm_get(lsubst_mat, i, j));
+            A += (L[j][op->lchild] * d->PP[op->lchild][rcat]->data[i][j]) +
+              (LL[j][op->lchild] * mm_get(lsubst_mat, i, j));
           }
 
           for (k = 0; k < nstates; k++) {
-            totr += L[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
+            totr += L[k][op->rchild] * mm_get(rsubst_mat, i, k);
 
-            B += (L[k][n->rchild->id] * d->PP[n->rchild->id][rcat]->data[i][k]) +
-              (LL[k][n->rchild->id] * mm_get(rsubst_mat, i, k));
+            B += (L[k][op->rchild] * d->PP[op->rchild][rcat]->data[i][k]) +
+              (LL[k][op->rchild] * mm_get(rsubst_mat, i, k));
 
           }
 
-          L[i][n->id] = totl * totr;
-          LL[i][n->id] = totr*A + totl*B;
+          L[i][op->node] = totl * totr;
+          LL[i][op->node] = totr*A + totl*B;
 
           if (second_deriv != NULL) {
             for (j = 0; j < nstates; j++)
-              E += L[j][n->lchild->id] * d->PPP[n->lchild->id][rcat]->data[i][j] +
-                2 * LL[j][n->lchild->id] * d->PP[n->lchild->id][rcat]->data[i][j] +
-                LLL[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
+              E += L[j][op->lchild] * d->PPP[op->lchild][rcat]->data[i][j] +
+                2 * LL[j][op->lchild] * d->PP[op->lchild][rcat]->data[i][j] +
+                LLL[j][op->lchild] * mm_get(lsubst_mat, i, j);
 
             for (k = 0; k < nstates; k++)
-              F += L[k][n->rchild->id] * d->PPP[n->rchild->id][rcat]->data[i][k] +
-                2 * LL[k][n->rchild->id] * d->PP[n->rchild->id][rcat]->data[i][k] +
-                LLL[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
+              F += L[k][op->rchild] * d->PPP[op->rchild][rcat]->data[i][k] +
+                2 * LL[k][op->rchild] * d->PP[op->rchild][rcat]->data[i][k] +
+                LLL[k][op->rchild] * mm_get(rsubst_mat, i, k);
 
-            LLL[i][n->id] = totr*E + 2*A*B + totl*F;
+            LLL[i][op->node] = totr*E + 2*A*B + totl*F;
           }
         }
       }
@@ -456,9 +473,9 @@ double col_scale_derivs_subtree(ColFitData *d, Vector *gradient,
                                 Matrix *hessian, double ***scratch) {
   int i, j, k, nodeidx, rcat;
   int nstates = d->mod->rate_matrix->size;
-  TreeNode *n;
   double total_prob = 0;
-  List *traversal = tr_postorder(d->mod->tree);
+  TreePrunePlan *plan = tm_get_prune_plan(d->mod);
+  TreePruneOp *op;
   double **L=NULL;                   /* partial likelihoods */
   double **LL=NULL;                  /* 1st deriv of partial likelihoods wrt
                                    1st scale param */
@@ -523,86 +540,86 @@ double col_scale_derivs_subtree(ColFitData *d, Vector *gradient,
   col_scale_derivs_subst(d);
 
   for (rcat = 0; rcat < d->mod->nratecats; rcat++) {
-    for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
-      n = lst_get_ptr(traversal, nodeidx);
-      if (n->lchild == NULL) {
+    for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+      op = &plan->postorder[nodeidx];
+      if (op->lchild < 0) {
         /* leaf: base case of recursion */
         int state = d->mod->rate_matrix->
           inv_states[(int)ss_get_char_tuple(d->msa, d->tupleidx,
-                                            d->mod->msa_seq_idx[n->id], 0)];
+                                            d->mod->msa_seq_idx[op->node], 0)];
         for (i = 0; i < nstates; i++) {
           if (state < 0 || i == state)
-            L[i][n->id] = 1;
+            L[i][op->node] = 1;
           else
-            L[i][n->id] = 0;
+            L[i][op->node] = 0;
 
-          LL[i][n->id] = MM[i][n->id] = 0;
+          LL[i][op->node] = MM[i][op->node] = 0;
           if (pd2 != NULL)
-            LLL[i][n->id] = MMM[i][n->id] = NNN[i][n->id] = 0;
+            LLL[i][op->node] = MMM[i][op->node] = NNN[i][op->node] = 0;
         }
       }
       else {
         /* general recursive case */
-        MarkovMatrix *lsubst_mat = d->mod->P[n->lchild->id][rcat];
-        MarkovMatrix *rsubst_mat = d->mod->P[n->rchild->id][rcat];
+        MarkovMatrix *lsubst_mat = d->mod->P[op->lchild][rcat];
+        MarkovMatrix *rsubst_mat = d->mod->P[op->rchild][rcat];
         for (i = 0; i < nstates; i++) {
           double totl = 0, totr = 0, A = 0, B = 0, C = 0, D = 0, E = 0,
             F = 0, G = 0, H = 0, I = 0, J = 0;
           for (j = 0; j < nstates; j++) {
-            totl += L[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
+            totl += L[j][op->lchild] * mm_get(lsubst_mat, i, j);
 
-            A += (L[j][n->lchild->id] * d->PP[n->lchild->id][rcat]->data[i][j]) +
-              (LL[j][n->lchild->id] * mm_get(lsubst_mat, i, j));
+            A += (L[j][op->lchild] * d->PP[op->lchild][rcat]->data[i][j]) +
+              (LL[j][op->lchild] * mm_get(lsubst_mat, i, j));
 
-            C += (L[j][n->lchild->id] * d->QQ[n->lchild->id][rcat]->data[i][j]) +
-              (MM[j][n->lchild->id] * mm_get(lsubst_mat, i, j));
+            C += (L[j][op->lchild] * d->QQ[op->lchild][rcat]->data[i][j]) +
+              (MM[j][op->lchild] * mm_get(lsubst_mat, i, j));
           }
 
           for (k = 0; k < nstates; k++) {
-            totr += L[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
+            totr += L[k][op->rchild] * mm_get(rsubst_mat, i, k);
 
-            B += (L[k][n->rchild->id] * d->PP[n->rchild->id][rcat]->data[i][k]) +
-              (LL[k][n->rchild->id] * mm_get(rsubst_mat, i, k));
+            B += (L[k][op->rchild] * d->PP[op->rchild][rcat]->data[i][k]) +
+              (LL[k][op->rchild] * mm_get(rsubst_mat, i, k));
 
-            D += (L[k][n->rchild->id] * d->QQ[n->rchild->id][rcat]->data[i][k]) +
-              (MM[k][n->rchild->id] * mm_get(rsubst_mat, i, k));
+            D += (L[k][op->rchild] * d->QQ[op->rchild][rcat]->data[i][k]) +
+              (MM[k][op->rchild] * mm_get(rsubst_mat, i, k));
 
           }
 
-          L[i][n->id] = totl * totr;
-          LL[i][n->id] = totr*A + totl*B;
-          MM[i][n->id] = totr*C + totl*D;
+          L[i][op->node] = totl * totr;
+          LL[i][op->node] = totr*A + totl*B;
+          MM[i][op->node] = totr*C + totl*D;
 
           if (pd2 != NULL) {
             for (j = 0; j < nstates; j++) {
-              E += L[j][n->lchild->id] * d->PPP[n->lchild->id][rcat]->data[i][j] +
-                2 * LL[j][n->lchild->id] * d->PP[n->lchild->id][rcat]->data[i][j] +
-                LLL[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
-              G += L[j][n->lchild->id] * d->QQQ[n->lchild->id][rcat]->data[i][j] +
-                2 * MM[j][n->lchild->id] * d->QQ[n->lchild->id][rcat]->data[i][j] +
-                MMM[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
-              I += L[j][n->lchild->id] * d->RRR[n->lchild->id][rcat]->data[i][j] +
-                MM[j][n->lchild->id] * d->PP[n->lchild->id][rcat]->data[i][j] +
-                LL[j][n->lchild->id] * d->QQ[n->lchild->id][rcat]->data[i][j] +
-                NNN[j][n->lchild->id] * mm_get(lsubst_mat, i, j);
+              E += L[j][op->lchild] * d->PPP[op->lchild][rcat]->data[i][j] +
+                2 * LL[j][op->lchild] * d->PP[op->lchild][rcat]->data[i][j] +
+                LLL[j][op->lchild] * mm_get(lsubst_mat, i, j);
+              G += L[j][op->lchild] * d->QQQ[op->lchild][rcat]->data[i][j] +
+                2 * MM[j][op->lchild] * d->QQ[op->lchild][rcat]->data[i][j] +
+                MMM[j][op->lchild] * mm_get(lsubst_mat, i, j);
+              I += L[j][op->lchild] * d->RRR[op->lchild][rcat]->data[i][j] +
+                MM[j][op->lchild] * d->PP[op->lchild][rcat]->data[i][j] +
+                LL[j][op->lchild] * d->QQ[op->lchild][rcat]->data[i][j] +
+                NNN[j][op->lchild] * mm_get(lsubst_mat, i, j);
             }
 
             for (k = 0; k < nstates; k++) {
-              F += L[k][n->rchild->id] * d->PPP[n->rchild->id][rcat]->data[i][k] +
-                2 * LL[k][n->rchild->id] * d->PP[n->rchild->id][rcat]->data[i][k] +
-                LLL[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
-              H += L[k][n->rchild->id] * d->QQQ[n->rchild->id][rcat]->data[i][k] +
-                2 * MM[k][n->rchild->id] * d->QQ[n->rchild->id][rcat]->data[i][k] +
-                MMM[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
-              J += L[k][n->rchild->id] * d->RRR[n->rchild->id][rcat]->data[i][k] +
-                MM[k][n->rchild->id] * d->PP[n->rchild->id][rcat]->data[i][k] +
-                LL[k][n->rchild->id] * d->QQ[n->rchild->id][rcat]->data[i][k] +
-                NNN[k][n->rchild->id] * mm_get(rsubst_mat, i, k);
+              F += L[k][op->rchild] * d->PPP[op->rchild][rcat]->data[i][k] +
+                2 * LL[k][op->rchild] * d->PP[op->rchild][rcat]->data[i][k] +
+                LLL[k][op->rchild] * mm_get(rsubst_mat, i, k);
+              H += L[k][op->rchild] * d->QQQ[op->rchild][rcat]->data[i][k] +
+                2 * MM[k][op->rchild] * d->QQ[op->rchild][rcat]->data[i][k] +
+                MMM[k][op->rchild] * mm_get(rsubst_mat, i, k);
+              J += L[k][op->rchild] * d->RRR[op->rchild][rcat]->data[i][k] +
+                MM[k][op->rchild] * d->PP[op->rchild][rcat]->data[i][k] +
+                LL[k][op->rchild] * d->QQ[op->rchild][rcat]->data[i][k] +
+                NNN[k][op->rchild] * mm_get(rsubst_mat, i, k);
             }
 
-            LLL[i][n->id] = totr*E + 2*A*B + totl*F;
-            MMM[i][n->id] = totr*G + 2*C*D + totl*H;
-            NNN[i][n->id] = totr*I + A*D + B*C + totl*J;
+            LLL[i][op->node] = totr*E + 2*A*B + totl*F;
+            MMM[i][op->node] = totr*G + 2*C*D + totl*H;
+            NNN[i][op->node] = totr*I + A*D + B*C + totl*J;
           }
         }
       }
@@ -666,6 +683,62 @@ double col_scale_derivs_subtree(ColFitData *d, Vector *gradient,
 }
 
 
+/* Set substitution matrices for the current scale factors of d->mod,
+   copying them from the memo if possible.  A set of matrices is
+   memoized the second time its scale factors are requested (within
+   the last COL_MEMO_SEEN misses), so that the memo fills with values
+   that recur from tuple to tuple rather than with the intermediate
+   values of a particular optimization */
+void col_set_subst_matrices(ColFitData *d) {
+  ColMemo *m = d->memo;
+  TreeModel *mod = d->mod;
+  double scale = mod->scale, scale_sub = mod->scale_sub;
+  int e, nid, rcat;
+
+  for (e = 0; e < m->nentries; e++) {
+    if (m->scale[e] == scale && m->scale_sub[e] == scale_sub) {
+      for (nid = 0; nid < mod->tree->nnodes; nid++) {
+        if (m->P[e][nid] == NULL) continue;
+        for (rcat = 0; rcat < mod->nratecats; rcat++)
+          mat_copy(mod->P[nid][rcat]->matrix, m->P[e][nid][rcat]);
+      }
+      return;
+    }
+  }
+
+  tm_set_subst_matrices(mod);
+
+  if (m->nentries == m->maxentries) return;
+  for (e = 0; e < m->nseen; e++)
+    if (m->seen_scale[e] == scale && m->seen_scale_sub[e] == scale_sub)
+      break;
+
+  if (e == m->nseen) {          /* first request; just remember it */
+    m->seen_scale[m->next_seen] = scale;
+    m->seen_scale_sub[m->next_seen] = scale_sub;
+    m->next_seen = (m->next_seen + 1) % COL_MEMO_SEEN;
+    if (m->nseen < COL_MEMO_SEEN) m->nseen++;
+    return;
+  }
+
+  /* repeated request; memoize */
+  m->seen_scale[e] = m->seen_scale_sub[e] = -1;
+  e = m->nentries++;
+  m->scale[e] = scale;
+  m->scale_sub[e] = scale_sub;
+  m->P[e] = smalloc(mod->tree->nnodes * sizeof(void*));
+  for (nid = 0; nid < mod->tree->nnodes; nid++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, nid);
+    if (n->parent == NULL) {
+      m->P[e][nid] = NULL;
+      continue;
+    }
+    m->P[e][nid] = smalloc(mod->nratecats * sizeof(void*));
+    for (rcat = 0; rcat < mod->nratecats; rcat++)
+      m->P[e][nid][rcat] = mat_create_copy(mod->P[nid][rcat]->matrix);
+  }
+}
+
 /* Wrapper for likelihood function for use in parameter estimation */
 double col_likelihood_wrapper(Vector *params, void *data) {
   ColFitData *d = (ColFitData*)data;
@@ -675,7 +748,7 @@ double col_likelihood_wrapper(Vector *params, void *data) {
     d->mod->scale_sub = vec_get(params, 1);
 
   /* reestimate subst models on edges */
-  tm_set_subst_matrices(d->mod);
+  col_set_subst_matrices(d);
 
   return -1 * col_compute_scaled_log_likelihood(d->mod, d->msa, d->tupleidx,
                                                 d->fels_scratch[0]);
@@ -691,7 +764,7 @@ double col_likelihood_wrapper_1d(double x, void *data) {
   d->mod->scale = x;
 
   /* reestimate subst models on edges */
-  tm_set_subst_matrices(d->mod);
+  col_set_subst_matrices(d);
 
   return -1 * col_compute_scaled_log_likelihood(d->mod, d->msa, d->tupleidx,
                                                 d->fels_scratch[0]);
@@ -734,6 +807,203 @@ double col_deriv2_wrapper_1d(double x, void *data, double lb, double ub) {
   return d->deriv2;
 }
 
+/* Per-thread models and scratch memory for the tuple-by-tuple tests
+   below.  Thread 0 works directly with the caller's model; other
+   threads work with copies, so that each has its own substitution
+   matrices and fitting data. */
+typedef struct {
+  TreeModel *mod;               /* model (a copy, except in thread 0) */
+  TreeModel *modcpy;            /* copy of mod without subtree info,
+                                   for null model of subtree tests
+                                   (NULL otherwise) */
+  ColFitData *d;                /* fitting data for mod, or for modcpy
+                                   in subtree tests */
+  ColFitData *d2;               /* fitting data for mod in subtree
+                                   tests (NULL otherwise) */
+  Vector *grad;                 /* gradient for subtree score test */
+  int *has_data;                /* informative branches for GERP */
+} ColWorker;
+
+typedef struct col_job ColJob;
+
+/* function that performs a test for a single tuple */
+typedef void (*col_tuple_func)(ColJob *job, ColWorker *w, int tupleidx);
+
+/* data shared by all threads in a tuple-by-tuple test.  Per-tuple
+   outputs are those of the public functions (any may be NULL) */
+struct col_job {
+  MSA *msa;
+  mode_type mode;
+  FILE *logf;
+  col_tuple_func func;
+  ColWorker *workers;           /* indexed by thread */
+  int nworkers;
+  int chunk;                    /* number of tuples per task */
+  double fim;                   /* Fisher information (score test) */
+  FimGrid *grid;                /* grid of FIMs (subtree score test) */
+  List *inside, *outside;       /* leaves inside and outside subtree */
+  double *pvals, *null_scales, *scales, *sub_scales, *llrs, *derivs,
+    *sub_derivs, *teststats, *nneut, *nobs, *nrejected, *nspec;
+};
+
+/* Prepare a tuple-by-tuple test with one worker per thread used (or a
+   single worker if a log file is in use, so that its contents are as
+   in a serial run).  Fitting data are created as for stype (ALL or
+   SUBTREE) and mode; in the subtree case, the null model is always
+   fitted with mode NNEUT.  All copies of mod are made before any
+   fitting data are created, so that every worker starts from the
+   same state as the caller's model. */
+static void col_job_init(ColJob *job, TreeModel *mod, MSA *msa,
+                         scale_type stype, mode_type mode, FILE *logf) {
+  int t;
+
+  memset(job, 0, sizeof(ColJob));
+  job->msa = msa;
+  job->mode = mode;
+  job->logf = logf;
+  job->nworkers = (logf == NULL ? thr_nthreads_for(msa->ss->ntuples) : 1);
+  job->chunk = max(1, msa->ss->ntuples /
+                   (job->nworkers * COL_CHUNKS_PER_THREAD));
+  job->workers = smalloc(job->nworkers * sizeof(ColWorker));
+
+  for (t = 0; t < job->nworkers; t++)
+    job->workers[t].mod = (t == 0 ? mod : tm_create_copy(mod));
+
+  for (t = 0; t < job->nworkers; t++) {
+    ColWorker *w = &job->workers[t];
+    if (stype == ALL) {
+      w->modcpy = NULL;
+      w->d = col_init_fit_data(w->mod, msa, ALL, mode, FALSE);
+      w->d2 = NULL;
+    }
+    else {
+      w->modcpy = tm_create_copy(w->mod);
+      w->modcpy->subtree_root = NULL;
+      w->d = col_init_fit_data(w->modcpy, msa, ALL, NNEUT, FALSE);
+      w->d2 = col_init_fit_data(w->mod, msa, SUBTREE, mode, FALSE);
+                                /* mod has the subtree info, modcpy
+                                   does not */
+    }
+    tm_get_prune_plan(w->mod);  /* build now rather than within a
+                                   task */
+    if (w->modcpy != NULL) tm_get_prune_plan(w->modcpy);
+    w->grad = vec_new(2);
+    w->has_data = smalloc(mod->tree->nnodes * sizeof(int));
+  }
+}
+
+static void col_job_free(ColJob *job) {
+  int t;
+  for (t = 0; t < job->nworkers; t++) {
+    ColWorker *w = &job->workers[t];
+    col_free_fit_data(w->d);
+    if (w->d2 != NULL) col_free_fit_data(w->d2);
+    if (w->modcpy != NULL) {
+      w->modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
+                                /* have to revert for tm_free to work
+                                   correctly */
+      tm_free(w->modcpy);
+    }
+    if (t > 0) {
+      w->mod->estimate_branchlens = TM_BRANCHLENS_ALL;
+      tm_free(w->mod);
+    }
+    vec_free(w->grad);
+    sfree(w->has_data);
+  }
+  sfree(job->workers);
+}
+
+static void col_tuple_task(void *data, int task, int thread) {
+  ColJob *job = (ColJob*)data;
+  int i, end = min((task+1) * job->chunk, job->msa->ss->ntuples);
+  for (i = task * job->chunk; i < end; i++)
+    job->func(job, &job->workers[thread], i);
+}
+
+/* Apply job->func to every tuple.  Per-tuple computations are
+   independent, so results do not depend on the number of threads */
+static void col_job_run(ColJob *job) {
+  int i, ntuples = job->msa->ss->ntuples;
+  if (job->nworkers == 1) {
+    for (i = 0; i < ntuples; i++) {
+      checkInterruptN(i, 100);
+      job->func(job, &job->workers[0], i);
+    }
+  }
+  else
+    thr_parallel_for((ntuples + job->chunk - 1) / job->chunk,
+                     col_tuple_task, job);
+}
+
+/* compute p-value from chi-sq test statistic and store it */
+static void col_store_pval(ColJob *job, int tupleidx, double teststat,
+                           int accel) {
+  double *p;
+  if (job->pvals == NULL) return;
+  p = &job->pvals[tupleidx];
+  if (job->mode == NNEUT || job->mode == CONACC)
+    *p = chisq_cdf(teststat, 1, FALSE);
+  else
+    *p = half_chisq_cdf(teststat, 1, FALSE);
+  /* assumes 50:50 mix of chisq and point mass at zero, due to
+     bounding of param */
+
+  if (*p < 1e-20)
+    *p = 1e-20;
+  /* approx limit of eval of tail prob; pvals of 0 cause problems */
+
+  if (job->mode == CONACC && accel)
+    *p *= -1;                   /* mark as acceleration */
+}
+
+/* LRT for a single tuple (see col_lrts) */
+static void col_lrts_tuple(ColJob *job, ColWorker *w, int i) {
+  TreeModel *mod = w->mod;
+  ColFitData *d = w->d;
+  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+
+  /* first check for actual substitution data in column; if none,
+     don't waste time computing likelihoods */
+  if (!col_has_data(mod, job->msa, i)) {
+    delta_lnl = 0;
+    this_scale = 1;
+  }
+
+  else {                        /* compute null and alt lnl */
+    mod->scale = 1;
+    col_set_subst_matrices(d);
+
+    /* compute log likelihoods under null and alt hypotheses */
+    null_lnl = col_compute_scaled_log_likelihood(mod, job->msa, i,
+                                                 d->fels_scratch[0]);
+
+    vec_set(d->params, 0, d->init_scale);
+    d->tupleidx = i;
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &alt_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  job->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    alt_lnl *= -1;
+    this_scale = d->params->data[0];
+
+    delta_lnl = alt_lnl - null_lnl;
+    if (delta_lnl <= -0.01)
+      die("ERROR col_lrts: delta_lnl = %e < -0.01\n", delta_lnl);
+    if (delta_lnl < 0) delta_lnl = 0;
+  } /* end estimation of delta_lnl */
+
+  /* compute p-vals via chi-sq */
+  col_store_pval(job, i, 2*delta_lnl, this_scale > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (job->scales != NULL) job->scales[i] = this_scale;
+  if (job->llrs != NULL) job->llrs[i] = delta_lnl;
+}
+
 /* Perform a likelihood ratio test for each column tuple in an
    alignment, comparing the given null model with an alternative model
    that has a free scaling parameter for all branches.  Assumes a 0th
@@ -746,72 +1016,80 @@ double col_deriv2_wrapper_1d(double x, void *data, double lb, double ub) {
    (for 1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale) */
 void col_lrts(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_pvals,
               double *tuple_scales, double *tuple_llrs, FILE *logf) {
-  int i;
-  ColFitData *d;
-  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+  ColJob job;
 
-  /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, mode, FALSE);
+  /* init ColFitData for each thread */
+  col_job_init(&job, mod, msa, ALL, mode, logf);
+  job.func = col_lrts_tuple;
+  job.pvals = tuple_pvals;
+  job.scales = tuple_scales;
+  job.llrs = tuple_llrs;
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
+  col_job_run(&job);
 
-    /* first check for actual substitution data in column; if none,
-       don't waste time computing likelihoods */
-    if (!col_has_data(mod, msa, i)) {
-      delta_lnl = 0;
-      this_scale = 1;
-    }
-
-    else {                      /* compute null and alt lnl */
-      mod->scale = 1;
-      tm_set_subst_matrices(mod);
-
-      /* compute log likelihoods under null and alt hypotheses */
-      null_lnl = col_compute_scaled_log_likelihood(mod, msa, i, d->fels_scratch[0]);
-
-      vec_set(d->params, 0, d->init_scale);
-      d->tupleidx = i;
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &alt_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      alt_lnl *= -1;
-      this_scale = d->params->data[0];
-
-      delta_lnl = alt_lnl - null_lnl;
-      if (delta_lnl <= -0.01)
-	die("ERROR col_lrts: delta_lnl = %e < -0.01\n", delta_lnl);
-      if (delta_lnl < 0) delta_lnl = 0;
-    } /* end estimation of delta_lnl */
-
-    /* compute p-vals via chi-sq */
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero, due to
-           bounding of param */
+  col_job_free(&job);
+}
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+/* Subtree LRT for a single tuple (see col_lrts_sub) */
+static void col_lrts_sub_tuple(ColJob *job, ColWorker *w, int i) {
+  ColFitData *d = w->d, *d2 = w->d2;
+  double null_lnl, alt_lnl, delta_lnl;
 
-      if (mode == CONACC && this_scale > 1)
-          tuple_pvals[i] *= -1; /* mark as acceleration */
-    }
+  /* first check for informative substitution data in column; if none,
+     don't waste time computing likeihoods */
+  if (!col_has_data_sub(w->mod, job->msa, i, job->inside, job->outside)) {
+    delta_lnl = 0;
+    d->params->data[0] = d2->params->data[0] = d2->params->data[1] = 1;
+  }
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_scales != NULL) tuple_scales[i] = this_scale;
-    if (tuple_llrs != NULL) tuple_llrs[i] = delta_lnl;
+  else {
+    /* compute log likelihoods under null and alt hypotheses */
+    d->tupleidx = i;
+    vec_set(d->params, 0, d->init_scale);
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &null_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  job->logf, NULL, NULL);
+
+    //      opt_bfgs(col_likelihood_wrapper, d->params, d, &null_lnl, d->lb,
+    //	       d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL);
+
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+    null_lnl *= -1;
+
+    d2->tupleidx = i;
+    vec_set(d2->params, 0, max(0.05, d->params->data[0]));
+    /* init to previous estimate to save time, but don't init to
+       value at boundary */
+    vec_set(d2->params, 1, d2->init_scale_sub);
+
+    if (opt_bfgs(col_likelihood_wrapper, d2->params, d2, &alt_lnl, d2->lb,
+                 d2->ub, job->logf, NULL, OPT_HIGH_PREC, NULL, NULL) != 0)
+      ;                         /* do nothing; nonzero exit typically
+                                   occurs when max iterations is
+                                   reached; a warning is printed to
+                                   the log */
+    alt_lnl *= -1;
+
+    delta_lnl = alt_lnl - null_lnl;
+    if (delta_lnl <= -0.1)
+      die("ERROR col_lrts_sub: delta_lnl = %e <= -0.1\n", delta_lnl);
+    if (delta_lnl < 0) delta_lnl = 0;
   }
 
-  col_free_fit_data(d);
+  /* compute p-vals via chi-sq */
+  col_store_pval(job, i, 2*delta_lnl, d2->params->data[1] > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (job->null_scales != NULL)
+    job->null_scales[i] = d->params->data[0];
+  if (job->scales != NULL)
+    job->scales[i] = d2->params->data[0];
+  if (job->sub_scales != NULL)
+    job->sub_scales[i] = d2->params->data[1];
+  if (job->llrs != NULL)
+    job->llrs[i] = delta_lnl;
 }
 
 /* Subtree version of LRT */
@@ -819,177 +1097,152 @@ void col_lrts_sub(TreeModel *mod, MSA *msa, mode_type mode,
                   double *tuple_pvals, double *tuple_null_scales,
                   double *tuple_scales, double *tuple_sub_scales,
                   double *tuple_llrs, FILE *logf) {
-  int i;
-  ColFitData *d, *d2;
-  double null_lnl, alt_lnl, delta_lnl;
-  TreeModel *modcpy;
-  List *inside=NULL, *outside=NULL;
-
-  modcpy = tm_create_copy(mod);   /* need separate copy of tree model
-                                     with different internal scaling
-                                     data for supertree/subtree case */
-  modcpy->subtree_root = NULL;
-
-  /* init ColFitData -- one for null model, one for alt */
-  d = col_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = col_init_fit_data(mod, msa, SUBTREE, mode, FALSE);
-                                /* mod has the subtree info, modcpy
-                                   does not */
+  ColJob job;
+
+  /* init ColFitData for each thread -- one for null model, one for
+     alt (each thread has separate copies of the tree model with
+     different internal scaling data for supertree/subtree case) */
+  col_job_init(&job, mod, msa, SUBTREE, mode, logf);
+  job.func = col_lrts_sub_tuple;
+  job.pvals = tuple_pvals;
+  job.null_scales = tuple_null_scales;
+  job.scales = tuple_scales;
+  job.sub_scales = tuple_sub_scales;
+  job.llrs = tuple_llrs;
 
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes);
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    job.inside = lst_new_ptr(mod->tree->nnodes);
+    job.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, job.inside,
+                        job.outside);
   }
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
+  col_job_run(&job);
 
-    /* first check for informative substitution data in column; if none,
-       don't waste time computing likeihoods */
-    if (!col_has_data_sub(mod, msa, i, inside, outside)) {
-      delta_lnl = 0;
-      d->params->data[0] = d2->params->data[0] = d2->params->data[1] = 1;
-    }
+  col_job_free(&job);
+  if (job.inside != NULL) lst_free(job.inside);
+  if (job.outside != NULL) lst_free(job.outside);
+}
 
-    else {
-      /* compute log likelihoods under null and alt hypotheses */
-      d->tupleidx = i;
-      vec_set(d->params, 0, d->init_scale);
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &null_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-
-      //      opt_bfgs(col_likelihood_wrapper, d->params, d, &null_lnl, d->lb,
-      //	       d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL);
-
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-      null_lnl *= -1;
-
-      d2->tupleidx = i;
-      vec_set(d2->params, 0, max(0.05, d->params->data[0]));
-      /* init to previous estimate to save time, but don't init to
-         value at boundary */
-      vec_set(d2->params, 1, d2->init_scale_sub);
-
-      if (opt_bfgs(col_likelihood_wrapper, d2->params, d2, &alt_lnl, d2->lb,
-                   d2->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL) != 0)
-        ;                         /* do nothing; nonzero exit typically
-                                     occurs when max iterations is
-                                     reached; a warning is printed to
-                                     the log */
-      alt_lnl *= -1;
-
-      delta_lnl = alt_lnl - null_lnl;
-      if (delta_lnl <= -0.1)
-	die("ERROR col_lrts_sub: delta_lnl = %e <= -0.1\n", delta_lnl);
-      if (delta_lnl < 0) delta_lnl = 0;
-    }
+/* Score test for a single tuple (see col_score_tests) */
+static void col_score_test_tuple(ColJob *job, ColWorker *w, int i) {
+  ColFitData *d = w->d;
+  double first_deriv, teststat;
 
-    /* compute p-vals via chi-sq */
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero, due to
-           bounding of param */
+  /* first check for actual substitution data in column; if none,
+     don't waste time computing score */
+  if (!col_has_data(w->mod, job->msa, i)) {
+    first_deriv = 0;
+    teststat = 0;
+  }
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+  else {
+    d->tupleidx = i;
 
-      if (mode == CONACC && d2->params->data[1] > 1)
-        tuple_pvals[i] *= -1;    /* mark as acceleration */
-    }
+    col_scale_derivs(d, &first_deriv, NULL, d->fels_scratch);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_null_scales != NULL)
-      tuple_null_scales[i] = d->params->data[0];
-    if (tuple_scales != NULL)
-      tuple_scales[i] = d2->params->data[0];
-    if (tuple_sub_scales != NULL)
-      tuple_sub_scales[i] = d2->params->data[1];
-    if (tuple_llrs != NULL)
-      tuple_llrs[i] = delta_lnl;
+    teststat = first_deriv*first_deriv / job->fim;
+
+    if ((job->mode == ACC && first_deriv < 0) ||
+        (job->mode == CON && first_deriv > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
   }
 
-  col_free_fit_data(d);
-  col_free_fit_data(d2);
-  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
-                                /* have to revert for tm_free to work
-                                   correctly */
-  tm_free(modcpy);
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
+  col_store_pval(job, i, teststat, first_deriv > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (job->derivs != NULL) job->derivs[i] = first_deriv;
+  if (job->teststats != NULL) job->teststats[i] = teststat;
 }
 
 /* Score test */
 void col_score_tests(TreeModel *mod, MSA *msa, mode_type mode,
                      double *tuple_pvals, double *tuple_derivs,
                      double *tuple_teststats) {
-  int i;
-  ColFitData *d;
-  double first_deriv, teststat, fim;
+  ColJob job;
 
-  /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
+  /* init ColFitData for each thread */
+  col_job_init(&job, mod, msa, ALL, NNEUT, NULL);
+  job.mode = mode;
+  job.func = col_score_test_tuple;
+  job.pvals = tuple_pvals;
+  job.derivs = tuple_derivs;
+  job.teststats = tuple_teststats;
 
   /* precompute FIM */
-  fim = col_estimate_fim(mod);
+  job.fim = col_estimate_fim(mod);
 
-  if (fim < 0)
+  if (job.fim < 0)
     die("ERROR: negative fisher information in col_score_tests\n");
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 1000);
+  col_job_run(&job);
 
-    /* first check for actual substitution data in column; if none,
-       don't waste time computing score */
-    if (!col_has_data(mod, msa, i)) {
-      first_deriv = 0;
-      teststat = 0;
-    }
-
-    else {
-      d->tupleidx = i;
-
-      col_scale_derivs(d, &first_deriv, NULL, d->fels_scratch);
-
-      teststat = first_deriv*first_deriv / fim;
-
-      if ((mode == ACC && first_deriv < 0) ||
-          (mode == CON && first_deriv > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
-    }
+  col_job_free(&job);
+}
 
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero */
+/* Subtree score test for a single tuple (see col_score_tests_sub) */
+static void col_score_test_sub_tuple(ColJob *job, ColWorker *w, int i) {
+  ColFitData *d = w->d, *d2 = w->d2;
+  Vector *grad = w->grad;
+  Matrix *fim;
+  double lnl, teststat;
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+  /* first check for informative substitution data in column; if none,
+     don't waste time computing score */
+  if (!col_has_data_sub(w->mod, job->msa, i, job->inside, job->outside)) {
+    teststat = 0;
+    vec_zero(grad);
+    d->params->data[0] = 1.0;
+  }
 
-      if (mode == CONACC && first_deriv > 0)
-        tuple_pvals[i] *= -1; /* mark as acceleration */
+  else {
+    d->tupleidx = i;
+    vec_set(d->params, 0, d->init_scale);
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  job->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    d2->tupleidx = i;
+    d2->mod->scale = d->params->data[0];
+    d2->mod->scale_sub = 1;
+    tm_set_subst_matrices(d2->mod);
+    col_scale_derivs_subtree(d2, grad, NULL, d2->fels_scratch);
+
+    fim = col_get_fim_sub(job->grid, d2->mod->scale);
+
+    teststat = grad->data[1]*grad->data[1] /
+      (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
+
+    if (teststat < 0) {
+      fprintf(stderr, "WARNING: teststat < 0 (%f\t%f\t%f\t%f\t%f\t%f)\n",
+              teststat, fim->data[0][0], fim->data[0][1],
+              fim->data[1][0], fim->data[1][1],
+              fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
+      teststat = 0;
     }
+    mat_free(fim);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_derivs != NULL) tuple_derivs[i] = first_deriv;
-    if (tuple_teststats != NULL) tuple_teststats[i] = teststat;
+    if ((job->mode == ACC && grad->data[1] < 0) ||
+        (job->mode == CON && grad->data[1] > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
   }
 
-  col_free_fit_data(d);
+  col_store_pval(job, i, teststat, grad->data[1] > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (job->null_scales != NULL) job->null_scales[i] = d->params->data[0];
+  if (job->derivs != NULL) job->derivs[i] = grad->data[0];
+  if (job->sub_derivs != NULL) job->sub_derivs[i] = grad->data[1];
+  if (job->teststats != NULL) job->teststats[i] = teststat;
 }
 
 /* Subtree version of score test */
@@ -997,115 +1250,39 @@ void col_score_tests_sub(TreeModel *mod, MSA *msa, mode_type mode,
                          double *tuple_pvals, double *tuple_null_scales,
                          double *tuple_derivs, double *tuple_sub_derivs,
                          double *tuple_teststats, FILE *logf) {
-  int i;
-  ColFitData *d, *d2;
-  Vector *grad = vec_new(2);
-  Matrix *fim;
-  double lnl, teststat;
-  FimGrid *grid;
-  List *inside=NULL, *outside=NULL;
-  TreeModel *modcpy = tm_create_copy(mod); /* need separate copy of tree model
-                                              with different internal scaling
-                                              data for supertree/subtree case */
-  modcpy->subtree_root = NULL;
-
-  /* init ColFitData -- one for null model, one for alt */
-  d = col_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = col_init_fit_data(mod, msa, SUBTREE, NNEUT, FALSE);
-                                /* mod has the subtree info, modcpy
-                                   does not */
+  ColJob job;
+
+  /* init ColFitData for each thread -- one for null model, one for
+     alt (each thread has separate copies of the tree model with
+     different internal scaling data for supertree/subtree case) */
+  col_job_init(&job, mod, msa, SUBTREE, NNEUT, logf);
+  job.mode = mode;
+  job.func = col_score_test_sub_tuple;
+  job.pvals = tuple_pvals;
+  job.null_scales = tuple_null_scales;
+  job.derivs = tuple_derivs;
+  job.sub_derivs = tuple_sub_derivs;
+  job.teststats = tuple_teststats;
 
   /* precompute Fisher information matrices for a grid of scale values */
-  grid = col_fim_grid_sub(mod);
+  job.grid = col_fim_grid_sub(mod);
 
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes);
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    job.inside = lst_new_ptr(mod->tree->nnodes);
+    job.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, job.inside,
+                        job.outside);
   }
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
+  col_job_run(&job);
 
-    /* first check for informative substitution data in column; if none,
-       don't waste time computing score */
-    if (!col_has_data_sub(mod, msa, i, inside, outside)) {
-      teststat = 0;
-      vec_zero(grad);
-      d->params->data[0] = 1.0;
-    }
-
-    else {
-      d->tupleidx = i;
-      vec_set(d->params, 0, d->init_scale);
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      d2->tupleidx = i;
-      d2->mod->scale = d->params->data[0];
-      d2->mod->scale_sub = 1;
-      tm_set_subst_matrices(d2->mod);
-      col_scale_derivs_subtree(d2, grad, NULL, d2->fels_scratch);
-
-      fim = col_get_fim_sub(grid, d2->mod->scale);
-
-      teststat = grad->data[1]*grad->data[1] /
-        (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
-
-      if (teststat < 0) {
-        fprintf(stderr, "WARNING: teststat < 0 (%f\t%f\t%f\t%f\t%f\t%f)\n",
-                teststat, fim->data[0][0], fim->data[0][1],
-                fim->data[1][0], fim->data[1][1],
-                fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
-        teststat = 0;
-      }
-      mat_free(fim);
-
-      if ((mode == ACC && grad->data[1] < 0) ||
-          (mode == CON && grad->data[1] > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
-    }
-
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-      /* assumes 50:50 mix of chisq and point mass at zero */
-
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
-
-      if (mode == CONACC && grad->data[1] > 0)
-        tuple_pvals[i] *= -1; /* mark as acceleration */
-    }
-
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_null_scales != NULL) tuple_null_scales[i] = d->params->data[0];
-    if (tuple_derivs != NULL) tuple_derivs[i] = grad->data[0];
-    if (tuple_sub_derivs != NULL) tuple_sub_derivs[i] = grad->data[1];
-    if (tuple_teststats != NULL) tuple_teststats[i] = teststat;
-  }
-
-  col_free_fit_data(d);
-  col_free_fit_data(d2);
-  vec_free(grad);
-  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
-                                /* have to revert for tm_free to work
-                                   correctly */
-  tm_free(modcpy);
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
-  col_free_fim_grid(grid);
+  col_job_free(&job);
+  if (job.inside != NULL) lst_free(job.inside);
+  if (job.outside != NULL) lst_free(job.outside);
+  col_free_fim_grid(job.grid);
 }
 
 /* Create object with metadata and scratch memory for fitting scale
@@ -1220,6 +1397,12 @@ ColFitData *col_init_fit_data(TreeModel *mod, MSA *msa, scale_type stype,
   d->vec_scratch2_z = zvec_new(size);
   d->vec_scratch1_r = vec_new(size);
   d->vec_scratch2_r = vec_new(size);
+
+  d->memo = smalloc(sizeof(ColMemo));
+  d->memo->maxentries = min(COL_MEMO_SIZE, COL_MEMO_MAX_BYTES /
+                            ((size_t)nnodes * nrcats * size * size *
+                             sizeof(double)));
+  d->memo->nentries = d->memo->nseen = d->memo->next_seen = 0;
   return d;
 }
 
@@ -1265,9 +1448,57 @@ void col_free_fit_data(ColFitData *d) {
   vec_free(d->vec_scratch1_r);
   vec_free(d->vec_scratch2_r);
 
+  for (i = 0; i < d->memo->nentries; i++) {
+    for (nid = 0; nid < d->mod->tree->nnodes; nid++) {
+      if (d->memo->P[i][nid] == NULL) continue;
+      for (rcat = 0; rcat < d->mod->nratecats; rcat++)
+        mat_free(d->memo->P[i][nid][rcat]);
+      sfree(d->memo->P[i][nid]);
+    }
+    sfree(d->memo->P[i]);
+  }
+  sfree(d->memo);
+
   sfree(d);
 }
 
+/* GERP-like computation for a single tuple (see col_gerp) */
+static void col_gerp_tuple(ColJob *job, ColWorker *w, int i) {
+  TreeModel *mod = w->mod;
+  ColFitData *d = w->d;
+  int j, nspec = 0;
+  double nneut, scale, lnl;
+
+  col_find_missing_branches(mod, job->msa, i, w->has_data, &nspec);
+
+  if (nspec < 3)
+    nneut = scale = 0;
+  else {
+    vec_set(d->params, 0, d->init_scale);
+    d->tupleidx = i;
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  job->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    scale = d->params->data[0];
+    for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
+      if (w->has_data[j])
+        nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
+  }
+
+  if (job->nspec != NULL) job->nspec[i] = (double)nspec;
+  if (job->nneut != NULL) job->nneut[i] = nneut;
+  if (job->nobs != NULL) job->nobs[i] = scale * nneut;
+  if (job->nrejected != NULL) {
+    job->nrejected[i] = nneut * (1 - scale);
+    if (job->mode == ACC) job->nrejected[i] *= -1;
+    else if (job->mode == NNEUT) job->nrejected[i] = fabs(job->nrejected[i]);
+  }
+}
+
 /* Perform a GERP-like computation for each tuple.  Computes expected
    number of subst. under neutrality (tuple_nneut), expected number
    after rescaling by ML (tuple_nobs), expected number of rejected
@@ -1278,48 +1509,21 @@ void col_free_fit_data(ColFitData *d) {
 void col_gerp(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_nneut,
               double *tuple_nobs, double *tuple_nrejected,
               double *tuple_nspec, FILE *logf) {
-  int i, j, nspec = 0;
-  double nneut, scale, lnl;
-  int *has_data = smalloc(mod->tree->nnodes * sizeof(int));
-  ColFitData *d;
+  ColJob job;
 
-  /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
+  /* init ColFitData for each thread */
+  col_job_init(&job, mod, msa, ALL, NNEUT, logf);
+  job.mode = mode;
+  job.func = col_gerp_tuple;
+  job.nneut = tuple_nneut;
+  job.nobs = tuple_nobs;
+  job.nrejected = tuple_nrejected;
+  job.nspec = tuple_nspec;
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples;i++) {
-    checkInterruptN(i, 1000);
-    col_find_missing_branches(mod, msa, i, has_data, &nspec);
-
-    if (nspec < 3)
-      nneut = scale = 0;
-    else {
-      vec_set(d->params, 0, d->init_scale);
-      d->tupleidx = i;
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      scale = d->params->data[0];
-      for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
-        if (has_data[j])
-          nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
-    }
+  col_job_run(&job);
 
-    if (tuple_nspec != NULL) tuple_nspec[i] = (double)nspec;
-    if (tuple_nneut != NULL) tuple_nneut[i] = nneut;
-    if (tuple_nobs != NULL) tuple_nobs[i] = scale * nneut;
-    if (tuple_nrejected != NULL) {
-      tuple_nrejected[i] = nneut * (1 - scale);
-      if (mode == ACC) tuple_nrejected[i] *= -1;
-      else if (mode == NNEUT) tuple_nrejected[i] = fabs(tuple_nrejected[i]);
-    }
-  }
-  col_free_fit_data(d);
-  sfree(has_data);
+  col_job_free(&job);
 }
 
 /* Identify branches wrt which a given column tuple is uninformative,
@@ -1330,30 +1534,27 @@ void col_gerp(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_nneut,
 void col_find_missing_branches(TreeModel *mod, MSA *msa, int tupleidx,
                                int *has_data, int *nspec) {
   int i;
-  List *traversal = tr_postorder(mod->tree);
+  TreePrunePlan *plan = tm_get_prune_plan(mod);
   *nspec = 0;
-  for (i = 0; i < lst_size(traversal); i++) {
-    TreeNode *n = lst_get_ptr(traversal, i);
-    if (!((n->lchild == NULL && n->rchild == NULL) ||
-	  (n->lchild != NULL && n->rchild != NULL)))
-      die("ERROR: col_find_missing_branches: lchild and rchild must be either both NULL or both non-NULL\n");
-    if (n->parent == NULL)      /* root */
-      has_data[n->id] = FALSE;
-    else if (n->lchild == NULL) {    /* leaf */
+  for (i = 0; i < plan->nnodes; i++) {
+    TreePruneOp *op = &plan->postorder[i];
+    if (op->parent < 0)         /* root */
+      has_data[op->node] = FALSE;
+    else if (op->lchild < 0) {  /* leaf */
       if (mod->rate_matrix->
           inv_states[(int)ss_get_char_tuple(msa, tupleidx,
-                                            mod->msa_seq_idx[n->id], 0)] >= 0) {
-        has_data[n->id] = TRUE;
+                                            mod->msa_seq_idx[op->node], 0)] >= 0) {
+        has_data[op->node] = TRUE;
         (*nspec)++;
       }
       else
-        has_data[n->id] = FALSE;
+        has_data[op->node] = FALSE;
     }
     else {                      /* non-root ancestral node */
-      if (has_data[n->lchild->id] || has_data[n->rchild->id])
-        has_data[n->id] = TRUE;
+      if (has_data[op->lchild] || has_data[op->rchild])
+        has_data[op->node] = TRUE;
       else
-        has_data[n->id] = FALSE;
+        has_data[op->node] = FALSE;
     }
   }
 }
@@ -1440,6 +1641,7 @@ void col_scale_derivs_subtree_num(ColFitData *d, Vector *gradient,
 Matrix *col_estimate_fim_sub(TreeModel *mod) {
   Vector *grad = vec_new(2);
   Matrix *hessian = mat_new(2, 2), *fim = mat_new(2, 2);
+  int *seq_idx = mod->msa_seq_idx; /* replaced by tm_generate_msa */
   MSA *msa = tm_generate_msa(NSAMPLES_FIM, NULL, &mod, NULL);
   ColFitData *d = col_init_fit_data(mod, msa, SUBTREE, NNEUT, TRUE);
   int i;
@@ -1460,6 +1662,8 @@ Matrix *col_estimate_fim_sub(TreeModel *mod) {
   col_free_fit_data(d);
   vec_free(grad);
   mat_free(hessian);
+  sfree(mod->msa_seq_idx);      /* restore mapping for real alignment */
+  mod->msa_seq_idx = seq_idx;
   return (fim);
 }
 
@@ -1506,6 +1710,7 @@ void col_free_fim_grid(FimGrid *g) {
    required.  Estimation is done by sampling, as above */
 double col_estimate_fim(TreeModel *mod) {
   double deriv1, deriv2, retval = 0;
+  int *seq_idx = mod->msa_seq_idx; /* replaced by tm_generate_msa */
   MSA *msa = tm_generate_msa(NSAMPLES_FIM, NULL, &mod, NULL);
   ColFitData *d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
   int i;
@@ -1522,6 +1727,8 @@ double col_estimate_fim(TreeModel *mod) {
 
   msa_free(msa);
   col_free_fit_data(d);
+  sfree(mod->msa_seq_idx);      /* restore mapping for real alignment */
+  mod->msa_seq_idx = seq_idx;
   return (retval);
 }
 
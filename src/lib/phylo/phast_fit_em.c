@@ -1336,3 +1336,81 @@ void compute_grad_em_exact(Vector *grad, Vector *params, void *data,
   lst_free(erows); lst_free(ecols); lst_free(distinct_rows); 
 }
 
+
+/* Return TRUE if the gradient of the likelihood function used by
+   tm_fit can be computed analytically (see tm_likelihood_grad).  The
+   rate matrix must be diagonalizable, with parameters appearing
+   linearly in it as assumed by compute_grad_em_exact, and it must not
+   be rescaled during optimization.  Should be called after
+   mod->scale_during_opt has been set */
+int tm_likelihood_grad_ok(TreeModel *mod) {
+  int i;
+
+  if (mod->tree == NULL || mod->estimate_branchlens != TM_BRANCHLENS_ALL ||
+      mod->scale_during_opt || mod->estimate_backgd ||
+      mod->alt_subst_mods != NULL || mod->selection_idx >= 0 ||
+      mod->site_model || !mod->allow_gaps || mod->inform_reqd ||
+      (mod->order > 0 && mod->use_conditionals))
+    return FALSE;
+
+  /* only models of order 0 or 1 have been validated against numerical
+     derivatives; higher-order (e.g., R3, U3) models fall back on them */
+  if (mod->order > 1)
+    return FALSE;
+
+  switch (mod->subst_mod) {
+  case HKY85: case HKY85G: case REV: case SSREV: case UNREST:
+  case R2: case U2: case R2S: case U2S:
+    break;
+  default:
+    return FALSE;
+  }
+
+  /* empirical rate weights are not handled */
+  if (mod->nratecats > 1 && mod->empirical_rates)
+    for (i = 0; i < tm_get_nratevarparams(mod); i++)
+      if (mod->param_map[mod->ratevar_idx + i] >= 0) return FALSE;
+
+  return TRUE;
+}
+
+/* Compute the gradient of tm_likelihood_wrapper (negative log
+   likelihood, base 2) analytically.  The expected numbers of
+   substitutions of each type on each branch, obtained by a single
+   inside/outside pass of tl_compute_log_likelihood, give the
+   gradient of the log likelihood via compute_grad_em_exact (the
+   gradient of the expected complete-data log likelihood equals that
+   of the log likelihood at the current parameters).  Requires
+   mod->tree_posteriors with expected_nsubst_tot allocated and
+   complex eigensystems for the rate matrix (see tm_fit) */
+void tm_likelihood_grad(Vector *grad, Vector *params, void *data, 
+                        Vector *lb, Vector *ub) {
+  TreeModel *mod = (TreeModel*)data;
+  List *traversal;
+  int i;
+
+  tm_unpack_params(mod, params, -1);
+  tl_compute_log_likelihood(mod, mod->msa, NULL, NULL, mod->category, 
+                            mod->tree_posteriors);
+  compute_grad_em_exact(grad, params, data, lb, ub);
+
+  /* compute_grad_em_exact differentiates wrt the length of each
+     branch; with a reversible model, the two branches from the root
+     are each assigned half of their parameter (see
+     tm_unpack_params) */
+  if (tm_is_reversible(mod)) {
+    int lidx = -1, ridx = -1;
+    traversal = tr_preorder(mod->tree);
+    for (i = 1; i < lst_size(traversal); i++) {  /* skip root */
+      TreeNode *n = lst_get_ptr(traversal, i);
+      if (n == mod->tree->lchild) 
+        lidx = mod->param_map[mod->bl_idx + i - 1];
+      else if (n == mod->tree->rchild) 
+        ridx = mod->param_map[mod->bl_idx + i - 1];
+    }
+    if (lidx >= 0) vec_set(grad, lidx, vec_get(grad, lidx) / 2);
+    if (ridx >= 0 && ridx != lidx) vec_set(grad, ridx, vec_get(grad, ridx) / 2);
+  }
+
+  vec_scale(grad, 1/log(2));
+}
@@ -0,0 +1,346 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Inner loops of the pruning algorithm.  Each kernel computes results
+   for a block of output states at once, visiting the summation index
+   in increasing order, so that every output element undergoes exactly
+   the same sequence of multiplications and additions in the scalar
+   and vectorized versions.  The vectorized versions are compiled with
+   function-level target attributes and selected at run time, so no
+   special compiler flags are needed.  Compile with -DSKIP_SIMD to
+   disable them. */
+
+#include <phast/prune_kernels.h>
+#include <phast/misc.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(SKIP_SIMD)
+#define PK_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* gcc otherwise may contract multiply-add pairs into fused
+   multiply-adds when they are available, changing results */
+#if defined(__GNUC__) && !defined(__clang__)
+#define PK_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define PK_NO_CONTRACT
+#endif
+
+#ifdef PK_X86_SIMD
+#define PK_TARGET_AVX2 __attribute__((target("avx2"))) PK_NO_CONTRACT
+#define PK_TARGET_AVX512 __attribute__((target("avx512f"))) PK_NO_CONTRACT
+#endif
+
+#define PK_NBLOCK 4             /* vectors per block in blocked kernels */
+
+static int pk_simd_level = -1;  /* best instruction set supported by
+                                   the processor; determined on first
+                                   use */
+
+double *pk_new_aligned(size_t n, void **base) {
+  char *raw = smalloc(n * sizeof(double) + PK_ALIGN);
+  *base = raw;
+  return (double*)(raw + PK_ALIGN - ((uintptr_t)raw % PK_ALIGN));
+}
+
+void pk_pack(double *dest, MarkovMatrix *P) {
+  int i, j, n = P->size;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++)
+      dest[i*n + j] = mm_get(P, i, j);
+}
+
+void pk_pack_transpose(double *dest, MarkovMatrix *P) {
+  int i, j, n = P->size;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++)
+      dest[j*n + i] = mm_get(P, i, j);
+}
+
+/* portable versions, for any number of states */
+
+PK_NO_CONTRACT
+static void pk_matvec_scalar(double *dest, const double *M, const double *src,
+                             int n) {
+  int i, j;
+  for (i = 0; i < n; i++) {
+    double tot = 0;
+    for (j = 0; j < n; j++)
+      tot += src[j] * M[j*n + i];
+    dest[i] = tot;
+  }
+}
+
+PK_NO_CONTRACT
+static void pk_inside_scalar(double *dest, const double *PTl,
+                             const double *lsrc, const double *PTr,
+                             const double *rsrc, int n) {
+  int i, j;
+  for (i = 0; i < n; i++) {
+    double totl = 0, totr = 0;
+    for (j = 0; j < n; j++)
+      totl += lsrc[j] * PTl[j*n + i];
+    for (j = 0; j < n; j++)
+      totr += rsrc[j] * PTr[j*n + i];
+    dest[i] = totl * totr;
+  }
+}
+
+PK_NO_CONTRACT
+static void pk_outside_scalar(double *dest, const double *PTsib,
+                              const double *parent, const double *sib,
+                              int n) {
+  int j, k;
+  for (j = 0; j < n; j++) {
+    double tot = 0;
+    for (k = 0; k < n; k++)
+      tot += parent[j] * sib[k] * PTsib[k*n + j];
+    dest[j] = tot;
+  }
+}
+
+#ifdef PK_X86_SIMD
+
+/* AVX2, 4 states: a single vector holds all states */
+
+PK_TARGET_AVX2
+static void pk_matvec_avx2_4(double *dest, const double *M,
+                             const double *src, int n) {
+  __m256d tot = _mm256_setzero_pd();
+  int j;
+  for (j = 0; j < 4; j++)
+    tot = _mm256_add_pd(tot, _mm256_mul_pd(_mm256_set1_pd(src[j]),
+                                           _mm256_loadu_pd(M + 4*j)));
+  _mm256_storeu_pd(dest, tot);
+}
+
+PK_TARGET_AVX2
+static void pk_inside_avx2_4(double *dest, const double *PTl,
+                             const double *lsrc, const double *PTr,
+                             const double *rsrc, int n) {
+  __m256d totl = _mm256_setzero_pd(), totr = _mm256_setzero_pd();
+  int j;
+  for (j = 0; j < 4; j++)
+    totl = _mm256_add_pd(totl, _mm256_mul_pd(_mm256_set1_pd(lsrc[j]),
+                                             _mm256_loadu_pd(PTl + 4*j)));
+  for (j = 0; j < 4; j++)
+    totr = _mm256_add_pd(totr, _mm256_mul_pd(_mm256_set1_pd(rsrc[j]),
+                                             _mm256_loadu_pd(PTr + 4*j)));
+  _mm256_storeu_pd(dest, _mm256_mul_pd(totl, totr));
+}
+
+PK_TARGET_AVX2
+static void pk_outside_avx2_4(double *dest, const double *PTsib,
+                              const double *parent, const double *sib,
+                              int n) {
+  __m256d tot = _mm256_setzero_pd(), par = _mm256_loadu_pd(parent);
+  int k;
+  for (k = 0; k < 4; k++) {
+    __m256d s = _mm256_set1_pd(sib[k]);
+    tot = _mm256_add_pd(tot, _mm256_mul_pd(_mm256_mul_pd(par, s),
+                                           _mm256_loadu_pd(PTsib + 4*k)));
+  }
+  _mm256_storeu_pd(dest, tot);
+}
+
+/* AVX2, blocked: n must be a multiple of 4*PK_NBLOCK */
+
+PK_TARGET_AVX2
+static void pk_matvec_avx2(double *dest, const double *M,
+                           const double *src, int n) {
+  int ib, j, v;
+  for (ib = 0; ib < n; ib += 4*PK_NBLOCK) {
+    __m256d tot[PK_NBLOCK];
+    for (v = 0; v < PK_NBLOCK; v++) tot[v] = _mm256_setzero_pd();
+    for (j = 0; j < n; j++) {
+      __m256d s = _mm256_set1_pd(src[j]);
+      const double *row = M + j*n + ib;
+      for (v = 0; v < PK_NBLOCK; v++)
+        tot[v] = _mm256_add_pd(tot[v],
+                               _mm256_mul_pd(s, _mm256_loadu_pd(row + 4*v)));
+    }
+    for (v = 0; v < PK_NBLOCK; v++)
+      _mm256_storeu_pd(dest + ib + 4*v, tot[v]);
+  }
+}
+
+PK_TARGET_AVX2
+static void pk_inside_avx2(double *dest, const double *PTl,
+                           const double *lsrc, const double *PTr,
+                           const double *rsrc, int n) {
+  int i;
+  double totr[n];
+  pk_matvec_avx2(dest, PTl, lsrc, n);
+  pk_matvec_avx2(totr, PTr, rsrc, n);
+  for (i = 0; i < n; i += 4)
+    _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(dest + i),
+                                             _mm256_loadu_pd(totr + i)));
+}
+
+PK_TARGET_AVX2
+static void pk_outside_avx2(double *dest, const double *PTsib,
+                            const double *parent, const double *sib,
+                            int n) {
+  int ib, k, v;
+  for (ib = 0; ib < n; ib += 4*PK_NBLOCK) {
+    __m256d tot[PK_NBLOCK], par[PK_NBLOCK];
+    for (v = 0; v < PK_NBLOCK; v++) {
+      tot[v] = _mm256_setzero_pd();
+      par[v] = _mm256_loadu_pd(parent + ib + 4*v);
+    }
+    for (k = 0; k < n; k++) {
+      __m256d s = _mm256_set1_pd(sib[k]);
+      const double *row = PTsib + k*n + ib;
+      for (v = 0; v < PK_NBLOCK; v++)
+        tot[v] = _mm256_add_pd(tot[v],
+                               _mm256_mul_pd(_mm256_mul_pd(par[v], s),
+                                             _mm256_loadu_pd(row + 4*v)));
+    }
+    for (v = 0; v < PK_NBLOCK; v++)
+      _mm256_storeu_pd(dest + ib + 4*v, tot[v]);
+  }
+}
+
+/* AVX-512, blocked: n must be a multiple of 8*PK_NBLOCK */
+
+PK_TARGET_AVX512
+static void pk_matvec_avx512(double *dest, const double *M,
+                             const double *src, int n) {
+  int ib, j, v;
+  for (ib = 0; ib < n; ib += 8*PK_NBLOCK) {
+    __m512d tot[PK_NBLOCK];
+    for (v = 0; v < PK_NBLOCK; v++) tot[v] = _mm512_setzero_pd();
+    for (j = 0; j < n; j++) {
+      __m512d s = _mm512_set1_pd(src[j]);
+      const double *row = M + j*n + ib;
+      for (v = 0; v < PK_NBLOCK; v++)
+        tot[v] = _mm512_add_pd(tot[v],
+                               _mm512_mul_pd(s, _mm512_loadu_pd(row + 8*v)));
+    }
+    for (v = 0; v < PK_NBLOCK; v++)
+      _mm512_storeu_pd(dest + ib + 8*v, tot[v]);
+  }
+}
+
+PK_TARGET_AVX512
+static void pk_inside_avx512(double *dest, const double *PTl,
+                             const double *lsrc, const double *PTr,
+                             const double *rsrc, int n) {
+  int i;
+  double totr[n];
+  pk_matvec_avx512(dest, PTl, lsrc, n);
+  pk_matvec_avx512(totr, PTr, rsrc, n);
+  for (i = 0; i < n; i += 8)
+    _mm512_storeu_pd(dest + i, _mm512_mul_pd(_mm512_loadu_pd(dest + i),
+                                             _mm512_loadu_pd(totr + i)));
+}
+
+PK_TARGET_AVX512
+static void pk_outside_avx512(double *dest, const double *PTsib,
+                              const double *parent,
+                              const double *sib, int n) {
+  int ib, k, v;
+  for (ib = 0; ib < n; ib += 8*PK_NBLOCK) {
+    __m512d tot[PK_NBLOCK], par[PK_NBLOCK];
+    for (v = 0; v < PK_NBLOCK; v++) {
+      tot[v] = _mm512_setzero_pd();
+      par[v] = _mm512_loadu_pd(parent + ib + 8*v);
+    }
+    for (k = 0; k < n; k++) {
+      __m512d s = _mm512_set1_pd(sib[k]);
+      const double *row = PTsib + k*n + ib;
+      for (v = 0; v < PK_NBLOCK; v++)
+        tot[v] = _mm512_add_pd(tot[v],
+                               _mm512_mul_pd(_mm512_mul_pd(par[v], s),
+                                             _mm512_loadu_pd(row + 8*v)));
+    }
+    for (v = 0; v < PK_NBLOCK; v++)
+      _mm512_storeu_pd(dest + ib + 8*v, tot[v]);
+  }
+}
+
+#endif  /* PK_X86_SIMD */
+
+/* determine best instruction set supported by processor */
+static void pk_init() {
+  pk_simd_level = PK_SCALAR;
+#ifdef PK_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    pk_simd_level = PK_AVX512;
+  else if (__builtin_cpu_supports("avx2"))
+    pk_simd_level = PK_AVX2;
+#endif
+}
+
+pk_simd_type pk_get_simd(int n) {
+  if (pk_simd_level < 0) pk_init();
+  if (n == 4 && pk_simd_level >= PK_AVX2)
+    return PK_AVX2;             /* one 256-bit vector per node */
+  if (n % (8*PK_NBLOCK) == 0 && pk_simd_level >= PK_AVX512)
+    return PK_AVX512;
+  if (n % (4*PK_NBLOCK) == 0 && pk_simd_level >= PK_AVX2)
+    return PK_AVX2;
+  return PK_SCALAR;
+}
+
+void pk_matvec(double *dest, const double *M, const double *src, int n) {
+#ifdef PK_X86_SIMD
+  switch (pk_get_simd(n)) {
+  case PK_AVX512:
+    pk_matvec_avx512(dest, M, src, n);
+    return;
+  case PK_AVX2:
+    if (n == 4) pk_matvec_avx2_4(dest, M, src, n);
+    else pk_matvec_avx2(dest, M, src, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  pk_matvec_scalar(dest, M, src, n);
+}
+
+void pk_inside(double *dest, const double *PTl, const double *lsrc,
+               const double *PTr, const double *rsrc, int n) {
+#ifdef PK_X86_SIMD
+  switch (pk_get_simd(n)) {
+  case PK_AVX512:
+    pk_inside_avx512(dest, PTl, lsrc, PTr, rsrc, n);
+    return;
+  case PK_AVX2:
+    if (n == 4) pk_inside_avx2_4(dest, PTl, lsrc, PTr, rsrc, n);
+    else pk_inside_avx2(dest, PTl, lsrc, PTr, rsrc, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  pk_inside_scalar(dest, PTl, lsrc, PTr, rsrc, n);
+}
+
+void pk_outside(double *dest, const double *PTsib, const double *parent,
+                const double *sib, int n) {
+#ifdef PK_X86_SIMD
+  switch (pk_get_simd(n)) {
+  case PK_AVX512:
+    pk_outside_avx512(dest, PTsib, parent, sib, n);
+    return;
+  case PK_AVX2:
+    if (n == 4) pk_outside_avx2_4(dest, PTsib, parent, sib, n);
+    else pk_outside_avx2(dest, PTsib, parent, sib, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  pk_outside_scalar(dest, PTsib, parent, sib, n);
+}
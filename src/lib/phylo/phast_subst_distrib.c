@@ -21,6 +21,7 @@
 #include <phast/prob_vector.h>
 #include <phast/prob_matrix.h>
 #include <phast/fit_column.h>
+#include <phast/thread_pool.h>
 
 /* (used below) compute and return a set of matrices giving p(b, n |
    j), the probability of n substitutions and a final base b given j
@@ -857,29 +858,202 @@ void sub_posterior_joint_stats_alignment(JumpProcess *jp, MSA *msa,
   }
 }
 
+/* features grouped by length, so that the prior distribution for
+   each distinct length need only be computed once */
+typedef struct {
+  int ngroups;
+  int *order;                   /* feature indices, by decreasing
+                                   length (ties in original order) */
+  int *start;                   /* group g consists of order[start[g]]
+                                   through order[start[g+1]-1] */
+  int *len;                     /* feature length for each group */
+  int *group;                   /* group of each feature */
+} SubLenGroups;
+
+typedef struct {
+  int len;
+  int idx;
+} SubFeatLen;
+
+static int sub_featlen_compare(const void *ptr1, const void *ptr2) {
+  const SubFeatLen *a = ptr1, *b = ptr2;
+  if (a->len != b->len) return (a->len > b->len ? -1 : 1);
+  return a->idx - b->idx;
+}
+
+/* (used by sub_p_value_many and sub_p_value_joint_many) group
+   features by length.  Longest lengths come first, so that the most
+   expensive convolutions are started first */
+static SubLenGroups *sub_group_by_length(List *feats) {
+  int nfeats = lst_size(feats), idx, g;
+  SubLenGroups *groups = smalloc(sizeof(SubLenGroups));
+  SubFeatLen *fl = smalloc(nfeats * sizeof(SubFeatLen));
+
+  for (idx = 0; idx < nfeats; idx++) {
+    GFF_Feature *f = lst_get_ptr(feats, idx);
+    fl[idx].len = f->end - f->start + 1;
+    fl[idx].idx = idx;
+  }
+  qsort(fl, nfeats, sizeof(SubFeatLen), sub_featlen_compare);
+
+  groups->order = smalloc(nfeats * sizeof(int));
+  groups->start = smalloc((nfeats + 1) * sizeof(int));
+  groups->len = smalloc(nfeats * sizeof(int));
+  groups->group = smalloc(nfeats * sizeof(int));
+  for (idx = 0, g = -1; idx < nfeats; idx++) {
+    if (idx == 0 || fl[idx].len != fl[idx-1].len) {
+      g++;
+      groups->start[g] = idx;
+      groups->len[g] = fl[idx].len;
+    }
+    groups->order[idx] = fl[idx].idx;
+    groups->group[fl[idx].idx] = g;
+  }
+  groups->ngroups = g + 1;
+  groups->start[groups->ngroups] = nfeats;
+  sfree(fl);
+  return groups;
+}
+
+static void sub_free_len_groups(SubLenGroups *groups) {
+  sfree(groups->order);
+  sfree(groups->start);
+  sfree(groups->len);
+  sfree(groups->group);
+  sfree(groups);
+}
+
+/* (used by sub_p_value_many and sub_p_value_joint_many) select the
+   "powers" of the site prior whose convolution gives the prior for
+   features of length len, i.e., pow_p[i] for each bit i set in len.
+   Returns the number selected */
+static int sub_select_pows(void **pow_p, int len, void **pows,
+                           const char *caller) {
+  int i, j = 0, checksum = 0, loglen = log2_int(len);
+  for (i = 0; i <= loglen; i++) {
+    unsigned bit_i = (len >> i) & 1;
+    if (bit_i) {
+      pows[j++] = pow_p[i];
+      checksum += int_pow(2, i);
+    }
+  }
+  if (checksum != len)
+    die("ERROR %s: checksum (%i) != len (%i)\n", caller, checksum, len);
+  return j;
+}
+
+/* number of features handled by each task when computing
+   per-feature stats in parallel */
+#define SUB_FEATS_PER_TASK 16
+
+/* prior distribution for a given feature length, and its summary
+   stats */
+typedef struct {
+  Vector *p;
+  double mean, var;
+  int min, max;
+} SubPrior;
+
+/* shared data for parallel portions of sub_p_value_many */
+typedef struct {
+  JumpProcess *jp;
+  MSA *msa;
+  List *feats;
+  double ci;
+  int *tuples;                  /* tuples used by any feature */
+  double *post_mean, *post_var; /* per tuple */
+  Vector **pow_p;
+  int logmaxlen;
+  SubLenGroups *groups;
+  int gfirst;                   /* first group of current batch */
+  SubPrior *priors;             /* priors for groups of current batch */
+  int ffirst, flast;            /* positions in groups->order of
+                                   features of current batch */
+  p_value_stats *stats;
+} SubPValueJob;
+
+static void sub_post_tuple_task(void *data, int task, int thread) {
+  SubPValueJob *job = data;
+  int idx = job->tuples[task];
+  Vector *p = sub_posterior_distrib_site(job->jp, job->msa, idx);
+  pv_stats(p, &job->post_mean[idx], &job->post_var[idx]);
+  vec_free(p);
+}
+
+static void sub_prior_len_task(void *data, int task, int thread) {
+  SubPValueJob *job = data;
+  SubPrior *pr = &job->priors[task];
+  Vector **pows = smalloc((job->logmaxlen+1) * sizeof(void*));
+  int j = sub_select_pows((void**)job->pow_p, 
+                          job->groups->len[job->gfirst + task], 
+                          (void**)pows, "sub_p_value_many");
+  pr->p = pv_convolve_many(pows, NULL, j, job->jp->epsilon);
+  pv_stats(pr->p, &pr->mean, &pr->var);
+  pv_confidence_interval(pr->p, 0.95, &pr->min, &pr->max);
+  sfree(pows);
+}
+
+static void sub_pval_feat_task(void *data, int task, int thread) {
+  SubPValueJob *job = data;
+  int k, i, end = min(job->ffirst + (task+1) * SUB_FEATS_PER_TASK, 
+                      job->flast);
+  double this_min, this_max;
+
+  for (k = job->ffirst + task * SUB_FEATS_PER_TASK; k < end; k++) {
+    int idx = job->groups->order[k];
+    GFF_Feature *f = lst_get_ptr(job->feats, idx);
+    SubPrior *pr = &job->priors[job->groups->group[idx] - job->gfirst];
+    p_value_stats *s = &job->stats[idx];
+
+    s->prior_mean = pr->mean;
+    s->prior_var = pr->var;
+    s->prior_min = pr->min;
+    s->prior_max = pr->max;
+
+    s->post_mean = s->post_var = 0;
+    for (i = f->start - 1; i < f->end; i++) {
+      s->post_mean += job->post_mean[job->msa->ss->tuple_idx[i]];
+      s->post_var += job->post_var[job->msa->ss->tuple_idx[i]];
+    }
+    
+    if (job->ci != -1)
+      norm_confidence_interval(s->post_mean, sqrt(s->post_var), 
+                               job->ci, &this_min, &this_max);
+    else 
+      this_min = this_max = s->post_mean;
+
+    s->post_min = (int)floor(this_min);
+    s->post_max = (int)ceil(this_max);
+
+    s->p_cons = pv_p_value(pr->p, s->post_max, LOWER);
+    s->p_anti_cons = pv_p_value(pr->p, s->post_min, UPPER);    
+  }
+}
+
 /* compute p-values and related stats for a given alignment and model
    and each of a set of features.  Returns an array of p_value_stats
    objects, one for each feature (dimension
-   lst_size(feat->features)) */   
+   lst_size(feat->features)).  The prior for each distinct feature
+   length is computed only once.  Per-tuple posteriors, priors for
+   distinct lengths (a batch at a time, to limit memory), and
+   per-feature stats are each computed in parallel */   
 p_value_stats *sub_p_value_many(JumpProcess *jp, MSA *msa, List *feats, 
                                 double ci /* confidence interval; if
                                              -1, posterior mean will
                                              be used */
                                 ) {
 
-  Vector *p, *prior = NULL;
-  int maxlen = -1, len, idx, i, j, logmaxlen, loglen, checksum, lastlen = -1, 
-    prior_min, prior_max;
+  int maxlen = -1, len, idx, i, logmaxlen, nused = 0, batch, g;
   GFF_Feature *f;
-  double *post_mean, *post_var;
-  double this_min, this_max, prior_mean, prior_var;
-  p_value_stats *stats = smalloc(lst_size(feats) * 
-                                 sizeof(p_value_stats));
-  char *used = smalloc(msa->ss->ntuples * sizeof(char));
-  Vector **pow_p, **pows;
+  p_value_stats *stats;
+  char *used;
+  Vector **pow_p;
+  SubPValueJob job;
 
   if (lst_size(feats) == 0) return NULL;
 
+  stats = smalloc(lst_size(feats) * sizeof(p_value_stats));
+  used = smalloc(msa->ss->ntuples * sizeof(char));
 
   /* find max length of feature.  Simultaneously, figure out which
      column tuples actually used (saves time below) */
@@ -901,83 +1075,58 @@ p_value_stats *sub_p_value_many(JumpProcess *jp, MSA *msa, List *feats,
   pow_p[0] = sub_prior_distrib_site(jp);
   for (i = 1; i <= logmaxlen; i++) 
     pow_p[i] = pv_convolve(pow_p[i-1], 2, jp->epsilon);
-  pows = smalloc((logmaxlen+1) * sizeof(void*)); /* for use below */
-
-  /* compute mean and variance of posterior for all column tuples */
-  post_mean = smalloc(msa->ss->ntuples * sizeof(double));
-  post_var = smalloc(msa->ss->ntuples * sizeof(double));
-  for (idx = 0; idx < msa->ss->ntuples; idx++) {
-    checkInterruptN(idx, 1000);
-    if (used[idx] == 'N') continue; /* can save fairly expensive call below */
-    p = sub_posterior_distrib_site(jp, msa, idx); 
-    pv_stats(p, &post_mean[idx], &post_var[idx]);
-    vec_free(p);
-  }
 
-  /* now obtain stats for each feature */
-  for (idx = 0; idx < lst_size(feats); idx++) {
-    checkInterruptN(idx, 100);
-    f = lst_get_ptr(feats, idx);
-    len = f->end - f->start + 1;
-    loglen = log2_int(len);
-
-    if (len != lastlen) { /* don't recompute if length doesn't change;
-                             saves time in some cases */
-      if (prior != NULL) vec_free(prior);
-
-      /* compute convolution of prior from powers */
-      j = checksum = 0;
-      for (i = 0; i <= loglen; i++) {
-        unsigned bit_i = (len >> i) & 1;
-        if (bit_i) {
-          pows[j++] = pow_p[i];
-          checksum += int_pow(2, i);
-        }
-      }
-      if (checksum != len)
-	die("ERROR sub_p_value_many: checksum (%i) != len (%i)\n",
-	    checksum, len);
-      prior = pv_convolve_many(pows, NULL, j, jp->epsilon);
-
-      pv_stats(prior, &prior_mean, &prior_var);
-      pv_confidence_interval(prior, 0.95, &prior_min, &prior_max);
-
-    }
-
-    stats[idx].prior_mean = prior_mean;
-    stats[idx].prior_var = prior_var;
-    stats[idx].prior_min = prior_min;
-    stats[idx].prior_max = prior_max;
-
-    stats[idx].post_mean = stats[idx].post_var = 0;
-    for (i = f->start - 1; i < f->end; i++) {
-      stats[idx].post_mean += post_mean[msa->ss->tuple_idx[i]];
-      stats[idx].post_var += post_var[msa->ss->tuple_idx[i]];
-    }
-    
-    if (ci != -1)
-      norm_confidence_interval(stats[idx].post_mean, sqrt(stats[idx].post_var), 
-                               ci, &this_min, &this_max);
-    else 
-      this_min = this_max = stats[idx].post_mean;
-
-    stats[idx].post_min = (int)floor(this_min);
-    stats[idx].post_max = (int)ceil(this_max);
+  job.jp = jp;
+  job.msa = msa;
+  job.feats = feats;
+  job.ci = ci;
+  job.pow_p = pow_p;
+  job.logmaxlen = logmaxlen;
+  job.stats = stats;
+
+  /* compute mean and variance of posterior for all column tuples
+     (only those used; can save fairly expensive calls).  Make sure
+     lazily computed parts of the model exist before starting
+     threads */
+  if (jp->mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(jp->mod, msa);
+  tr_postorder(jp->mod->tree);
+  job.post_mean = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_var = smalloc(msa->ss->ntuples * sizeof(double));
+  job.tuples = smalloc(msa->ss->ntuples * sizeof(int));
+  for (idx = 0; idx < msa->ss->ntuples; idx++)
+    if (used[idx] == 'Y') job.tuples[nused++] = idx;
+  thr_parallel_for(nused, sub_post_tuple_task, &job);
+
+  /* now obtain stats for each feature, a batch of distinct lengths at
+     a time */
+  job.groups = sub_group_by_length(feats);
+  batch = thr_get_nthreads();
+  job.priors = smalloc(batch * sizeof(SubPrior));
+  for (job.gfirst = 0; job.gfirst < job.groups->ngroups; 
+       job.gfirst += batch) {
+    int nprior = min(batch, job.groups->ngroups - job.gfirst);
+    checkInterrupt();
+    thr_parallel_for(nprior, sub_prior_len_task, &job);
 
-    stats[idx].p_cons = pv_p_value(prior, stats[idx].post_max, LOWER);
-    stats[idx].p_anti_cons = pv_p_value(prior, stats[idx].post_min, UPPER);    
+    job.ffirst = job.groups->start[job.gfirst];
+    job.flast = job.groups->start[job.gfirst + nprior];
+    thr_parallel_for((job.flast - job.ffirst + SUB_FEATS_PER_TASK - 1) /
+                     SUB_FEATS_PER_TASK, sub_pval_feat_task, &job);
 
-    lastlen = len;
+    for (g = 0; g < nprior; g++)
+      vec_free(job.priors[g].p);
   }
-  vec_free(prior);
+  sfree(job.priors);
+  sub_free_len_groups(job.groups);
 
   for (idx = 0; idx <= logmaxlen; idx++)
     vec_free(pow_p[idx]);
   sfree(pow_p);
-  sfree(pows);
 
-  sfree(post_mean);
-  sfree(post_var);
+  sfree(job.post_mean);
+  sfree(job.post_var);
+  sfree(job.tuples);
   sfree(used);
 
   return stats;
@@ -1007,6 +1156,201 @@ int max_convolve_len(int max_convolve_size, double max_nsd,
   return l-1;
 }
 
+/* joint prior distribution for a given feature length, its
+   marginals, and their summary stats.  If the joint prior is too
+   large to compute (p == NULL), the marginals are computed directly
+   and conditional p-values are approximated */
+typedef struct {
+  Matrix *p;
+  Vector *marg_left, *marg_right;
+  double mean_left, var_left, mean_right, var_right;
+  int min_left, max_left, min_right, max_right;
+} SubJointPrior;
+
+/* shared data for parallel portions of sub_p_value_joint_many */
+typedef struct {
+  JumpProcess *jp;
+  MSA *msa;
+  List *feats;
+  double ci;
+  int *tuples;                  /* tuples used by any feature */
+  double *post_mean_left, *post_mean_right, *post_mean_tot, 
+    *post_var_left, *post_var_right, *post_var_tot; /* per tuple */
+  Matrix **pow_p;
+  int logmaxlen, max_conv_len;
+  double max_nsd;
+  double prior_site_mean_left, prior_site_var_left,
+    prior_site_mean_right, prior_site_var_right;
+  Vector *prior_site_marg_left, *prior_site_marg_right;
+  SubLenGroups *groups;
+  int gfirst;                   /* first group of current batch */
+  SubJointPrior *priors;        /* priors for groups of current batch */
+  int ffirst, flast;            /* positions in groups->order of
+                                   features of current batch */
+  p_value_joint_stats *stats;
+  FILE *timing_f;
+} SubPValueJointJob;
+
+static void sub_post_joint_tuple_task(void *data, int task, int thread) {
+  SubPValueJointJob *job = data;
+  int idx = job->tuples[task];
+  Matrix *p = sub_joint_distrib_site(job->jp, job->msa, idx); 
+  Vector *marg = pm_marg_x(p);
+  pv_stats(marg, &job->post_mean_left[idx], &job->post_var_left[idx]);
+  vec_free(marg);
+  marg = pm_marg_y(p);
+  pv_stats(marg, &job->post_mean_right[idx], &job->post_var_right[idx]);
+  vec_free(marg);
+  marg = pm_marg_tot(p);
+  pv_stats(marg, &job->post_mean_tot[idx], &job->post_var_tot[idx]);
+  vec_free(marg);
+  mat_free(p);
+}
+
+static void sub_prior_joint_len_task(void *data, int task, int thread) {
+  SubPValueJointJob *job = data;
+  SubJointPrior *pr = &job->priors[task];
+  int len = job->groups->len[job->gfirst + task], max_nrows, max_ncols, j;
+  struct timeval marker_time;
+
+  if (len > 25) {
+    /* use central limit theorem to limit size of matrix to keep
+       track of */
+    max_nrows = (int)ceil(len * job->prior_site_mean_left + 
+                          job->max_nsd * sqrt(len * job->prior_site_var_left));
+    max_ncols = (int)ceil(len * job->prior_site_mean_right + 
+                          job->max_nsd * sqrt(len * job->prior_site_var_right));
+  }
+  else {
+    max_nrows = job->pow_p[0]->nrows * len;
+    max_ncols = job->pow_p[0]->ncols * len;
+  }
+
+  if (len <= job->max_conv_len) {
+    /* compute convolution of prior from powers */
+    Matrix **pows = smalloc((job->logmaxlen+1) * sizeof(void*));
+    j = sub_select_pows((void**)job->pow_p, len, (void**)pows,
+                        "sub_p_value_joint_many");
+    if (job->timing_f != NULL) gettimeofday(&marker_time, NULL);
+    pr->p = pm_convolve_many_fast(pows, j, max_nrows, max_ncols);
+    if (job->timing_f != NULL)
+      fprintf(job->timing_f, "len = %d (%d x %d): %f sec\n", len, max_nrows, 
+              max_ncols, get_elapsed_time(&marker_time));
+    sfree(pows);
+
+    pr->marg_left = pm_marg_x(pr->p);
+    pr->marg_right = pm_marg_y(pr->p);
+  }
+  else {
+    pr->p = NULL;             /* won't be used explicitly */
+    pr->marg_left = pv_convolve(job->prior_site_marg_left, len, 
+                                job->jp->epsilon);
+    pr->marg_right = pv_convolve(job->prior_site_marg_right, len, 
+                                 job->jp->epsilon);
+    if (job->timing_f != NULL)
+      fprintf(job->timing_f, "len = %d (%d x %d): [skipping joint convolution]\n",
+              len, max_nrows, max_ncols);
+  }
+
+  pv_stats(pr->marg_left, &pr->mean_left, &pr->var_left);
+  pv_confidence_interval(pr->marg_left, 0.95, &pr->min_left, &pr->max_left);
+  pv_stats(pr->marg_right, &pr->mean_right, &pr->var_right);
+  pv_confidence_interval(pr->marg_right, 0.95, &pr->min_right, 
+                         &pr->max_right);
+}
+
+static void sub_pval_joint_feat_task(void *data, int task, int thread) {
+  SubPValueJointJob *job = data;
+  int k, i, tup, end = min(job->ffirst + (task+1) * SUB_FEATS_PER_TASK, 
+                           job->flast);
+  double this_min_left, this_min_right, this_max_left, this_max_right, 
+    this_min_tot, this_max_tot;
+  Vector *cond;
+
+  for (k = job->ffirst + task * SUB_FEATS_PER_TASK; k < end; k++) {
+    int idx = job->groups->order[k], g = job->groups->group[idx];
+    GFF_Feature *f = lst_get_ptr(job->feats, idx);
+    SubJointPrior *pr = &job->priors[g - job->gfirst];
+    p_value_joint_stats *s = &job->stats[idx];
+
+    if (job->timing_f != NULL && k != job->groups->start[g])
+      fprintf(job->timing_f, "len = %d: [using cached convolution]\n",
+              job->groups->len[g]);
+
+    s->prior_mean_left = pr->mean_left;
+    s->prior_var_left = pr->var_left;
+    s->prior_mean_right = pr->mean_right;
+    s->prior_var_right = pr->var_right;
+    s->prior_min_left = pr->min_left;
+    s->prior_max_left = pr->max_left;
+    s->prior_min_right = pr->min_right;
+    s->prior_max_right = pr->max_right;
+
+    s->post_mean_left = s->post_mean_right = s->post_var_left = 
+      s->post_var_right = s->post_mean_tot = s->post_var_tot = 0;
+    for (i = f->start - 1; i < f->end; i++) {
+      tup = job->msa->ss->tuple_idx[i];
+      s->post_mean_left += job->post_mean_left[tup];
+      s->post_mean_right += job->post_mean_right[tup];
+      s->post_mean_tot += job->post_mean_tot[tup];
+      s->post_var_left += job->post_var_left[tup];
+      s->post_var_right += job->post_var_right[tup];
+      s->post_var_tot += job->post_var_tot[tup];
+    }
+    
+    if (job->ci != -1) {
+      norm_confidence_interval(s->post_mean_left, sqrt(s->post_var_left), 
+                               job->ci, &this_min_left, &this_max_left);
+      norm_confidence_interval(s->post_mean_right, sqrt(s->post_var_right), 
+                               job->ci, &this_min_right, &this_max_right);
+      norm_confidence_interval(s->post_mean_tot, sqrt(s->post_var_tot), 
+                               job->ci, &this_min_tot, &this_max_tot);
+    }
+    else {
+      this_min_left = this_max_left = s->post_mean_left;
+      this_min_right = this_max_right = s->post_mean_right;
+      this_min_tot = this_max_tot = s->post_mean_tot;
+    }
+
+    s->post_min_left = (int)floor(this_min_left);
+    s->post_max_left = (int)ceil(this_max_left);
+    s->post_min_right = (int)floor(this_min_right);
+    s->post_max_right = (int)ceil(this_max_right);
+    s->post_min_tot = (int)floor(this_min_tot);
+    s->post_max_tot = (int)ceil(this_max_tot);
+
+    /* conditional p-values */
+    cond = pr->p != NULL ? pm_x_given_tot(pr->p, s->post_min_tot) :
+      pm_x_given_tot_indep(s->post_min_tot, pr->marg_left, pr->marg_right);
+    s->cond_p_cons_left = pv_p_value(cond, s->post_max_left, LOWER);
+    vec_free(cond);
+
+    cond = pr->p != NULL ? pm_x_given_tot(pr->p, s->post_max_tot) :
+      pm_x_given_tot_indep(s->post_max_tot, pr->marg_left, pr->marg_right);
+    s->cond_p_anti_cons_left = pv_p_value(cond, s->post_min_left, UPPER);
+    vec_free(cond);
+
+    cond = pr->p != NULL ? pm_y_given_tot(pr->p, s->post_min_tot) :
+      pm_y_given_tot_indep(s->post_min_tot, pr->marg_left, pr->marg_right);
+    s->cond_p_cons_right = pv_p_value(cond, s->post_max_right, LOWER);
+    vec_free(cond);
+
+    cond = pr->p != NULL ? pm_y_given_tot(pr->p, s->post_max_tot) :
+      pm_y_given_tot_indep(s->post_max_tot, pr->marg_left, pr->marg_right);
+    s->cond_p_anti_cons_right = pv_p_value(cond, s->post_min_right, UPPER);
+    vec_free(cond);
+
+    s->cond_p_approx = (pr->p == NULL ? TRUE : FALSE);
+
+    /* marginal p-values */
+    s->p_cons_left = pv_p_value(pr->marg_left, s->post_max_left, LOWER);
+    s->p_anti_cons_left = pv_p_value(pr->marg_left, s->post_min_left, UPPER);
+    s->p_cons_right = pv_p_value(pr->marg_right, s->post_max_right, LOWER);
+    s->p_anti_cons_right = pv_p_value(pr->marg_right, s->post_min_right, 
+                                      UPPER);
+  }
+}
+
 /* left/right subtree version of above: compute p-values and related
    stats for a given alignment and model and each of a set of
    features.  Returns an array of p_value_joint_stats objects, one for
@@ -1025,26 +1369,19 @@ sub_p_value_joint_many(JumpProcess *jp, MSA *msa, List *feats,
                        FILE *timing_f /* log file for timing info */
                        ) {
 
-  Matrix *p, *prior = NULL, *prior_site;
-  int maxlen = -1, len, idx, i, j, logmaxlen, loglen, max_nrows=-1, max_ncols=-1,
-    max_conv_len, checksum, lastlen = -1;
+  Matrix *prior_site;
+  int maxlen = -1, len, idx, i, logmaxlen, nused = 0, batch, g;
   GFF_Feature *f;
-  double *post_mean_left, *post_mean_right, *post_mean_tot, *post_var_left,
-    *post_var_right, *post_var_tot;
-  double this_min_left, this_min_right, this_max_left, this_max_right, 
-    this_min_tot, this_max_tot, prior_site_mean_left, prior_site_var_left,
-    prior_site_mean_right, prior_site_var_right, rho;
-  double  prior_mean_left, prior_var_left, prior_mean_right, prior_var_right;
-  int prior_min_left, prior_max_left, prior_min_right, prior_max_right;
+  double rho;
   p_value_joint_stats *stats = smalloc(lst_size(feats) * 
                                        sizeof(p_value_joint_stats));
-  Vector *prior_site_marg_left, *prior_site_marg_right,
-    *prior_marg_left = NULL, *prior_marg_right = NULL, *marg, *cond;
   char *used = smalloc(msa->ss->ntuples * sizeof(char));
-  Matrix **pow_p, **pows;
+  Matrix **pow_p;
   struct timeval marker_time;
-  double max_nsd = -inv_cum_norm(jp->epsilon) + 1; /* for use in CLT
-                                                      approximations */
+  SubPValueJointJob job;
+
+  job.max_nsd = -inv_cum_norm(jp->epsilon) + 1; /* for use in CLT
+                                                   approximations */
 
   /* find max length of feature.  Simultaneously, figure out which
      column tuples actually used (saves time below)  */
@@ -1060,21 +1397,20 @@ sub_p_value_joint_many(JumpProcess *jp, MSA *msa, List *feats,
 
   /* compute per-site prior distribution and left/right marginals */
   prior_site = sub_joint_distrib_site(jp, NULL, -1);
-  pm_stats(prior_site, &prior_site_mean_left, &prior_site_mean_right,
-           &prior_site_var_left, &prior_site_var_right, &rho);
-  rho /= (sqrt(prior_site_var_left * prior_site_var_right));
-                                /* (convert covariance to corr. coef.) */
-  prior_site_marg_left = pm_marg_x(prior_site);
-  prior_site_marg_right = pm_marg_y(prior_site);
+  pm_stats(prior_site, &job.prior_site_mean_left, &job.prior_site_mean_right,
+           &job.prior_site_var_left, &job.prior_site_var_right, &rho);
+  job.prior_site_marg_left = pm_marg_x(prior_site);
+  job.prior_site_marg_right = pm_marg_y(prior_site);
 
   /* compute maximum length for explicit computation of joint prior
      via convolution */
-  max_conv_len = 
-    max_convolve_len(max_convolve_size, max_nsd,
-                     prior_site_mean_left, sqrt(prior_site_var_left), 
-                     prior_site_mean_right, sqrt(prior_site_var_right));
-  if (maxlen > max_conv_len)
-    maxlen = max_conv_len;
+  job.max_conv_len = 
+    max_convolve_len(max_convolve_size, job.max_nsd,
+                     job.prior_site_mean_left, sqrt(job.prior_site_var_left), 
+                     job.prior_site_mean_right, 
+                     sqrt(job.prior_site_var_right));
+  if (maxlen > job.max_conv_len)
+    maxlen = job.max_conv_len;
 
   /* compute "powers" of prior distribution, to allow fast computation
      of convolution of prior */
@@ -1088,211 +1424,71 @@ sub_p_value_joint_many(JumpProcess *jp, MSA *msa, List *feats,
       fprintf(timing_f, "pow_p[%d] (%d x %d): %f sec\n", i, 
               pow_p[i]->nrows, pow_p[i]->ncols, get_elapsed_time(&marker_time));
   }
-  pows = smalloc((logmaxlen+1) * sizeof(void*)); /* for use below */
-
-  /* compute mean and variance of (marginals of) posterior for all
-     column tuples */
-  post_mean_left = smalloc(msa->ss->ntuples * sizeof(double));
-  post_mean_right = smalloc(msa->ss->ntuples * sizeof(double));
-  post_mean_tot = smalloc(msa->ss->ntuples * sizeof(double));
-  post_var_left = smalloc(msa->ss->ntuples * sizeof(double));
-  post_var_right = smalloc(msa->ss->ntuples * sizeof(double));
-  post_var_tot = smalloc(msa->ss->ntuples * sizeof(double));
-  for (idx = 0; idx < msa->ss->ntuples; idx++) {
-    checkInterruptN(idx, 100);
-    if (used[idx] == 'N') continue; /* can save fairly expensive call below */
-    p = sub_joint_distrib_site(jp, msa, idx); 
-    marg = pm_marg_x(p);
-    pv_stats(marg, &post_mean_left[idx], &post_var_left[idx]);
-    vec_free(marg);
-    marg = pm_marg_y(p);
-    pv_stats(marg, &post_mean_right[idx], &post_var_right[idx]);
-    vec_free(marg);
-    marg = pm_marg_tot(p);
-    pv_stats(marg, &post_mean_tot[idx], &post_var_tot[idx]);
-    vec_free(marg);
-    mat_free(p);
-  }
-
-  /* now obtain stats for each feature */
-  for (idx = 0; idx < lst_size(feats); idx++) {
-    checkInterruptN(idx, 100);
-    f = lst_get_ptr(feats, idx);
-    len = f->end - f->start + 1;
-    loglen = log2_int(len);
-
-    if (len == lastlen) {
-      if (timing_f != NULL)
-        fprintf(timing_f, "len = %d (%d x %d): [using cached convolution]\n",
-                len, max_nrows, max_ncols);
-    }
 
-    else {                /* don't recompute if length doesn't change;
-                             saves time in some cases */
+  job.jp = jp;
+  job.msa = msa;
+  job.feats = feats;
+  job.ci = ci;
+  job.pow_p = pow_p;
+  job.logmaxlen = logmaxlen;
+  job.stats = stats;
+  job.timing_f = timing_f;
 
-      if (prior_marg_left != NULL) { 
-        if (prior != NULL) mat_free(prior);
-        vec_free(prior_marg_left);
-        vec_free(prior_marg_right);
-      }
-
-      if (len <= max_conv_len) {
-
-        /* compute convolution of prior from powers */
-        j = checksum = 0;
-        for (i = 0; i <= loglen; i++) {
-          unsigned bit_i = (len >> i) & 1;
-          if (bit_i) {
-            pows[j++] = pow_p[i];
-            checksum += int_pow(2, i);
-          }
-        }
-	if (checksum != len)
-	  die("ERROR sub_p_value_joint_many: checksum (%i) != len (%i)\n",
-	      checksum, len);
-
-        if (len > 25) {
-          /* use central limit theorem to limit size of matrix to keep
-             track of */
-          max_nrows = (int)ceil(len * prior_site_mean_left + 
-                           max_nsd * sqrt(len * prior_site_var_left));
-          max_ncols = (int)ceil(len * prior_site_mean_right + 
-                           max_nsd * sqrt(len * prior_site_var_right));
-        }
-        else {
-          max_nrows = pow_p[0]->nrows * len;
-          max_ncols = pow_p[0]->ncols * len;
-        }
-        
-        if (timing_f != NULL) gettimeofday(&marker_time, NULL);
-        prior = pm_convolve_many_fast(pows, j, max_nrows, max_ncols);
-        if (timing_f != NULL)
-          fprintf(timing_f, "len = %d (%d x %d): %f sec\n", len, max_nrows, 
-                  max_ncols, get_elapsed_time(&marker_time));
-
-        prior_marg_left = pm_marg_x(prior);
-        prior_marg_right = pm_marg_y(prior);
-      }
-      else {
-        prior = NULL;             /* won't be used explicitly */
-        prior_marg_left = pv_convolve(prior_site_marg_left, len, jp->epsilon);
-        prior_marg_right = pv_convolve(prior_site_marg_right, len, jp->epsilon);
-        if (timing_f != NULL)
-          fprintf(timing_f, "len = %d (%d x %d): [skipping joint convolution]\n",
-                  len, max_nrows, max_ncols);
-      }
+  /* compute mean and variance of (marginals of) posterior for all
+     column tuples (only those used; can save fairly expensive calls).
+     Make sure lazily computed parts of the model exist before
+     starting threads */
+  if (jp->mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(jp->mod, msa);
+  tr_postorder(jp->mod->tree);
+  job.post_mean_left = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_mean_right = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_mean_tot = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_var_left = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_var_right = smalloc(msa->ss->ntuples * sizeof(double));
+  job.post_var_tot = smalloc(msa->ss->ntuples * sizeof(double));
+  job.tuples = smalloc(msa->ss->ntuples * sizeof(int));
+  for (idx = 0; idx < msa->ss->ntuples; idx++)
+    if (used[idx] == 'Y') job.tuples[nused++] = idx;
+  thr_parallel_for(nused, sub_post_joint_tuple_task, &job);
+
+  /* now obtain stats for each feature, a batch of distinct lengths at
+     a time */
+  job.groups = sub_group_by_length(feats);
+  batch = thr_get_nthreads();
+  job.priors = smalloc(batch * sizeof(SubJointPrior));
+  for (job.gfirst = 0; job.gfirst < job.groups->ngroups; 
+       job.gfirst += batch) {
+    int nprior = min(batch, job.groups->ngroups - job.gfirst);
+    checkInterrupt();
+    thr_parallel_for(nprior, sub_prior_joint_len_task, &job);
 
-      pv_stats(prior_marg_left, &prior_mean_left, &prior_var_left);
-      pv_confidence_interval(prior_marg_left, 0.95, &prior_min_left,
-                             &prior_max_left);
-      pv_stats(prior_marg_right, &prior_mean_right, &prior_var_right);
-      pv_confidence_interval(prior_marg_right, 0.95, &prior_min_right,
-                             &prior_max_right);
-      
-    }
+    job.ffirst = job.groups->start[job.gfirst];
+    job.flast = job.groups->start[job.gfirst + nprior];
+    thr_parallel_for((job.flast - job.ffirst + SUB_FEATS_PER_TASK - 1) /
+                     SUB_FEATS_PER_TASK, sub_pval_joint_feat_task, &job);
 
-    stats[idx].prior_mean_left = prior_mean_left;
-    stats[idx].prior_var_left = prior_var_left;
-    stats[idx].prior_mean_right = prior_mean_right;
-    stats[idx].prior_var_right = prior_var_right;
-    stats[idx].prior_min_left = prior_min_left;
-    stats[idx].prior_max_left = prior_max_left;
-    stats[idx].prior_min_right = prior_min_right;
-    stats[idx].prior_max_right = prior_max_right;
-
-    stats[idx].post_mean_left = stats[idx].post_mean_right = 
-      stats[idx].post_var_left = stats[idx].post_var_right = 
-      stats[idx].post_mean_tot = stats[idx].post_var_tot = 0;
-    for (i = f->start - 1; i < f->end; i++) {
-      stats[idx].post_mean_left += post_mean_left[msa->ss->tuple_idx[i]];
-      stats[idx].post_mean_right += post_mean_right[msa->ss->tuple_idx[i]];
-      stats[idx].post_mean_tot += post_mean_tot[msa->ss->tuple_idx[i]];
-      stats[idx].post_var_left += post_var_left[msa->ss->tuple_idx[i]];
-      stats[idx].post_var_right += post_var_right[msa->ss->tuple_idx[i]];
-      stats[idx].post_var_tot += post_var_tot[msa->ss->tuple_idx[i]];
+    for (g = 0; g < nprior; g++) {
+      if (job.priors[g].p != NULL) mat_free(job.priors[g].p);
+      vec_free(job.priors[g].marg_left);
+      vec_free(job.priors[g].marg_right);
     }
-    
-    if (ci != -1) {
-      norm_confidence_interval(stats[idx].post_mean_left, 
-                               sqrt(stats[idx].post_var_left), 
-                               ci, &this_min_left, &this_max_left);
-      norm_confidence_interval(stats[idx].post_mean_right, 
-                               sqrt(stats[idx].post_var_right), 
-                               ci, &this_min_right, &this_max_right);
-      norm_confidence_interval(stats[idx].post_mean_tot, 
-                               sqrt(stats[idx].post_var_tot), 
-                               ci, &this_min_tot, &this_max_tot);
-    }
-    else {
-      this_min_left = this_max_left = stats[idx].post_mean_left;
-      this_min_right = this_max_right = stats[idx].post_mean_right;
-      this_min_tot = this_max_tot = stats[idx].post_mean_tot;
-    }
-
-    stats[idx].post_min_left = (int)floor(this_min_left);
-    stats[idx].post_max_left = (int)ceil(this_max_left);
-    stats[idx].post_min_right = (int)floor(this_min_right);
-    stats[idx].post_max_right = (int)ceil(this_max_right);
-    stats[idx].post_min_tot = (int)floor(this_min_tot);
-    stats[idx].post_max_tot = (int)ceil(this_max_tot);
-
-    /* conditional p-values */
-    cond = prior != NULL ? pm_x_given_tot(prior, stats[idx].post_min_tot) :
-      pm_x_given_tot_indep(stats[idx].post_min_tot, prior_marg_left, prior_marg_right);
-    stats[idx].cond_p_cons_left = pv_p_value(cond, stats[idx].post_max_left, 
-                                             LOWER);
-    vec_free(cond);
-
-    cond = prior != NULL ? pm_x_given_tot(prior, stats[idx].post_max_tot) :
-      pm_x_given_tot_indep(stats[idx].post_max_tot, prior_marg_left, prior_marg_right);
-    stats[idx].cond_p_anti_cons_left = pv_p_value(cond, 
-                                                  stats[idx].post_min_left, 
-                                                  UPPER);
-    vec_free(cond);
-
-    cond = prior != NULL ? pm_y_given_tot(prior, stats[idx].post_min_tot) :
-      pm_y_given_tot_indep(stats[idx].post_min_tot, prior_marg_left, prior_marg_right);
-    stats[idx].cond_p_cons_right = pv_p_value(cond, stats[idx].post_max_right, 
-                                              LOWER);
-    vec_free(cond);
-
-    cond = prior != NULL ? pm_y_given_tot(prior, stats[idx].post_max_tot) :
-      pm_y_given_tot_indep(stats[idx].post_max_tot, prior_marg_left, prior_marg_right);
-    stats[idx].cond_p_anti_cons_right = pv_p_value(cond, 
-                                                   stats[idx].post_min_right, 
-                                                   UPPER);
-    vec_free(cond);
-
-    stats[idx].cond_p_approx = (prior == NULL ? TRUE : FALSE);
-
-    /* marginal p-values */
-    stats[idx].p_cons_left = pv_p_value(prior_marg_left, 
-                                        stats[idx].post_max_left, LOWER);
-    stats[idx].p_anti_cons_left = pv_p_value(prior_marg_left, 
-                                             stats[idx].post_min_left, UPPER);
-    stats[idx].p_cons_right = pv_p_value(prior_marg_right, 
-                                         stats[idx].post_max_right, LOWER);
-    stats[idx].p_anti_cons_right = pv_p_value(prior_marg_right, 
-                                              stats[idx].post_min_right, UPPER);
-
-    lastlen = len;
   }
-  if (prior != NULL) mat_free(prior);
-  vec_free(prior_marg_left);
-  vec_free(prior_marg_right);
+  sfree(job.priors);
+  sub_free_len_groups(job.groups);
 
   for (idx = 0; idx <= logmaxlen; idx++)
     mat_free(pow_p[idx]);       /* this will also free prior_site */
   sfree(pow_p);
-  sfree(pows);
-  vec_free(prior_site_marg_left);
-  vec_free(prior_site_marg_right);
-  sfree(post_mean_left);
-  sfree(post_mean_right);
-  sfree(post_mean_tot);
-  sfree(post_var_left);
-  sfree(post_var_right);
-  sfree(post_var_tot);
+  vec_free(job.prior_site_marg_left);
+  vec_free(job.prior_site_marg_right);
+  sfree(job.post_mean_left);
+  sfree(job.post_mean_right);
+  sfree(job.post_mean_tot);
+  sfree(job.post_var_left);
+  sfree(job.post_var_right);
+  sfree(job.post_var_tot);
+  sfree(job.tuples);
   sfree(used);
 
   return stats;
@@ -1325,4 +1521,5 @@ void sub_reroot(TreeModel *mod, char *subtree_name) {
     tmp = mod->tree->lchild;
     mod->tree->lchild = mod->tree->rchild;
     mod->tree->rchild = tmp;
+    tm_free_prune_plan(mod);
 }
@@ -9,12 +9,15 @@
 
 /* $Id: tree_likelihoods.c,v 1.14 2008-11-12 02:07:59 acs Exp $ */
 
+#include <limits.h>
 #include <phast/tree_likelihoods.h>
 #include <phast/subst_mods.h>
 #include <phast/markov_matrix.h>
 #include <phast/subst_mods.h>
 #include <phast/dgamma.h>
 #include <phast/sufficient_stats.h>
+#include <phast/thread_pool.h>
+#include <phast/prune_kernels.h>
 
 /* Computation of likelihoods for columns of a given multiple
    alignment, according to a given tree model.  */
@@ -23,81 +26,902 @@
    tree (as defined in the TreeModel object) are numbers from 1 to
    nseqs.  */
 
-/* FIXME: inside and outside computations should be in log space --
-   probably only an issue when the number of leaves is large */
+/* To avoid underflow with large trees, inside and outside
+   probabilities are rescaled by a factor of 2^TL_SCALE_EXP whenever
+   all of the values for a node fall below 2^-TL_SCALE_EXP, and the
+   number of factors applied is accumulated up (inside) or down
+   (outside) the tree, as in BEAGLE or RAxML.  Because the scaling
+   factors are powers of two, rescaling is exact, and results are
+   unchanged for trees small enough that no rescaling is needed. */
 
 int tuple_index_missing_data(char *tuple, int *inv_alph, int *is_missing,
                              int alph_size);
 
 
 
-/* Compute the likelihood of a tree model with respect to an
-   alignment.  Optionally retain column-by-column likelihoods,
-   optionally compute posterior probabilities.  If 'post' is NULL, no
-   posterior probabilities (or related quantities) will be computed.
-   If 'post' is non-NULL each of its attributes must either be NULL or
-   previously allocated to the required size. */
-double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
-                                 double *col_scores, double *tuple_scores,
-				 int cat, TreePosteriors *post) {
+/* Tuples are processed in windows of consecutive tuples.  Within a
+   window, tuples are distributed over threads in chunks, and each
+   tuple's log probability and posterior quantities are stored by
+   window position.  Quantities summed over tuples are then
+   accumulated in tuple order, so that results are identical
+   regardless of the number of threads. */
+#define TL_TUPLES_PER_THREAD 1024 /* window size per thread */
+#define TL_CHUNKS_PER_THREAD 4  /* tasks per thread per window, for
+                                   load balancing */
+#define TL_SCALE_EXP 256
+#define TL_SCALE_THRESHOLD 8.6361685550944446e-78 /* 2^-TL_SCALE_EXP */
+#define TL_WINDOW_MAX_BYTES 67108864
+                                /* bound on storage for per-tuple
+                                   substitution probabilities in a
+                                   window */
+#define TL_REPEAT_MAX_BYTES 33554432
+                                /* bound on per-thread storage for
+                                   partials of site-repeat classes;
+                                   limits the number of tuples per
+                                   chunk */
+
+/* Site repeats.  Two tuples with identical characters at all leaves
+   beneath a node have identical inside partials at that node.  Before
+   each chunk of tuples is processed, its tuples are assigned to
+   classes at every node -- at leaves by their characters, at internal
+   nodes by the pair of classes of their children -- and during the
+   inside pass, the partials of each class (and rate category) are
+   computed only once and shared by all tuples of the class.  Because
+   the same arithmetic is performed, results are unchanged. */
+
+/* scratch space for pruning; one per thread.  Partials are indexed
+   by node then state */
+typedef struct {
+  double **inside_joint, **outside_joint, **inside_marginal,
+    **outside_marginal;
+  int *inside_scale, *outside_scale; /* number of factors of
+                                        2^TL_SCALE_EXP applied to
+                                        the partials of each node */
+  int *pattern;                 /* class of each tuple of current
+                                   chunk at each node, indexed by
+                                   position in chunk * nnodes + node */
+  int *class_start;             /* index of first class of each node */
+  double *class_partials;       /* inside partials indexed by class,
+                                   rate category, then state */
+  void *class_base;             /* storage for class_partials */
+  int *class_scale;             /* scale of each row of class_partials */
+  char *class_done;             /* whether each row has been computed */
+  uint64_t *hash_key;           /* open-addressing table used to
+                                   number classes */
+  int *hash_class, *hash_stamp, stamp, hash_mask;
+  int *todo;                    /* nodes to compute for current tuple */
+} TlScratch;
+
+/* data shared by all threads in a call to tl_compute_log_likelihood */
+typedef struct {
+  TreeModel *mod;
+  MSA *msa;
+  int cat;
+  TreePosteriors *post;
+  double *tuple_scores;         /* may be NULL */
+  TlScratch *scratch;           /* indexed by thread */
+  int wstart, wsize;            /* first tuple and size of current
+                                   window */
+  int chunk;                    /* number of tuples per task */
+  int chunk_max;                /* upper bound on chunk */
+  int nsubst_ntasks;            /* number of node ranges for
+                                   tl_nsubst_task */
+  int *counted;                 /* whether tuple in each window slot
+                                   has nonzero count */
+  double *lprob;                /* log2 probability of tuple in each
+                                   window slot */
+  double **rcat_post;           /* posterior prob of each rate
+                                   category for each window slot */
+  double *****subst_probs;      /* substitution probabilities for
+                                   each window slot (NULL if post ==
+                                   NULL) */
+  double ***ptrans, ***pmat;    /* packed transposed and untransposed
+                                   substitution matrices, by node and
+                                   rate category (see prune_kernels.h);
+                                   pmat is NULL if post == NULL */
+  TreePrunePlan *plan;          /* traversals of mod->tree */
+  int *subtree_size;            /* number of nodes in subtree beneath
+                                   each node, inclusive */
+} TlJob;
+
+static double tl_tuple_count(MSA *msa, int cat, int tupleidx) {
+  return (cat >= 0 ? msa->ss->cat_counts[cat][tupleidx] :
+          msa->ss->counts[tupleidx]);
+}
+
+/* allocate a 4d array of substitution probabilities indexed by rate
+   category, parent state, child state, and node, backed by a single
+   block */
+static double ****tl_new_subst_probs(int nratecats, int nstates,
+                                     int nnodes) {
+  int rcat, j, k;
+  double ****sp = (double****)smalloc(nratecats * sizeof(double***));
+  double *block = (double*)smalloc(nratecats * nstates * nstates * nnodes *
+                                   sizeof(double));
+  for (rcat = 0; rcat < nratecats; rcat++) {
+    sp[rcat] = (double***)smalloc(nstates * sizeof(double**));
+    for (j = 0; j < nstates; j++) {
+      sp[rcat][j] = (double**)smalloc(nstates * sizeof(double*));
+      for (k = 0; k < nstates; k++) {
+        sp[rcat][j][k] = block;
+        block += nnodes;
+      }
+    }
+  }
+  return sp;
+}
+
+static void tl_free_subst_probs(double ****sp, int nratecats, int nstates) {
+  int rcat, j;
+  sfree(sp[0][0][0]);
+  for (rcat = 0; rcat < nratecats; rcat++) {
+    for (j = 0; j < nstates; j++)
+      sfree(sp[rcat][j]);
+    sfree(sp[rcat]);
+  }
+  sfree(sp);
+}
+
+/* allocate partials indexed by node then state, backed by a single
+   aligned block whose base pointer is kept after the last row */
+static double **tl_new_partials(int nstates, int nnodes) {
+  int node;
+  double **p = (double**)smalloc((nnodes+2) * sizeof(double*));
+  double *block = pk_new_aligned((size_t)(nnodes+1) * nstates,
+                                 (void**)&p[nnodes+1]);
+  for (node = 0; node <= nnodes; node++)
+    p[node] = block + (size_t)node * nstates;
+  return p;
+}
+
+static void tl_free_partials(double **p, int nnodes) {
+  if (p == NULL) return;
+  sfree(p[nnodes+1]);
+  sfree(p);
+}
+
+/* pack substitution matrices for use by the pruning kernels */
+static void tl_pack_matrices(TlJob *job) {
+  TreeModel *mod = job->mod;
+  int nodeidx, rcat;
+
+  pk_get_simd(mod->rate_matrix->size); /* select kernels before starting
+                                          threads */
+  for (nodeidx = 0; nodeidx < mod->tree->nnodes; nodeidx++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, nodeidx);
+    if (n->parent == NULL) continue;
+    for (rcat = 0; rcat < mod->nratecats; rcat++) {
+      pk_pack_transpose(job->ptrans[n->id][rcat], mod->P[n->id][rcat]);
+      if (job->post != NULL)
+        pk_pack(job->pmat[n->id][rcat], mod->P[n->id][rcat]);
+    }
+  }
+}
+
+/* Rescale the partials of node 'id' by powers of 2^TL_SCALE_EXP if
+   they are all small enough to risk underflow.  Returns the number of
+   scaling factors applied */
+static int tl_rescale(double **p, int id, int nstates) {
+  int i, nscale = 0;
+  double maxval = 0;
+  for (i = 0; i < nstates; i++)
+    if (p[id][i] > maxval) maxval = p[id][i];
+  while (maxval > 0 && maxval < TL_SCALE_THRESHOLD) {
+    for (i = 0; i < nstates; i++)
+      p[id][i] = ldexp(p[id][i], TL_SCALE_EXP);
+    maxval = ldexp(maxval, TL_SCALE_EXP);
+    nscale++;
+  }
+  return nscale;
+}
+
+/* Add x * 2^(-TL_SCALE_EXP * xscale) to a running sum represented as
+   *sum * 2^(-TL_SCALE_EXP * *sumscale), keeping the smaller of the two
+   scales.  Equivalent to *sum += x when the scales are equal */
+static void tl_add_scaled(double *sum, int *sumscale, double x, int xscale) {
+  if (x == 0)
+    return;
+  if (*sum == 0)
+    *sumscale = xscale;
+  else if (xscale > *sumscale)
+    x = ldexp(x, -TL_SCALE_EXP * (xscale - *sumscale));
+  else if (xscale < *sumscale) {
+    *sum = ldexp(*sum, -TL_SCALE_EXP * (*sumscale - xscale));
+    *sumscale = xscale;
+  }
+  *sum += x;
+}
+
+/* allocate storage for site-repeat classes; chunks may have up to
+   chunk_max tuples */
+static void tl_new_repeats(TlScratch *scr, int nstates, int nnodes,
+                           int nratecats, int chunk_max) {
+  int hsize = 1;
+  size_t nrows = (size_t)nnodes * chunk_max * nratecats;
+  while (hsize < 2 * chunk_max) hsize *= 2;
+  scr->pattern = (int*)smalloc((size_t)nnodes * chunk_max * sizeof(int));
+  scr->class_start = (int*)smalloc(nnodes * sizeof(int));
+  scr->class_partials = pk_new_aligned(nrows * nstates, &scr->class_base);
+  scr->class_scale = (int*)smalloc(nrows * sizeof(int));
+  scr->class_done = (char*)smalloc(nrows * sizeof(char));
+  scr->hash_key = (uint64_t*)smalloc(hsize * sizeof(uint64_t));
+  scr->hash_class = (int*)smalloc(hsize * sizeof(int));
+  scr->hash_stamp = (int*)smalloc(hsize * sizeof(int));
+  memset(scr->hash_stamp, 0, hsize * sizeof(int));
+  scr->stamp = 0;
+  scr->hash_mask = hsize - 1;
+  scr->todo = (int*)smalloc(nnodes * sizeof(int));
+}
+
+static void tl_free_repeats(TlScratch *scr) {
+  sfree(scr->pattern);
+  sfree(scr->class_start);
+  sfree(scr->class_base);
+  sfree(scr->class_scale);
+  sfree(scr->class_done);
+  sfree(scr->hash_key);
+  sfree(scr->hash_class);
+  sfree(scr->hash_stamp);
+  sfree(scr->todo);
+}
+
+/* Storage for tl_compute_log_likelihood, kept by the tree model
+   between calls so that repeated evaluations (e.g., during
+   optimization) do not allocate memory.  It depends only on the
+   dimensions below, not on the topology or parameters of the model */
+struct tl_workspace_struct {
+  int nthreads, nstates, nnodes, nratecats;
+  int marginal;                 /* whether marginal partials are
+                                   allocated (models of order > 0) */
+  int post;                     /* whether storage for posterior
+                                   quantities is allocated */
+  int wsize_max, chunk_max;     /* maximum window and chunk sizes */
+  TlScratch *scratch;           /* indexed by thread */
+  int *counted;                 /* see TlJob */
+  double *lprob, **rcat_post, *****subst_probs;
+  double ***ptrans, ***pmat;
+  void *packed_base;            /* storage for ptrans and pmat */
+  int *subtree_size;
+  double *tuple_scores;         /* temporary per-tuple scores */
+  int ntuples;                  /* size of tuple_scores */
+};
+
+static TlWorkspace *tl_new_workspace(TreeModel *mod, int nthreads,
+                                     int wsize_max, int chunk_max,
+                                     int post) {
+  TlWorkspace *ws = (TlWorkspace*)smalloc(sizeof(TlWorkspace));
+  int nstates = mod->rate_matrix->size, nnodes = mod->tree->nnodes;
+  int nratecats = mod->nratecats, nmats = (post ? 2 : 1);
+  int thread, slot, node, rcat;
+  size_t msize = (size_t)nstates * nstates;
+  double *block;
+
+  ws->nthreads = nthreads;
+  ws->nstates = nstates;
+  ws->nnodes = nnodes;
+  ws->nratecats = nratecats;
+  ws->marginal = (mod->order > 0);
+  ws->post = post;
+  ws->wsize_max = wsize_max;
+  ws->chunk_max = chunk_max;
+
+  ws->scratch = (TlScratch*)smalloc(nthreads * sizeof(TlScratch));
+  for (thread = 0; thread < nthreads; thread++) {
+    TlScratch *scr = &ws->scratch[thread];
+    scr->inside_joint = tl_new_partials(nstates, nnodes);
+    scr->outside_joint = tl_new_partials(nstates, nnodes);
+    scr->inside_marginal = (ws->marginal ? tl_new_partials(nstates, nnodes) :
+                            NULL);
+    scr->outside_marginal = (ws->marginal && post ?
+                             tl_new_partials(nstates, nnodes) : NULL);
+    scr->inside_scale = (int*)smalloc((nnodes+1) * sizeof(int));
+    scr->outside_scale = (int*)smalloc((nnodes+1) * sizeof(int));
+    tl_new_repeats(scr, nstates, nnodes, nratecats, chunk_max);
+  }
+
+  ws->counted = (int*)smalloc(wsize_max * sizeof(int));
+  ws->lprob = (double*)smalloc(wsize_max * sizeof(double));
+  ws->rcat_post = (double**)smalloc(wsize_max * sizeof(double*));
+  for (slot = 0; slot < wsize_max; slot++)
+    ws->rcat_post[slot] = (double*)smalloc(nratecats * sizeof(double));
+  ws->subst_probs = NULL;
+  if (post) {
+    ws->subst_probs = (double*****)smalloc(wsize_max * sizeof(double****));
+    for (slot = 0; slot < wsize_max; slot++)
+      ws->subst_probs[slot] = tl_new_subst_probs(nratecats, nstates, nnodes);
+  }
 
+  /* packed matrices, by node id then rate category */
+  block = pk_new_aligned(nmats * nnodes * nratecats * msize,
+                         &ws->packed_base);
+  ws->ptrans = (double***)smalloc(nnodes * sizeof(double**));
+  ws->pmat = (post ? (double***)smalloc(nnodes * sizeof(double**)) : NULL);
+  for (node = 0; node < nnodes; node++) {
+    ws->ptrans[node] = (double**)smalloc(nratecats * sizeof(double*));
+    if (post)
+      ws->pmat[node] = (double**)smalloc(nratecats * sizeof(double*));
+    for (rcat = 0; rcat < nratecats; rcat++) {
+      ws->ptrans[node][rcat] = block;
+      block += msize;
+      if (post) {
+        ws->pmat[node][rcat] = block;
+        block += msize;
+      }
+    }
+  }
+
+  ws->subtree_size = (int*)smalloc(nnodes * sizeof(int));
+  ws->tuple_scores = NULL;
+  ws->ntuples = 0;
+  return ws;
+}
+
+void tl_free_workspace(TlWorkspace *ws) {
+  int thread, slot, node;
+  if (ws == NULL) return;
+  for (thread = 0; thread < ws->nthreads; thread++) {
+    TlScratch *scr = &ws->scratch[thread];
+    tl_free_partials(scr->inside_joint, ws->nnodes);
+    tl_free_partials(scr->outside_joint, ws->nnodes);
+    tl_free_partials(scr->inside_marginal, ws->nnodes);
+    tl_free_partials(scr->outside_marginal, ws->nnodes);
+    sfree(scr->inside_scale);
+    sfree(scr->outside_scale);
+    tl_free_repeats(scr);
+  }
+  sfree(ws->scratch);
+  for (slot = 0; slot < ws->wsize_max; slot++) {
+    sfree(ws->rcat_post[slot]);
+    if (ws->subst_probs != NULL)
+      tl_free_subst_probs(ws->subst_probs[slot], ws->nratecats, ws->nstates);
+  }
+  sfree(ws->rcat_post);
+  if (ws->subst_probs != NULL) sfree(ws->subst_probs);
+  sfree(ws->counted);
+  sfree(ws->lprob);
+  for (node = 0; node < ws->nnodes; node++) {
+    sfree(ws->ptrans[node]);
+    if (ws->pmat != NULL) sfree(ws->pmat[node]);
+  }
+  sfree(ws->ptrans);
+  if (ws->pmat != NULL) sfree(ws->pmat);
+  sfree(ws->packed_base);
+  sfree(ws->subtree_size);
+  if (ws->tuple_scores != NULL) sfree(ws->tuple_scores);
+  sfree(ws);
+}
+
+/* Return the workspace of mod, (re)allocating it if it is missing or
+   too small for the requested window and chunk sizes.  When it must
+   be reallocated for a model of unchanged dimensions, its capacities
+   only grow, so that alternating calls do not thrash */
+static TlWorkspace *tl_get_workspace(TreeModel *mod, int nthreads,
+                                     int wsize_max, int chunk_max,
+                                     int post) {
+  TlWorkspace *ws = mod->tl_workspace;
+  if (ws != NULL && ws->nthreads >= nthreads &&
+      ws->nstates == mod->rate_matrix->size &&
+      ws->nnodes == mod->tree->nnodes && ws->nratecats == mod->nratecats &&
+      ws->marginal == (mod->order > 0)) {
+    if ((ws->post || !post) && ws->wsize_max >= wsize_max &&
+        ws->chunk_max >= chunk_max)
+      return ws;
+    wsize_max = max(wsize_max, ws->wsize_max);
+    chunk_max = max(chunk_max, ws->chunk_max);
+    nthreads = ws->nthreads;
+    post = (post || ws->post);
+  }
+  tl_free_workspace(ws);
+  mod->tl_workspace = tl_new_workspace(mod, nthreads, wsize_max, chunk_max,
+                                       post);
+  return mod->tl_workspace;
+}
+
+/* Assign the n tuples of the chunk starting at window slot 'first' to
+   site-repeat classes at each node, and mark all classes as not yet
+   computed */
+static void tl_find_repeats(TlJob *job, TlScratch *scr, int first, int n) {
+  TreeModel *mod = job->mod;
+  TreePrunePlan *plan = job->plan;
+  int nodeidx, i, offset, h, nclasses = 0;
+  int nnodes = mod->tree->nnodes;
+
+  for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+    TreePruneOp *op = &plan->postorder[nodeidx];
+    int nodeclasses = 0, seq = -1;
+
+    if (op->lchild < 0 && (seq = mod->msa_seq_idx[op->node]) < 0)
+      die("ERROR tl_compute_log_likelihood: expected a leaf node\n");
+
+    /* start a new (empty) table */
+    if (++scr->stamp == INT_MAX) {
+      memset(scr->hash_stamp, 0, (scr->hash_mask + 1) * sizeof(int));
+      scr->stamp = 1;
+    }
+
+    for (i = 0; i < n; i++) {
+      uint64_t key = 0;
+      if (op->lchild < 0)     /* characters of leaf in all columns of tuple */
+        for (offset = -mod->order; offset <= 0; offset++)
+          key = (key << 8) | (unsigned char)
+            ss_get_char_tuple(job->msa, job->wstart + first + i, seq, offset);
+      else
+        key = ((uint64_t)scr->pattern[i * nnodes + op->lchild] << 32) |
+          (uint32_t)scr->pattern[i * nnodes + op->rchild];
+
+      h = (int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & scr->hash_mask;
+      while (scr->hash_stamp[h] == scr->stamp && scr->hash_key[h] != key)
+        h = (h + 1) & scr->hash_mask;
+      if (scr->hash_stamp[h] != scr->stamp) {
+        scr->hash_stamp[h] = scr->stamp;
+        scr->hash_key[h] = key;
+        scr->hash_class[h] = nodeclasses++;
+      }
+      scr->pattern[i * nnodes + op->node] = scr->hash_class[h];
+    }
+    scr->class_start[op->node] = nclasses;
+    nclasses += nodeclasses;
+  }
+  memset(scr->class_done, FALSE, (size_t)nclasses * mod->nratecats);
+}
+
+/* index of the row of class_partials for the class of the tuple at
+   position pos of the current chunk, at a given node and rate
+   category */
+static inline size_t tl_class_row(TlJob *job, TlScratch *scr, int node,
+                                  int pos, int rcat) {
+  return (size_t)(scr->class_start[node] +
+                  scr->pattern[pos * job->mod->tree->nnodes + node]) *
+    job->mod->nratecats + rcat;
+}
+
+/* Point the inside partials (scr->inside_joint) of each node to the
+   rows for the classes of the tuple at position pos of the current
+   chunk, and list in scr->todo the postorder indices of the nodes
+   whose rows remain to be computed, in reverse postorder.  Subtrees
+   beneath nodes whose rows are already computed are skipped unless
+   'all' is TRUE, in which case every node's partials are set up.
+   Returns the number of nodes listed */
+static int tl_class_rows(TlJob *job, TlScratch *scr, int pos, int rcat,
+                         int all) {
+  TreePrunePlan *plan = job->plan;
+  int nodeidx, ntodo = 0, nstates = job->mod->rate_matrix->size;
+
+  /* visiting the postorder traversal backwards, each subtree is a
+     contiguous block starting at its root */
+  for (nodeidx = plan->nnodes - 1; nodeidx >= 0; nodeidx--) {
+    int node = plan->postorder[nodeidx].node;
+    size_t row = tl_class_row(job, scr, node, pos, rcat);
+    scr->inside_joint[node] = scr->class_partials + row * nstates;
+    if (!scr->class_done[row])
+      scr->todo[ntodo++] = nodeidx;
+    else {
+      scr->inside_scale[node] = scr->class_scale[row];
+      if (!all)
+        nodeidx -= job->subtree_size[node] - 1;
+    }
+  }
+  return ntodo;
+}
+
+/* Compute the log (base 2) probability of a single column tuple by
+   Felsenstein pruning, unweighted by the tuple's count.  Also stores
+   the posterior probability of each rate category in rcat_post and,
+   if job->post is non-NULL, computes per-tuple posterior quantities
+   and substitution probabilities (subst_probs).  Does not modify
+   anything shared with other tuples, so may be called concurrently
+   for different tuples with different scratch space.  The tuple must
+   be at position pos of the chunk last passed to tl_find_repeats with
+   the same scratch space. */
+static double tl_compute_tuple(TlJob *job, int tupleidx, int pos,
+                               TlScratch *scr, double *rcat_post,
+                               double ****subst_probs) {
+  TreeModel *mod = job->mod;
+  MSA *msa = job->msa;
+  TreePosteriors *post = job->post;
   int i, j;
-  double retval = 0;
   int nstates = mod->rate_matrix->size;
   int alph_size = (int)strlen(mod->rate_matrix->states);
   int npasses = (mod->order > 0 && mod->use_conditionals == 1 ? 2 : 1);
-  int pass, col_offset, k, nodeidx, rcat, /* colidx, */ tupleidx, defined;
-  TreeNode *n;
-  double total_prob, marg_tot;
-  List *traversal;
-  double **inside_joint = NULL, **inside_marginal = NULL,
-    **outside_joint = NULL, **outside_marginal = NULL,
-    ****subst_probs = NULL;
-  double *curr_tuple_scores=NULL;
+  int pass, col_offset, nodeidx, rcat;
+  int skip_fels = FALSE;
+  TreePrunePlan *plan = job->plan;
+  TreePruneOp *op;
+  double total_prob, marg_tot, lprob;
+  double **inside_joint = scr->inside_joint,
+    **inside_marginal = scr->inside_marginal,
+    **outside_joint = scr->outside_joint,
+    **outside_marginal = scr->outside_marginal;
+  int *inside_scale = scr->inside_scale, *outside_scale = scr->outside_scale;
+  int total_scale = 0, marg_scale = 0;
   double rcat_prob[mod->nratecats];
-  double tmp[nstates];
+  int rcat_scale[mod->nratecats];
+  double tmp[nstates], denom[nstates];
+
+  checkInterruptN(tupleidx, 1000);
+
+  total_prob = 0;
+  marg_tot = NULL_LOG_LIKELIHOOD;
+
+  /* check for gaps and whether column is informative, if necessary */
+  if (!mod->allow_gaps)
+    for (j = 0; !skip_fels && j < msa->nseqs; j++)
+      if (ss_get_char_tuple(msa, tupleidx, j, 0) == GAP_CHAR)
+        skip_fels = TRUE;
+  if (!skip_fels && mod->inform_reqd) {
+    int ninform = 0;
+    for (j = 0; j < msa->nseqs; j++) {
+      if (msa->is_informative != NULL && !msa->is_informative[j])
+        continue;
+      else if (!msa->is_missing[(int)ss_get_char_tuple(msa, tupleidx, j, 0)])
+        ninform++;
+    }
+    if (ninform < 2) skip_fels = TRUE;
+  }
 
-  checkInterrupt();
+  if (!skip_fels) {
+    for (pass = 0; pass < npasses; pass++) {
+      double **pL = (pass == 0 ? inside_joint : inside_marginal);
+      double **pLbar = (pass == 0 ? outside_joint : outside_marginal);
 
-  /* allocate memory */
-  inside_joint = (double**)smalloc(nstates * sizeof(double*));
-  for (j = 0; j < nstates; j++)
-    inside_joint[j] = (double*)smalloc((mod->tree->nnodes+1) *
-                                       sizeof(double));
-  outside_joint = (double**)smalloc(nstates * sizeof(double*));
-  for (j = 0; j < nstates; j++)
-    outside_joint[j] = (double*)smalloc((mod->tree->nnodes+1) *
-                                        sizeof(double));
-  /* only needed if post != NULL? */
-  if (mod->order > 0) {
-    inside_marginal = (double**)smalloc(nstates * sizeof(double*));
-    for (j = 0; j < nstates; j++)
-      inside_marginal[j] = (double*)smalloc((mod->tree->nnodes+1) *
-                                            sizeof(double));
+      if (pass > 0)
+        marg_tot = 0;         /* will need to compute */
+
+      for (rcat = 0; rcat < mod->nratecats; rcat++) {
+        /* on the first pass, only the partials of classes not yet
+           seen need to be computed */
+        int ntodo = (pass == 0 ? tl_class_rows(job, scr, pos, rcat,
+                                               post != NULL) :
+                     plan->nnodes), k;
+        for (k = 0; k < ntodo; k++) {
+          int partial_match[mod->order+1][alph_size];
+          nodeidx = (pass == 0 ? scr->todo[ntodo-1-k] : k);
+          op = &plan->postorder[nodeidx];
+          if (op->lchild < 0) {
+            /* leaf: base case of recursion */
+            int thisseq;
+
+            thisseq = mod->msa_seq_idx[op->node];
+            if (thisseq < 0)
+              die("ERROR tl_compute_log_likelihood: expected a leaf node\n");
+
+            /* first figure out whether there is a match for each
+               character in each position; we'll call this the record of
+               "partial_matches". */
+            for (col_offset = -1*mod->order; col_offset <= 0; col_offset++) {
+              int observed_state = -1;
+              int *iupac_prob = NULL;
+
+              if (pass == 0 || col_offset < 0) {
+                char thischar = ss_get_char_tuple(msa, tupleidx,
+                                                  thisseq, col_offset);
+                observed_state = mod->rate_matrix->inv_states[(int)thischar];
+                if (observed_state < 0)
+                  iupac_prob = mod->iupac_inv_map[(int)thischar];
+              }
+
+              /* otherwise, we're on a second pass and looking the
+                 current base, so we want to use the "missing
+                 information" principle */
+
+              if (iupac_prob != NULL) {
+                for (i = 0; i < alph_size; i++)
+                  partial_match[mod->order+col_offset][i] = iupac_prob[i];
+              }
+              else {
+                for (i = 0; i < alph_size; i++) {
+                  if (observed_state < 0 || i == observed_state)
+                    partial_match[mod->order+col_offset][i] = 1;
+                  else
+                    partial_match[mod->order+col_offset][i] = 0;
+                }
+              }
+            }
+
+            /* now find the intersection of the partial matches */
+            inside_scale[op->node] = 0;
+            for (i = 0; i < nstates; i++) {
+              if (mod->order == 0)  /* handle 0th order model as special
+                                       case, for efficiency.  In this case
+                                       the partial match *is* the total
+                                       match */
+                pL[op->node][i] = partial_match[0][i];
+              else {
+                int total_match = 1;
+                /* figure out the "projection" of state i in the dimension
+                   of each position, and see whether there is a
+                   corresponding partial match. */
+                /* NOTE: mod->order is approx equal to log nstates
+                   (prob no more than 2) */
+                for (col_offset = -1*mod->order; col_offset <= 0 && total_match;
+                     col_offset++) {
+                  int projection = (i / int_pow(alph_size, -1 * col_offset)) %
+                    alph_size;
+
+                  if (!partial_match[mod->order+col_offset][projection])
+                    total_match = 0; /* must have partial matches in all
+                                        dimensions for a total match */
+                }
+                pL[op->node][i] = total_match;
+              }
+            }
+          }
+          else {
+            /* general recursive case */
+            pk_inside(pL[op->node], job->ptrans[op->lchild][rcat],
+                      pL[op->lchild], job->ptrans[op->rchild][rcat],
+                      pL[op->rchild], nstates);
+            inside_scale[op->node] = inside_scale[op->lchild] +
+              inside_scale[op->rchild] + tl_rescale(pL, op->node, nstates);
+          }
+          if (pass == 0) {
+            size_t row = tl_class_row(job, scr, op->node, pos, rcat);
+            scr->class_scale[row] = inside_scale[op->node];
+            scr->class_done[row] = TRUE;
+          }
+        }
+
+        if (post != NULL && pass == 0) {
+          double this_total, *subst_mat;
+          int corr_exp = 0;
+
+          /* do outside calculation */
+          for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+            op = &plan->preorder[nodeidx];
+            if (op->parent < 0) { /* base case */
+              for (i = 0; i < nstates; i++)
+                pLbar[op->node][i] = vec_get(mod->backgd_freqs, i);
+              outside_scale[op->node] = 0;
+            }
+            else {            /* recursive case */
+
+              /* breaking this computation into two parts as follows
+                 reduces its complexity by a factor of nstates */
+              pk_outside(tmp, job->ptrans[op->sibling][rcat],
+                         pLbar[op->parent], pL[op->sibling], nstates);
+              pk_matvec(pLbar[op->node], job->pmat[op->node][rcat], tmp,
+                        nstates);
+              outside_scale[op->node] = outside_scale[op->parent] +
+                inside_scale[op->sibling] +
+                tl_rescale(pLbar, op->node, nstates);
+            }
+
+
+            /* compute total probability based on current node, to
+               avoid numerical errors */
+            this_total = 0;
+            for (i = 0; i < nstates; i++)
+              this_total += pL[op->node][i] * pLbar[op->node][i];
+
+            /* correct for any difference in scaling between this_total
+               (at the node) and the partials at its parent.  The
+               correction is kept as a binary exponent and applied to
+               each final probability, as the factor 2^corr_exp by
+               itself can overflow or underflow */
+            if (op->parent >= 0)
+              corr_exp = TL_SCALE_EXP * 
+                (inside_scale[op->node] + outside_scale[op->node] -
+                 inside_scale[op->parent] - outside_scale[op->parent]);
+
+            if (post->expected_nsubst != NULL && op->parent >= 0)
+              post->expected_nsubst[rcat][op->node][tupleidx] = 1;
+
+            /* (intermediate computation used for subst probs) */
+            if (op->parent >= 0)
+              pk_matvec(denom, job->ptrans[op->node][rcat], pL[op->node],
+                        nstates);
+
+            subst_mat = job->pmat[op->node][rcat];
+            for (i = 0; i < nstates; i++) {
+              /* compute posterior prob of base (tuple) i at node n */
+              if (post->base_probs != NULL) {
+                post->base_probs[rcat][i][op->node][tupleidx] =
+                  safediv(pL[op->node][i] * pLbar[op->node][i], this_total);
+              }
+
+              if (op->parent < 0) continue;
+
+              for (j = 0; j < nstates; j++) {
+                /* compute posterior prob of a subst of base j at
+                   node n for base i at node n->parent */
+                subst_probs[rcat][i][j][op->node] =
+                  safediv(pL[op->parent][i] * pLbar[op->parent][i],
+                          this_total) *
+                  pL[op->node][j] * subst_mat[i*nstates + j];
+                subst_probs[rcat][i][j][op->node] =
+                  safediv(subst_probs[rcat][i][j][op->node], denom[i]);
+                if (corr_exp != 0)
+                  subst_probs[rcat][i][j][op->node] =
+                    ldexp(subst_probs[rcat][i][j][op->node], corr_exp);
+
+                if (post->subst_probs != NULL)
+                  post->subst_probs[rcat][i][j][op->node][tupleidx] =
+                    subst_probs[rcat][i][j][op->node];
+
+                if (post->expected_nsubst != NULL && j == i)
+                  post->expected_nsubst[rcat][op->node][tupleidx] -=
+                    subst_probs[rcat][i][j][op->node];
+
+              }
+            }
+          }
+        }
+
+        if (pass == 0) {
+          rcat_prob[rcat] = 0;
+          for (i = 0; i < nstates; i++) {
+            rcat_prob[rcat] += vec_get(mod->backgd_freqs, i) *
+              inside_joint[mod->tree->id][i] * mod->freqK[rcat];
+          }
+          rcat_scale[rcat] = inside_scale[mod->tree->id];
+          tl_add_scaled(&total_prob, &total_scale, rcat_prob[rcat],
+                        rcat_scale[rcat]);
+        }
+        else {
+          for (i = 0; i < nstates; i++)
+            tl_add_scaled(&marg_tot, &marg_scale,
+                          vec_get(mod->backgd_freqs, i) *
+                          inside_marginal[mod->tree->id][i] *
+                          mod->freqK[rcat], inside_scale[mod->tree->id]);
+        }
+      } /* for rcat */
+    } /* for pass */
+  } /* if skip_fels */
+
+  /* compute posterior prob of each rate cat and related quantities;
+     sums over tuples are left to the caller */
+  if (post != NULL) {
+    if (skip_fels) die("ERROR: tl_compute_log_likelihood: skip_fels should be 0 but is %i\n", skip_fels);
+    for (rcat = 0; rcat < mod->nratecats; rcat++) {
+      double rcat_post_prob =
+        safediv(rcat_scale[rcat] == total_scale ? rcat_prob[rcat] :
+                ldexp(rcat_prob[rcat],
+                      -TL_SCALE_EXP * (rcat_scale[rcat] - total_scale)),
+                total_prob);
+      rcat_post[rcat] = rcat_post_prob;
+      if (post->rcat_probs != NULL)
+        post->rcat_probs[rcat][tupleidx] = rcat_post_prob;
+      if (post->expected_nsubst_col != NULL) {
+        for (nodeidx = 0; nodeidx < plan->nnodes; nodeidx++) {
+          op = &plan->preorder[nodeidx];
+          if (op->parent < 0) continue;
+          for (i = 0; i < nstates; i++)
+            for (j = 0; j < nstates; j++)
+              post->expected_nsubst_col[rcat][op->node][tupleidx][i][j] =
+                subst_probs[rcat][i][j][op->node] * rcat_post_prob;
+        }
+      }
+    }
   }
-  if (mod->order > 0 && post != NULL) {
-    outside_marginal = (double**)smalloc(nstates * sizeof(double*));
-    for (j = 0; j < nstates; j++)
-      outside_marginal[j] = (double*)smalloc((mod->tree->nnodes+1) *
-                                             sizeof(double));
+
+  if (mod->order > 0 && mod->use_conditionals == 1 && !skip_fels) {
+    total_prob /= marg_tot;
+    total_scale -= marg_scale;
   }
-  if (post != NULL) {
-    subst_probs = (double****)smalloc(mod->nratecats * sizeof(double***));
+
+  /*    if (total_prob > 1.0) {
+    if (total_prob - 1.0 < 1.0e-6) total_prob = 1.0;
+    else die("got total_prob=%.10g\n", total_prob);
+    }*/
+  lprob = log2(total_prob);
+  if (total_scale != 0 && total_prob > 0)
+    lprob -= (double)TL_SCALE_EXP * total_scale;
+  return lprob;
+}
+
+/* thread task: compute one chunk of tuples in the current window */
+static void tl_tuple_task(void *data, int task, int thread) {
+  TlJob *job = (TlJob*)data;
+  int slot, end = min((task+1) * job->chunk, job->wsize);
+  TlScratch *scr = &job->scratch[thread];
+  tl_find_repeats(job, scr, task * job->chunk, end - task * job->chunk);
+  for (slot = task * job->chunk; slot < end; slot++) {
+    int tupleidx = job->wstart + slot;
+    job->counted[slot] = (tl_tuple_count(job->msa, job->cat, tupleidx) != 0);
+    if (!job->counted[slot]) continue;
+    job->lprob[slot] =
+      tl_compute_tuple(job, tupleidx, slot - task * job->chunk, scr,
+                       job->rcat_post[slot],
+                       job->subst_probs == NULL ? NULL : job->subst_probs[slot]);
+    if (job->tuple_scores != NULL)
+      job->tuple_scores[tupleidx] = job->lprob[slot];
+    /* NOTE: tuple_scores contains the (log) probabilities
+       *unweighted* by tuple counts */
+  }
+}
+
+/* thread task: add expected numbers of substitutions for the current
+   window to post->expected_nsubst_tot, for one range of nodes.
+   Tuples are visited in order, so each sum is accumulated exactly as
+   in a serial computation */
+static void tl_nsubst_task(void *data, int task, int thread) {
+  TlJob *job = (TlJob*)data;
+  TreeModel *mod = job->mod;
+  int nstates = mod->rate_matrix->size;
+  int nnodes = mod->tree->nnodes;
+  int ntasks = job->nsubst_ntasks;
+  int first = task * nnodes / ntasks, last = (task+1) * nnodes / ntasks;
+  int slot, rcat, nodeidx, i, j;
+  TreeNode *n;
+
+  for (slot = 0; slot < job->wsize; slot++) {
+    double count;
+    if (!job->counted[slot]) continue;
+    count = tl_tuple_count(job->msa, job->cat, job->wstart + slot);
     for (rcat = 0; rcat < mod->nratecats; rcat++) {
-      subst_probs[rcat] = (double***)smalloc(nstates * sizeof(double**));
-      for (j = 0; j < nstates; j++) {
-        subst_probs[rcat][j] = (double**)smalloc(nstates * sizeof(double*));
-        for (k = 0; k < nstates; k++)
-          subst_probs[rcat][j][k] = (double*)smalloc(mod->tree->nnodes * sizeof(double));
+      double rcat_post_prob = job->rcat_post[slot][rcat];
+      double ***subst_probs = job->subst_probs[slot][rcat];
+      for (nodeidx = first; nodeidx < last; nodeidx++) {
+        n = lst_get_ptr(mod->tree->nodes, nodeidx);
+        if (n->parent == NULL) continue;
+        for (i = 0; i < nstates; i++)
+          for (j = 0; j < nstates; j++)
+            job->post->expected_nsubst_tot[rcat][i][j][n->id] +=
+              subst_probs[i][j][n->id] * count * rcat_post_prob;
       }
     }
   }
+}
+
+/* Set up the parts of a tree model that tl_compute_log_likelihood
+   needs and that are otherwise created on demand: the IUPAC mapping,
+   the mapping from leaves to sequences, the substitution matrices and
+   the pruning plan.  Some of these use static storage, so this must
+   be called before calls for different models run concurrently */
+void tl_prepare(TreeModel *mod, MSA *msa) {
+  int i, j, defined;
+  int alph_size = (int)strlen(mod->rate_matrix->states);
 
   /* create IUPAC mapping if needed */
   if (mod->iupac_inv_map == NULL)
     mod->iupac_inv_map = build_iupac_inv_map(mod->rate_matrix->inv_states,
                                              alph_size);
 
+  /* set up leaf to sequence mapping, if necessary */
+  if (mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(mod, msa);
+
+  /* set up prob matrices, if any are undefined */
+  for (i = 0, defined = TRUE; defined && i < mod->tree->nnodes; i++) {
+    if (((TreeNode*)lst_get_ptr(mod->tree->nodes, i))->parent == NULL)
+      continue;  		/* skip root */
+    for (j = 0; j < mod->nratecats; j++)
+      if (mod->P[i][j] == NULL) defined = FALSE;
+  }
+  if (!defined) {
+    tm_set_subst_matrices(mod);
+  }
+
+  /* traversals are created on demand; make sure that happens before
+     any threads are started */
+  tm_get_prune_plan(mod);
+}
+
+/* Compute the likelihood of a tree model with respect to an
+   alignment.  Optionally retain column-by-column likelihoods,
+   optionally compute posterior probabilities.  If 'post' is NULL, no
+   posterior probabilities (or related quantities) will be computed.
+   If 'post' is non-NULL each of its attributes must either be NULL or
+   previously allocated to the required size.  Tuples are distributed
+   over up to thr_get_nthreads() threads; results do not depend on the
+   number of threads.  Working storage is kept in mod->tl_workspace
+   and reused by later calls, so concurrent calls must not share a
+   model. */
+double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
+                                 double *col_scores, double *tuple_scores,
+				 int cat, TreePosteriors *post) {
+
+  int i, j, k;
+  double retval = 0;
+  int nstates = mod->rate_matrix->size;
+  int rcat, tupleidx, slot;
+  int nthreads, wsize_max;
+  double *curr_tuple_scores=NULL;
+  size_t slot_bytes = 0;
+  TlJob job;
+  TlWorkspace *ws;
+
+  checkInterrupt();
 
   if (cat > msa->ncats)
     die("ERROR tl_compute_log_likelihood: cat (%i) > msa->ncats (%i)\n", cat, msa->ncats);
@@ -118,28 +942,7 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
     ss_from_msas(msa, mod->order+1, col_scores == NULL ? 0 : 1,
                  NULL, NULL, NULL, -1, subst_mod_is_codon_model(mod->subst_mod));
 
-  /* set up leaf to sequence mapping, if necessary */
-  if (mod->msa_seq_idx == NULL)
-    tm_build_seq_idx(mod, msa);
-
-  /* set up prob matrices, if any are undefined */
-  for (i = 0, defined = TRUE; defined && i < mod->tree->nnodes; i++) {
-    if (((TreeNode*)lst_get_ptr(mod->tree->nodes, i))->parent == NULL)
-      continue;  		/* skip root */
-    for (j = 0; j < mod->nratecats; j++)
-      if (mod->P[i][j] == NULL) defined = FALSE;
-  }
-/*   printf("mod %d\n", mod); */
-  if (!defined) {
-    tm_set_subst_matrices(mod);
-  }
-  if (col_scores != NULL && tuple_scores == NULL)
-    curr_tuple_scores = (double*)smalloc(msa->ss->ntuples * sizeof(double));
-  else if (tuple_scores != NULL)
-    curr_tuple_scores = tuple_scores;
-  if (curr_tuple_scores != NULL)
-    for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
-      curr_tuple_scores[tupleidx] = 0;
+  tl_prepare(mod, msa);
 
   if (post != NULL && post->expected_nsubst_tot != NULL) {
     for (rcat = 0; rcat < mod->nratecats; rcat++)
@@ -152,306 +955,93 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
     for (rcat = 0; rcat < mod->nratecats; rcat++)
       post->rcat_expected_nsites[rcat] = 0;
 
-  for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++) {
-    int skip_fels = FALSE;
-
-    if ((cat >= 0 && msa->ss->cat_counts[cat][tupleidx] == 0) ||
-        (cat < 0 && msa->ss->counts[tupleidx] == 0))
-      continue;
-    checkInterruptN(tupleidx, 1000);
-
-    total_prob = 0;
-    marg_tot = NULL_LOG_LIKELIHOOD;
-
-    /* check for gaps and whether column is informative, if necessary */
-    if (!mod->allow_gaps)
-      for (j = 0; !skip_fels && j < msa->nseqs; j++)
-        if (ss_get_char_tuple(msa, tupleidx, j, 0) == GAP_CHAR)
-          skip_fels = TRUE;
-    if (!skip_fels && mod->inform_reqd) {
-      int ninform = 0;
-      for (j = 0; j < msa->nseqs; j++) {
-        if (msa->is_informative != NULL && !msa->is_informative[j])
-          continue;
-        else if (!msa->is_missing[(int)ss_get_char_tuple(msa, tupleidx, j, 0)])
-          ninform++;
-      }
-      if (ninform < 2) skip_fels = TRUE;
-    }
-
-    if (!skip_fels) {
-      for (pass = 0; pass < npasses; pass++) {
-        double **pL = (pass == 0 ? inside_joint : inside_marginal);
-        double **pLbar = (pass == 0 ? outside_joint : outside_marginal);
-        /*         TreePosteriors *postpass = (pass == 0 ? post : postmarg); */
-
-        if (pass > 0)
-          marg_tot = 0;         /* will need to compute */
-
-        for (rcat = 0; rcat < mod->nratecats; rcat++) {
-          traversal = tr_postorder(mod->tree);
-          for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
-            int partial_match[mod->order+1][alph_size];
-            n = lst_get_ptr(traversal, nodeidx);
-            if (n->lchild == NULL) {
-              /* leaf: base case of recursion */
-              int thisseq;
-
-              thisseq = mod->msa_seq_idx[n->id];
-	      if (thisseq < 0)
-		die("ERROR tl_compute_log_likelihood: expected a leaf node\n");
-
-              /* first figure out whether there is a match for each
-                 character in each position; we'll call this the record of
-                 "partial_matches". */
-              for (col_offset = -1*mod->order; col_offset <= 0; col_offset++) {
-                int observed_state = -1;
-                int *iupac_prob = NULL;
-
-                if (pass == 0 || col_offset < 0) {
-                  char thischar = ss_get_char_tuple(msa, tupleidx,
-						    thisseq, col_offset);
-                  observed_state = mod->rate_matrix->inv_states[(int)thischar];
-                  if (observed_state < 0)
-                    iupac_prob = mod->iupac_inv_map[(int)thischar];
-                }
-
-                /* otherwise, we're on a second pass and looking the
-                   current base, so we want to use the "missing
-                   information" principle */
+  job.plan = tm_get_prune_plan(mod);
 
-                if (iupac_prob != NULL) {
-                  for (i = 0; i < alph_size; i++)
-                    partial_match[mod->order+col_offset][i] = iupac_prob[i];
-                }
-                else {
-                  for (i = 0; i < alph_size; i++) {
-                    if (observed_state < 0 || i == observed_state)
-                      partial_match[mod->order+col_offset][i] = 1;
-                    else
-                      partial_match[mod->order+col_offset][i] = 0;
-                  }
-                }
-              }
+  /* number of threads that will actually be used, which determines
+     the per-thread storage needed.  Every window but the last has at
+     least this many tasks (see below) */
+  nthreads = thr_nthreads_for(msa->ss->ntuples);
 
-              /* now find the intersection of the partial matches */
-              for (i = 0; i < nstates; i++) {
-                if (mod->order == 0)  /* handle 0th order model as special
-                                         case, for efficiency.  In this case
-                                         the partial match *is* the total
-                                         match */
-                  pL[i][n->id] = partial_match[0][i];
-                else {
-                  int total_match = 1;
-                  /* figure out the "projection" of state i in the dimension
-                     of each position, and see whether there is a
-                     corresponding partial match. */
-                  /* NOTE: mod->order is approx equal to log nstates
-                     (prob no more than 2) */
-                  for (col_offset = -1*mod->order; col_offset <= 0 && total_match;
-                       col_offset++) {
-                    int projection = (i / int_pow(alph_size, -1 * col_offset)) %
-                      alph_size;
-
-                    if (!partial_match[mod->order+col_offset][projection])
-                      total_match = 0; /* must have partial matches in all
-                                          dimensions for a total match */
-                  }
-                  pL[i][n->id] = total_match;
-                }
-              }
-            }
-            else {
-              /* general recursive case */
-              MarkovMatrix *lsubst_mat = mod->P[n->lchild->id][rcat];
-              MarkovMatrix *rsubst_mat = mod->P[n->rchild->id][rcat];
-              for (i = 0; i < nstates; i++) {
-                double totl = 0, totr = 0;
-                for (j = 0; j < nstates; j++)
-                  totl += pL[j][n->lchild->id] *
-                    mm_get(lsubst_mat, i, j);
-
-                for (k = 0; k < nstates; k++)
-                  totr += pL[k][n->rchild->id] *
-                    mm_get(rsubst_mat, i, k);
-
-                pL[i][n->id] = totl * totr;
-              }
-            }
-          }
-
-          if (post != NULL && pass == 0) {
-            MarkovMatrix *subst_mat;
-            double this_total, denom;
-
-            /* do outside calculation */
-            traversal = tr_preorder(mod->tree);
-            for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
-              n = lst_get_ptr(traversal, nodeidx);
-              if (n->parent == NULL) { /* base case */
-                for (i = 0; i < nstates; i++)
-                  pLbar[i][n->id] = vec_get(mod->backgd_freqs, i);
-              }
-              else {            /* recursive case */
-                TreeNode *sibling = (n == n->parent->lchild ?
-                                     n->parent->rchild : n->parent->lchild);
-                MarkovMatrix *par_subst_mat = mod->P[n->id][rcat];
-                MarkovMatrix *sib_subst_mat = mod->P[sibling->id][rcat];
-
-                /* breaking this computation into two parts as follows
-                   reduces its complexity by a factor of nstates */
-
-                for (j = 0; j < nstates; j++) { /* parent state */
-                  tmp[j] = 0;
-                  for (k = 0; k < nstates; k++) { /* sibling state */
-                    tmp[j] += pLbar[j][n->parent->id] *
-                      pL[k][sibling->id] * mm_get(sib_subst_mat, j, k);
-                  }
-                }
-
-                for (i = 0; i < nstates; i++) { /* child state */
-                  pLbar[i][n->id] = 0;
-                  for (j = 0; j < nstates; j++) { /* parent state */
-                    pLbar[i][n->id] +=
-                      tmp[j] * mm_get(par_subst_mat, j, i);
-                  }
-                }
-              }
-
-
-              /* compute total probability based on current node, to
-                 avoid numerical errors */
-              this_total = 0;
-              for (i = 0; i < nstates; i++)
-                this_total += pL[i][n->id] * pLbar[i][n->id];
-
-              if (post->expected_nsubst != NULL && n->parent != NULL)
-                post->expected_nsubst[rcat][n->id][tupleidx] = 1;
-
-              subst_mat = mod->P[n->id][rcat];
-              for (i = 0; i < nstates; i++) {
-                /* compute posterior prob of base (tuple) i at node n */
-                if (post->base_probs != NULL) {
-                  post->base_probs[rcat][i][n->id][tupleidx] =
-                    safediv(pL[i][n->id] * pLbar[i][n->id], this_total);
-                }
-
-                if (n->parent == NULL) continue;
-
-                /* (intermediate computation used for subst probs) */
-                denom = 0;
-                for (k = 0; k < nstates; k++)
-                  denom += pL[k][n->id] * mm_get(subst_mat, i, k);
-
-                for (j = 0; j < nstates; j++) {
-                  /* compute posterior prob of a subst of base j at
-                     node n for base i at node n->parent */
-                  subst_probs[rcat][i][j][n->id] =
-                    safediv(pL[i][n->parent->id] * pLbar[i][n->parent->id],
-                            this_total) *
-                    pL[j][n->id] * mm_get(subst_mat, i, j);
-                  subst_probs[rcat][i][j][n->id] =
-                    safediv(subst_probs[rcat][i][j][n->id], denom);
-
-                  if (post->subst_probs != NULL)
-                    post->subst_probs[rcat][i][j][n->id][tupleidx] =
-                      subst_probs[rcat][i][j][n->id];
-
-                  if (post->expected_nsubst != NULL && j == i)
-                    post->expected_nsubst[rcat][n->id][tupleidx] -=
-                      subst_probs[rcat][i][j][n->id];
-
-                }
-              }
-            }
-          }
-
-          if (pass == 0) {
-            rcat_prob[rcat] = 0;
-            for (i = 0; i < nstates; i++) {
-              rcat_prob[rcat] += vec_get(mod->backgd_freqs, i) *
-                inside_joint[i][mod->tree->id] * mod->freqK[rcat];
-            }
-            total_prob += rcat_prob[rcat];
-          }
-          else {
-            for (i = 0; i < nstates; i++)
-              marg_tot += vec_get(mod->backgd_freqs, i) *
-                inside_marginal[i][mod->tree->id] * mod->freqK[rcat];
-          }
-        } /* for rcat */
-      } /* for pass */
-    } /* if skip_fels */
-
-      /* compute posterior prob of each rate cat and related quantities */
-    if (post != NULL) {
-      if (skip_fels) die("ERROR: tl_compute_log_likelihood: skip_fels should be 0 but is %i\n", skip_fels);
-      for (rcat = 0; rcat < mod->nratecats; rcat++) {
-        double rcat_post_prob = safediv(rcat_prob[rcat], total_prob);
-        if (post->rcat_probs != NULL)
-          post->rcat_probs[rcat][tupleidx] = rcat_post_prob;
-        if (post->rcat_expected_nsites != NULL)
-          post->rcat_expected_nsites[rcat] += rcat_post_prob *
-            (cat >= 0 ? msa->ss->cat_counts[cat][tupleidx] :
-             msa->ss->counts[tupleidx]);
-        if (post->expected_nsubst_tot != NULL) {
-          for (nodeidx = 0; nodeidx < mod->tree->nnodes; nodeidx++) {
-            n = lst_get_ptr(mod->tree->nodes, nodeidx);
-            if (n->parent == NULL) continue;
-            for (i = 0; i < nstates; i++)
-              for (j = 0; j < nstates; j++)
-                post->expected_nsubst_tot[rcat][i][j][n->id] +=
-                  subst_probs[rcat][i][j][n->id] *
-                  (cat >= 0 ? msa->ss->cat_counts[cat][tupleidx] :
-                   msa->ss->counts[tupleidx]) *
-                  rcat_post_prob;
-          }
-        }
-	if (post->expected_nsubst_col != NULL) {
-	  for (nodeidx = 0; nodeidx < mod->tree->nnodes; nodeidx++) {
-            n = lst_get_ptr(mod->tree->nodes, nodeidx);
-            if (n->parent == NULL) continue;
-            for (i = 0; i < nstates; i++)
-              for (j = 0; j < nstates; j++)
-                post->expected_nsubst_col[rcat][n->id][tupleidx][i][j] =
-                  subst_probs[rcat][i][j][n->id] * rcat_post_prob;
-          }
-        }
-      }
+  /* window size, limited by storage for substitution probs */
+  wsize_max = nthreads * TL_TUPLES_PER_THREAD;
+  if (post != NULL) {
+    slot_bytes = (size_t)mod->nratecats * nstates * nstates *
+      mod->tree->nnodes * sizeof(double);
+    if ((size_t)wsize_max * slot_bytes > TL_WINDOW_MAX_BYTES)
+      wsize_max = max(nthreads, (int)(TL_WINDOW_MAX_BYTES / slot_bytes));
+  }
+  wsize_max = max(1, min(wsize_max, msa->ss->ntuples));
+
+  /* chunk size, limited by storage for partials of site-repeat
+     classes (at most one class per node per tuple) */
+  job.chunk_max = max(1, wsize_max / (nthreads * TL_CHUNKS_PER_THREAD));
+  job.chunk_max = max(1, min(job.chunk_max, (int)(TL_REPEAT_MAX_BYTES /
+                             ((size_t)mod->tree->nnodes * mod->nratecats *
+                              nstates * sizeof(double)))));
+
+  /* storage is kept by the model and reused across calls */
+  ws = tl_get_workspace(mod, nthreads, wsize_max, job.chunk_max,
+                        post != NULL);
+  if (col_scores != NULL && tuple_scores == NULL) {
+    if (ws->ntuples < msa->ss->ntuples) {
+      if (ws->tuple_scores != NULL) sfree(ws->tuple_scores);
+      ws->tuple_scores = (double*)smalloc(msa->ss->ntuples * sizeof(double));
+      ws->ntuples = msa->ss->ntuples;
     }
+    curr_tuple_scores = ws->tuple_scores;
+  }
+  else if (tuple_scores != NULL)
+    curr_tuple_scores = tuple_scores;
+  if (curr_tuple_scores != NULL)
+    for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
+      curr_tuple_scores[tupleidx] = 0;
 
-    if (mod->order > 0 && mod->use_conditionals == 1 && !skip_fels)
-      total_prob /= marg_tot;
-
-    /*    if (total_prob > 1.0) {
-      if (total_prob - 1.0 < 1.0e-6) total_prob = 1.0;
-      else die("got total_prob=%.10g\n", total_prob);
-      }*/
-    total_prob = log2(total_prob);
-
-    if (curr_tuple_scores != NULL &&
-        (cat < 0 || msa->ss->cat_counts[cat][tupleidx] > 0))
-      curr_tuple_scores[tupleidx] = total_prob;
-    /* NOTE: curr_tuple_scores contains the
-       (log) probabilities *unweighted* by tuple counts */
-
-    total_prob *= (cat >= 0 ? msa->ss->cat_counts[cat][tupleidx] :
-                   msa->ss->counts[tupleidx]); /* log space */
-
-    retval += total_prob;     /* log space */
+  job.mod = mod;
+  job.msa = msa;
+  job.cat = cat;
+  job.post = post;
+  job.tuple_scores = curr_tuple_scores;
+  job.scratch = ws->scratch;
+  job.counted = ws->counted;
+  job.lprob = ws->lprob;
+  job.rcat_post = ws->rcat_post;
+  job.subst_probs = (post != NULL ? ws->subst_probs : NULL);
+  job.ptrans = ws->ptrans;
+  job.pmat = (post != NULL ? ws->pmat : NULL);
+  tl_pack_matrices(&job);
+  job.subtree_size = ws->subtree_size;
+  for (i = 0; i < job.plan->nnodes; i++) {
+    TreePruneOp *op = &job.plan->postorder[i];
+    job.subtree_size[op->node] = 1 + (op->lchild < 0 ? 0 :
+                                      job.subtree_size[op->lchild] +
+                                      job.subtree_size[op->rchild]);
+  }
 
-  } /* for tupleidx */
+  for (job.wstart = 0; job.wstart < msa->ss->ntuples;
+       job.wstart += wsize_max) {
+    job.wsize = min(wsize_max, msa->ss->ntuples - job.wstart);
+    job.chunk = max(1, min(job.chunk_max,
+                           job.wsize / (nthreads * TL_CHUNKS_PER_THREAD)));
+    thr_parallel_for((job.wsize + job.chunk - 1) / job.chunk,
+                     tl_tuple_task, &job);
+
+    if (post != NULL && post->expected_nsubst_tot != NULL) {
+      job.nsubst_ntasks = min(nthreads, mod->tree->nnodes);
+      thr_parallel_for(job.nsubst_ntasks, tl_nsubst_task, &job);
+    }
 
-  for (j = 0; j < nstates; j++) {
-    sfree(inside_joint[j]);
-    sfree(outside_joint[j]);
-    if (mod->order > 0) sfree(inside_marginal[j]);
-    if (mod->order > 0 && post != NULL) sfree(outside_marginal[j]);
+    for (slot = 0; slot < job.wsize; slot++) {
+      double count;
+      if (!job.counted[slot]) continue;
+      count = tl_tuple_count(msa, cat, job.wstart + slot);
+      if (post != NULL && post->rcat_expected_nsites != NULL)
+        for (rcat = 0; rcat < mod->nratecats; rcat++)
+          post->rcat_expected_nsites[rcat] += job.rcat_post[slot][rcat] *
+            count;
+      retval += job.lprob[slot] * count; /* log space */
+    }
   }
-  sfree(inside_joint);
-  sfree(outside_joint);
-  if (mod->order > 0) sfree(inside_marginal);
-  if (mod->order > 0 && post != NULL) sfree(outside_marginal);
+
   if (col_scores != NULL) {
     if (cat >= 0)
       for (i = 0; i < msa->length; i++)
@@ -461,18 +1051,6 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
     else
       for (i = 0; i < msa->length; i++)
         col_scores[i] = curr_tuple_scores[msa->ss->tuple_idx[i]];
-    if (tuple_scores == NULL) sfree(curr_tuple_scores);
-  }
-  if (post != NULL) {
-    for (rcat = 0; rcat < mod->nratecats; rcat++) {
-      for (j = 0; j < nstates; j++) {
-        for (k = 0; k < nstates; k++)
-          sfree(subst_probs[rcat][j][k]);
-        sfree(subst_probs[rcat][j]);
-      }
-      sfree (subst_probs[rcat]);
-    }
-    sfree(subst_probs);
   }
   return(retval);
 }
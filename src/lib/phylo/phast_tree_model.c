@@ -17,6 +17,7 @@
 #include <phast/numerical_opt.h>
 #include <phast/markov_matrix.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/fit_em.h>
 #include <time.h>
 #include <sys/time.h>
 #include <phast/sufficient_stats.h>
@@ -164,6 +165,8 @@ TreeModel *tm_new(TreeNode *tree, MarkovMatrix *rate_matrix,
   tm->bound_arg = NULL;
   tm->scale_during_opt = 0;
   tm->iupac_inv_map = NULL;
+  tm->prune_plan = NULL;
+  tm->tl_workspace = NULL;
   return tm;
 }
 
@@ -303,6 +306,8 @@ void tm_free(TreeModel *tm) {
     str_free(tm->noopt_arg);
   if (tm->iupac_inv_map != NULL)
     free_iupac_inv_map(tm->iupac_inv_map);
+  tm_free_prune_plan(tm);
+  tl_free_workspace(tm->tl_workspace);
   sfree(tm);
 }
 
@@ -636,7 +641,7 @@ void tm_print(FILE *F, TreeModel *tm) {
 }
 
 /* Note: does not copy msa_seq_idx, tree_posteriors, P, rate_matrix_param_row,
-   or iupac_inv_map
+   iupac_inv_map, prune_plan, or tl_workspace
  */
 TreeModel *tm_create_copy(TreeModel *src) {
   TreeModel *retval;
@@ -1950,6 +1955,8 @@ int tm_fit(TreeModel *mod, MSA *msa, Vector *params, int cat,
   double ll;
   Vector *lower_bounds, *upper_bounds, *opt_params;
   int i, retval = 0, npar, numeval;
+  void (*grad_func)(Vector*, Vector*, void*, Vector*, Vector*) = NULL;
+  number_type eigentype = mod->rate_matrix->eigentype;
 
   if (msa->ss == NULL) {
     if (msa->seqs == NULL)
@@ -2011,11 +2018,30 @@ int tm_fit(TreeModel *mod, MSA *msa, Vector *params, int cat,
     }
   }
   
+  /* use analytic gradients if possible; otherwise opt_bfgs falls back
+     on numerical estimates */
+  if (mod->tree_posteriors == NULL && tm_likelihood_grad_ok(mod)) {
+    grad_func = tm_likelihood_grad;
+    mm_set_eigentype(mod->rate_matrix, COMPLEX_NUM);
+                                /* (required by tm_likelihood_grad) */
+    mod->tree_posteriors = tl_new_tree_posteriors(mod, msa, 0, 0, 0, 1, 
+                                                  0, 0, 0);
+  }
+
   if (!quiet) fprintf(stderr, "numpar = %i\n", opt_params->size);
   retval = opt_bfgs(tm_likelihood_wrapper, opt_params, (void*)mod, &ll, 
-                    lower_bounds, upper_bounds, logf, NULL, precision, 
+                    lower_bounds, upper_bounds, logf, grad_func, precision, 
 		    NULL, &numeval);
 
+  if (grad_func != NULL) {
+    tl_free_tree_posteriors(mod, msa, mod->tree_posteriors);
+    mod->tree_posteriors = NULL;
+    if (mod->rate_matrix->eigentype != eigentype) {
+      mm_set_eigentype(mod->rate_matrix, eigentype);
+      mm_diagonalize(mod->rate_matrix);
+    }
+  }
+
   mod->lnL = ll * -1 * log(2);  /* make negative again and convert to
                                    natural log scale */
   if (!quiet) fprintf(stderr, "Done.  log(likelihood) = %f numeval=%i\n", mod->lnL, numeval);
@@ -3657,6 +3683,7 @@ void tm_prune(TreeModel *mod,   /* TreeModel whose tree is to be pruned  */
   if (mod->alt_subst_mods_ptr != NULL)
     id_map = smalloc(mod->tree->nnodes*sizeof(int));
 
+  tm_free_prune_plan(mod);
   tr_prune(&mod->tree, names, TRUE, id_map);
 
   if (mod->tree == NULL) {
@@ -3717,6 +3744,8 @@ void tm_reset_tree(TreeModel *mod,   /** TreeModel */
   /* merge this with tm_reinit? */
   int i, j;
 
+  tm_free_prune_plan(mod);
+
   /* free P matrices */
   for (i = 0; i < mod->tree->nnodes; i++) {
     for (j = 0; j < mod->nratecats; j++)
@@ -3743,6 +3772,56 @@ void tm_reset_tree(TreeModel *mod,   /** TreeModel */
   }
 }
 
+/* Build (or return cached) flattened traversals of mod->tree */
+TreePrunePlan *tm_get_prune_plan(TreeModel *mod) {
+  TreePrunePlan *plan = mod->prune_plan;
+  List *traversal;
+  int i, pass;
+
+  if (plan != NULL && plan->tree == mod->tree &&
+      plan->nnodes == mod->tree->nnodes)
+    return plan;
+  tm_free_prune_plan(mod);
+
+  plan = smalloc(sizeof(TreePrunePlan));
+  plan->tree = mod->tree;
+  plan->nnodes = mod->tree->nnodes;
+  plan->postorder = smalloc(plan->nnodes * sizeof(TreePruneOp));
+  plan->preorder = smalloc(plan->nnodes * sizeof(TreePruneOp));
+  for (pass = 0; pass < 2; pass++) {
+    TreePruneOp *ops = (pass == 0 ? plan->postorder : plan->preorder);
+    traversal = (pass == 0 ? tr_postorder(mod->tree) :
+                 tr_preorder(mod->tree));
+    if (lst_size(traversal) != plan->nnodes)
+      die("ERROR tm_get_prune_plan: traversal has %i nodes, expected %i\n",
+          lst_size(traversal), plan->nnodes);
+    for (i = 0; i < plan->nnodes; i++) {
+      TreeNode *n = lst_get_ptr(traversal, i);
+      if ((n->lchild == NULL) != (n->rchild == NULL))
+        die("ERROR tm_get_prune_plan: either both children should be NULL or neither\n");
+      ops[i].node = n->id;
+      ops[i].lchild = (n->lchild == NULL ? -1 : n->lchild->id);
+      ops[i].rchild = (n->rchild == NULL ? -1 : n->rchild->id);
+      ops[i].parent = (n->parent == NULL ? -1 : n->parent->id);
+      if (n->parent == NULL)
+        ops[i].sibling = -1;
+      else
+        ops[i].sibling = (n == n->parent->lchild ? n->parent->rchild->id :
+                          n->parent->lchild->id);
+    }
+  }
+  mod->prune_plan = plan;
+  return plan;
+}
+
+void tm_free_prune_plan(TreeModel *mod) {
+  if (mod->prune_plan == NULL) return;
+  sfree(mod->prune_plan->postorder);
+  sfree(mod->prune_plan->preorder);
+  sfree(mod->prune_plan);
+  mod->prune_plan = NULL;
+}
+
 /* Set branches to be ignored in likelihood calculation and parameter
    estimation.  Argument 'ignore_branches' should be a list of Strings
    indicating nodes in the tree and the branches leading to those
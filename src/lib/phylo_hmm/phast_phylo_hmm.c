@@ -15,6 +15,7 @@
 #include <phast/tree_likelihoods.h>
 #include <phast/subst_mods.h>
 #include <phast/em.h>
+#include <phast/thread_pool.h>
 
 /* initial values for alpha, beta, tau; possibly should be passed in instead */
 #define ALPHA_INIT 0.05
@@ -99,6 +100,7 @@ PhyloHmm *phmm_new(HMM *hmm,    /* HMM.  If indel_mode ==
   phmm->emissions = NULL;
   phmm->forward = NULL;
   phmm->alloc_len = -1;
+  phmm->window = phmm->window_overlap = 0;
   phmm->state_pos = phmm->state_neg = NULL;
   phmm->gpm = NULL;
   phmm->T = phmm->t = NULL;
@@ -514,6 +516,27 @@ void phmm_free(PhyloHmm *phmm) {
   sfree(phmm);
 }
 
+/* Shared data for computing emissions in parallel; one task per
+   tree model, covering both of its strands */
+typedef struct {
+  PhyloHmm *phmm;
+  MSA *msa, *msa_compl;
+  int *task_mod;                /* model for each task */
+} PhmmEmissionsData;
+
+static void phmm_emissions_task(void *data, int task, int thread) {
+  PhmmEmissionsData *d = data;
+  int mod = d->task_mod[task];
+  if (d->phmm->state_pos[mod] != -1)
+    tl_compute_log_likelihood(d->phmm->mods[mod], d->msa,
+                              d->phmm->emissions[d->phmm->state_pos[mod]],
+                              NULL, -1, NULL);
+  if (d->phmm->state_neg[mod] != -1)
+    tl_compute_log_likelihood(d->phmm->mods[mod], d->msa_compl,
+                              d->phmm->emissions[d->phmm->state_neg[mod]],
+                              NULL, -1, NULL);
+}
+
 /** Compute emissions for given PhyloHmm and MSA.  Preprocessor for
     phmm_viterbi_features, phmm_posterior_probs, and phmm_lnl
     (often only needs to be run once). */
@@ -526,9 +549,10 @@ void phmm_compute_emissions(PhyloHmm *phmm,
                                    reported to stderr */
                             ) {
 
-  int i, mod, j;
+  int i, mod, j, ntasks = 0;
   MSA *msa_compl = NULL;
   int new_alloc = (phmm->emissions == NULL); 
+  PhmmEmissionsData d;
   /* allocate new memory if emissions is NULL; otherwise reuse */ 
 
   if (new_alloc) {
@@ -540,27 +564,18 @@ void phmm_compute_emissions(PhyloHmm *phmm,
 	phmm->alloc_len, msa->length);
 
   /* if HMM is reflected, we need the reverse complement of the
-     alignment as well */
-  if (phmm->reflected) {          
-    int idx1, idx2;
-    msa_compl = msa_create_copy(msa, 0);
-    msa_reverse_compl(msa_compl);
-
-    /* we actually want to keep the indexing of the forward strand; to
-       save code, we'll just *reverse* the reverse complement */
-    for (idx1 = 0, idx2 = msa_compl->length-1; 
-         idx1 < idx2; idx1++, idx2--) {
-      int tmp = msa_compl->ss->tuple_idx[idx2];
-      msa_compl->ss->tuple_idx[idx2] = msa_compl->ss->tuple_idx[idx1];
-      msa_compl->ss->tuple_idx[idx1] = tmp;
-    }
-
-    /* get rid of the sequences! they'll be wrong! */
-    if (msa_compl->seqs != NULL) {
-      for (i = 0; i < msa_compl->nseqs; i++) sfree(msa_compl->seqs[i]);
-      sfree(msa_compl->seqs);
-      msa_compl->seqs = NULL;
+     alignment as well.  We actually want to keep the indexing of the
+     forward strand, which ss_reverse_compl_fwd_coords does directly
+     from the sufficient statistics */
+  if (phmm->reflected) {
+    if (msa->ss == NULL) {
+      int tuple_size = 1;
+      for (i = 0; i < phmm->nmods; i++)
+        tuple_size = max(tuple_size, phmm->mods[i]->order + 1);
+      ss_from_msas(msa, tuple_size, TRUE, NULL, NULL, NULL, -1,
+                   subst_mod_is_codon_model(phmm->mods[0]->subst_mod));
     }
+    msa_compl = ss_reverse_compl_fwd_coords(msa);
   }
 
   /* set up mapping from model/strand to first associated state
@@ -573,6 +588,11 @@ void phmm_compute_emissions(PhyloHmm *phmm,
   for (i = 0; i < phmm->nmods; i++) 
     phmm->state_pos[i] = phmm->state_neg[i] = -1;
 
+  d.phmm = phmm;
+  d.msa = msa;
+  d.msa_compl = msa_compl;
+  d.task_mod = smalloc(phmm->nmods * sizeof(int));
+
   for (i = 0; i < phmm->hmm->nstates; i++) {
     if (!quiet) {
       fprintf(stderr, "Computing emission probs (state %d, cat %d, mod %d",
@@ -594,13 +614,26 @@ void phmm_compute_emissions(PhyloHmm *phmm,
       if (new_alloc)
 	phmm->emissions[i] = smalloc(msa->length * sizeof(double));
 
-      tl_compute_log_likelihood(phmm->mods[mod], 
-                                phmm->reverse_compl[i] ? msa_compl : msa,
-                                phmm->emissions[i], NULL, -1, NULL);
+      /* computed below */
+      if (phmm->state_pos[mod] == -1 && phmm->state_neg[mod] == -1) {
+        tl_prepare(phmm->mods[mod], msa);
+        d.task_mod[ntasks++] = mod;
+      }
       if (!phmm->reverse_compl[i]) phmm->state_pos[mod] = i;
       else phmm->state_neg[mod] = i;            
     }
   }
+
+  /* models are independent, so with enough of them it is best to
+     compute them concurrently; otherwise each is parallelized over
+     tuples (see tl_compute_log_likelihood) */
+  if (ntasks >= thr_get_nthreads())
+    thr_parallel_for(ntasks, phmm_emissions_task, &d);
+  else
+    for (i = 0; i < ntasks; i++)
+      phmm_emissions_task(&d, i, 0);
+
+  sfree(d.task_mod);
   if (msa_compl != NULL) msa_free(msa_compl);
 
   /* finally, adjust for indel model, if necessary */
@@ -660,7 +693,8 @@ GFF_Set* phmm_predict_viterbi(PhyloHmm *phmm,
   if (phmm->emissions == NULL)
     die("ERROR: emissions required for phmm_viterbi_features.\n");
           
-  hmm_viterbi(phmm->hmm, phmm->emissions, phmm->alloc_len, path);
+  hmm_viterbi_windowed(phmm->hmm, phmm->emissions, phmm->alloc_len, path,
+                       phmm->window, phmm->window_overlap);
 
   retval = cm_labeling_as_gff(phmm->cm, path, phmm->alloc_len, 
                               phmm->state_to_cat, 
@@ -762,8 +796,10 @@ double phmm_postprobs(PhyloHmm *phmm, double **post_probs) {
   if (phmm->emissions == NULL)
     die("ERROR: emissions required for phmm_posterior_probs.\n");
 
-  return hmm_posterior_probs(phmm->hmm, phmm->emissions, phmm->alloc_len, 
-                             post_probs) * log(2);
+  return hmm_posterior_probs_windowed(phmm->hmm, phmm->emissions,
+                                      phmm->alloc_len, post_probs,
+                                      phmm->window, phmm->window_overlap)
+    * log(2);
                                 /* convert to natural log */          
 }
 
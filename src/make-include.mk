@@ -163,3 +163,30 @@ endif
 endif
 endif
 
+
+# POSIX threads are used for parallel likelihood computations (see
+# the --threads option of phyloFit, phyloP, and phastCons).  Define
+# SKIP_THREADS to build without them; all computations will then be
+# done serially.
+ifneq ($(TARGETOS), Windows)
+ifndef SKIP_THREADS
+  LIBS += -lpthread
+else
+  CFLAGS += -DSKIP_THREADS
+endif
+else
+  CFLAGS += -DSKIP_THREADS
+endif
+
+# zlib is used to read gzip- or bgzip-compressed input directly and
+# to write compressed output to files named *.gz or *.bgz (see
+# compressed_io.h).  Define SKIP_ZLIB to build without it.
+ifneq ($(TARGETOS), Windows)
+ifndef SKIP_ZLIB
+  LIBS += -lz
+else
+  CFLAGS += -DSKIP_ZLIB
+endif
+else
+  CFLAGS += -DSKIP_ZLIB
+endif
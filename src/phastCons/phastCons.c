@@ -19,6 +19,7 @@
 #include <phast/tree_likelihoods.h>
 #include <phast/maf.h>
 #include "phast/cons.h"
+#include <phast/thread_pool.h>
 #include "phastCons.help"
 
 
@@ -63,6 +64,11 @@ int main(int argc, char *argv[]) {
     {"indels-only", 0, 0, 'J'},
     {"alias", 1, 0, 'A'},
     {"quiet", 0, 0, 'q'},
+    {"threads", 1, 0, 'j'},
+    {"chunk-size", 1, 0, 'K'},
+    {"chunk-overlap", 1, 0, 'Q'},
+    {"start", 1, 0, 0},
+    {"end", 1, 0, 0},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
   };
@@ -71,7 +77,7 @@ int main(int argc, char *argv[]) {
   FILE *infile;
   char *msa_fname;
   signed char c;
-  int opt_idx, i, coding_potential=FALSE;
+  int opt_idx, i, coding_potential=FALSE, region_start = 0, region_end = -1;
   List *tmpl = NULL;
   String *tmpstr;
   char *mods_fname = NULL;
@@ -79,7 +85,7 @@ int main(int argc, char *argv[]) {
   msa_format_type msa_format = UNKNOWN_FORMAT;
 
   while ((c = getopt_long(argc, argv, 
-			  "S:H:V:ni:k:l:C:G:zt:E:R:T:O:r:xL:sN:P:g:U:c:e:IY:D:JM:F:pA:Xqh", 
+			  "S:H:V:ni:k:l:C:G:zt:E:R:T:O:r:xL:sN:P:g:U:c:e:IY:D:JM:F:pA:Xqj:K:Q:h", 
                           long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'S':
@@ -246,6 +252,21 @@ int main(int argc, char *argv[]) {
     case 'q':
       p->results_f = NULL;
       break;
+    case 'j':
+      thr_set_nthreads(get_arg_int_bounds(optarg, 1, THR_MAX_THREADS));
+      break;
+    case 'K':
+      p->chunk_size = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
+    case 'Q':
+      p->chunk_overlap = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
+    case 0:
+      if (strcmp(long_opts[opt_idx].name, "start") == 0)
+        region_start = get_arg_int_bounds(optarg, 1, INFTY) - 1;
+      else if (strcmp(long_opts[opt_idx].name, "end") == 0)
+        region_end = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -258,6 +279,9 @@ int main(int argc, char *argv[]) {
       (coding_potential && optind != argc - 2 && optind != argc - 1))
     die("ERROR: extra or missing arguments.  Try '%s -h'.\n", argv[0]);
 
+  if (region_end != -1 && region_end <= region_start)
+    die("ERROR: --end must not be less than --start.\n");
+
   set_seed(-1);
 
   if (p->extrapolate_tree_fname != NULL &&
@@ -339,11 +363,19 @@ int main(int argc, char *argv[]) {
     fprintf(p->results_f, "Reading alignment from %s...\n", msa_fname);
   if (msa_format == MAF) {
     List *keepSeqs = tr_leaf_names(p->mod[0]->tree);
-    p->msa = maf_read_cats_subset(infile, NULL, 1, NULL, NULL, 
-				  NULL, -1, TRUE, NULL, NO_STRIP, FALSE, NULL, keepSeqs, 1);
+    MafIndex *mindex = NULL;
+    if ((region_start > 0 || region_end != -1) && strcmp(msa_fname, "-") != 0)
+      mindex = mafIndex_load(msa_fname);
+    p->msa = maf_read_cats_region(infile, NULL, 1, NULL, NULL, 
+                                  NULL, -1, TRUE, NULL, NO_STRIP, FALSE, NULL, 
+                                  keepSeqs, 1, mindex, region_start, 
+                                  region_end);
+    if (mindex != NULL) mafIndex_free(mindex);
     lst_free_strings(keepSeqs);
     lst_free(keepSeqs);
   }
+  else if (region_start > 0 || region_end != -1)
+    die("ERROR: --start and --end require MAF input.\n");
   else
     p->msa = msa_new_from_file_define_format(infile, msa_format, NULL);
 
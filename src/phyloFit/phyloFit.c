@@ -27,6 +27,7 @@
 #include <phast/sufficient_stats.h>
 #include <phast/maf.h>
 #include <phast/phylo_fit.h>
+#include <phast/thread_pool.h>
 #include "phyloFit.help"
 
 
@@ -92,14 +93,15 @@ int main(int argc, char *argv[]) {
     {"selection", 1, 0, 0},
     {"bound", 1, 0, 'u'},
     {"seed", 1, 0, 'D'},
+    {"threads", 1, 0, 'j'},
     {0, 0, 0, 0}
   };
 
-  // NOTE: remaining shortcuts left: HjQx
+  // NOTE: remaining shortcuts left: HQx
 
   pf = phyloFit_struct_new(0);
 
-  while ((c = getopt_long(argc, argv, "m:t:s:g:c:C:i:o:k:a:l:w:v:M:p:A:I:K:S:b:d:O:u:Y:e:D:GVENRqLPXZUBFfnrzhWyJ", long_opts, &opt_idx)) != -1) {
+  while ((c = getopt_long(argc, argv, "m:t:s:g:c:C:i:o:k:a:l:w:v:M:p:A:I:K:S:b:d:O:u:Y:e:D:j:GVENRqLPXZUBFfnrzhWyJ", long_opts, &opt_idx)) != -1) {
     switch(c) {
     case 'm':
       msa_fname = optarg;
@@ -307,6 +309,9 @@ int main(int argc, char *argv[]) {
     case 'D':
       seed = get_arg_int_bounds(optarg, 1, INFTY);
       break;
+    case 'j':
+      thr_set_nthreads(get_arg_int_bounds(optarg, 1, THR_MAX_THREADS));
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -330,7 +335,8 @@ int main(int argc, char *argv[]) {
     input_format = msa_format_for_content(infile, 1);
 
   if (pf->nonoverlapping && (pf->use_conditionals || pf->gff != NULL || 
-			     pf->cats_to_do_str || input_format == SS))
+			     pf->cats_to_do_str || input_format == SS ||
+			     input_format == BSS))
     die("ERROR: cannot use --non-overlapping with --markov, --features,\n--msa-format SS, or --do-cats.\n");
 
 
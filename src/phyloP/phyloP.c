@@ -10,6 +10,7 @@
 #include "phast/phylo_p.h"
 #include "phyloP.help"
 #include <phast/misc.h>
+#include <phast/thread_pool.h>
 
 
 int main(int argc, char *argv[]) {
@@ -19,7 +20,7 @@ int main(int argc, char *argv[]) {
   msa_format_type msa_format = UNKNOWN_FORMAT;
 
   /* other variables */
-  int opt_idx, seed = -1;
+  int opt_idx, seed = -1, region_start = 0, region_end = -1;
   List *cats_to_do_str=NULL;
   struct timeval now;
 
@@ -46,6 +47,9 @@ int main(int argc, char *argv[]) {
     {"catmap", 1, 0, 'M'},
     {"no-prune", 0, 0, 'P'},
     {"seed", 1, 0, 'd'},
+    {"threads", 1, 0, 'j'},
+    {"start", 1, 0, 0},
+    {"end", 1, 0, 0},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
   };
@@ -56,7 +60,7 @@ int main(int argc, char *argv[]) {
   srandom((unsigned int)now.tv_usec);
 #endif
 
-  while ((c = getopt_long(argc, argv, "m:o:i:n:pc:s:f:Fe:l:r:B:d:qwgbPN:h", 
+  while ((c = getopt_long(argc, argv, "m:o:i:n:pc:s:f:Fe:l:r:B:d:j:qwgbPN:h", 
                           long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'm':
@@ -145,9 +149,18 @@ int main(int argc, char *argv[]) {
     case 'd':
       seed = get_arg_int_bounds(optarg, 0, INFTY);
       break;
+    case 'j':
+      thr_set_nthreads(get_arg_int_bounds(optarg, 1, THR_MAX_THREADS));
+      break;
     case 'P':
       p->no_prune = TRUE;
       break;
+    case 0:
+      if (strcmp(long_opts[opt_idx].name, "start") == 0)
+        region_start = get_arg_int_bounds(optarg, 1, INFTY) - 1;
+      else if (strcmp(long_opts[opt_idx].name, "end") == 0)
+        region_end = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -161,6 +174,8 @@ int main(int argc, char *argv[]) {
   if ((p->prior_only && optind > argc - 1) || 
       (!p->prior_only && optind != argc - 2))
     die("ERROR: bad arguments.  Try 'phyloP -h'.\n");
+  if (region_end != -1 && region_end <= region_start)
+    die("ERROR: --end must not be less than --start.\n");
   p->mod_fname = argv[optind];
 
   p->mod = tm_new_from_file(phast_fopen(p->mod_fname, "r"), 1);
@@ -175,11 +190,20 @@ int main(int argc, char *argv[]) {
     msa_f = phast_fopen(p->msa_fname, "r");
     if (msa_format == UNKNOWN_FORMAT)
       msa_format = msa_format_for_content(msa_f, 1);
-    if (msa_format == MAF) 
-      p->msa = maf_read_cats(msa_f, NULL, 1, NULL, 
-			     p->cats_to_do==NULL ? NULL : p->feats, p->cm, -1, 
-			     (p->feats == NULL && p->base_by_base==0) ? FALSE : TRUE, /* --features requires order */
-			     NULL, NO_STRIP, FALSE, p->cats_to_do); 
+    if (msa_format == MAF) {
+      MafIndex *mindex = NULL;
+      if ((region_start > 0 || region_end != -1) && 
+          strcmp(p->msa_fname, "-") != 0)
+        mindex = mafIndex_load(p->msa_fname);
+      p->msa = maf_read_cats_region(msa_f, NULL, 1, NULL, 
+                                    p->cats_to_do==NULL ? NULL : p->feats, p->cm, -1, 
+                                    (p->feats == NULL && p->base_by_base==0) ? FALSE : TRUE, /* --features requires order */
+                                    NULL, NO_STRIP, FALSE, p->cats_to_do, 
+                                    NULL, 0, mindex, region_start, region_end);
+      if (mindex != NULL) mafIndex_free(mindex);
+    }
+    else if (region_start > 0 || region_end != -1)
+      die("ERROR: --start and --end require MAF input.\n");
     else 
       p->msa = msa_new_from_file_define_format(msa_f, msa_format, NULL);
     phast_fclose(msa_f);
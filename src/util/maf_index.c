@@ -0,0 +1,126 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <phast/misc.h>
+#include <phast/stringsplus.h>
+#include <phast/maf_index.h>
+#include <phast/compressed_io.h>
+
+void print_usage() {
+  printf("\n\
+USAGE: maf_index [OPTIONS] <infile.maf>\n\
+\n\
+DESCRIPTION:\n\
+    Build an index of a MAF file by coordinates of the reference\n\
+    sequence (the first sequence in each block), so that the blocks\n\
+    overlapping a region can be found without reading the file from\n\
+    the beginning.  By default, the index is written to\n\
+    <infile.maf>.mai, where it is found automatically by programs\n\
+    that use it (maf_parse, phastCons, and phyloP, when given --start\n\
+    and/or --end).\n\
+\n\
+    The MAF must be sorted with respect to the reference sequence.\n\
+    It may be uncompressed or compressed with bgzip, in which case\n\
+    the index records BGZF virtual offsets, so that reading can begin\n\
+    near the region of interest without decompressing the file from\n\
+    the beginning.  Files compressed with plain gzip are rejected;\n\
+    recompress them with bgzip.  (If the MAF is read from stdin, it is\n\
+    indexed as uncompressed data, and the index can be used only with\n\
+    an uncompressed copy.)  The index must be rebuilt if the MAF\n\
+    changes; a stale index is detected by the size of the file and\n\
+    ignored.\n\
+\n\
+    Other programs that read MAF files, such as msa_view, read the\n\
+    whole file even when given --start and --end.\n\
+\n\
+EXAMPLE:\n\
+    maf_index chr22.maf.gz\n\
+    maf_parse chr22.maf.gz --start 14600000 --end 14700000 > sub.maf\n\
+\n\
+OPTIONS:\n\
+    --out, -o <fname>\n\
+        Write index to specified file (use '-' for stdout) instead of\n\
+        <infile.maf>.mai.\n\
+\n\
+    --help, -h\n\
+        Print this help message.\n\n");
+}
+
+int main(int argc, char* argv[]) {
+  char *maf_fname = NULL, *out_fname = NULL;
+  int opt_idx, bgzf = FALSE, nbgzf;
+  int64_t *coffset, *upos;
+  signed char c;
+  FILE *mfile, *outfile;
+  MafIndex *idx;
+  String *fname;
+
+  struct option long_opts[] = {
+    {"out", 1, 0, 'o'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((c = getopt_long(argc, argv, "o:h", long_opts, &opt_idx)) != -1) {
+    switch(c) {
+    case 'o':
+      out_fname = optarg;
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    case '?':
+      die("Bad argument.  Try 'maf_index -h' for help.\n");
+    }
+  }
+
+  if (optind >= argc)
+    die("Missing alignment filename.  Try 'maf_index -h' for help.\n");
+  else if (optind == argc - 1)
+    maf_fname = argv[optind];
+  else
+    die("ERROR: Too many arguments.  Try 'maf_index -h' for help.\n");
+
+  if (out_fname == NULL && !strcmp(maf_fname, "-"))
+    die("ERROR: --out required when reading from stdin.\n");
+
+  /* offsets in a compressed file are usable only if it is in BGZF
+     format; check before reading it all */
+  if (strcmp(maf_fname, "-") && cio_compressed_file(maf_fname)) {
+    if ((nbgzf = cio_bgzf_blocks(maf_fname, &coffset, &upos)) < 0)
+      die("ERROR: %s is not in BGZF format; only MAF files compressed with bgzip (not gzip) can be indexed.\n",
+          maf_fname);
+    if (nbgzf > 0) {
+      sfree(coffset);
+      sfree(upos);
+    }
+    bgzf = TRUE;
+  }
+
+  mfile = phast_fopen(maf_fname, "r");
+  idx = mafIndex_build(mfile);
+  phast_fclose(mfile);
+  if (bgzf && !mafIndex_add_bgzf(idx, maf_fname))
+    die("ERROR: cannot determine BGZF offsets of blocks in %s.\n", maf_fname);
+
+  fname = str_new_charstr(out_fname != NULL ? out_fname : maf_fname);
+  if (out_fname == NULL) str_append_charstr(fname, MAF_INDEX_SUFFIX);
+  outfile = phast_fopen(fname->chars, "w");
+  mafIndex_write(outfile, idx);
+  phast_fclose(outfile);
+
+  fprintf(stderr, "Indexed %d blocks of %s (reference %s).\n", idx->nblocks,
+          maf_fname, idx->refseq->chars);
+  str_free(fname);
+  mafIndex_free(idx);
+  return 0;
+}
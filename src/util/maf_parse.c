@@ -18,6 +18,7 @@
 #include <phast/local_alignment.h>
 #include <phast/maf.h>
 #include <phast/maf_block.h>
+#include <phast/maf_index.h>
 
 void print_usage() {
     printf("\n\
@@ -62,6 +63,12 @@ OPTIONS:\n\
     --end, -e <end_col>\n\
         End index of sub-alignment.  Default is length of alignment.\n\
         Coordinates defined as in --start option, above.\n\
+        If the MAF has been indexed with maf_index (i.e., a file\n\
+        named <maf_fname>.mai exists), the index is used to go directly\n\
+        to the requested region, unless --no-refseq, --seqs, or --order\n\
+        is used.  MAFs compressed with bgzip can be indexed; those\n\
+        compressed with plain gzip cannot, and are read from the\n\
+        beginning.\n\
 \n\
     --seqs, -l <seq_list>\n\
         Comma-separated list of sequences to include (default)\n\
@@ -271,6 +278,8 @@ int main(int argc, char* argv[]) {
   List *order_list = NULL, *seqlist_str = NULL, *cats_to_do_str=NULL, *cats_to_do=NULL;
   MafBlock *block;
   FILE *mfile, *outfile=NULL, *masked_file=NULL;
+  MafReader *mreader;
+  MafIndex *mindex = NULL;
   int useRefseq=TRUE, currLen=-1, blockIdx=0, currSize, sortWarned=0;
   int lastIdx = 0, currStart=0, by_category = FALSE, i, pretty_print = FALSE;
   int lastStart = -1, gffSearchIdx=0;
@@ -450,7 +459,17 @@ int main(int argc, char* argv[]) {
      If so, set output_format to SS ? or FASTA ? */
 
   mfile = phast_fopen(maf_fname, "r");
-  block = mafBlock_read_next(mfile, NULL, NULL);
+  mreader = mafReader_new(mfile);
+
+  /* with an index, skip directly to the first block that may overlap
+     the requested region.  Not possible if the reference sequence is
+     not simply the first sequence in each block */
+  if ((startcol != 1 || endcol != -1) && useRefseq && order_list == NULL && 
+      seqlist_str == NULL && strcmp(maf_fname, "-") != 0 &&
+      (mindex = mafIndex_load(maf_fname)) != NULL)
+    mafIndex_seek(mindex, mreader, startcol - 1);
+
+  block = mafBlock_read_next(mreader, NULL, NULL);
 
   if (splitInterval == -1 && gff==NULL) {
     //TODO: do we want to copy header from original MAF in this case?
@@ -458,6 +477,12 @@ int main(int argc, char* argv[]) {
   }
 
   while (block != NULL) {
+    /* indexed MAFs are sorted, so no later block can overlap region */
+    if (mindex != NULL && endcol != -1 && 
+        mafBlock_get_start(block, NULL) > endcol) {
+      mafBlock_free(block);
+      break;
+    }
     if (order_list != NULL)
       mafBlock_reorder(block, order_list);
     if (seqlist_str != NULL)
@@ -567,7 +592,7 @@ int main(int argc, char* argv[]) {
 
   get_next_block:
     mafBlock_free(block);
-    block = mafBlock_read_next(mfile, NULL, NULL);
+    block = mafBlock_read_next(mreader, NULL, NULL);
   }
 
   if (masked_file != NULL) fclose(masked_file);
@@ -581,6 +606,8 @@ int main(int argc, char* argv[]) {
     msa_free(msa);
   }
   if (gff != NULL) gff_free_set(gff);
+  if (mindex != NULL) mafIndex_free(mindex);
+  mafReader_free(mreader);
   phast_fclose(mfile);
   return 0;
 }
@@ -162,7 +162,7 @@ OPTIONS:\n\
         should both work fine).\n\
 \n\
  (File formats, gap stripping, reordering, etc.)\n\
-    --in-format, -i PHYLIP|FASTA|MPM|MAF|SS\n\
+    --in-format, -i PHYLIP|FASTA|MPM|MAF|SS|BSS\n\
         (Default is to guess format from file contents).  Input file\n\
         format.  FASTA is as usual.  PHYLIP is compatible with the formats\n\
         used in the PHYLIP and PAML packages.  MPM is the format used by the\n\
@@ -173,8 +173,11 @@ OPTIONS:\n\
         or tuple of columns and their counts).  Use --out-format SS with\n\
         --in-format MAF for best efficiency (explicit alignment is\n\
         never created).  Also, use --unordered-ss if possible.\n\
+        BSS is a binary version of SS that loads much faster; files\n\
+        in BSS format are accepted wherever SS is, and are recognized\n\
+        automatically.\n\
 \n\
-    --out-format, -o PHYLIP|FASTA|MPM|SS\n\
+    --out-format, -o PHYLIP|FASTA|MPM|SS|BSS\n\
         (Default FASTA)  Output file format.\n\
 \n\
     --alphabet, -a <alphabet_string>\n\
@@ -410,7 +413,7 @@ int main(int argc, char* argv[]) {
     rand_perm = FALSE, reverse_compl = FALSE, stats_only = FALSE, win_size = -1, 
     cycle_size = -1, maf_keep_overlapping = FALSE, collapse_missing = FALSE,
     fourD = FALSE, mark_missing_maxsize = -1, missing_as_indels = FALSE,
-    unmask = FALSE, split_all = FALSE;
+    unmask = FALSE, split_all = FALSE, binary_ss = FALSE;
   signed char c;
   char *out_root=NULL, out_fname[STR_MED_LEN];
   List *cats_to_do = NULL, *aggregate_list = NULL, *msa_fname_list = NULL, 
@@ -608,6 +611,13 @@ int main(int argc, char* argv[]) {
 
   set_seed(-1);
 
+  /* binary SS is treated as SS except when printing */
+  if (input_format == BSS) input_format = SS;
+  if (output_format == BSS) {
+    output_format = SS;
+    binary_ss = TRUE;
+  }
+
   if (gff != NULL && lst_size(gff->features) == 0)
     die("ERROR: empty features file.\n");
 
@@ -905,7 +915,8 @@ int main(int argc, char* argv[]) {
     
     else {                         /* print alignment */
       msa_update_length(sub_msa);
-      msa_print(stdout, sub_msa, output_format, pretty_print);
+      msa_print(stdout, sub_msa, binary_ss ? BSS : output_format, 
+                pretty_print);
     }
   }
 